@@ -33,6 +33,8 @@
     #include <cstdio> // fwrite, stdout
 #endif
 
+#include <cstring> // memcpy
+
 #if defined(_WIN32)
     #if !defined(NOMINMAX)
         #define NOMINMAX
@@ -95,7 +97,13 @@ static void AtExitWrapper()
 #endif // LOGGER_DISABLE_ATEXIT
 
 OutputWorker::OutputWorker()
+    : Ring(new QueuedMessage[kWorkQueueLimit])
 {
+    static_assert((kWorkQueueLimit & (kWorkQueueLimit - 1)) == 0, "kWorkQueueLimit must be a power of two");
+    for (size_t i = 0; i < kWorkQueueLimit; ++i) {
+        Ring[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+
     Start();
 
 #if !defined(LOGGER_DISABLE_ATEXIT)
@@ -117,8 +125,7 @@ void OutputWorker::Start()
     CachedIsDebuggerPresent = (::IsDebuggerPresent() != FALSE);
 #endif // _WIN32
 
-    QueuePublic.clear();
-    QueuePrivate.clear();
+    // Note: Messages written while stopped stay in the ring and are logged now
 
 #if !defined(LOGGER_NEVER_DROP)
     Overrun = 0;
@@ -177,7 +184,12 @@ void OutputWorker::Stop()
 
 void OutputWorker::Write(LogStringBuffer& buffer)
 {
-    std::string str = buffer.LogStream.str();
+    size_t bytes = buffer.StreamBuffer.GetBytes();
+
+    // Mark truncated messages
+    if (buffer.StreamBuffer.Truncated && bytes >= 3) {
+        memcpy(buffer.Text + bytes - 3, "...", 3);
+    }
 
 #if defined(_WIN32)
     // If a debugger is present:
@@ -185,37 +197,78 @@ void OutputWorker::Write(LogStringBuffer& buffer)
     {
         // Log all messages immediately to the Visual Studio Output Window
         // to allow logging while single-stepping in a debugger.
+        std::string str(buffer.Text, bytes);
         ::OutputDebugStringA((str + "\n").c_str());
     }
 #endif // _WIN32
 
-#if defined(LOGGER_NEVER_DROP)
-    for (;; Flush())
+    // Claim a ring slot
+    QueuedMessage* slot;
+    uint64_t position = WriteIndex.load(std::memory_order_relaxed);
+    for (;;)
     {
-        std::lock_guard<std::mutex> locker(QueueLock);
+        slot = &Ring[position & (kWorkQueueLimit - 1)];
+        const uint64_t sequence = slot->Sequence.load(std::memory_order_acquire);
 
-        if (QueuePublic.size() >= kWorkQueueLimit)
+        if (sequence == position)
         {
-            continue;
+            if (WriteIndex.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
         }
-        else
+        else if ((int64_t)(sequence - position) < 0)
         {
-            QueuePublic.emplace_back(buffer.LogLevel, buffer.ChannelName, str);
-            break;
+            // Ring is full
+#if defined(LOGGER_NEVER_DROP)
+            Flush();
+            position = WriteIndex.load(std::memory_order_relaxed);
+#else // LOGGER_NEVER_DROP
+            Overrun++;
+            return;
+#endif // LOGGER_NEVER_DROP
         }
+        else
+            position = WriteIndex.load(std::memory_order_relaxed);
     }
-#else // LOGGER_NEVER_DROP
+
+    slot->LogLevel = buffer.LogLevel;
+    slot->ChannelName = buffer.ChannelName;
+    slot->Bytes = static_cast<unsigned>(bytes);
+    memcpy(slot->Text, buffer.Text, bytes);
+
+    // Publish the slot, ordered before the Sleeping check below
+    slot->Sequence.store(position + 1, std::memory_order_seq_cst);
+
+    // Only the first writer to see the thread sleeping takes the lock to wake it
+    if (Sleeping.load(std::memory_order_seq_cst) &&
+        Sleeping.exchange(false, std::memory_order_seq_cst))
     {
         std::lock_guard<std::mutex> locker(QueueLock);
-
-        if (QueuePublic.size() >= kWorkQueueLimit)
-            Overrun++;
-        else
-            QueuePublic.emplace_back(buffer.LogLevel, buffer.ChannelName, str);
+        QueueCondition.notify_all();
     }
-#endif // LOGGER_NEVER_DROP
+}
+
+void OutputWorker::DrainRing(bool flushing)
+{
+    // Messages claimed before the flush must be logged before it returns
+    const uint64_t flushEnd = flushing ? WriteIndex.load(std::memory_order_acquire) : 0;
+
+    for (;;)
+    {
+        QueuedMessage& slot = Ring[ReadIndex & (kWorkQueueLimit - 1)];
+        if (slot.Sequence.load(std::memory_order_acquire) != ReadIndex + 1)
+        {
+            // Stop at the first unpublished slot unless a writer is filling it for a flush
+            if ((int64_t)(ReadIndex - flushEnd) >= 0)
+                break;
+            std::this_thread::yield();
+            continue;
+        }
+
+        Log(slot.LogLevel, slot.ChannelName, slot.Text, slot.Bytes);
 
-    QueueCondition.notify_all();
+        slot.Sequence.store(ReadIndex + kWorkQueueLimit, std::memory_order_release);
+        ++ReadIndex;
+    }
 }
 
 void OutputWorker::Loop()
@@ -228,10 +281,18 @@ void OutputWorker::Loop()
             // unique_lock used since QueueCondition.wait requires it
             std::unique_lock<std::mutex> locker(QueueLock);
 
-            if (QueuePublic.empty() && !FlushRequested && !Terminated)
-                QueueCondition.wait(locker);
+            if (!FlushRequested && !Terminated)
+            {
+                // Announce sleeping before checking the ring, so a writer
+                // publishing a message either is seen here or wakes us
+                Sleeping.store(true, std::memory_order_seq_cst);
+
+                QueuedMessage& slot = Ring[ReadIndex & (kWorkQueueLimit - 1)];
+                if (slot.Sequence.load(std::memory_order_seq_cst) != ReadIndex + 1)
+                    QueueCondition.wait(locker);
 
-            std::swap(QueuePublic, QueuePrivate);
+                Sleeping.store(false, std::memory_order_relaxed);
+            }
 
 #if !defined(LOGGER_NEVER_DROP)
             overrun = Overrun;
@@ -242,8 +303,7 @@ void OutputWorker::Loop()
             FlushRequested = false;
         }
 
-        for (auto& log : QueuePrivate)
-            Log(log);
+        DrainRing(flushRequested);
 
         // Handle log message overrun
         if (overrun > 0)
@@ -251,26 +311,25 @@ void OutputWorker::Loop()
             std::ostringstream oss;
             oss << "Queue overrun. Lost " << overrun << " log messages";
             std::string str = oss.str();
-            QueuedMessage qm(Level::Error, "Logger", str);
-            Log(qm);
+            Log(Level::Error, "Logger", str.c_str(), str.size());
         }
 
-        QueuePrivate.clear();
-
         if (flushRequested)
             FlushCondition.notify_all();
     }
 
+    DrainRing(false);
+
     // Log out that logger is terminating
-    std::string terminatingMessage = "Terminating";
-    QueuedMessage qm(Level::Info, "Logger", terminatingMessage);
-    Log(qm);
+    static const char kTerminatingMessage[] = "Terminating";
+    Log(Level::Info, "Logger", kTerminatingMessage, sizeof(kTerminatingMessage) - 1);
 }
 
-void OutputWorker::Log(QueuedMessage& message)
+void OutputWorker::Log(Level level, const char* channelName, const char* text, size_t bytes)
 {
     std::ostringstream ss;
-    ss << '{' << LevelToChar(message.LogLevel) << '-' << message.ChannelName << "} " << message.Message;
+    ss << '{' << LevelToChar(level) << '-' << channelName << "} ";
+    ss.write(text, bytes);
 
 #if defined(ANDROID)
     std::string fmtstr = ss.str();
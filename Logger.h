@@ -53,6 +53,8 @@
 
     * Automatic initialization and shutdown just like 'cout'.
     * Low performance impact since the logging occurs on a background thread.
+    * Messages are formatted on the stack and handed over through a lock-free ring.
+    * CompiledChannel removes messages below a compile-time level entirely.
     * Automatically flushes message queue on shutdown.  (And it isn't buggy.)
 
     Additional extra features:
@@ -74,7 +76,6 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
-#include <list>
 #include <thread>
 #include <memory>
 
@@ -139,8 +140,12 @@ namespace logger {
 
 /// Tune the number of work queue items before we drop log messages on the floor.
 /// If LOGGER_NEVER_DROP is defined this is when we block and flush.
+/// Note: This must be a power of two
 static const size_t kWorkQueueLimit = 1024;
 
+/// Longest message in bytes.  Longer messages are truncated
+static const size_t kMaxMessageBytes = 1000;
+
 
 //------------------------------------------------------------------------------
 // Level
@@ -166,16 +171,45 @@ char LevelToChar(Level level);
 //------------------------------------------------------------------------------
 // Buffer
 
+/// Stream buffer writing into a fixed array, so formatting does not allocate
+class LogStreamBuffer : public std::streambuf
+{
+public:
+    LogStreamBuffer(char* data, size_t bytes)
+    {
+        setp(data, data + bytes);
+    }
+
+    /// Number of bytes written so far
+    size_t GetBytes() const
+    {
+        return static_cast<size_t>(pptr() - pbase());
+    }
+
+    /// Was the message too long to fit?
+    bool Truncated = false;
+
+protected:
+    int_type overflow(int_type /*ch*/) override
+    {
+        Truncated = true;
+        return traits_type::eof();
+    }
+};
+
 struct LogStringBuffer
 {
     const char* ChannelName;
     Level LogLevel;
-    std::ostringstream LogStream;
+    char Text[kMaxMessageBytes];
+    LogStreamBuffer StreamBuffer;
+    std::ostream LogStream;
 
     LogStringBuffer(const char* channel, Level level) :
         ChannelName(channel),
         LogLevel(level),
-        LogStream()
+        StreamBuffer(Text, sizeof(Text)),
+        LogStream(&StreamBuffer)
     {
     }
 };
@@ -225,35 +259,42 @@ public:
     void Write(LogStringBuffer& buffer);
 
 protected:
+    /// Slot in the message ring
     struct QueuedMessage
     {
+        /// Ring position this slot is ready for.
+        /// Writers claim it at position and publish it as position + 1,
+        /// then the thread frees it for position + kWorkQueueLimit
+        std::atomic<uint64_t> Sequence;
+
         Level LogLevel;
         const char* ChannelName;
-        std::string Message;
-
-        QueuedMessage(Level level, const char* channel, std::string& message)
-            : LogLevel(level)
-            , ChannelName(channel)
-            , Message(message)
-        {
-        }
+        unsigned Bytes;
+        char Text[kMaxMessageBytes];
     };
 
 
     /// Lock preventing thread safety issues around Start() and Stop()
     mutable std::mutex StartStopLock;
 
-    /// Lock protecting QueuePublic and QueueCondition
+    /// Lock protecting QueueCondition and FlushCondition.
+    /// Writers only take it to wake the thread when it is sleeping
     mutable std::mutex QueueLock;
 
     /// Condition that indicates the thread should wake up
     std::condition_variable QueueCondition;
 
-    /// List of messages that are being delivered to thread
-    std::list<QueuedMessage> QueuePublic;
+    /// Bounded multi-producer ring of messages read by the thread
+    std::unique_ptr<QueuedMessage[]> Ring;
+
+    /// Next ring position to claim for writing
+    std::atomic<uint64_t> WriteIndex = ATOMIC_VAR_INIT(0);
+
+    /// Next ring position to log.  Only accessed by the thread
+    uint64_t ReadIndex = 0;
 
-    /// Private list of messages being logged out by thread
-    std::list<QueuedMessage> QueuePrivate;
+    /// Is the thread waiting on QueueCondition?
+    std::atomic<bool> Sleeping = ATOMIC_VAR_INIT(false);
 
 #if !defined(LOGGER_NEVER_DROP)
     /// Number of log queue overruns
@@ -281,8 +322,12 @@ protected:
     /// Queue processing loop
     void Loop();
 
+    /// Log messages from the ring that are ready.
+    /// If flushing, wait on writers until the messages claimed so far are logged
+    void DrainRing(bool flushing);
+
     /// Internal log message dispatch function
-    void Log(QueuedMessage& message);
+    void Log(Level level, const char* channelName, const char* text, size_t bytes);
 };
 
 
@@ -396,6 +441,77 @@ protected:
     }
 };
 
+
+//------------------------------------------------------------------------------
+// CompiledChannel
+
+/// Logging channel that also has a compile-time minimum level.
+/// Messages below kCompiledMinLevel compile to nothing, including the
+/// argument set-up and ShouldLog() checks, so hot paths can log freely
+template<Level kCompiledMinLevel>
+class CompiledChannel : public Channel
+{
+public:
+    explicit CompiledChannel(const char* name, Level minLevel)
+        : Channel(name, minLevel)
+    {
+    }
+
+    /// Should we log at this level?
+    LOGGER_FORCE_INLINE bool ShouldLog(Level level) const
+    {
+        return level >= kCompiledMinLevel && Channel::ShouldLog(level);
+    }
+
+    /// Log a message at a specified level
+    template<typename... Args>
+    LOGGER_FORCE_INLINE void Log(Level level, Args&&... args) const
+    {
+        if (level >= kCompiledMinLevel)
+            Channel::Log(level, std::forward<Args>(args)...);
+    }
+
+    /// Log an Error level message
+    template<typename... Args>
+    LOGGER_FORCE_INLINE void Error(Args&&... args) const
+    {
+        if (Level::Error >= kCompiledMinLevel)
+            Channel::Error(std::forward<Args>(args)...);
+    }
+
+    /// Log a Warning level message
+    template<typename... Args>
+    LOGGER_FORCE_INLINE void Warning(Args&&... args) const
+    {
+        if (Level::Warning >= kCompiledMinLevel)
+            Channel::Warning(std::forward<Args>(args)...);
+    }
+
+    /// Log an Info level message
+    template<typename... Args>
+    LOGGER_FORCE_INLINE void Info(Args&&... args) const
+    {
+        if (Level::Info >= kCompiledMinLevel)
+            Channel::Info(std::forward<Args>(args)...);
+    }
+
+    /// Log a Debug level message
+    template<typename... Args>
+    LOGGER_FORCE_INLINE void Debug(Args&&... args) const
+    {
+        if (Level::Debug >= kCompiledMinLevel)
+            Channel::Debug(std::forward<Args>(args)...);
+    }
+
+    /// Log a Trace level message
+    template<typename... Args>
+    LOGGER_FORCE_INLINE void Trace(Args&&... args) const
+    {
+        if (Level::Trace >= kCompiledMinLevel)
+            Channel::Trace(std::forward<Args>(args)...);
+    }
+};
+
 /// Flush log output to console
 LOGGER_FORCE_INLINE void Flush()
 {
@@ -32,6 +32,31 @@
 #include <cstring> // memcpy
 #include <cstdlib> // calloc
 
+#if defined(__linux__)
+    #include <sys/mman.h> // mmap
+    #include <sys/syscall.h> // SYS_mbind
+    #include <unistd.h> // syscall
+    #define PKTALLOC_MAPPED_MEMORY
+#elif defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h> // VirtualAllocExNuma
+    #define PKTALLOC_MAPPED_MEMORY
+#endif
+
+// Bitmap scans use the vector unit the build targets
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define PKTALLOC_BITMAP_AVX2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #include <arm_neon.h>
+    #define PKTALLOC_BITMAP_NEON
+#endif
+
 #if defined(PKTALLOC_ENABLE_ALLOCATOR_INTEGRITY_CHECKS) && defined(PKTALLOC_DEBUG)
     #define ALLOC_DEBUG_INTEGRITY_CHECK() IntegrityCheck();
 #else // PKTALLOC_ENABLE_ALLOCATOR_INTEGRITY_CHECKS
@@ -41,6 +66,165 @@
 namespace pktalloc {
 
 
+//------------------------------------------------------------------------------
+// Bitmap Scanning
+
+/// Returns the number of set bits in words[0..count)
+static unsigned PopcountWords(const uint64_t* words, unsigned count)
+{
+    unsigned total = 0;
+    unsigned i = 0;
+
+#if defined(PKTALLOC_BITMAP_AVX2)
+    // Count the bits in each nibble with a table lookup, then add the bytes
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sums = zero;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i));
+        const __m256i lo = _mm256_and_si256(v, lowMask);
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+        const __m256i counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, lo),
+            _mm256_shuffle_epi8(lookup, hi));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, zero));
+    }
+
+    total += (unsigned)(
+        _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+        _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3));
+#elif defined(PKTALLOC_BITMAP_NEON)
+    uint64x2_t sums = vdupq_n_u64(0);
+
+    for (; i + 2 <= count; i += 2)
+    {
+        const uint8x16_t counts = vcntq_u8(vreinterpretq_u8_u64(vld1q_u64(words + i)));
+        sums = vpadalq_u32(sums, vpaddlq_u16(vpaddlq_u8(counts)));
+    }
+
+    total += (unsigned)(vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1));
+#endif
+
+    for (; i < count; ++i) {
+        total += PopCount64(words[i]);
+    }
+
+    return total;
+}
+
+/// Returns the first index in [wordStart, wordEnd) where the word is not
+/// equal to 'skip', or wordEnd if they all are
+static unsigned FindWordNotEqual(const uint64_t* words, unsigned wordStart, unsigned wordEnd, uint64_t skip)
+{
+    unsigned i = wordStart;
+
+#if defined(PKTALLOC_BITMAP_AVX2)
+    const __m256i skipV = _mm256_set1_epi64x((long long)skip);
+
+    for (; i + 4 <= wordEnd; i += 4)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, skipV)) != -1) {
+            break;
+        }
+    }
+#elif defined(PKTALLOC_BITMAP_NEON)
+    const uint64x2_t skipV = vdupq_n_u64(skip);
+
+    for (; i + 2 <= wordEnd; i += 2)
+    {
+        const uint64x2_t eq = vceqq_u64(vld1q_u64(words + i), skipV);
+        if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != ~(uint64_t)0) {
+            break;
+        }
+    }
+#endif
+
+    for (; i < wordEnd; ++i) {
+        if (words[i] != skip) {
+            return i;
+        }
+    }
+
+    return wordEnd;
+}
+
+unsigned BitmapRangePopcount(const uint64_t* words, unsigned bitStart, unsigned bitEnd)
+{
+    if (bitStart >= bitEnd) {
+        return 0;
+    }
+
+    const unsigned wordStart = bitStart / 64;
+    const unsigned wordEnd = bitEnd / 64;
+
+    // Eliminate low bits of first word
+    const uint64_t first = words[wordStart] >> (bitStart % 64);
+
+    // If there is just one word, also eliminate its high bits
+    if (wordEnd == wordStart) {
+        return PopCount64(first << (64 - (bitEnd - bitStart)));
+    }
+
+    unsigned count = PopCount64(first);
+
+    // Whole words
+    count += PopcountWords(words + wordStart + 1, wordEnd - wordStart - 1);
+
+    // Low bits of the last word, if any
+    const unsigned lastWordBits = bitEnd % 64;
+    if (lastWordBits > 0) {
+        count += PopCount64(words[wordEnd] << (64 - lastWordBits));
+    }
+
+    return count;
+}
+
+/// Find the first bit in the range that differs from the bits of 'skip',
+/// which is all zeroes or all ones
+static unsigned BitmapFindFirstNot(const uint64_t* words, unsigned bitStart, unsigned bitEnd, uint64_t skip)
+{
+    if (bitStart >= bitEnd) {
+        return bitEnd;
+    }
+
+    const unsigned wordStart = bitStart / 64;
+
+    unsigned found;
+
+    const uint64_t first = (words[wordStart] ^ skip) >> (bitStart % 64);
+    if (first != 0) {
+        found = bitStart + TrailingZeros64(first);
+    }
+    else
+    {
+        const unsigned wordEnd = (bitEnd + 63) / 64;
+        const unsigned i = FindWordNotEqual(words, wordStart + 1, wordEnd, skip);
+        if (i >= wordEnd) {
+            return bitEnd;
+        }
+        found = i * 64 + TrailingZeros64(words[i] ^ skip);
+    }
+
+    return (found < bitEnd) ? found : bitEnd;
+}
+
+unsigned BitmapFindFirstClear(const uint64_t* words, unsigned bitStart, unsigned bitEnd)
+{
+    return BitmapFindFirstNot(words, bitStart, bitEnd, ~(uint64_t)0);
+}
+
+unsigned BitmapFindFirstSet(const uint64_t* words, unsigned bitStart, unsigned bitEnd)
+{
+    return BitmapFindFirstNot(words, bitStart, bitEnd, 0);
+}
+
+
 //------------------------------------------------------------------------------
 // SIMD-Safe Aligned Memory Allocations
 
@@ -72,13 +256,187 @@ static inline void SIMDSafeFree(void* ptr)
 }
 
 
+//------------------------------------------------------------------------------
+// Memory Mapped from the OS
+
+#ifdef PKTALLOC_MAPPED_MEMORY
+
+static const size_t kSmallPageBytes = 4096;
+static const size_t kHugePageBytes = 2 * 1024 * 1024;
+
+/// Bytes at the front of each chunk for its MappedChunk header
+static const unsigned kChunkHeaderBytes = 64;
+
+/// log2(kWindowPoolLargeMinBytes)
+static const unsigned kLargeMinShift = 14;
+static_assert((1u << kLargeMinShift) == kWindowPoolLargeMinBytes, "Update kLargeMinShift");
+
+/// Returns the bytes in each block of the given size class
+static inline size_t GetLargeClassBytes(unsigned sizeClass)
+{
+    return (size_t)(4 + sizeClass % 4) << (kLargeMinShift - 2 + sizeClass / 4);
+}
+
+/// Returns the smallest size class that holds `bytes`, which may be
+/// kWindowPoolLargeClassCount or more if the allocation does not fit a chunk
+static unsigned GetLargeClassAbove(size_t bytes)
+{
+    if (bytes <= kWindowPoolLargeMinBytes) {
+        return 0;
+    }
+
+    // Find the power of two at or below bytes - 1, and then the quarter step
+    const size_t last = bytes - 1;
+    unsigned shift = kLargeMinShift;
+    while ((last >> (shift + 1)) != 0) {
+        ++shift;
+    }
+    return (shift - kLargeMinShift) * 4 + (unsigned)(last >> (shift - 2)) - 4 + 1;
+}
+
+/// Returns the largest size class that fits in `bytes`.
+/// Precondition: bytes >= kWindowPoolLargeMinBytes
+static unsigned GetLargeClassBelow(size_t bytes)
+{
+    unsigned shift = kLargeMinShift;
+    while ((bytes >> (shift + 1)) != 0) {
+        ++shift;
+    }
+    const unsigned sizeClass = (shift - kLargeMinShift) * 4 + (unsigned)(bytes >> (shift - 2)) - 4;
+    if (sizeClass >= kWindowPoolLargeClassCount) {
+        return kWindowPoolLargeClassCount - 1;
+    }
+    return sizeClass;
+}
+
+/// Round up to the size that will actually be mapped
+static inline size_t GetMappedBytes(size_t bytes, bool hugePages)
+{
+    if (hugePages && bytes >= kHugePageBytes) {
+        return (bytes + kHugePageBytes - 1) & ~(kHugePageBytes - 1);
+    }
+    return (bytes + kSmallPageBytes - 1) & ~(kSmallPageBytes - 1);
+}
+
+/// Map zeroed memory from the OS, preferring the given NUMA node if >= 0.
+/// Precondition: `bytes` came from GetMappedBytes()
+static uint8_t* MapMemory(size_t bytes, bool hugePages, int numaNode)
+{
+    hugePages = hugePages && (bytes % kHugePageBytes == 0);
+
+#if defined(_WIN32)
+    const DWORD node = (numaNode >= 0) ? (DWORD)numaNode : NUMA_NO_PREFERRED_NODE;
+    void* mapped = nullptr;
+
+    // Large pages require SeLockMemoryPrivilege, so fall back without them
+    const SIZE_T largePageBytes = GetLargePageMinimum();
+    if (hugePages && largePageBytes > 0 && bytes % largePageBytes == 0)
+    {
+        mapped = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes,
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+    }
+    if (!mapped)
+    {
+        mapped = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes,
+            MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+    }
+    return (uint8_t*)mapped;
+#else // _WIN32
+    void* mapped = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages are only available if the admin reserved some
+    if (hugePages)
+    {
+        mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif // MAP_HUGETLB
+
+    if (mapped == MAP_FAILED && hugePages)
+    {
+        // Transparent huge pages need huge page alignment, so map extra
+        // and trim it down to an aligned region
+        const size_t paddedBytes = bytes + kHugePageBytes;
+        uint8_t* padded = (uint8_t*)mmap(nullptr, paddedBytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (padded == (uint8_t*)MAP_FAILED) {
+            return nullptr;
+        }
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)padded + kHugePageBytes - 1) & ~(uintptr_t)(kHugePageBytes - 1));
+        if (aligned > padded) {
+            munmap(padded, aligned - padded);
+        }
+        const size_t tailBytes = (size_t)((padded + paddedBytes) - (aligned + bytes));
+        if (tailBytes > 0) {
+            munmap(aligned + bytes, tailBytes);
+        }
+        mapped = aligned;
+
+#ifdef MADV_HUGEPAGE
+        madvise(mapped, bytes, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+    }
+
+    if (mapped == MAP_FAILED)
+    {
+        mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+
+#ifdef SYS_mbind
+    // Set the policy before first touch so the pages are placed on the node.
+    // MPOL_PREFERRED falls back to other nodes when the node is full.
+    // Failure is harmless, for example on kernels without NUMA support
+    if (numaNode >= 0)
+    {
+        static const int kMpolPreferred = 1;
+        static const unsigned kMaskBits = (unsigned)(8 * sizeof(unsigned long));
+        unsigned long nodeMask[kWindowPoolMaxNumaNodes / kMaskBits] = {};
+        nodeMask[numaNode / kMaskBits] = 1UL << (numaNode % kMaskBits);
+
+        // Note: The kernel expects one more than the number of mask bits
+        syscall(SYS_mbind, mapped, bytes, kMpolPreferred, nodeMask,
+            (unsigned long)kWindowPoolMaxNumaNodes + 1, 0);
+    }
+#endif // SYS_mbind
+
+    return (uint8_t*)mapped;
+#endif // _WIN32
+}
+
+/// Unmap memory from MapMemory()
+static inline void UnmapMemory(uint8_t* ptr, size_t bytes)
+{
+#if defined(_WIN32)
+    (void)bytes;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else // _WIN32
+    munmap(ptr, bytes);
+#endif // _WIN32
+}
+
+#endif // PKTALLOC_MAPPED_MEMORY
+
+
 //------------------------------------------------------------------------------
 // Allocator
 
-Allocator::Allocator()
+Allocator::Allocator(WindowPool* pool, bool hugePages, int numaNode)
+    : Pool(pool)
 {
     static_assert(kAlignmentBytes == kUnitSize, "update SIMDSafeAllocate");
 
+    // Pooled allocators take windows from the pool as needed
+    if (Pool)
+    {
+        PoolArena = Pool->GetArena(hugePages, numaNode);
+        return;
+    }
+
     PreferredWindows.SetSize_NoCopy(kPreallocatedWindows);
 
     HugeChunkStart = SIMDSafeAllocate(kWindowSizeBytes * kPreallocatedWindows);
@@ -112,7 +470,7 @@ Allocator::~Allocator()
         WindowHeader* window = PreferredWindows.GetRef(i);
         PKTALLOC_DEBUG_ASSERT(window != nullptr);
         if (window && !window->Preallocated) {
-            SIMDSafeFree(window);
+            freeWindow(window);
         }
     }
     for (unsigned i = 0, count = FullWindows.GetSize(); i < count; ++i)
@@ -120,10 +478,16 @@ Allocator::~Allocator()
         WindowHeader* window = FullWindows.GetRef(i);
         PKTALLOC_DEBUG_ASSERT(window != nullptr);
         if (window && !window->Preallocated) {
-            SIMDSafeFree(window);
+            freeWindow(window);
         }
     }
     SIMDSafeFree(HugeChunkStart);
+
+    while (FallbackHead)
+    {
+        const AllocationHeader* regionHeader = (const AllocationHeader*)((uint8_t*)FallbackHead + kUnitSize);
+        fallbackFree((uint8_t*)regionHeader + kUnitSize, regionHeader->UsedUnits);
+    }
 }
 
 unsigned Allocator::GetMemoryUsedBytes() const
@@ -153,6 +517,14 @@ unsigned Allocator::GetMemoryAllocatedBytes() const
     return (unsigned)((PreferredWindows.GetSize() + FullWindows.GetSize()) * kWindowMaxUnits * kUnitSize);
 }
 
+uint64_t Allocator::GetPoolMemoryAllocatedBytes() const
+{
+    if (!Pool) {
+        return 0;
+    }
+    return Pool->GetMemoryAllocatedBytes();
+}
+
 bool Allocator::IntegrityCheck() const
 {
 #ifdef PKTALLOC_SHRINK
@@ -161,6 +533,7 @@ bool Allocator::IntegrityCheck() const
 
     unsigned emptyCount = 0;
     unsigned preallocatedCount = 0;
+    uint64_t liveUnits = 0;
 
     // Check preferred windows list:
     for (unsigned i = 0, icount = PreferredWindows.GetSize(); i < icount; ++i)
@@ -196,6 +569,7 @@ bool Allocator::IntegrityCheck() const
             PKTALLOC_DEBUG_BREAK(); // Bitfield does not match FreeUnitCount
             return false;
         }
+        liveUnits += setCount;
         if (window->Preallocated) {
             ++preallocatedCount;
         }
@@ -247,12 +621,23 @@ bool Allocator::IntegrityCheck() const
             PKTALLOC_DEBUG_BREAK(); // Bitfield does not match FreeUnitCount
             return false;
         }
+        liveUnits += setCount;
         if (window->Preallocated) {
             ++preallocatedCount;
         }
     }
 
-    if (preallocatedCount != kPreallocatedWindows) {
+    for (const FallbackLink* link = FallbackHead; link; link = link->Next)
+    {
+        const AllocationHeader* regionHeader = (const AllocationHeader*)((const uint8_t*)link + kUnitSize);
+        liveUnits += regionHeader->UsedUnits;
+    }
+    if (liveUnits != LiveUnitCount) {
+        PKTALLOC_DEBUG_BREAK(); // LiveUnitCount does not match allocations
+        return false;
+    }
+
+    if (preallocatedCount != (Pool ? 0 : kPreallocatedWindows)) {
         PKTALLOC_DEBUG_BREAK(); // Lost a preallocated window
         return false;
     }
@@ -335,6 +720,7 @@ uint8_t* Allocator::Allocate(unsigned bytes)
             }
 #endif // PKTALLOC_SHRINK
             window->FreeUnitCount -= units;
+            LiveUnitCount += units;
             usedPtr->SetRange(regionStart, regionStart + units);
             window->ResumeScanOffset = regionStart + units;
 
@@ -397,7 +783,13 @@ uint8_t* Allocator::allocateFromNewWindow(unsigned units)
 {
     ALLOC_DEBUG_INTEGRITY_CHECK();
 
-    uint8_t* headerStart = SIMDSafeAllocate(kWindowSizeBytes);
+    uint8_t* headerStart;
+    if (Pool) {
+        headerStart = Pool->AllocateWindow(PoolArena);
+    }
+    else {
+        headerStart = SIMDSafeAllocate(kWindowSizeBytes);
+    }
     if (!headerStart) {
         return nullptr; // Allocation failure
     }
@@ -407,6 +799,7 @@ uint8_t* Allocator::allocateFromNewWindow(unsigned units)
     window->Used.ClearAll();
     window->Used.SetRange(0, units);
     window->FreeUnitCount = kWindowMaxUnits - units;
+    LiveUnitCount += units;
     window->ResumeScanOffset = units;
     window->Preallocated = false;
     PKTALLOC_DEBUG_ASSERT(PreferredWindows.GetSize() == 0);
@@ -540,6 +933,7 @@ void Allocator::Shrink(uint8_t* ptr, unsigned bytes)
 
         // Give back the unit count
         windowHeader->FreeUnitCount += unitsCurrent - unitsNeeded;
+        LiveUnitCount -= unitsCurrent - unitsNeeded;
 
         // Update unit count
         regionHeader->UsedUnits = unitsNeeded;
@@ -575,8 +969,9 @@ void Allocator::Free(uint8_t* ptr)
     WindowHeader* window = regionHeader->Header;
     if (!window)
     {
+        const unsigned fallbackUnits = regionHeader->UsedUnits;
         regionHeader->UsedUnits = 0; // Mark freed
-        fallbackFree(ptr);
+        fallbackFree(ptr, fallbackUnits);
         return;
     }
 
@@ -601,6 +996,8 @@ void Allocator::Free(uint8_t* ptr)
 
     // Give back the unit count
     window->FreeUnitCount += units;
+    PKTALLOC_DEBUG_ASSERT(LiveUnitCount >= units);
+    LiveUnitCount -= units;
 
     // If we may want to promote this to Preferred:
     if (window->FreeUnitCount >= kPreferredThresholdUnits &&
@@ -626,6 +1023,15 @@ void Allocator::Free(uint8_t* ptr)
         PreferredWindows.Append(window);
     }
 
+    // Pooled allocators give back empty windows right away so that idle
+    // codecs hold almost nothing
+    if (Pool && window->FreeUnitCount >= kWindowMaxUnits)
+    {
+        releaseEmptyWindow(window);
+        ALLOC_DEBUG_INTEGRITY_CHECK();
+        return;
+    }
+
 #ifdef PKTALLOC_SHRINK
     // If we should do some bulk cleanup:
     if (window->FreeUnitCount >= kWindowMaxUnits &&
@@ -664,7 +1070,7 @@ void Allocator::freeEmptyWindows()
             continue;
         }
 
-        SIMDSafeFree(window);
+        freeWindow(window);
 
         PKTALLOC_DEBUG_ASSERT(count > 0);
         --count;
@@ -683,31 +1089,444 @@ void Allocator::freeEmptyWindows()
 
 #endif // PKTALLOC_SHRINK
 
+void Allocator::freeWindow(WindowHeader* window)
+{
+    if (Pool) {
+        Pool->FreeWindow((uint8_t*)window, PoolArena);
+    }
+    else {
+        SIMDSafeFree(window);
+    }
+}
+
+void Allocator::releaseEmptyWindow(WindowHeader* window)
+{
+    PKTALLOC_DEBUG_ASSERT(window->FullListIndex == kNotInFullList);
+    PKTALLOC_DEBUG_ASSERT(!window->Preallocated);
+
+    const unsigned count = PreferredWindows.GetSize();
+    for (unsigned i = 0; i < count; ++i)
+    {
+        if (PreferredWindows.GetRef(i) != window) {
+            continue;
+        }
+
+        PreferredWindows.GetRef(i) = PreferredWindows.GetRef(count - 1);
+        PreferredWindows.SetSize_Copy(count - 1);
+
+        Pool->FreeWindow((uint8_t*)window, PoolArena);
+        return;
+    }
+
+    PKTALLOC_DEBUG_BREAK(); // Window not found in preferred list
+}
+
 uint8_t* Allocator::fallbackAllocate(unsigned bytes)
 {
     // Calculate number of units required by this allocation
     // Note: +1 for the AllocationHeader
     const unsigned units = (bytes + kUnitSize - 1) / kUnitSize + 1;
 
-    uint8_t* ptr = SIMDSafeAllocate(kUnitSize * units);
+    // Note: +1 for the FallbackLink
+    uint8_t* ptr;
+    if (Pool) {
+        ptr = Pool->AllocateLarge(kUnitSize * (units + 1), PoolArena);
+    }
+    else {
+        ptr = SIMDSafeAllocate(kUnitSize * (units + 1));
+    }
     if (!ptr) {
         return nullptr;
     }
 
+    FallbackLink* link = (FallbackLink*)ptr;
+    link->Prev = nullptr;
+    link->Next = FallbackHead;
+    if (FallbackHead) {
+        FallbackHead->Prev = link;
+    }
+    FallbackHead = link;
+    ptr += kUnitSize;
+
     AllocationHeader* regionHeader = (AllocationHeader*)ptr;
 #ifdef PKTALLOC_DEBUG
     regionHeader->Canary = AllocationHeader::kCanaryExpected;
 #endif // PKTALLOC_DEBUG
     regionHeader->Header = nullptr;
     regionHeader->UsedUnits = units;
+    LiveUnitCount += units;
 
     return ptr + kUnitSize;
 }
 
-void Allocator::fallbackFree(uint8_t* ptr)
+void Allocator::fallbackFree(uint8_t* ptr, unsigned units)
+{
+    PKTALLOC_DEBUG_ASSERT(ptr);
+
+    FallbackLink* link = (FallbackLink*)(ptr - kUnitSize * 2);
+    if (link->Prev) {
+        link->Prev->Next = link->Next;
+    }
+    else {
+        PKTALLOC_DEBUG_ASSERT(FallbackHead == link);
+        FallbackHead = link->Next;
+    }
+    if (link->Next) {
+        link->Next->Prev = link->Prev;
+    }
+
+    PKTALLOC_DEBUG_ASSERT(LiveUnitCount >= units);
+    LiveUnitCount -= units;
+
+    if (Pool) {
+        Pool->FreeLarge((uint8_t*)link, kUnitSize * (units + 1), PoolArena);
+    }
+    else {
+        SIMDSafeFree(link);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// WindowPool
+
+WindowPool::WindowPool(uint64_t maxBytes, bool hugePages, int numaNode)
+    : MaxBytes(maxBytes)
+{
+    PKTALLOC_DEBUG_ASSERT(numaNode < kWindowPoolMaxNumaNodes);
+    Arenas[0].HugePages = hugePages;
+    Arenas[0].NumaNode = numaNode;
+#ifdef PKTALLOC_MAPPED_MEMORY
+    Mapped = hugePages || (numaNode >= 0 && numaNode < kWindowPoolMaxNumaNodes);
+#endif // PKTALLOC_MAPPED_MEMORY
+}
+
+WindowPool::~WindowPool()
+{
+#ifdef PKTALLOC_MAPPED_MEMORY
+    // Windows and blocks live inside the chunks, so only the chunks are unmapped
+    for (unsigned i = 0; i < ArenaCount; ++i)
+    {
+        while (MappedChunk* chunk = Arenas[i].Chunks)
+        {
+            Arenas[i].Chunks = chunk->Next;
+            UnmapMemory((uint8_t*)chunk, kWindowPoolChunkBytes);
+            AllocatedBytes -= kWindowPoolChunkBytes;
+        }
+    }
+
+    if (Mapped)
+    {
+        // Memory still allocated means an Allocator outlived the pool
+        PKTALLOC_DEBUG_ASSERT(AllocatedBytes == 0);
+        return;
+    }
+#endif // PKTALLOC_MAPPED_MEMORY
+
+    for (unsigned i = 0; i < kWindowPoolCacheCount; ++i)
+    {
+        while (uint8_t* window = Caches[i].Windows.Pop())
+        {
+            SIMDSafeFree(window);
+            AllocatedBytes -= Allocator::kWindowSizeBytes;
+        }
+    }
+    while (uint8_t* window = GlobalWindows.Pop())
+    {
+        SIMDSafeFree(window);
+        AllocatedBytes -= Allocator::kWindowSizeBytes;
+    }
+
+    // Memory still allocated means an Allocator outlived the pool
+    PKTALLOC_DEBUG_ASSERT(AllocatedBytes == 0);
+}
+
+unsigned WindowPool::GetArena(bool hugePages, int numaNode)
+{
+#ifdef PKTALLOC_MAPPED_MEMORY
+    PKTALLOC_DEBUG_ASSERT(numaNode < kWindowPoolMaxNumaNodes);
+    if (numaNode >= kWindowPoolMaxNumaNodes) {
+        numaNode = -1;
+    }
+
+    // Leaving both unset keeps the pool's own placement
+    if (!hugePages && numaNode < 0) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> globalLocker(GlobalLock);
+
+    for (unsigned i = Mapped ? 0 : 1; i < ArenaCount; ++i)
+    {
+        if (Arenas[i].HugePages == hugePages && Arenas[i].NumaNode == numaNode) {
+            return i;
+        }
+    }
+
+    // Out of arenas: Use the pool's own placement
+    if (ArenaCount >= kWindowPoolMaxArenas) {
+        return 0;
+    }
+
+    MappedArena& arena = Arenas[ArenaCount];
+    arena.HugePages = hugePages;
+    arena.NumaNode = numaNode;
+    return ArenaCount++;
+#else // PKTALLOC_MAPPED_MEMORY
+    (void)hugePages;
+    (void)numaNode;
+    return 0;
+#endif // PKTALLOC_MAPPED_MEMORY
+}
+
+WindowPool::ThreadCache* WindowPool::getThreadCache()
+{
+    // Hand out caches to threads round-robin on first use
+    static std::atomic<unsigned> NextCacheIndex = ATOMIC_VAR_INIT(0);
+    static thread_local unsigned CacheIndex = (NextCacheIndex++) % kWindowPoolCacheCount;
+
+    return &Caches[CacheIndex];
+}
+
+uint8_t* WindowPool::AllocateWindow(unsigned arena)
+{
+    PKTALLOC_DEBUG_ASSERT(arena < kWindowPoolMaxArenas);
+
+    // Other placements keep their free windows in the arena
+    if (arena != 0)
+    {
+        std::lock_guard<std::mutex> globalLocker(GlobalLock);
+
+        uint8_t* window = Arenas[arena].Windows.Pop();
+        if (window) {
+            return window;
+        }
+        return allocateFromChunk(Arenas[arena], Allocator::kWindowSizeBytes);
+    }
+
+    ThreadCache* cache = getThreadCache();
+    {
+        std::lock_guard<std::mutex> locker(cache->Lock);
+
+        uint8_t* window = cache->Windows.Pop();
+        if (window) {
+            return window;
+        }
+
+        // Refill half of the cache from the global list
+        std::lock_guard<std::mutex> globalLocker(GlobalLock);
+
+        window = GlobalWindows.Pop();
+        if (window)
+        {
+            for (unsigned i = 1; i < kWindowPoolCacheWindows / 2; ++i)
+            {
+                uint8_t* extra = GlobalWindows.Pop();
+                if (!extra) {
+                    break;
+                }
+                cache->Windows.Push(extra);
+            }
+            return window;
+        }
+
+        // Mapped windows are carved from chunks under the global lock
+        if (Mapped) {
+            return allocateFromChunk(Arenas[0], Allocator::kWindowSizeBytes);
+        }
+    }
+
+    if (!reserve(Allocator::kWindowSizeBytes)) {
+        return nullptr; // Over the memory limit
+    }
+
+    uint8_t* window = SIMDSafeAllocate(Allocator::kWindowSizeBytes);
+    if (!window) {
+        unreserve(Allocator::kWindowSizeBytes);
+    }
+    return window;
+}
+
+uint8_t* WindowPool::allocateFromChunk(MappedArena& arena, size_t bytes)
+{
+#ifdef PKTALLOC_MAPPED_MEMORY
+    static_assert(kChunkHeaderBytes >= sizeof(MappedChunk), "Chunk header too small");
+    static_assert(kChunkHeaderBytes % kAlignmentBytes == 0, "Windows must stay aligned");
+    static_assert(Allocator::kWindowSizeBytes % kAlignmentBytes == 0, "Windows must stay aligned");
+    static_assert(kChunkHeaderBytes + Allocator::kWindowSizeBytes <= kWindowPoolChunkBytes, "Chunk too small");
+    PKTALLOC_DEBUG_ASSERT(bytes % kAlignmentBytes == 0);
+    PKTALLOC_DEBUG_ASSERT(kChunkHeaderBytes + bytes <= kWindowPoolChunkBytes);
+
+    if (arena.ChunkNext + bytes > arena.ChunkEnd)
+    {
+        if (!reserve(kWindowPoolChunkBytes)) {
+            return nullptr; // Over the memory limit
+        }
+
+        uint8_t* chunkStart = MapMemory(kWindowPoolChunkBytes, arena.HugePages, arena.NumaNode);
+        if (!chunkStart)
+        {
+            unreserve(kWindowPoolChunkBytes);
+            return nullptr;
+        }
+
+        // Keep the rest of the previous chunk as free blocks
+        while (arena.ChunkNext && (size_t)(arena.ChunkEnd - arena.ChunkNext) >= kWindowPoolLargeMinBytes)
+        {
+            const unsigned sizeClass = GetLargeClassBelow((size_t)(arena.ChunkEnd - arena.ChunkNext));
+            arena.LargeBlocks[sizeClass].Push(arena.ChunkNext);
+            arena.ChunkNext += GetLargeClassBytes(sizeClass);
+        }
+
+        MappedChunk* chunk = (MappedChunk*)chunkStart;
+        chunk->Next = arena.Chunks;
+        arena.Chunks = chunk;
+
+        arena.ChunkNext = chunkStart + kChunkHeaderBytes;
+        arena.ChunkEnd = chunkStart + kWindowPoolChunkBytes;
+    }
+
+    uint8_t* ptr = arena.ChunkNext;
+    arena.ChunkNext += bytes;
+    return ptr;
+#else // PKTALLOC_MAPPED_MEMORY
+    (void)arena;
+    (void)bytes;
+    PKTALLOC_DEBUG_BREAK(); // Should never get here
+    return nullptr;
+#endif // PKTALLOC_MAPPED_MEMORY
+}
+
+uint8_t* WindowPool::AllocateLarge(unsigned bytes, unsigned arena)
+{
+    PKTALLOC_DEBUG_ASSERT(arena < kWindowPoolMaxArenas);
+
+#ifdef PKTALLOC_MAPPED_MEMORY
+    static_assert(kChunkHeaderBytes + ((size_t)(4 + (kWindowPoolLargeClassCount - 1) % 4)
+        << (kLargeMinShift - 2 + (kWindowPoolLargeClassCount - 1) / 4)) <= kWindowPoolChunkBytes,
+        "Largest block must fit in a chunk");
+
+    if (arena != 0 || Mapped)
+    {
+        MappedArena& mapped = Arenas[arena];
+
+        // Carve blocks that fit in a chunk from the chunks
+        const unsigned sizeClass = GetLargeClassAbove(bytes);
+        if (sizeClass < kWindowPoolLargeClassCount)
+        {
+            std::lock_guard<std::mutex> globalLocker(GlobalLock);
+
+            uint8_t* block = mapped.LargeBlocks[sizeClass].Pop();
+            if (block) {
+                return block;
+            }
+            return allocateFromChunk(mapped, GetLargeClassBytes(sizeClass));
+        }
+
+        const size_t mappedBytes = GetMappedBytes(bytes, mapped.HugePages);
+        if (!reserve(mappedBytes)) {
+            return nullptr; // Over the memory limit
+        }
+
+        uint8_t* ptr = MapMemory(mappedBytes, mapped.HugePages, mapped.NumaNode);
+        if (!ptr) {
+            unreserve(mappedBytes);
+        }
+        return ptr;
+    }
+#endif // PKTALLOC_MAPPED_MEMORY
+
+    if (!reserve(bytes)) {
+        return nullptr; // Over the memory limit
+    }
+
+    uint8_t* ptr = SIMDSafeAllocate(bytes);
+    if (!ptr) {
+        unreserve(bytes);
+    }
+    return ptr;
+}
+
+void WindowPool::FreeLarge(uint8_t* ptr, unsigned bytes, unsigned arena)
 {
     PKTALLOC_DEBUG_ASSERT(ptr);
-    SIMDSafeFree(ptr - kUnitSize);
+    PKTALLOC_DEBUG_ASSERT(arena < kWindowPoolMaxArenas);
+
+#ifdef PKTALLOC_MAPPED_MEMORY
+    if (arena != 0 || Mapped)
+    {
+        MappedArena& mapped = Arenas[arena];
+
+        const unsigned sizeClass = GetLargeClassAbove(bytes);
+        if (sizeClass < kWindowPoolLargeClassCount)
+        {
+            std::lock_guard<std::mutex> globalLocker(GlobalLock);
+            mapped.LargeBlocks[sizeClass].Push(ptr);
+            return;
+        }
+
+        const size_t mappedBytes = GetMappedBytes(bytes, mapped.HugePages);
+        UnmapMemory(ptr, mappedBytes);
+        unreserve(mappedBytes);
+        return;
+    }
+#endif // PKTALLOC_MAPPED_MEMORY
+
+    SIMDSafeFree(ptr);
+    unreserve(bytes);
+}
+
+void WindowPool::FreeWindow(uint8_t* window, unsigned arena)
+{
+    PKTALLOC_DEBUG_ASSERT(window);
+    PKTALLOC_DEBUG_ASSERT(arena < kWindowPoolMaxArenas);
+
+    if (arena != 0)
+    {
+        std::lock_guard<std::mutex> globalLocker(GlobalLock);
+        Arenas[arena].Windows.Push(window);
+        return;
+    }
+
+    ThreadCache* cache = getThreadCache();
+    std::lock_guard<std::mutex> locker(cache->Lock);
+
+    // Spill half of a full cache to the global list
+    if (cache->Windows.Count >= kWindowPoolCacheWindows)
+    {
+        std::lock_guard<std::mutex> globalLocker(GlobalLock);
+
+        for (unsigned i = 0; i < kWindowPoolCacheWindows / 2; ++i) {
+            GlobalWindows.Push(cache->Windows.Pop());
+        }
+    }
+
+    cache->Windows.Push(window);
+}
+
+bool WindowPool::reserve(uint64_t bytes)
+{
+    if (MaxBytes == 0)
+    {
+        AllocatedBytes += bytes;
+        return true;
+    }
+
+    uint64_t allocated = AllocatedBytes.load(std::memory_order_relaxed);
+    do
+    {
+        if (allocated + bytes > MaxBytes) {
+            return false;
+        }
+    } while (!AllocatedBytes.compare_exchange_weak(allocated, allocated + bytes));
+
+    return true;
+}
+
+void WindowPool::unreserve(uint64_t bytes)
+{
+    PKTALLOC_DEBUG_ASSERT(AllocatedBytes >= bytes);
+    AllocatedBytes -= bytes;
 }
 
 
@@ -50,11 +50,23 @@
     Disadvantages:
     + Uses more memory than strictly necessary.
     + Requires some tuning for new applications.
+
+    Shared pools:
+    Applications with many thousands of mostly-idle allocators can attach each
+    of them to one WindowPool.  Attached allocators do not preallocate, take
+    their windows from the pool, and hand empty windows back right away.
+    The pool is the only thread-safe object in this module.
+
+    A pool can also map its memory from huge pages on a chosen NUMA node, so
+    that sessions served by one core keep their packet data close to it.
+    Each allocator attached to the pool can ask for its own placement too.
 */
 
 #include <stdint.h>
 #include <new>
 #include <cstring> // memcpy
+#include <atomic>
+#include <mutex>
 
 #ifdef _WIN32
     #include <intrin.h> // __popcnt64
@@ -109,6 +121,31 @@ static const unsigned kEmptyWindowMinimum = 32;
 /// PKTALLOC_SHRINK: Lazy cleanup after a certain point
 static const unsigned kEmptyWindowCleanupThreshold = 64;
 
+/// WindowPool: Number of free window caches shared out between threads
+static const unsigned kWindowPoolCacheCount = 16;
+
+/// WindowPool: Maximum number of free windows held in each cache
+static const unsigned kWindowPoolCacheWindows = 8;
+
+/// WindowPool: Bytes mapped at a time to carve into windows when the pool
+/// uses huge pages or a NUMA node.  This is the usual huge page size
+static const unsigned kWindowPoolChunkBytes = 2 * 1024 * 1024;
+
+/// WindowPool: NUMA nodes at or above this are not supported
+static const int kWindowPoolMaxNumaNodes = 1024;
+
+/// WindowPool: Number of memory placements one pool maps memory for,
+/// including its own.  Allocators asking for more get the pool's placement
+static const unsigned kWindowPoolMaxArenas = 8;
+
+/// WindowPool: Smallest block carved from a chunk for a fallback allocation
+static const unsigned kWindowPoolLargeMinBytes = 16 * 1024;
+
+/// WindowPool: Number of block sizes carved from chunks for fallback
+/// allocations.  There are four sizes per power of two, from
+/// kWindowPoolLargeMinBytes up to 1.75 MB, which is the largest that fits
+static const unsigned kWindowPoolLargeClassCount = 28;
+
 
 //------------------------------------------------------------------------------
 // Platform
@@ -437,6 +474,27 @@ struct CustomBitSet
 };
 
 
+//------------------------------------------------------------------------------
+// Bitmap Scanning
+
+/**
+    Scans over a flat array of 64-bit words, where bit i is bit (i % 64) of
+    word (i / 64).  Whole words are scanned with AVX2 or NEON when the build
+    targets them, so long runs of set or clear bits are skipped quickly.
+
+    bitStart <= bitEnd: Range to scan (non-inclusive end)
+*/
+
+/// Returns the number of set bits in the range
+unsigned BitmapRangePopcount(const uint64_t* words, unsigned bitStart, unsigned bitEnd);
+
+/// Returns the first clear bit in the range, or bitEnd if all bits are set
+unsigned BitmapFindFirstClear(const uint64_t* words, unsigned bitStart, unsigned bitEnd);
+
+/// Returns the first set bit in the range, or bitEnd if all bits are clear
+unsigned BitmapFindFirstSet(const uint64_t* words, unsigned bitStart, unsigned bitEnd);
+
+
 //------------------------------------------------------------------------------
 // Enumerations
 
@@ -596,11 +654,20 @@ public:
 //------------------------------------------------------------------------------
 // Allocator
 
+class WindowPool;
+
 /// Instance of a packet allocator with its own block of memory
 class Allocator
 {
+    friend class WindowPool;
+
 public:
-    Allocator();
+    /// If `pool` is provided, windows are taken from and returned to it.
+    /// The pool must outlive the allocator.
+    /// `hugePages` and `numaNode` choose where the pool maps memory for this
+    /// allocator, as for the WindowPool.  Leaving both unset uses the pool's
+    /// own placement.  They are ignored without a pool
+    explicit Allocator(WindowPool* pool = nullptr, bool hugePages = false, int numaNode = -1);
     ~Allocator();
 
     /**
@@ -688,6 +755,17 @@ public:
     unsigned GetMemoryAllocatedBytes() const;
     bool IntegrityCheck() const;
 
+    /// Returns bytes held by live allocations, including their headers and
+    /// fallback allocations.  Unlike GetMemoryUsedBytes() this is O(1)
+    uint64_t GetMemoryLiveBytes() const
+    {
+        return LiveUnitCount * kUnitSize;
+    }
+
+    /// Returns bytes allocated by the shared pool for all of its allocators,
+    /// or 0 if this allocator is not attached to a pool
+    uint64_t GetPoolMemoryAllocatedBytes() const;
+
 protected:
     typedef CustomBitSet<kWindowMaxUnits> UsedMaskT;
 
@@ -749,6 +827,16 @@ protected:
 
     static_assert(kUnitSize >= (unsigned)sizeof(AllocationHeader), "too small");
 
+    /// This is tagged on the front of each fallback allocation, before the
+    /// AllocationHeader, so that they can be freed in the destructor
+    struct FallbackLink
+    {
+        FallbackLink* Prev;
+        FallbackLink* Next;
+    };
+
+    static_assert(kUnitSize >= (unsigned)sizeof(FallbackLink), "too small");
+
     /// Round the window header size up to alignment size
     static const unsigned kWindowHeaderBytes = (unsigned)(sizeof(WindowHeader) + kAlignmentBytes - 1) & ~(kAlignmentBytes - 1);
 
@@ -756,6 +844,18 @@ protected:
     static const unsigned kWindowSizeBytes = kWindowHeaderBytes + kWindowMaxUnits * kUnitSize;
 
 
+    /// Optional shared pool that provides windows
+    WindowPool* Pool = nullptr;
+
+    /// Pool arena for the memory placement of this allocator
+    unsigned PoolArena = 0;
+
+    /// List of outstanding fallback allocations
+    FallbackLink* FallbackHead = nullptr;
+
+    /// Units held by live allocations, both in windows and fallback
+    uint64_t LiveUnitCount = 0;
+
     /// Preallocated windows on startup
     uint8_t* HugeChunkStart = nullptr;
 
@@ -784,9 +884,196 @@ protected:
     /// Allocate the units from a new window
     uint8_t* allocateFromNewWindow(unsigned units);
 
+    /// Return a window to the pool or to the system
+    void freeWindow(WindowHeader* window);
+
+    /// Return an empty window from the preferred list to the pool
+    void releaseEmptyWindow(WindowHeader* window);
+
     /// Fallback functions used when the custom allocator will not work
     uint8_t* fallbackAllocate(unsigned bytes);
-    void fallbackFree(uint8_t* ptr);
+    void fallbackFree(uint8_t* ptr, unsigned units);
+};
+
+
+//------------------------------------------------------------------------------
+// WindowPool
+
+/**
+    Process-wide pool of free allocator windows, shared by many Allocators.
+
+    Each thread is assigned one of kWindowPoolCacheCount small caches of free
+    windows, so threads serving different codecs rarely touch the same lock.
+    Caches spill to and refill from a global free list in batches.  New
+    windows are only requested from the system when all of these are empty,
+    and only while the total stays under the memory limit.
+
+    Fallback allocations too large for a window are charged against the same
+    limit, so the limit bounds all packet memory held by attached allocators.
+
+    When huge pages or a NUMA node are requested, windows are carved out of
+    kWindowPoolChunkBytes chunks mapped directly from the OS.  So are fallback
+    allocations, which are rounded up to one of kWindowPoolLargeClassCount
+    block sizes and reused through a free list for each size.  Only fallback
+    allocations too large for a chunk are mapped individually.  Chunks are
+    only returned to the OS when the pool is freed.  On platforms without
+    support for this, memory comes from the heap as usual.
+
+    Memory for each placement (huge pages and NUMA node) is kept in its own
+    arena.  Arena 0 has the placement the pool was created with, and uses the
+    thread caches.  Allocators that ask for another placement share an arena
+    with any others that asked for the same one.  Their free windows are held
+    in that arena under the global lock.
+
+    The pool must be freed after all of the allocators attached to it.
+*/
+class WindowPool
+{
+public:
+    /**
+        `maxBytes` = 0 means no limit.
+        `hugePages` = Back memory with huge pages when the OS allows it.
+        `numaNode` = Prefer memory on this NUMA node, or -1 for any node.
+    */
+    explicit WindowPool(uint64_t maxBytes = 0, bool hugePages = false, int numaNode = -1);
+    ~WindowPool();
+
+    /// Returns the arena for memory with the given placement, which is 0
+    /// for the pool's own placement
+    unsigned GetArena(bool hugePages, int numaNode);
+
+    /// Returns a window of Allocator::kWindowSizeBytes, or nullptr if the
+    /// memory limit has been reached
+    uint8_t* AllocateWindow(unsigned arena = 0);
+
+    /// Returns a window from AllocateWindow() to the pool
+    void FreeWindow(uint8_t* window, unsigned arena = 0);
+
+    /// Allocate/free memory for allocations too large for a window.
+    /// The same `bytes` and `arena` must be passed to both.
+    /// Returns nullptr if the memory limit would be exceeded
+    uint8_t* AllocateLarge(unsigned bytes, unsigned arena = 0);
+    void FreeLarge(uint8_t* ptr, unsigned bytes, unsigned arena = 0);
+
+    /// Statistics API
+    uint64_t GetMemoryAllocatedBytes() const
+    {
+        return AllocatedBytes.load(std::memory_order_relaxed);
+    }
+    uint64_t GetMemoryLimitBytes() const
+    {
+        return MaxBytes;
+    }
+
+protected:
+    /// Free windows are linked through their first bytes
+    struct FreeWindowLink
+    {
+        FreeWindowLink* Next;
+    };
+
+    /// List of free windows
+    struct FreeList
+    {
+        FreeWindowLink* Head = nullptr;
+        unsigned Count = 0;
+
+        PKTALLOC_FORCE_INLINE void Push(uint8_t* window)
+        {
+            FreeWindowLink* link = (FreeWindowLink*)window;
+            link->Next = Head;
+            Head = link;
+            ++Count;
+        }
+        PKTALLOC_FORCE_INLINE uint8_t* Pop()
+        {
+            FreeWindowLink* link = Head;
+            if (link) {
+                Head = link->Next;
+                --Count;
+            }
+            return (uint8_t*)link;
+        }
+    };
+
+    /// Per-thread cache of free windows.
+    /// Padded to keep neighboring caches off of the same cache line.
+    /// Note: alignas() would not be honored by operator new before C++17
+    struct ThreadCache
+    {
+        std::mutex Lock;
+        FreeList Windows;
+        uint8_t Padding[64];
+    };
+
+    /// Header at the front of each mapped chunk of windows
+    struct MappedChunk
+    {
+        MappedChunk* Next;
+    };
+
+    /// Memory mapped from the OS with one placement.
+    /// Protected by GlobalLock
+    struct MappedArena
+    {
+        /// Back memory with huge pages
+        bool HugePages = false;
+
+        /// Preferred NUMA node, or -1 for any
+        int NumaNode = -1;
+
+        /// List of chunks to unmap
+        MappedChunk* Chunks = nullptr;
+
+        /// Unused part of the latest chunk
+        uint8_t* ChunkNext = nullptr;
+        uint8_t* ChunkEnd = nullptr;
+
+        /// Free windows for arenas after the first, which has thread caches
+        FreeList Windows;
+
+        /// Free blocks for fallback allocations, by size class
+        FreeList LargeBlocks[kWindowPoolLargeClassCount];
+    };
+
+    /// Memory limit in bytes, or 0 for no limit
+    uint64_t MaxBytes = 0;
+
+    /// Arena 0 is mapped from the OS rather than allocated from the heap
+    bool Mapped = false;
+
+    /// Bytes allocated from the system, including free windows
+    std::atomic<uint64_t> AllocatedBytes = ATOMIC_VAR_INIT(0);
+
+    /// Caches assigned to threads
+    ThreadCache Caches[kWindowPoolCacheCount];
+
+    /// Lock protecting GlobalWindows
+    std::mutex GlobalLock;
+
+    /// Windows spilled from the caches
+    FreeList GlobalWindows;
+
+    /// Arenas for each memory placement, protected by GlobalLock.
+    /// Arena 0 is the pool's own placement, and is only used if Mapped
+    MappedArena Arenas[kWindowPoolMaxArenas];
+
+    /// Number of arenas in use, protected by GlobalLock
+    unsigned ArenaCount = 1;
+
+
+    /// Charge/refund bytes against the memory limit.
+    /// Returns false if the charge would exceed the memory limit
+    bool reserve(uint64_t bytes);
+    void unreserve(uint64_t bytes);
+
+    /// Mapped: Carve `bytes` out of the latest chunk of the arena.
+    /// Precondition: GlobalLock is held
+    uint8_t* allocateFromChunk(MappedArena& arena, size_t bytes);
+
+
+    /// Returns the cache assigned to the calling thread
+    ThreadCache* getThreadCache();
 };
 
 
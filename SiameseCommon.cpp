@@ -33,6 +33,162 @@
 namespace siamese {
 
 
+//------------------------------------------------------------------------------
+// Tables
+
+uint8_t RowOpcodeTable[kRowPeriod][kColumnLaneCount];
+
+void InitializeTables()
+{
+    static_assert((1 << (kColumnSumCount * 2)) <= 256, "Opcodes must fit in a byte");
+
+    for (unsigned row = 0; row < kRowPeriod; ++row) {
+        for (unsigned lane = 0; lane < kColumnLaneCount; ++lane) {
+            RowOpcodeTable[row][lane] = (uint8_t)CalculateRowOpcode(lane, row);
+        }
+    }
+}
+
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+
+//------------------------------------------------------------------------------
+// Row cost model
+
+unsigned RowXorCost256 = 192;
+unsigned RowRollCost256 = 4 * 256;
+unsigned RowDenseAdds256 = kColumnLaneCount * kColumnSumCount * 256;
+
+/// Zeroing the row and product buffers, in units of 1/256 multiply-add
+static const unsigned kRowFixedCost256 = 2 * 256;
+
+/// Source count and length for each calibration batch
+static const unsigned kCalibrationSources = MultiplyAccumulator::kMaxSources;
+static const unsigned kCalibrationBytes = 1024;
+
+/// Number of batches to time, and the best of this many tries is kept
+static const unsigned kCalibrationBatches = 32;
+static const unsigned kCalibrationTries = 3;
+
+/// Returns the fastest time in microseconds for a run of calibration batches.
+/// If `roll` is set, each source is rolled into three sums one at a time
+/// like EncoderPacketWindow::GetSum() does for new originals
+static uint64_t TimeCalibrationBatches(
+    uint8_t* dest,
+    const uint8_t* coefficients,
+    const void* const* sources,
+    const int* sourceBytes,
+    bool roll)
+{
+    uint64_t best = ~(uint64_t)0;
+    for (unsigned i = 0; i < kCalibrationTries; ++i)
+    {
+        const uint64_t t0 = GetSystemTimeUsec();
+        for (unsigned j = 0; j < kCalibrationBatches; ++j)
+        {
+            if (!roll) {
+                gf256_muladd_multi_mem(dest, kCalibrationSources, coefficients, sources, sourceBytes);
+                continue;
+            }
+            for (unsigned k = 0; k < kCalibrationSources; ++k)
+            {
+                gf256_add_mem(dest, sources[k], sourceBytes[k]);
+                gf256_muladd_mem(dest + kCalibrationBytes, coefficients[k], sources[k], sourceBytes[k]);
+                gf256_muladd_mem(dest + kCalibrationBytes * 2, coefficients[k], sources[k], sourceBytes[k]);
+            }
+        }
+        const uint64_t t1 = GetSystemTimeUsec();
+        if (best > t1 - t0) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+/// Returns 256 * numerator / denominator clamped to [minimum, maximum]
+static unsigned GetCostRatio256(uint64_t numerator, uint64_t denominator, unsigned minimum, unsigned maximum)
+{
+    const uint64_t ratio = (numerator * 256) / denominator;
+    if (ratio < minimum) {
+        return minimum;
+    }
+    if (ratio > maximum) {
+        return maximum;
+    }
+    return (unsigned)ratio;
+}
+
+void CalibrateRowCosts()
+{
+    // Each opcode bit adds one lane sum into the row or its product
+    uint64_t denseAdds = 0;
+    for (unsigned row = 0; row < kRowPeriod; ++row)
+    {
+        for (unsigned lane = 0; lane < kColumnLaneCount; ++lane)
+        {
+            for (unsigned opcode = RowOpcodeTable[row][lane]; opcode != 0; opcode &= opcode - 1) {
+                ++denseAdds;
+            }
+        }
+    }
+    RowDenseAdds256 = (unsigned)((denseAdds * 256) / kRowPeriod);
+
+    // The first three buffers are destinations
+    alignas(32) static uint8_t buffers[kCalibrationSources + 3][kCalibrationBytes];
+    const void* sources[kCalibrationSources];
+    int sourceBytes[kCalibrationSources];
+    uint8_t coefficients[kCalibrationSources];
+
+    PCGRandom prng;
+    prng.Seed(kCalibrationBytes, kCalibrationSources);
+    for (unsigned i = 0; i < kCalibrationSources + 3; ++i) {
+        for (unsigned j = 0; j < kCalibrationBytes; ++j) {
+            buffers[i][j] = (uint8_t)prng.Next();
+        }
+    }
+    for (unsigned i = 0; i < kCalibrationSources; ++i)
+    {
+        sources[i]      = buffers[i + 3];
+        sourceBytes[i]  = (int)kCalibrationBytes;
+        coefficients[i] = (uint8_t)(2 + prng.Next() % 254);
+    }
+
+    const uint64_t xorUsec    = TimeCalibrationBatches(buffers[0], nullptr, sources, sourceBytes, false);
+    const uint64_t mulAddUsec = TimeCalibrationBatches(buffers[0], coefficients, sources, sourceBytes, false);
+    const uint64_t rollUsec   = TimeCalibrationBatches(buffers[0], coefficients, sources, sourceBytes, true);
+
+    // Keep the defaults if the clock is too coarse to tell
+    if (xorUsec == 0 || mulAddUsec == 0 || rollUsec == 0) {
+        return;
+    }
+
+    RowXorCost256  = GetCostRatio256(xorUsec, mulAddUsec, 16, 256);
+    RowRollCost256 = GetCostRatio256(rollUsec, mulAddUsec, 256, 16 * 256);
+}
+
+bool IsCauchyRowCheaper(unsigned count, unsigned added256)
+{
+    if (count > kCauchyCostMaxCount) {
+        return false;
+    }
+
+    // Light columns are added in pairs, one pair per kPairAddRate columns
+    const unsigned pairCount = (count + kPairAddRate - 1) / kPairAddRate;
+
+    // Costs in units of 1/256 multiply-add
+    const uint64_t xorSources256 = RowDenseAdds256 + pairCount * 2 * 256;
+    const uint64_t sumCost256 =
+        (xorSources256 * RowXorCost256) / 256 +
+        ((uint64_t)added256 * RowRollCost256) / 256 +
+        256 + kRowFixedCost256;
+    const uint64_t cauchyCost256 = (uint64_t)count * 256;
+
+    return cauchyCost256 <= sumCost256;
+}
+
+#endif // SIAMESE_ENABLE_CAUCHY
+
+
 //------------------------------------------------------------------------------
 // GrowingAlignedByteMatrix
 
@@ -117,12 +273,68 @@ bool GrowingAlignedByteMatrix::Resize(pktalloc::Allocator* allocator, unsigned r
 }
 
 
+//------------------------------------------------------------------------------
+// MultiplyAccumulator
+
+void MultiplyAccumulator::FlushMixedOffsets()
+{
+    const void* groupSources[kMaxSources];
+    int groupBytes[kMaxSources];
+    uint8_t groupCoefficients[kMaxSources];
+
+    // Sources that have been run are marked by zeroing their bytes
+    for (unsigned i = 0; i < SourceCount; ++i)
+    {
+        if (SourceBytes[i] <= 0) {
+            continue;
+        }
+
+        const unsigned offset = SourceOffsets[i];
+        unsigned groupCount = 0;
+
+        for (unsigned j = i; j < SourceCount; ++j)
+        {
+            if (SourceBytes[j] > 0 && SourceOffsets[j] == offset)
+            {
+                groupSources[groupCount]      = Sources[j];
+                groupBytes[groupCount]        = SourceBytes[j];
+                groupCoefficients[groupCount] = Coefficients[j];
+                ++groupCount;
+                SourceBytes[j] = 0;
+            }
+        }
+
+        gf256_muladd_multi_mem(Destination + offset, groupCount, groupCoefficients, groupSources, groupBytes);
+    }
+
+    MixedOffsets = false;
+}
+
+
 //------------------------------------------------------------------------------
 // OriginalPacket
 
+static_assert(OriginalPacket::kMaxHeaderBytes == kMaxPacketLengthFieldBytes, "Update this");
+
 unsigned OriginalPacket::Initialize(pktalloc::Allocator* allocator, const SiameseOriginalPacket& packet)
 {
-    SIAMESE_DEBUG_ASSERT(allocator && packet.Data && packet.DataBytes > 0 && packet.PacketNum < kColumnPeriod);
+    SIAMESE_DEBUG_ASSERT(packet.Data);
+
+    SiameseFragment fragment;
+    fragment.Data      = packet.Data;
+    fragment.DataBytes = packet.DataBytes;
+
+    return InitializeGather(allocator, packet, &fragment, 1);
+}
+
+unsigned OriginalPacket::InitializeGather(
+    pktalloc::Allocator* allocator,
+    const SiameseOriginalPacket& packet,
+    const SiameseFragment* fragments,
+    unsigned fragmentCount)
+{
+    SIAMESE_DEBUG_ASSERT(allocator && fragments && packet.DataBytes > 0 && packet.PacketNum < kColumnPeriod);
+    SIAMESE_DEBUG_ASSERT(ExternalData == nullptr);
 
     // Allocate space for the packet
     const unsigned bufferSize = kMaxPacketLengthFieldBytes + packet.DataBytes;
@@ -134,7 +346,7 @@ unsigned OriginalPacket::Initialize(pktalloc::Allocator* allocator, const Siames
     SIAMESE_DEBUG_ASSERT(HeaderBytes <= kMaxPacketLengthFieldBytes);
 
     // Copy packet data after the length
-    memcpy(Buffer.Data + HeaderBytes, packet.Data, packet.DataBytes);
+    GatherFragments(Buffer.Data + HeaderBytes, fragments, fragmentCount);
 
     Buffer.Bytes = HeaderBytes + packet.DataBytes;
 
@@ -143,5 +355,52 @@ unsigned OriginalPacket::Initialize(pktalloc::Allocator* allocator, const Siames
     return HeaderBytes;
 }
 
+unsigned OriginalPacket::InitializeExternal(
+    const SiameseOriginalPacket& packet,
+    SiameseReleaseCallback release,
+    void* context)
+{
+    SIAMESE_DEBUG_ASSERT(packet.Data && packet.DataBytes > 0 && packet.PacketNum < kColumnPeriod);
+    SIAMESE_DEBUG_ASSERT(ExternalData == nullptr);
+
+    // Serialize the packet length out of band
+    HeaderBytes = SerializeHeader_PacketLength(packet.DataBytes, ExternalHeader);
+    SIAMESE_DEBUG_ASSERT(HeaderBytes <= kMaxPacketLengthFieldBytes);
+
+    // Any buffer left over from an earlier packet is kept for reuse, but
+    // its contents are no longer valid
+    ExternalData    = packet.Data;
+    ExternalRelease = release;
+    ExternalContext = context;
+    Buffer.Bytes    = HeaderBytes + packet.DataBytes;
+
+    Column = packet.PacketNum;
+
+    return HeaderBytes;
+}
+
+void OriginalPacket::ReleaseExternal()
+{
+    if (!ExternalData) {
+        return;
+    }
+
+    SiameseOriginalPacket packet;
+    packet.PacketNum = Column;
+    packet.Data      = ExternalData;
+    packet.DataBytes = Buffer.Bytes - HeaderBytes;
+
+    SiameseReleaseCallback release = ExternalRelease;
+    void* context = ExternalContext;
+
+    // Clear the reference before handing the data back
+    ExternalData    = nullptr;
+    ExternalRelease = nullptr;
+    ExternalContext = nullptr;
+    Buffer.Bytes    = 0;
+
+    release(context, &packet);
+}
+
 
 } // namespace siamese
@@ -34,6 +34,7 @@
 
     + Parameters of the Siamese and Cauchy matrix structures
     + Growing buffer/matrix structures
+    + Batched multiply-accumulate helper
     + OriginalPacket structure
     + RecoveryMetadata structure
 */
@@ -72,6 +73,17 @@ namespace siamese {
 //#define SIAMESE_DECODER_DUMP_VERBOSE
 //#define SIAMESE_ENCODER_DUMP_VERBOSE
 
+/// Codec log messages below this level compile to nothing, so the hot paths
+/// do not pay for log calls that the channel would filter out anyway.
+/// Define it to a logger::Level to override
+#if !defined(SIAMESE_LOG_MIN_LEVEL)
+    #if defined(SIAMESE_DECODER_DUMP_VERBOSE) || defined(SIAMESE_ENCODER_DUMP_VERBOSE)
+        #define SIAMESE_LOG_MIN_LEVEL logger::Level::Trace
+    #else
+        #define SIAMESE_LOG_MIN_LEVEL logger::Level::Error
+    #endif
+#endif
+
 
 //------------------------------------------------------------------------------
 // Code Parameters
@@ -158,8 +170,9 @@ SIAMESE_FORCE_INLINE uint32_t Int32Hash(uint32_t key)
     return key;
 }
 
-/// Calculate operation code for the given row and lane
-SIAMESE_FORCE_INLINE unsigned GetRowOpcode(unsigned lane, unsigned row)
+/// Calculate operation code for the given row and lane.
+/// Note: Use GetRowOpcode() instead, which reads these from a table
+SIAMESE_FORCE_INLINE unsigned CalculateRowOpcode(unsigned lane, unsigned row)
 {
     SIAMESE_DEBUG_ASSERT(lane < kColumnLaneCount && row < kRowPeriod);
     static const uint32_t kSumMask = (1 << (kColumnSumCount * 2)) - 1;
@@ -173,6 +186,20 @@ SIAMESE_FORCE_INLINE unsigned GetRowOpcode(unsigned lane, unsigned row)
     return (opcode == 0) ? kZeroValue : (unsigned)opcode;
 }
 
+/// Table of CalculateRowOpcode() for every row and lane.
+/// This is filled in by InitializeTables() from siamese_init()
+extern uint8_t RowOpcodeTable[kRowPeriod][kColumnLaneCount];
+
+/// Fill in the precomputed tables
+void InitializeTables();
+
+/// Get operation code for the given row and lane
+SIAMESE_FORCE_INLINE unsigned GetRowOpcode(unsigned lane, unsigned row)
+{
+    SIAMESE_DEBUG_ASSERT(lane < kColumnLaneCount && row < kRowPeriod);
+    return RowOpcodeTable[row][lane];
+}
+
 
 //------------------------------------------------------------------------------
 // MDS Erasure Codes using Cauchy Matrix
@@ -217,6 +244,45 @@ SIAMESE_FORCE_INLINE uint8_t CauchyElement(unsigned row, unsigned column)
     return gf256_inv(x_i ^ y_j);
 }
 
+
+/**
+    Row cost model
+
+    A Cauchy row over n packets costs n batched multiply-adds.  A Siamese row
+    costs about the same regardless of the window size: the lane sums selected
+    by its opcodes and the light column pairs are added with batched XOR, the
+    product sum is multiplied once, the row and product buffers are zeroed,
+    and each original added since the last row is rolled into three running
+    sums, one XOR and two multiply-adds that are usually not batched.
+
+    These costs relative to a batched multiply-add depend on the CPU, so they
+    are measured by CalibrateRowCosts() from siamese_init().
+*/
+
+/// Cost of a source added by batched XOR relative to a batched multiply-add,
+/// in units of 1/256
+extern unsigned RowXorCost256;
+
+/// Cost of rolling one original into the running sums relative to a batched
+/// multiply-add, in units of 1/256
+extern unsigned RowRollCost256;
+
+/// Average number of lane sums added per Siamese row, in units of 1/256
+extern unsigned RowDenseAdds256;
+
+/// Largest number of packets in flight for which the cost model picks Cauchy
+/// rows over running sums.  This is kept below SIAMESE_CAUCHY_THRESHOLD so a
+/// window hovering around the threshold does not keep restarting the sums
+static const unsigned kCauchyCostMaxCount = SIAMESE_CAUCHY_THRESHOLD * 3 / 4;
+
+/// Measure RowXorCost256 and RowRollCost256, and fill in RowDenseAdds256
+void CalibrateRowCosts();
+
+/// Returns true if a Cauchy row over `count` packets is expected to be
+/// cheaper than a Siamese row, when about `added256` / 256 originals are
+/// added to the encoder per recovery packet
+bool IsCauchyRowCheaper(unsigned count, unsigned added256);
+
 #endif // SIAMESE_ENABLE_CAUCHY
 
 
@@ -335,13 +401,118 @@ struct GrowingAlignedByteMatrix
 };
 
 
+//------------------------------------------------------------------------------
+// MultiplyAccumulator
+
+/// Collects "Destination += Source * y" operations and runs them in batches
+/// with gf256_muladd_multi_mem(), so the destination buffer is streamed
+/// through the cache once per batch rather than once per source.
+///
+/// Sources must stay valid and unmodified until Flush() is called.
+struct MultiplyAccumulator
+{
+    /// Number of sources to collect before running a batch
+    static const unsigned kMaxSources = 16;
+
+    /// Destination buffer, which must be at least as long as any source
+    uint8_t* Destination = nullptr;
+
+    /// Collected sources
+    unsigned SourceCount = 0;
+    const void* Sources[kMaxSources];
+    int SourceBytes[kMaxSources];
+    uint8_t Coefficients[kMaxSources];
+
+    /// Offset into the destination where each source starts
+    uint8_t SourceOffsets[kMaxSources];
+
+    /// Set if the collected sources do not all have the same offset
+    bool MixedOffsets = false;
+
+
+    /// Start accumulating into a new destination buffer
+    SIAMESE_FORCE_INLINE void Start(uint8_t* destination)
+    {
+        SIAMESE_DEBUG_ASSERT(SourceCount == 0);
+        Destination = destination;
+        SourceCount = 0;
+    }
+
+    /// Destination[offset...] += data * y
+    /// The offset is small and is used for data stored apart from its header
+    SIAMESE_FORCE_INLINE void MulAdd(const uint8_t* data, uint8_t y, unsigned bytes, unsigned offset = 0)
+    {
+        SIAMESE_DEBUG_ASSERT(Destination != nullptr);
+        SIAMESE_DEBUG_ASSERT(offset <= 255);
+        if (bytes <= 0 || y == 0) {
+            return;
+        }
+        if (SourceCount >= kMaxSources) {
+            Flush();
+        }
+        if (SourceCount > 0 && SourceOffsets[0] != offset) {
+            MixedOffsets = true;
+        }
+        Sources[SourceCount]       = data;
+        SourceBytes[SourceCount]   = (int)bytes;
+        Coefficients[SourceCount]  = y;
+        SourceOffsets[SourceCount] = (uint8_t)offset;
+        ++SourceCount;
+    }
+
+    /// Destination += data
+    SIAMESE_FORCE_INLINE void Add(const uint8_t* data, unsigned bytes)
+    {
+        MulAdd(data, 1, bytes);
+    }
+
+    /// Run all of the collected operations
+    SIAMESE_FORCE_INLINE void Flush()
+    {
+        if (SourceCount > 0)
+        {
+            if (MixedOffsets) {
+                FlushMixedOffsets();
+            }
+            else {
+                gf256_muladd_multi_mem(Destination + SourceOffsets[0], SourceCount, Coefficients, Sources, SourceBytes);
+            }
+            SourceCount = 0;
+        }
+    }
+
+protected:
+    /// Run one batch for each distinct source offset
+    void FlushMixedOffsets();
+};
+
+
 //------------------------------------------------------------------------------
 // OriginalPacket
 
 /// Original packet
+/// Copy fragments back to back into dest
+SIAMESE_FORCE_INLINE void GatherFragments(
+    uint8_t* dest,
+    const SiameseFragment* fragments,
+    unsigned fragmentCount)
+{
+    for (unsigned i = 0; i < fragmentCount; ++i)
+    {
+        const unsigned bytes = fragments[i].DataBytes;
+        if (bytes > 0)
+        {
+            memcpy(dest, fragments[i].Data, bytes);
+            dest += bytes;
+        }
+    }
+}
+
 struct OriginalPacket
 {
-    /// Original packet data, prefixed with length field
+    /// Original packet data, prefixed with length field.
+    /// For external packets the data is not stored here, but Bytes is still
+    /// the total number of bytes for the length field and the data
     GrowingAlignedDataBuffer Buffer;
 
     /// Keep track of the column index for this packet
@@ -350,10 +521,232 @@ struct OriginalPacket
     /// Keep track of the number of bytes for header on the packet data
     unsigned HeaderBytes = 0;
 
+    /// Maximum number of bytes for header on the packet data
+    static const unsigned kMaxHeaderBytes = 4;
+
+    /// Application-owned data for packets added by InitializeExternal(),
+    /// or nullptr if the data was copied into the Buffer
+    const uint8_t* ExternalData = nullptr;
+
+    /// Length prefix for the external data, which is kept out of band
+    uint8_t ExternalHeader[kMaxHeaderBytes];
+
+    /// Callback to invoke when the external data is no longer needed
+    SiameseReleaseCallback ExternalRelease = nullptr;
+    void* ExternalContext = nullptr;
+
 
     /// Write data to buffer with length prefix and initialize other members
     /// Returns the number of bytes overhead, or 0 on out-of-memory error
     unsigned Initialize(pktalloc::Allocator* allocator, const SiameseOriginalPacket& packet);
+
+    /// Initialize() for data gathered from fragments instead of packet.Data.
+    /// packet.DataBytes must be the total length of the fragments
+    /// Returns the number of bytes overhead, or 0 on out-of-memory error
+    unsigned InitializeGather(
+        pktalloc::Allocator* allocator,
+        const SiameseOriginalPacket& packet,
+        const SiameseFragment* fragments,
+        unsigned fragmentCount);
+
+    /// Reference application data without copying it, and initialize other members.
+    /// The release callback is invoked by ReleaseExternal()
+    /// Returns the number of bytes overhead
+    unsigned InitializeExternal(
+        const SiameseOriginalPacket& packet,
+        SiameseReleaseCallback release,
+        void* context);
+
+    /// Return external data to the application, if any
+    void ReleaseExternal();
+
+    /// Get the length prefix
+    SIAMESE_FORCE_INLINE const uint8_t* GetHeader() const
+    {
+        return ExternalData ? ExternalHeader : Buffer.Data;
+    }
+
+    /// Get the packet data after the length prefix
+    SIAMESE_FORCE_INLINE const uint8_t* GetData() const
+    {
+        return ExternalData ? ExternalData : Buffer.Data + HeaderBytes;
+    }
+
+    /// accumulator += (length prefix + data) * y
+    /// At most maxBytes are accumulated, counting the length prefix
+    SIAMESE_FORCE_INLINE void MulAddTo(MultiplyAccumulator& accumulator, uint8_t y, unsigned maxBytes = ~0u) const
+    {
+        const unsigned bytes = (Buffer.Bytes < maxBytes) ? Buffer.Bytes : maxBytes;
+        if (!ExternalData) {
+            accumulator.MulAdd(Buffer.Data, y, bytes);
+        }
+        else if (bytes > HeaderBytes)
+        {
+            // The header is tiny so add it right away
+            gf256_muladd_mem(accumulator.Destination, y, ExternalHeader, HeaderBytes);
+            accumulator.MulAdd(ExternalData, y, bytes - HeaderBytes, HeaderBytes);
+        }
+        else {
+            gf256_muladd_mem(accumulator.Destination, y, ExternalHeader, bytes);
+        }
+    }
+
+    /// dest[] += (length prefix + data) * y
+    SIAMESE_FORCE_INLINE void MulAddTo(uint8_t* dest, uint8_t y) const
+    {
+        if (!ExternalData) {
+            gf256_muladd_mem(dest, y, Buffer.Data, Buffer.Bytes);
+        }
+        else
+        {
+            gf256_muladd_mem(dest, y, ExternalHeader, HeaderBytes);
+            gf256_muladd_mem(dest + HeaderBytes, y, ExternalData, Buffer.Bytes - HeaderBytes);
+        }
+    }
+
+    /// dest[] = (length prefix + data) * y
+    SIAMESE_FORCE_INLINE void MulTo(uint8_t* dest, uint8_t y) const
+    {
+        if (!ExternalData) {
+            gf256_mul_mem(dest, Buffer.Data, y, Buffer.Bytes);
+        }
+        else
+        {
+            gf256_mul_mem(dest, ExternalHeader, y, HeaderBytes);
+            gf256_mul_mem(dest + HeaderBytes, ExternalData, y, Buffer.Bytes - HeaderBytes);
+        }
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// SubwindowRing
+
+/**
+    Ring of subwindow pointers for a packet window.
+
+    Subwindows are indexed from the front of the window, and the ring maps
+    that index to a slot modulo the (power of two) capacity.  Removing
+    subwindows from the front only moves the removed subwindows to the back
+    for reuse, so it takes time proportional to the number removed rather
+    than the size of the window.  Slots past the allocated subwindows are
+    nullptr.
+*/
+template<typename SubwindowT>
+struct SubwindowRing
+{
+    /// Ring of slots.  Size is zero or a power of two
+    pktalloc::LightVector<SubwindowT*> Slots;
+
+    /// Slot holding the first subwindow
+    unsigned Head = 0;
+
+    /// Number of allocated subwindows, starting from Head
+    unsigned Count = 0;
+
+
+    /// Number of allocated subwindows
+    SIAMESE_FORCE_INLINE unsigned GetSize() const
+    {
+        return Count;
+    }
+
+    /// Number of slots in the ring
+    SIAMESE_FORCE_INLINE unsigned GetCapacity() const
+    {
+        return Slots.GetSize();
+    }
+
+    /// Get the slot for a subwindow, indexed from the front of the window
+    SIAMESE_FORCE_INLINE unsigned GetSlot(unsigned subwindow) const
+    {
+        return (Head + subwindow) & (Slots.GetSize() - 1);
+    }
+
+    /// Get a subwindow, indexed from the front of the window
+    /// Precondition: subwindow < GetSize()
+    SIAMESE_FORCE_INLINE SubwindowT* Get(unsigned subwindow) const
+    {
+        SIAMESE_DEBUG_ASSERT(subwindow < Count);
+        return Slots.GetRef(GetSlot(subwindow));
+    }
+
+    /// Make room for at least the given number of subwindows.
+    /// Growing the ring keeps the subwindows in order and sets Head to the
+    /// slot it had before, with the slots before Head moved up past the old
+    /// capacity.  Returns false if memory could not be allocated
+    bool Reserve(unsigned count)
+    {
+        const unsigned capacity = Slots.GetSize();
+        if (count <= capacity) {
+            return true;
+        }
+
+        unsigned newCapacity = (capacity > 0) ? capacity * 2 : 4;
+        while (newCapacity < count) {
+            newCapacity *= 2;
+        }
+        if (!Slots.SetSize_Copy(newCapacity)) {
+            return false;
+        }
+
+        // Unwrap the slots before Head so they follow the old last slot
+        for (unsigned i = 0; i < Head; ++i)
+        {
+            Slots.GetRef(capacity + i) = Slots.GetRef(i);
+            Slots.GetRef(i) = nullptr;
+        }
+        for (unsigned i = capacity + Head; i < newCapacity; ++i) {
+            Slots.GetRef(i) = nullptr;
+        }
+        return true;
+    }
+
+    /// Add a subwindow to the back.
+    /// Returns false if memory could not be allocated
+    bool Append(SubwindowT* subwindow)
+    {
+        if (!Reserve(Count + 1)) {
+            return false;
+        }
+        Slots.GetRef(GetSlot(Count)) = subwindow;
+        ++Count;
+        return true;
+    }
+
+    /// Move the first count subwindows to the back for reuse
+    void RotateFront(unsigned count)
+    {
+        SIAMESE_DEBUG_ASSERT(count <= Count);
+
+        // When the ring is full the removed slots are already at the back.
+        // Otherwise they are moved into the empty slots past the back, which
+        // can only overlap slots that were moved out of earlier in the loop
+        const unsigned capacity = Slots.GetSize();
+        if (Count < capacity)
+        {
+            for (unsigned i = 0; i < count; ++i)
+            {
+                const unsigned from = GetSlot(i);
+                const unsigned to   = GetSlot(Count + i);
+                Slots.GetRef(to)   = Slots.GetRef(from);
+                Slots.GetRef(from) = nullptr;
+            }
+        }
+
+        Head = GetSlot(count);
+    }
+
+    /// Forget subwindows past the given count.  The caller frees them first
+    void Truncate(unsigned count)
+    {
+        for (unsigned i = count; i < Count; ++i) {
+            Slots.GetRef(GetSlot(i)) = nullptr;
+        }
+        if (Count > count) {
+            Count = count;
+        }
+    }
 };
 
 
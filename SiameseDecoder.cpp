@@ -33,9 +33,9 @@
 namespace siamese {
 
 #ifdef SIAMESE_DECODER_DUMP_VERBOSE
-    static logger::Channel Logger("Decoder", logger::Level::Debug);
+    static logger::CompiledChannel<SIAMESE_LOG_MIN_LEVEL> Logger("Decoder", logger::Level::Debug);
 #else
-    static logger::Channel Logger("Decoder", logger::Level::Error);
+    static logger::CompiledChannel<SIAMESE_LOG_MIN_LEVEL> Logger("Decoder", logger::Level::Error);
 #endif
 
 
@@ -50,10 +50,218 @@ DecoderStats::DecoderStats()
 }
 
 
+//------------------------------------------------------------------------------
+// Solver Threads
+
+/// Split the bytes [start, end) into one aligned range for each worker
+static void GetWorkerByteRange(
+    unsigned start,
+    unsigned end,
+    unsigned workerIndex,
+    unsigned workerCount,
+    unsigned& rangeStartOut,
+    unsigned& rangeEndOut)
+{
+    SIAMESE_DEBUG_ASSERT(start <= end && workerIndex < workerCount);
+    const unsigned rangeBytes = pktalloc::NextAlignedOffset((end - start + workerCount - 1) / workerCount);
+
+    unsigned rangeStart = start + rangeBytes * workerIndex;
+    if (rangeStart > end) {
+        rangeStart = end;
+    }
+    unsigned rangeEnd = rangeStart + rangeBytes;
+    if (rangeEnd > end) {
+        rangeEnd = end;
+    }
+
+    rangeStartOut = rangeStart;
+    rangeEndOut   = rangeEnd;
+}
+
+/*
+    Solver thread cost model:
+
+    A data-side recovery step that runs on the solver threads pays for one
+    WorkerPool::Run() handoff H, and moves (W-1)/W of its multiply-adds off
+    the calling thread with W cores.  The triangular steps dominate, with
+    about n*n/2 row multiply-adds for n losses that are each about the size
+    of a recovery packet.  So with C the multiply-add cost per byte, a step
+    is split when:
+
+        n*n/2 * bytes * C * (W-1)/W >= kSolverHandoffMargin * H
+
+    GE on m matrix columns runs about m*m/2 row eliminations with an average
+    of 2m/3 bytes each, so its rows are short enough that the cost per row R
+    matters as well as C.  The parallel version pays for one handoff, plus a
+    wait of about S for the owner of each of the m pivot rows:
+
+        (m*m/2 * R + m*m*m/3 * C) * (W-1)/W >= kSolverHandoffMargin * (H + m*S)
+
+    C is timed on rows that stay in L1 cache, so it errs toward keeping
+    solves on the calling thread.
+
+    With 2 workers on a 1-core Xeon with GFNI this measured H = 2.4-3.5 usec,
+    S = 0.63 usec, R = 5 nsec and C = 0.009 nsec/byte.  On 2 cores that would
+    split steps with more than 0.66-0.96 MB of multiply-adds, which is about
+    40 losses of 1000 bytes, and GE from about 580 columns, so GE would stay
+    on the calling thread for all but the largest solves.  With a single core
+    the solver threads stay off.
+*/
+
+/// Safety margin on the thread handoff costs, covering the uneven splits and
+/// cache misses that the cost model leaves out
+static const unsigned kSolverHandoffMargin = 2;
+
+/// Number of times each solver thread cost is timed, keeping the best
+static const unsigned kSolverCalibrationTries = 3;
+
+/// Number of empty jobs timed to measure the handoff cost H
+static const unsigned kSolverCalibrationHandoffs = 32;
+
+/// Number of waits between two workers timed to measure the pivot wait S
+static const unsigned kSolverCalibrationWaits = 128;
+
+/// Number of row multiply-adds timed for each row size
+static const unsigned kSolverCalibrationRows = 16384;
+
+/// Row sizes timed to separate the cost per row R from the cost per byte C
+static const unsigned kSolverCalibrationShortBytes = 32;
+static const unsigned kSolverCalibrationLongBytes  = 1024;
+
+/// Largest matrix column count considered for parallel GE
+static const unsigned kSolverCalibrationMaxColumns = 1024;
+
+static void EmptySolverJob(void* /*context*/, unsigned /*workerIndex*/, unsigned /*workerCount*/)
+{
+}
+
+/// Two workers take turns advancing the counter, like a worker waiting for
+/// the owner of each pivot row in ParallelGaussianEliminationJob()
+static void AlternatingSolverJob(void* context, unsigned workerIndex, unsigned /*workerCount*/)
+{
+    if (workerIndex > 1) {
+        return;
+    }
+
+    WorkerCounter* turn = reinterpret_cast<WorkerCounter*>(context);
+    for (unsigned wait = workerIndex; wait < kSolverCalibrationWaits; wait += 2)
+    {
+        while (turn->Value.load(std::memory_order_acquire) < wait) {
+            std::this_thread::yield();
+        }
+        turn->Value.store(wait + 1, std::memory_order_release);
+    }
+}
+
+/// Returns the best time in microseconds for count runs of the job
+static uint64_t TimeSolverJobs(WorkerPool& pool, WorkerPool::JobFunction job, unsigned count)
+{
+    uint64_t best = ~(uint64_t)0;
+    for (unsigned tries = 0; tries < kSolverCalibrationTries; ++tries)
+    {
+        WorkerCounter turn;
+        const uint64_t t0 = GetSystemTimeUsec();
+        for (unsigned i = 0; i < count; ++i)
+        {
+            turn.Value.store(0, std::memory_order_relaxed);
+            pool.Run(job, &turn);
+        }
+        const uint64_t t1 = GetSystemTimeUsec();
+        if (best > t1 - t0) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+/// Returns the best time in picoseconds to multiply-add one row of the given size
+static uint64_t TimeSolverRowPsec(uint8_t* dest, const uint8_t* src, unsigned bytes)
+{
+    uint64_t best = ~(uint64_t)0;
+    for (unsigned tries = 0; tries < kSolverCalibrationTries; ++tries)
+    {
+        const uint64_t t0 = GetSystemTimeUsec();
+        for (unsigned i = 0; i < kSolverCalibrationRows; ++i) {
+            gf256_muladd_mem(dest, (uint8_t)(2 + i % 254), src, (int)bytes);
+        }
+        const uint64_t t1 = GetSystemTimeUsec();
+        if (best > t1 - t0) {
+            best = t1 - t0;
+        }
+    }
+    return (best * 1000000) / kSolverCalibrationRows;
+}
+
+void Decoder::SetSolverThreads(unsigned threadCount)
+{
+    SolverPool.Start(threadCount);
+    ParallelSolveMinBytes = kParallelSolveDisabledBytes;
+    RecoveryMatrix.ParallelGEMinColumns = ~0u;
+
+    // Workers sharing one core only add handoffs
+    const unsigned workerCount = SolverPool.GetWorkerCount();
+    unsigned coreCount = workerCount;
+    const unsigned hardwareThreads = std::thread::hardware_concurrency();
+    if (hardwareThreads > 0 && coreCount > hardwareThreads) {
+        coreCount = hardwareThreads;
+    }
+    if (coreCount <= 1) {
+        return;
+    }
+
+    alignas(64) uint8_t row[2][kSolverCalibrationLongBytes];
+    for (unsigned i = 0; i < kSolverCalibrationLongBytes; ++i)
+    {
+        row[0][i] = (uint8_t)i;
+        row[1][i] = (uint8_t)(i * 7 + 1);
+    }
+
+    const uint64_t handoffPsec = TimeSolverJobs(SolverPool, EmptySolverJob, kSolverCalibrationHandoffs) * 1000000 / kSolverCalibrationHandoffs;
+    const uint64_t waitsPsec   = TimeSolverJobs(SolverPool, AlternatingSolverJob, 1) * 1000000;
+    const uint64_t waitPsec    = (waitsPsec > handoffPsec ? waitsPsec - handoffPsec : 0) / kSolverCalibrationWaits;
+    const uint64_t shortPsec   = TimeSolverRowPsec(row[0], row[1], kSolverCalibrationShortBytes);
+    const uint64_t longPsec    = TimeSolverRowPsec(row[0], row[1], kSolverCalibrationLongBytes);
+
+    // Keep the solver threads off if the clock is too coarse to tell
+    if (handoffPsec == 0 || longPsec <= shortPsec) {
+        return;
+    }
+
+    // Scale the savings by (W-1)/W and the costs by W to stay in integers
+    const uint64_t savedScale = coreCount - 1;
+    const uint64_t costScale  = (uint64_t)kSolverHandoffMargin * coreCount;
+
+    // Data-side steps with C = longPsec / kSolverCalibrationLongBytes
+    ParallelSolveMinBytes = (costScale * handoffPsec * kSolverCalibrationLongBytes) / (savedScale * longPsec);
+
+    // GE with C = (longPsec - shortPsec) / (L - S) and R = shortPsec - S * C,
+    // checking 6 * (L - S) times both sides
+    const uint64_t byteScale = kSolverCalibrationLongBytes - kSolverCalibrationShortBytes;
+    const uint64_t bytePsec  = longPsec - shortPsec;
+    const uint64_t rowPsec   = shortPsec * byteScale > kSolverCalibrationShortBytes * bytePsec ?
+        shortPsec * byteScale - kSolverCalibrationShortBytes * bytePsec : 0;
+    for (uint64_t m = 1; m <= kSolverCalibrationMaxColumns; ++m)
+    {
+        const uint64_t work = m * m * (3 * rowPsec + 2 * m * bytePsec);
+        const uint64_t cost = 6 * byteScale * (handoffPsec + m * waitPsec);
+        if (work * savedScale >= cost * costScale)
+        {
+            RecoveryMatrix.ParallelGEMinColumns = (unsigned)m;
+            break;
+        }
+    }
+
+    Logger.Debug("Solver threads: handoff=", handoffPsec / 1000, " nsec wait=", waitPsec / 1000,
+        " nsec row=", rowPsec / byteScale, " psec byte=", bytePsec / byteScale,
+        " psec -> min bytes=", ParallelSolveMinBytes, " min GE columns=", RecoveryMatrix.ParallelGEMinColumns);
+}
+
+
 //------------------------------------------------------------------------------
 // Decoder
 
-Decoder::Decoder()
+Decoder::Decoder(pktalloc::WindowPool* pool, bool hugePages, int numaNode)
+    : TheAllocator(pool, hugePages, numaNode)
 {
     RecoveryPackets.TheAllocator  = &TheAllocator;
     RecoveryPackets.CheckedRegion = &CheckedRegion;
@@ -66,6 +274,7 @@ Decoder::Decoder()
     RecoveryMatrix.Window         = &Window;
     RecoveryMatrix.CheckedRegion  = &CheckedRegion;
     CheckedRegion.RecoveryMatrix  = &RecoveryMatrix;
+    RecoveryMatrix.Pool           = &SolverPool;
 }
 
 SiameseResult Decoder::Get(SiameseOriginalPacket& packetOut)
@@ -103,8 +312,8 @@ SiameseResult Decoder::Get(SiameseOriginalPacket& packetOut)
     // Check: Deserialize length from the front
     unsigned lengthCheck;
     int headerBytesCheck = DeserializeHeader_PacketLength(
-        original->Buffer.Data,
-        original->Buffer.Bytes,
+        original->GetHeader(),
+        headerBytes,
         lengthCheck);
 
     if (lengthCheck != length || (int)headerBytes != headerBytesCheck ||
@@ -117,7 +326,7 @@ SiameseResult Decoder::Get(SiameseOriginalPacket& packetOut)
     }
 #endif // SIAMESE_DEBUG
 
-    packetOut.Data      = original->Buffer.Data + headerBytes;
+    packetOut.Data      = original->GetData();
     packetOut.DataBytes = length;
     return Siamese_Success;
 }
@@ -409,7 +618,7 @@ SiameseResult Decoder::AddRecovery(const SiameseRecoveryPacket& packet)
             Logger.Error("AddRecovery.AddSingleRecovery failed");
             return Siamese_Disabled;
         }
-        return Siamese_Success;
+        return EnforceMemoryBudget();
     }
 
     // Allocate a packet object
@@ -440,13 +649,79 @@ SiameseResult Decoder::AddRecovery(const SiameseRecoveryPacket& packet)
     recovery->ElementEnd   = elementEnd;
 
     // Insert it into the sorted packet list
-    RecoveryPackets.Insert(recovery, outOfOrder);
+    if (!RecoveryPackets.Insert(recovery, outOfOrder))
+    {
+        recovery->Buffer.Free(&TheAllocator);
+        TheAllocator.Destruct(recovery);
+        Window.EmergencyDisabled = true;
+        Logger.Error("AddRecovery.Insert OOM");
+        return Siamese_Disabled;
+    }
 
     // Remove elements from the front if possible
     if (elementStart >= kDecoderRemoveThreshold) {
         Window.RemoveElements();
     }
 
+    return EnforceMemoryBudget();
+}
+
+SiameseResult Decoder::ShedMemory()
+{
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
+    }
+
+    // Buffers kept around for reuse are the cheapest to give back
+    Window.FreeSpareBuffers();
+
+    // Originals kept unsummed can be summed and dropped without losing anything
+    if (TheAllocator.GetMemoryLiveBytes() > MemoryBudget && Window.LazySumElements != 0)
+    {
+        Window.RemoveElements(true);
+        if (Window.EmergencyDisabled) {
+            return Siamese_Disabled;
+        }
+        Window.FreeSpareBuffers();
+    }
+
+    // If there are recovery packets, drop the oldest first.
+    // This also allows the window to be trimmed up to the first loss
+    if (TheAllocator.GetMemoryLiveBytes() > MemoryBudget && !RecoveryPackets.IsEmpty())
+    {
+        // The checked region and matrix reference the recovery packets
+        CheckedRegion.Reset();
+
+        do
+        {
+            Logger.Info("ShedMemory: Dropping recovery packet for column ", RecoveryPackets.Head->Metadata.ColumnStart);
+            RecoveryPackets.Delete(RecoveryPackets.Head);
+            Stats.Counts[SiameseDecoderStats_DroppedRecoveryCount]++;
+        } while (TheAllocator.GetMemoryLiveBytes() > MemoryBudget && !RecoveryPackets.IsEmpty());
+
+        Window.RemoveElements();
+        if (Window.EmergencyDisabled) {
+            return Siamese_Disabled;
+        }
+        Window.FreeSpareBuffers();
+    }
+
+    // Sums are rebuilt from the window once more recovery packets arrive
+    if (TheAllocator.GetMemoryLiveBytes() > MemoryBudget &&
+        Window.FreeSums())
+    {
+        CheckedRegion.Reset();
+    }
+
+    // The data after the first loss cannot be dropped without giving up on
+    // recovering it, so there is nothing more to do
+    if (TheAllocator.GetMemoryLiveBytes() > MemoryBudget)
+    {
+        Window.EmergencyDisabled = true;
+        Logger.Error("ShedMemory: Memory budget exceeded: ", TheAllocator.GetMemoryLiveBytes(), " > ", MemoryBudget);
+        return Siamese_Disabled;
+    }
+
     return Siamese_Success;
 }
 
@@ -485,7 +760,22 @@ bool Decoder::AddSingleRecovery(const SiameseRecoveryPacket& packet, const Recov
     original.Data      = packet.Data + headerBytes;
     original.PacketNum = metadata.ColumnStart;
 
-    unsigned newHeaderBytes = windowOriginal->Initialize(&TheAllocator, original);
+    // If the application provides a buffer for this packet:
+    uint8_t* outputData = nullptr;
+    if (OutputProvider) {
+        outputData = OutputProvider(OutputContext, original.PacketNum, original.DataBytes);
+    }
+
+    unsigned newHeaderBytes;
+    if (outputData)
+    {
+        memcpy(outputData, original.Data, original.DataBytes);
+        original.Data  = outputData;
+        newHeaderBytes = windowOriginal->InitializeExternal(original, OutputRelease, OutputContext);
+    }
+    else {
+        newHeaderBytes = windowOriginal->Initialize(&TheAllocator, original);
+    }
     SIAMESE_DEBUG_ASSERT(newHeaderBytes == (unsigned)headerBytes);
     if (0 == newHeaderBytes) {
         SIAMESE_DEBUG_BREAK(); // Invalid input
@@ -499,7 +789,7 @@ bool Decoder::AddSingleRecovery(const SiameseRecoveryPacket& packet, const Recov
         Window.RecoveredPackets.Clear();
     }
 
-    original.Data = windowOriginal->Buffer.Data + newHeaderBytes;
+    original.Data = windowOriginal->GetData();
     SIAMESE_DEBUG_ASSERT(original.DataBytes == windowOriginal->Buffer.Bytes - headerBytes);
 
     if (!Window.RecoveredPackets.Append(original)) {
@@ -573,7 +863,7 @@ bool Decoder::CheckRecoveryPossible()
     {
         recoveryCount = CheckedRegion.RecoveryCount;
         lostCount     = CheckedRegion.LostCount;
-        if (recoveryCount >= lostCount && !CheckedRegion.SolveFailed)
+        if (recoveryCount >= lostCount + RecoveryMatrix.DependentRows && !CheckedRegion.SolveFailed)
         {
             // If maximum loss recovery count is exceeded:
             if (lostCount > kMaximumLossRecoveryCount) {
@@ -587,8 +877,9 @@ bool Decoder::CheckRecoveryPossible()
     }
     SIAMESE_DEBUG_ASSERT(lostCount > 0);
 
-    // While we do not have enough recovery data:
-    while ((recoveryCount < lostCount || CheckedRegion.SolveFailed) &&
+    // While we do not have enough recovery data, counting only the rows that
+    // could raise the rank of the matrix after a failed solve:
+    while ((recoveryCount < lostCount + RecoveryMatrix.DependentRows || CheckedRegion.SolveFailed) &&
            (recovery->Next != nullptr))
     {
         recovery = recovery->Next;
@@ -624,7 +915,7 @@ bool Decoder::CheckRecoveryPossible()
         return false; // Limit was hit
     }
 
-    return recoveryCount >= lostCount && !CheckedRegion.SolveFailed;
+    return recoveryCount >= lostCount + RecoveryMatrix.DependentRows && !CheckedRegion.SolveFailed;
 }
 
 SiameseResult Decoder::Decode(SiameseOriginalPacket** packetsPtrOut, unsigned* countOut)
@@ -678,7 +969,7 @@ SiameseResult Decoder::Decode(SiameseOriginalPacket** packetsPtrOut, unsigned* c
 
     for (;;)
     {
-        if (recoveryCount >= lostCount)
+        if (recoveryCount >= lostCount + RecoveryMatrix.DependentRows)
         {
             SiameseResult result = DecodeCheckedRegion();
 
@@ -716,13 +1007,15 @@ SiameseResult Decoder::Decode(SiameseOriginalPacket** packetsPtrOut, unsigned* c
         recovery->LostCount = lostCount;
 
         nextCheckStart = elementEnd;
+
+        // Grow the checked region before the next attempt: the matrix is
+        // generated from it, so otherwise the same rows would be re-solved
+        CheckedRegion.LastRecovery   = recovery;
+        CheckedRegion.NextCheckStart = nextCheckStart;
+        CheckedRegion.RecoveryCount  = recoveryCount;
+        CheckedRegion.LostCount      = lostCount;
     }
 
-    // Remember state for the next time around
-    CheckedRegion.LastRecovery   = recovery;
-    CheckedRegion.NextCheckStart = nextCheckStart;
-    CheckedRegion.RecoveryCount  = recoveryCount;
-    CheckedRegion.LostCount      = lostCount;
     return Siamese_NeedMoreData;
 }
 
@@ -735,8 +1028,28 @@ SiameseResult Decoder::DecodeCheckedRegion()
     if (!skipLog)
         Logger.Debug("For ", CheckedRegion.LostCount, " losses:");
 
-    uint64_t t0 = GetTimeUsec();
+    const bool profile = true;
+#else
+    const bool profile = Profiler.Sample();
 #endif
+    Histogram* histograms = Stats.Histograms;
+
+    const uint64_t t0 = GetProfileTimeUsec(profile);
+
+    // Solve one or two losses without generating the recovery matrix
+    if (CheckedRegion.LostCount <= kSmallSolveMaxLosses)
+    {
+        const SiameseResult smallResult = SolveSmallRegion();
+        if (smallResult != Siamese_NeedMoreData)
+        {
+            CheckedRegion.Reset();
+
+            if (profile) {
+                histograms[SiameseDecoderHistogram_SolveUsec].Add(GetSystemTimeUsec() - t0);
+            }
+            return smallResult;
+        }
+    }
 
     // Generate updated recovery matrix
     if (!RecoveryMatrix.GenerateMatrix())
@@ -746,21 +1059,41 @@ SiameseResult Decoder::DecodeCheckedRegion()
         return Siamese_Disabled;
     }
 
-#ifdef SIAMESE_DECODER_DUMP_SOLVER_PERF
-    uint64_t t1 = GetTimeUsec();
-#endif
+    const uint64_t t1 = GetProfileTimeUsec(profile);
+    const unsigned matrixRows    = RecoveryMatrix.Rows.GetSize();
+    const unsigned matrixColumns = RecoveryMatrix.Columns.GetSize();
+    if (profile)
+    {
+        histograms[SiameseDecoderHistogram_MatrixRows].Add(matrixRows);
+        histograms[SiameseDecoderHistogram_MatrixColumns].Add(matrixColumns);
+        histograms[SiameseDecoderHistogram_GenerateMatrixUsec].Add(t1 - t0);
+    }
 
     // Attempt to solve the linear system
     if (!RecoveryMatrix.GaussianElimination())
     {
         CheckedRegion.SolveFailed = true;
         Stats.Counts[SiameseDecoderStats_SolveFailCount]++;
+
+        if (profile)
+        {
+            const uint64_t t2 = GetSystemTimeUsec();
+            histograms[SiameseDecoderHistogram_GaussianEliminationUsec].Add(t2 - t1);
+            histograms[SiameseDecoderHistogram_SolveUsec].Add(t2 - t0);
+        }
+
+        // Do the data-side work for these rows now so that the next attempt
+        // only needs to handle new rows and newly arrived originals
+        if (!EliminateUnsolvedRows())
+        {
+            Window.EmergencyDisabled = true;
+            Logger.Error("DecodeCheckedRegion.EliminateUnsolvedRows failed");
+            return Siamese_Disabled;
+        }
         return Siamese_NeedMoreData;
     }
 
-#ifdef SIAMESE_DECODER_DUMP_SOLVER_PERF
-    uint64_t t2 = GetTimeUsec();
-#endif
+    const uint64_t t2 = GetProfileTimeUsec(profile);
 
     if (!EliminateOriginalData())
     {
@@ -769,9 +1102,7 @@ SiameseResult Decoder::DecodeCheckedRegion()
         return Siamese_Disabled;
     }
 
-#ifdef SIAMESE_DECODER_DUMP_SOLVER_PERF
-    uint64_t t3 = GetTimeUsec();
-#endif
+    const uint64_t t3 = GetProfileTimeUsec(profile);
 
     if (!MultiplyLowerTriangle())
     {
@@ -780,20 +1111,29 @@ SiameseResult Decoder::DecodeCheckedRegion()
         return Siamese_Disabled;
     }
 
-#ifdef SIAMESE_DECODER_DUMP_SOLVER_PERF
-    uint64_t t4 = GetTimeUsec();
-#endif
+    const uint64_t t4 = GetProfileTimeUsec(profile);
 
     SiameseResult solveResult = BackSubstitution();
 
-#ifdef SIAMESE_DECODER_DUMP_SOLVER_PERF
-    uint64_t t5 = GetTimeUsec();
-#endif
+    const uint64_t t5 = GetProfileTimeUsec(profile);
 
     CheckedRegion.Reset();
 
+    if (profile)
+    {
+        histograms[SiameseDecoderHistogram_GaussianEliminationUsec].Add(t2 - t1);
+        histograms[SiameseDecoderHistogram_EliminateOriginalDataUsec].Add(t3 - t2);
+        histograms[SiameseDecoderHistogram_MultiplyLowerTriangleUsec].Add(t4 - t3);
+        histograms[SiameseDecoderHistogram_BackSubstitutionUsec].Add(t5 - t4);
+        histograms[SiameseDecoderHistogram_SolveUsec].Add(t5 - t0);
+        if (solveResult == Siamese_Success) {
+            histograms[SiameseDecoderHistogram_ExtraRecoveryCount].Add(
+                (matrixRows > matrixColumns) ? matrixRows - matrixColumns : 0);
+        }
+    }
+
 #ifdef SIAMESE_DECODER_DUMP_SOLVER_PERF
-    uint64_t t6 = GetTimeUsec();
+    uint64_t t6 = GetSystemTimeUsec();
 
     if (!skipLog)
     {
@@ -809,454 +1149,1641 @@ SiameseResult Decoder::DecodeCheckedRegion()
     return solveResult;
 }
 
-bool Decoder::EliminateOriginalData()
+SiameseResult Decoder::SolveSmallRegion()
 {
-    SIAMESE_DEBUG_ASSERT(CheckedRegion.LostCount == RecoveryMatrix.Columns.GetSize());
+    const unsigned lostCount = CheckedRegion.LostCount;
+    SIAMESE_DEBUG_ASSERT(lostCount >= 1 && lostCount <= kSmallSolveMaxLosses);
 
-    std::ostringstream* pDebugMsg = nullptr;
+    // Find the lost elements in the checked region
+    unsigned elements[kSmallSolveMaxLosses] = {};
+    unsigned element = CheckedRegion.ElementStart;
+    for (unsigned i = 0; i < lostCount; ++i)
+    {
+        element = Window.FindNextLostElement(element);
+        SIAMESE_DEBUG_ASSERT(element < CheckedRegion.NextCheckStart);
+        elements[i] = element++;
+    }
 
-    // Note: This is done because the Siamese sums need to be accumulated from
-    // left to right in the same order that the encoder generated them.
-    // This step tends to be slow because there is a lot of data that was
-    // successfully received that we need to eliminate from the recovery sums
+    /*
+        Pick rows with full rank from the coefficients alone, before any data
+        is touched.  For two losses, the first row with a nonzero coefficient
+        is paired with the first later row that is not a multiple of it:
 
-    const unsigned rows = CheckedRegion.RecoveryCount;
-    SIAMESE_DEBUG_ASSERT(CheckedRegion.RecoveryCount == RecoveryMatrix.Rows.GetSize());
+            row0 = a * x0 + b * x1
+            row1 = c * x0 + d * x1,  with a*d + b*c != 0
+    */
+    RecoveryPacket* row0 = nullptr;
+    RecoveryPacket* row1 = nullptr;
+    uint8_t a = 0, b = 0, c = 0, d = 0;
 
-    // Eliminate data in sorted row order regardless of pivot order:
-    for (unsigned matrixRowIndex = 0; matrixRowIndex < rows; ++matrixRowIndex)
+    for (RecoveryPacket* recovery = CheckedRegion.FirstRecovery; recovery; recovery = recovery->Next)
     {
-        if (!RecoveryMatrix.Rows.GetRef(matrixRowIndex).UsedForSolution) {
-            continue;
-        }
-
-        RecoveryPacket* recovery        = RecoveryMatrix.Rows.GetRef(matrixRowIndex).Recovery;
-        const RecoveryMetadata metadata = recovery->Metadata;
-        const unsigned elementStart     = recovery->ElementStart;
-        const unsigned elementEnd       = recovery->ElementEnd;
-        GrowingAlignedDataBuffer& recoveryBuffer = recovery->Buffer;
-        SIAMESE_DEBUG_ASSERT(recoveryBuffer.Data && recoveryBuffer.Bytes > 0);
+        const uint8_t x0 = GetRowCoefficient(recovery, elements[0]);
+        const uint8_t x1 = (lostCount > 1) ? GetRowCoefficient(recovery, elements[1]) : 0;
 
-#ifdef SIAMESE_ENABLE_CAUCHY
-        // If it is a Cauchy or parity row:
-        if (metadata.SumCount <= SIAMESE_CAUCHY_THRESHOLD)
+        if (!row0)
         {
-            // If this is a parity row:
-            if (metadata.Row == 0)
-            {
-                // Fill columns from left for new rows:
-                for (unsigned j = elementStart; j < elementEnd; ++j)
-                {
-                    OriginalPacket* original = Window.GetWindowElement(j);
-                    unsigned addBytes = original->Buffer.Bytes;
-                    if (addBytes > 0)
-                    {
-                        if (addBytes > recoveryBuffer.Bytes) {
-                            SIAMESE_DEBUG_BREAK(); // Should never happen
-                            addBytes = recoveryBuffer.Bytes;
-                        }
-                        gf256_add_mem(recoveryBuffer.Data, original->Buffer.Data, addBytes);
-                    }
-                }
-            }
-            else // This is a Cauchy row:
+            if (x0 != 0 || x1 != 0)
             {
-                // Fill columns from left for new rows:
-                for (unsigned j = elementStart; j < elementEnd; ++j)
-                {
-                    OriginalPacket* original = Window.GetWindowElement(j);
-                    unsigned addBytes = original->Buffer.Bytes;
-                    if (addBytes > 0)
-                    {
-                        const uint8_t y = CauchyElement(metadata.Row - 1, original->Column % kCauchyMaxColumns);
-                        if (addBytes > recoveryBuffer.Bytes) {
-                            SIAMESE_DEBUG_BREAK(); // Should never happen
-                            addBytes = recoveryBuffer.Bytes;
-                        }
-                        gf256_muladd_mem(recoveryBuffer.Data, y, original->Buffer.Data, addBytes);
-                    }
-                }
+                row0 = recovery;
+                a = x0;
+                b = x1;
             }
-
-            continue;
         }
-#endif // SIAMESE_ENABLE_CAUCHY
+        else if ((gf256_mul(a, x1) ^ gf256_mul(b, x0)) != 0)
+        {
+            row1 = recovery;
+            c = x0;
+            d = x1;
+            break;
+        }
 
-        // Zero the product sum
-        const unsigned recoveryBytes = recoveryBuffer.Bytes;
-        if (!ProductSum.Initialize(&TheAllocator, recoveryBytes)) {
-            return false;
+        if (row0 && lostCount == 1) {
+            break;
+        }
+        if (recovery == CheckedRegion.LastRecovery) {
+            break;
         }
-        memset(ProductSum.Data, 0, recoveryBytes);
+    }
 
-        Logger.Debug("Starting sums for row=", recovery->Metadata.Row, " start=", recovery->Metadata.ColumnStart, " count=", recovery->Metadata.SumCount);
+    if (!row0 || (lostCount > 1 && !row1)) {
+        return Siamese_NeedMoreData; // Leave the failure to the general solver
+    }
 
-        // Convert column start to window element.
-        // If some of the summed elements have fallen out of the window,
-        // then start it at the first element in the window (0).
-        unsigned sumElementStart = Window.ColumnToElement(recovery->Metadata.ColumnStart);
+    // Eliminate the received original data in row order so the running sums
+    // roll forward
+    if (!EliminateSmallRow(row0) ||
+        (row1 && !EliminateSmallRow(row1)))
+    {
+        Window.EmergencyDisabled = true;
+        Logger.Error("SolveSmallRegion.EliminateSmallRow failed");
+        return Siamese_Disabled;
+    }
 
-        /*
-            If the recovery packet indicates a different siamese sum, then we
-            will need to clear the running sums and recreate them from scratch.
-
-            Sums need to be restarted if the start point changed, which should
-            be a jump of over 128 packets that were acknowledged.  They would
-            also need to be restarted if the number of summed columns has
-            reduced instead of increased.  In both cases, data needs to be
-            removed from the running sum.  Instead of being clever about how to
-            remove that data, we just start over from scratch to avoid a huge
-            amount of extra complexity.
-
-            TBD: Collect real data on how much it would help to checkpoint on
-            the decoder side.  I suspect it would not help much because multi-
-            packet losses probably do not often straddle these checkpoints.
-            For example if start point changes 1/128 packets, then the benefit
-            of checkpoints is only felt in about 1% of the multi-loss cases,
-            which are already much less common than single losses.
-
-            Due to the way we order recovery packets in the list, and therefore
-            how they get ordered as matrix rows for the matrix we are solving,
-            often times sums will only roll forward or skip ahead.
-        */
-        if (metadata.ColumnStart != Window.SumColumnStart ||
-            metadata.SumCount < Window.SumColumnCount)
-        {
-            // If we have to restart the sums but the data is not available:
-            if (Window.InvalidElement(sumElementStart)) {
-                // This should never happen.  The code that decides when to
-                // remove data from the window should have kept this data.
-                SIAMESE_DEBUG_BREAK();
-                return false;
-            }
+    if (!Window.RecoveredPackets.SetSize_NoCopy(lostCount))
+    {
+        Window.EmergencyDisabled = true;
+        SIAMESE_DEBUG_BREAK(); // OOM
+        return Siamese_Disabled;
+    }
+
+    if (lostCount == 1)
+    {
+        // row0 = a * x0
+        GrowingAlignedDataBuffer& buffer0 = row0->Buffer;
+        gf256_mul_mem_inplace(buffer0.Data, gf256_inv(a), buffer0.Bytes);
 
-            Window.ResetSums(sumElementStart);
-            Window.SumColumnStart = metadata.ColumnStart;
+        if (!StoreSmallSolution(elements[0], row0, 0)) {
+            return Siamese_Disabled;
         }
-        else
+    }
+    else
+    {
+        // Pivot on a row that references the first loss
+        if (a == 0)
         {
-            if (Window.InvalidElement(sumElementStart)) {
-                sumElementStart = 0;
-            }
-
-            // Prepare any lane sums that have not accumulated data yet to
-            // receive data, since we are about to start accumulaing into
-            // some of these running sums.
-            if (!Window.StartSums(sumElementStart, recoveryBytes)) {
-                return false;
-            }
+            std::swap(row0, row1);
+            std::swap(a, c);
+            std::swap(b, d);
         }
-        Window.SumColumnCount = metadata.SumCount;
 
-        // Eliminate dense recovery data outside of matrix:
-        for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+        GrowingAlignedDataBuffer& buffer0 = row0->Buffer;
+        GrowingAlignedDataBuffer& buffer1 = row1->Buffer;
+        const unsigned bytes = (buffer0.Bytes > buffer1.Bytes) ? buffer0.Bytes : buffer1.Bytes;
+        if (!buffer0.GrowZeroPadded(&TheAllocator, bytes) ||
+            !buffer1.GrowZeroPadded(&TheAllocator, bytes))
         {
-            const unsigned opcode = GetRowOpcode(laneIndex, metadata.Row);
+            Window.EmergencyDisabled = true;
+            SIAMESE_DEBUG_BREAK(); // OOM
+            return Siamese_Disabled;
+        }
 
-            // For summations into the RecoveryPacket buffer:
-            unsigned mask = 1;
-            for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
-            {
-                if (opcode & mask)
-                {
-                    const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, elementEnd);
-                    SIAMESE_DEBUG_ASSERT(elementEnd + kColumnLaneCount >= Window.Lanes[laneIndex].Sums[sumIndex].ElementEnd);
-                    unsigned addBytes = sum->Bytes;
-                    if (addBytes > 0)
-                    {
-                        if (addBytes > recoveryBytes) {
-                            addBytes = recoveryBytes;
-                        }
-                        gf256_add_mem(recoveryBuffer.Data, sum->Data, addBytes);
-                    }
-                }
-                mask <<= 1;
-            }
+        // row1 += row0 * c/a leaves (d + b*c/a) * x1
+        const uint8_t ca = gf256_div(c, a);
+        const uint8_t y1 = d ^ gf256_mul(ca, b);
+        SIAMESE_DEBUG_ASSERT(y1 != 0);
+        gf256_muladd_mem(buffer1.Data, ca, buffer0.Data, bytes);
+        gf256_mul_mem_inplace(buffer1.Data, gf256_inv(y1), bytes);
 
-            // For summations into the ProductWorkspace buffer:
-            for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
-            {
-                if (opcode & mask)
-                {
-                    const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, elementEnd);
-                    SIAMESE_DEBUG_ASSERT(elementEnd + kColumnLaneCount >= Window.Lanes[laneIndex].Sums[sumIndex].ElementEnd);
-                    unsigned addBytes = sum->Bytes;
-                    if (addBytes > 0)
-                    {
-                        if (addBytes > recoveryBytes)
-                            addBytes = recoveryBytes;
-                        gf256_add_mem(ProductSum.Data, sum->Data, addBytes);
-                    }
-                }
-                mask <<= 1;
-            }
+        // row0 += x1 * b leaves a * x0
+        gf256_muladd_mem(buffer0.Data, b, buffer1.Data, bytes);
+        gf256_mul_mem_inplace(buffer0.Data, gf256_inv(a), bytes);
+
+        if (!StoreSmallSolution(elements[0], row0, 0) ||
+            !StoreSmallSolution(elements[1], row1, 1))
+        {
+            return Siamese_Disabled;
         }
+    }
 
-        // Eliminate light recovery data outside of matrix:
-        PCGRandom prng;
-        prng.Seed(metadata.Row, metadata.LDPCCount);
-        SIAMESE_DEBUG_ASSERT(metadata.SumCount >= metadata.LDPCCount);
+    return FinishSolution(elements[0] == Window.NextExpectedElement);
+}
 
-        if (Logger.ShouldLog(logger::Level::Debug))
-        {
-            delete pDebugMsg;
-            pDebugMsg = new std::ostringstream();
-            *pDebugMsg << "(Eliminate originals) LDPC columns (*=missing): ";
+bool Decoder::EliminateSmallRow(RecoveryPacket* recovery)
+{
+    SIAMESE_DEBUG_ASSERT(recovery->Buffer.Data && recovery->Buffer.Bytes > 0);
+
+    // If this row was already eliminated during a failed solve:
+    if (recovery->Eliminated)
+    {
+        EliminateLateOriginals(recovery);
+        return true;
+    }
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+    // If it is a Cauchy or parity row:
+    if (recovery->Metadata.SumCount <= SIAMESE_CAUCHY_THRESHOLD)
+    {
+        EliminateCauchyRow(recovery);
+        return true;
+    }
+#endif // SIAMESE_ENABLE_CAUCHY
+
+    // Return false if GetSum() ran out of memory
+    return EliminateSumRow(recovery, true) && !Window.EmergencyDisabled;
+}
+
+bool Decoder::StoreSmallSolution(unsigned element, RecoveryPacket* recovery, unsigned index)
+{
+    OriginalPacket* original = Window.GetWindowElement(element);
+    SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes == 0);
+
+    const unsigned bufferBytes = recovery->Buffer.Bytes;
+
+    // Check the embedded length field
+    unsigned length;
+    int headerBytes = DeserializeHeader_PacketLength(recovery->Buffer.Data, bufferBytes, length);
+    if (headerBytes < 0 || length == 0 || headerBytes + length > bufferBytes)
+    {
+        // See BackSubstitution() for common causes
+        Window.EmergencyDisabled = true;
+        Logger.Error("StoreSmallSolution corrupted recovered data len");
+        SIAMESE_DEBUG_BREAK(); // Should never happen
+        return false;
+    }
+
+    // All of the bytes are already solved
+    const unsigned column = Window.ElementToColumn(element);
+    StoreSolvedColumn(
+        original,
+        recovery,
+        column,
+        (unsigned)headerBytes,
+        length,
+        bufferBytes,
+        1,
+        false);
+
+    // Write recovered packet data
+    SiameseOriginalPacket* recoveredPtr = Window.RecoveredPackets.GetPtr(index);
+    recoveredPtr->Data      = original->GetData();
+    recoveredPtr->DataBytes = length;
+    recoveredPtr->PacketNum = column;
+
+    if (!Window.RecoveredColumns.Append(column))
+    {
+        Window.EmergencyDisabled = true;
+        SIAMESE_DEBUG_BREAK(); // OOM
+        return false;
+    }
+
+    Logger.Trace("Small Decoded: Column=", column, " Row=", recovery->Metadata.Row);
+
+    Window.MarkGotColumn(column);
+    return true;
+}
+
+bool Decoder::EliminateOriginalData()
+{
+    SIAMESE_DEBUG_ASSERT(CheckedRegion.LostCount == RecoveryMatrix.Columns.GetSize());
+
+    // Note: This is done because the Siamese sums need to be accumulated from
+    // left to right in the same order that the encoder generated them.
+    // This step tends to be slow because there is a lot of data that was
+    // successfully received that we need to eliminate from the recovery sums
+
+    const unsigned rows = CheckedRegion.RecoveryCount;
+    SIAMESE_DEBUG_ASSERT(CheckedRegion.RecoveryCount == RecoveryMatrix.Rows.GetSize());
+
+    // For large solves, only the running sums are accumulated in order here.
+    // The rest of the work for each row is independent and is finished on the
+    // solver threads afterwards
+    const bool parallel = UseSolverThreads();
+    ParallelRows.Clear();
+    unsigned parallelBytes = 0;
+
+    // Eliminate data in sorted row order regardless of pivot order:
+    for (unsigned matrixRowIndex = 0; matrixRowIndex < rows; ++matrixRowIndex)
+    {
+        if (!RecoveryMatrix.Rows.GetRef(matrixRowIndex).UsedForSolution) {
+            continue;
         }
 
-        const unsigned pairCount = (metadata.LDPCCount + kPairAddRate - 1) / kPairAddRate;
-        for (unsigned i = 0; i < pairCount; ++i)
+        RecoveryPacket* recovery = RecoveryMatrix.Rows.GetRef(matrixRowIndex).Recovery;
+        SIAMESE_DEBUG_ASSERT(recovery->Buffer.Data && recovery->Buffer.Bytes > 0);
+
+        // If this row was already eliminated during a failed solve:
+        if (recovery->Eliminated)
         {
-            const unsigned element1   = elementStart + (prng.Next() % metadata.LDPCCount);
-            OriginalPacket* original1 = Window.GetWindowElement(element1);
-            unsigned addBytes1 = original1->Buffer.Bytes;
-            if (addBytes1 > 0)
-            {
-                if (addBytes1 > recoveryBytes)
-                {
-                    SIAMESE_DEBUG_BREAK(); // Should never happen
-                    addBytes1 = recoveryBytes;
-                }
-                gf256_add_mem(recoveryBuffer.Data, original1->Buffer.Data, addBytes1);
+            EliminateLateOriginals(recovery);
+            continue;
+        }
 
-                if (pDebugMsg)
-                    *pDebugMsg << element1 << " ";
+        if (parallel)
+        {
+            if (!ParallelRows.Append(matrixRowIndex)) {
+                return false;
             }
-            else
-            {
-                if (pDebugMsg)
-                    *pDebugMsg << element1 << "* ";
+            if (parallelBytes < recovery->Buffer.Bytes) {
+                parallelBytes = recovery->Buffer.Bytes;
             }
+        }
 
-            const unsigned elementRX   = elementStart + (prng.Next() % metadata.LDPCCount);
-            OriginalPacket* originalRX = Window.GetWindowElement(elementRX);
-            unsigned addBytesRX = originalRX->Buffer.Bytes;
-            if (addBytesRX > 0)
-            {
-                if (addBytesRX > recoveryBytes)
-                {
-                    SIAMESE_DEBUG_BREAK(); // Should never happen
-                    addBytesRX = recoveryBytes;
-                }
-                gf256_add_mem(ProductSum.Data, originalRX->Buffer.Data, addBytesRX);
-
-                if (pDebugMsg)
-                    *pDebugMsg << elementRX << " ";
+#ifdef SIAMESE_ENABLE_CAUCHY
+        // If it is a Cauchy or parity row:
+        if (recovery->Metadata.SumCount <= SIAMESE_CAUCHY_THRESHOLD)
+        {
+            if (!parallel) {
+                EliminateCauchyRow(recovery);
             }
-            else
+            continue;
+        }
+#endif // SIAMESE_ENABLE_CAUCHY
+
+        if (!EliminateSumRow(recovery, !parallel)) {
+            return false;
+        }
+    }
+
+    if (ParallelRows.GetSize() > 0)
+    {
+        // Allocate workspace for each thread up front since the allocator
+        // is not thread-safe
+        const unsigned workerCount = SolverPool.GetWorkerCount();
+        for (unsigned i = 0; i < workerCount; ++i)
+        {
+            if (SolverProductSums[i].Bytes < parallelBytes &&
+                !SolverProductSums[i].Initialize(&TheAllocator, parallelBytes))
             {
-                if (pDebugMsg)
-                    *pDebugMsg << elementRX << "* ";
+                return false;
             }
         }
 
-        if (pDebugMsg)
-            Logger.Debug(pDebugMsg->str());
+        ParallelNextRow = 0;
+        SolverPool.Run(EliminateParallelRowsJob, this);
+    }
 
-        SIAMESE_DEBUG_ASSERT(recoveryBuffer.Bytes == ProductSum.Bytes);
-        const uint8_t RX = GetRowValue(metadata.Row);
-        gf256_muladd_mem(recoveryBuffer.Data, RX, ProductSum.Data, ProductSum.Bytes);
+    // Return false if GetSum() ran out of memory
+    return !Window.EmergencyDisabled;
+}
+
+bool Decoder::EliminateUnsolvedRows()
+{
+    const unsigned rows = RecoveryMatrix.Rows.GetSize();
+
+    // Eliminate data in sorted row order so the running sums roll forward:
+    for (unsigned matrixRowIndex = 0; matrixRowIndex < rows; ++matrixRowIndex)
+    {
+        RecoveryPacket* recovery = RecoveryMatrix.Rows.GetRef(matrixRowIndex).Recovery;
+        SIAMESE_DEBUG_ASSERT(recovery->Buffer.Data && recovery->Buffer.Bytes > 0);
+
+        // Late originals for rows that were already eliminated are handled
+        // only once the matrix can be solved
+        if (recovery->Eliminated) {
+            continue;
+        }
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+        // If it is a Cauchy or parity row:
+        if (recovery->Metadata.SumCount <= SIAMESE_CAUCHY_THRESHOLD) {
+            EliminateCauchyRow(recovery);
+        }
+        else
+#endif // SIAMESE_ENABLE_CAUCHY
+        if (!EliminateSumRow(recovery, true)) {
+            return false;
+        }
+
+        // Remember the columns that are still missing from the row
+        recovery->PendingColumns.Clear();
+        for (unsigned element = Window.FindNextLostElement(recovery->ElementStart);
+            element < recovery->ElementEnd;
+            element = Window.FindNextLostElement(element + 1))
+        {
+            if (!recovery->PendingColumns.Append(Window.ElementToColumn(element))) {
+                return false;
+            }
+        }
+
+        recovery->Eliminated = true;
     }
 
     // Return false if GetSum() ran out of memory
     return !Window.EmergencyDisabled;
 }
 
-bool Decoder::MultiplyLowerTriangle()
+void Decoder::EliminateLateOriginals(RecoveryPacket* recovery)
 {
-    // Note: This step tends to be slow because it is a dense triangular
-    // matrix-vector product
+    pktalloc::LightVector<unsigned>& pending = recovery->PendingColumns;
+    const unsigned pendingCount  = pending.GetSize();
+    const unsigned recoveryBytes = recovery->Buffer.Bytes;
+    unsigned keptCount = 0;
 
-    const unsigned columns = CheckedRegion.LostCount;
+    MultiplyAccumulator accumulator;
+    accumulator.Start(recovery->Buffer.Data);
 
-    // Multiply lower triangle following solution order from left to right:
-    for (unsigned col_i = 0; col_i < columns - 1; ++col_i)
+    for (unsigned i = 0; i < pendingCount; ++i)
     {
-        const unsigned matrixRowIndex_i = RecoveryMatrix.Pivots.GetRef(col_i);
-        const GrowingAlignedDataBuffer& recovery_i = RecoveryMatrix.Rows.GetRef(matrixRowIndex_i).Recovery->Buffer;
-        const uint8_t* srcData = recovery_i.Data;
-        const unsigned srcBytes = recovery_i.Bytes;
-        SIAMESE_DEBUG_ASSERT(srcData && srcBytes > 0);
+        const unsigned column  = pending.GetRef(i);
+        const unsigned element = Window.ColumnToElement(column);
+        SIAMESE_DEBUG_ASSERT(element >= recovery->ElementStart && element < recovery->ElementEnd);
 
-        for (unsigned col_j = col_i + 1; col_j < columns; ++col_j)
+        OriginalPacket* original = Window.GetWindowElement(element);
+        unsigned addBytes = original->Buffer.Bytes;
+
+        // If it is still lost, keep it for the next attempt
+        if (addBytes <= 0)
         {
-            const unsigned matrixRowIndex_j = RecoveryMatrix.Pivots.GetRef(col_j);
-            const uint8_t y = RecoveryMatrix.Matrix.Get(matrixRowIndex_j, col_i);
+            pending.GetRef(keptCount++) = column;
+            continue;
+        }
 
-            // If this row does not reference this column:
-            if (y == 0) {
-                continue;
+        if (addBytes > recoveryBytes)
+        {
+            SIAMESE_DEBUG_BREAK(); // Should never happen
+            addBytes = recoveryBytes;
+        }
+
+        const uint8_t y = GetRowCoefficient(recovery, element);
+        if (y != 0) {
+            original->MulAddTo(accumulator, y, addBytes);
+        }
+    }
+
+    accumulator.Flush();
+
+    // Shrinking does not reallocate
+    pending.SetSize_Copy(keptCount);
+}
+
+uint8_t Decoder::GetRowCoefficient(const RecoveryPacket* recovery, unsigned element)
+{
+    // Note: This must match the matrix row built by GenerateMatrix()
+
+    const RecoveryMetadata metadata = recovery->Metadata;
+    const unsigned column    = Window.ElementToColumn(element);
+    const unsigned sumOffset = SubtractColumns(column, metadata.ColumnStart);
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+    // If it is a Cauchy or parity row:
+    if (metadata.SumCount <= SIAMESE_CAUCHY_THRESHOLD)
+    {
+        if (sumOffset >= metadata.SumCount) {
+            return 0;
+        }
+        return (metadata.Row == 0) ? 1 : CauchyElement(metadata.Row - 1, column % kCauchyMaxColumns);
+    }
+#endif // SIAMESE_ENABLE_CAUCHY
+
+    const uint8_t RX = GetRowValue(metadata.Row);
+    unsigned value = 0;
+
+    if (sumOffset < metadata.SumCount)
+    {
+        // Interpret opcode to calculate the row element
+        const uint8_t CX      = GetColumnValue(column);
+        const uint8_t CX2     = gf256_sqr(CX);
+        const unsigned opcode = GetRowOpcode(column % kColumnLaneCount, metadata.Row);
+
+        if (opcode & 1)
+            value ^= 1;
+        if (opcode & 2)
+            value ^= CX;
+        if (opcode & 4)
+            value ^= CX2;
+        if (opcode & 8)
+            value ^= RX;
+        if (opcode & 16)
+            value ^= gf256_mul(CX, RX);
+        if (opcode & 32)
+            value ^= gf256_mul(CX2, RX);
+    }
+
+    PCGRandom prng;
+    prng.Seed(metadata.Row, metadata.LDPCCount);
+
+    const unsigned pairCount = (metadata.LDPCCount + kPairAddRate - 1) / kPairAddRate;
+    for (unsigned k = 0; k < pairCount; ++k)
+    {
+        const unsigned element1  = recovery->ElementStart + (prng.Next() % metadata.LDPCCount);
+        if (element1 == element)
+            value ^= 1;
+        const unsigned elementRX = recovery->ElementStart + (prng.Next() % metadata.LDPCCount);
+        if (elementRX == element)
+            value ^= RX;
+    }
+
+    return (uint8_t)value;
+}
+
+void Decoder::EliminateParallelRowsJob(void* context, unsigned workerIndex, unsigned /*workerCount*/)
+{
+    Decoder* decoder = reinterpret_cast<Decoder*>(context);
+    uint8_t* productSumData = decoder->SolverProductSums[workerIndex].Data;
+    const unsigned parallelRowCount = decoder->ParallelRows.GetSize();
+
+    // Claim rows one at a time until they are all done:
+    for (;;)
+    {
+        const unsigned i = decoder->ParallelNextRow++;
+        if (i >= parallelRowCount) {
+            break;
+        }
+
+        const unsigned matrixRowIndex = decoder->ParallelRows.GetRef(i);
+        RecoveryPacket* recovery = decoder->RecoveryMatrix.Rows.GetRef(matrixRowIndex).Recovery;
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+        if (recovery->Metadata.SumCount <= SIAMESE_CAUCHY_THRESHOLD)
+        {
+            decoder->EliminateCauchyRow(recovery);
+            continue;
+        }
+#endif // SIAMESE_ENABLE_CAUCHY
+
+        // Finish the light columns that EliminateSumRow() left out.
+        // The running sums for the product were already added, so this
+        // product sum only holds the remaining light columns
+        const unsigned recoveryBytes = recovery->Buffer.Bytes;
+        memset(productSumData, 0, recoveryBytes);
+
+        MultiplyAccumulator recoverySum, productSum;
+        recoverySum.Start(recovery->Buffer.Data);
+        productSum.Start(productSumData);
+
+        decoder->AddLightColumns(recovery, recoverySum, productSum);
+
+        productSum.Flush();
+
+        const uint8_t RX = GetRowValue(recovery->Metadata.Row);
+        recoverySum.MulAdd(productSumData, RX, recoveryBytes);
+        recoverySum.Flush();
+    }
+}
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+
+void Decoder::EliminateCauchyRow(RecoveryPacket* recovery)
+{
+    const RecoveryMetadata metadata = recovery->Metadata;
+    const unsigned elementStart     = recovery->ElementStart;
+    const unsigned elementEnd       = recovery->ElementEnd;
+    GrowingAlignedDataBuffer& recoveryBuffer = recovery->Buffer;
+
+    MultiplyAccumulator accumulator;
+    accumulator.Start(recoveryBuffer.Data);
+
+    // If this is a parity row:
+    if (metadata.Row == 0)
+    {
+        // Fill columns from left for new rows:
+        for (unsigned j = elementStart; j < elementEnd; ++j)
+        {
+            OriginalPacket* original = Window.GetWindowElement(j);
+            unsigned addBytes = original->Buffer.Bytes;
+            if (addBytes > 0)
+            {
+                if (addBytes > recoveryBuffer.Bytes) {
+                    SIAMESE_DEBUG_BREAK(); // Should never happen
+                    addBytes = recoveryBuffer.Bytes;
+                }
+                original->MulAddTo(accumulator, 1, addBytes);
+            }
+        }
+    }
+    else // This is a Cauchy row:
+    {
+        // Fill columns from left for new rows:
+        for (unsigned j = elementStart; j < elementEnd; ++j)
+        {
+            OriginalPacket* original = Window.GetWindowElement(j);
+            unsigned addBytes = original->Buffer.Bytes;
+            if (addBytes > 0)
+            {
+                const uint8_t y = CauchyElement(metadata.Row - 1, original->Column % kCauchyMaxColumns);
+                if (addBytes > recoveryBuffer.Bytes) {
+                    SIAMESE_DEBUG_BREAK(); // Should never happen
+                    addBytes = recoveryBuffer.Bytes;
+                }
+                original->MulAddTo(accumulator, y, addBytes);
             }
+        }
+    }
+
+    accumulator.Flush();
+}
 
-            GrowingAlignedDataBuffer& recovery_j = RecoveryMatrix.Rows.GetRef(matrixRowIndex_j).Recovery->Buffer;
-            SIAMESE_DEBUG_ASSERT(recovery_j.Data && recovery_j.Bytes > 0);
+#endif // SIAMESE_ENABLE_CAUCHY
 
-            // Make room for the summation
-            if (!recovery_j.GrowZeroPadded(&TheAllocator, srcBytes)) {
-                return false;
+bool Decoder::EliminateSumRow(RecoveryPacket* recovery, bool includeLightColumns)
+{
+    const RecoveryMetadata metadata = recovery->Metadata;
+    const unsigned elementEnd       = recovery->ElementEnd;
+    GrowingAlignedDataBuffer& recoveryBuffer = recovery->Buffer;
+
+    // Zero the product sum
+    const unsigned recoveryBytes = recoveryBuffer.Bytes;
+    if (!ProductSum.Initialize(&TheAllocator, recoveryBytes)) {
+        return false;
+    }
+    memset(ProductSum.Data, 0, recoveryBytes);
+
+    Logger.Debug("Starting sums for row=", recovery->Metadata.Row, " start=", recovery->Metadata.ColumnStart, " count=", recovery->Metadata.SumCount);
+
+    // Convert column start to window element.
+    // If some of the summed elements have fallen out of the window,
+    // then start it at the first element in the window (0).
+    unsigned sumElementStart = Window.ColumnToElement(recovery->Metadata.ColumnStart);
+
+    /*
+        If the recovery packet indicates a different siamese sum, then we
+        will need to clear the running sums and recreate them from scratch.
+
+        Sums need to be restarted if the start point changed, which should
+        be a jump of over 128 packets that were acknowledged.  They would
+        also need to be restarted if the number of summed columns has
+        reduced instead of increased.  In both cases, data needs to be
+        removed from the running sum.  Instead of being clever about how to
+        remove that data, we just start over from scratch to avoid a huge
+        amount of extra complexity.
+
+        TBD: Collect real data on how much it would help to checkpoint on
+        the decoder side.  I suspect it would not help much because multi-
+        packet losses probably do not often straddle these checkpoints.
+        For example if start point changes 1/128 packets, then the benefit
+        of checkpoints is only felt in about 1% of the multi-loss cases,
+        which are already much less common than single losses.
+
+        Due to the way we order recovery packets in the list, and therefore
+        how they get ordered as matrix rows for the matrix we are solving,
+        often times sums will only roll forward or skip ahead.
+    */
+    if (metadata.ColumnStart != Window.SumColumnStart ||
+        metadata.SumCount < Window.SumColumnCount)
+    {
+        // If we have to restart the sums but the data is not available:
+        if (Window.InvalidElement(sumElementStart)) {
+            // This should never happen.  The code that decides when to
+            // remove data from the window should have kept this data.
+            SIAMESE_DEBUG_BREAK();
+            return false;
+        }
+
+        Window.ResetSums(sumElementStart);
+        Window.SumColumnStart = metadata.ColumnStart;
+    }
+    else
+    {
+        if (Window.InvalidElement(sumElementStart)) {
+            sumElementStart = 0;
+        }
+
+        // Prepare any lane sums that have not accumulated data yet to
+        // receive data, since we are about to start accumulaing into
+        // some of these running sums.
+        if (!Window.StartSums(sumElementStart, recoveryBytes)) {
+            return false;
+        }
+    }
+    Window.SumColumnCount = metadata.SumCount;
+
+    MultiplyAccumulator recoverySum, productSum;
+    recoverySum.Start(recoveryBuffer.Data);
+    productSum.Start(ProductSum.Data);
+
+    // Eliminate dense recovery data outside of matrix:
+    for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+    {
+        const unsigned opcode = GetRowOpcode(laneIndex, metadata.Row);
+
+        // For summations into the RecoveryPacket buffer:
+        unsigned mask = 1;
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+        {
+            if (opcode & mask)
+            {
+                const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, elementEnd);
+                SIAMESE_DEBUG_ASSERT(elementEnd + kColumnLaneCount >= Window.Lanes[laneIndex].Sums[sumIndex].ElementEnd);
+                unsigned addBytes = sum->Bytes;
+                if (addBytes > 0)
+                {
+                    if (addBytes > recoveryBytes) {
+                        addBytes = recoveryBytes;
+                    }
+                    recoverySum.Add(sum->Data, addBytes);
+                }
+            }
+            mask <<= 1;
+        }
+
+        // For summations into the ProductWorkspace buffer:
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+        {
+            if (opcode & mask)
+            {
+                const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, elementEnd);
+                SIAMESE_DEBUG_ASSERT(elementEnd + kColumnLaneCount >= Window.Lanes[laneIndex].Sums[sumIndex].ElementEnd);
+                unsigned addBytes = sum->Bytes;
+                if (addBytes > 0)
+                {
+                    if (addBytes > recoveryBytes)
+                        addBytes = recoveryBytes;
+                    productSum.Add(sum->Data, addBytes);
+                }
             }
+            mask <<= 1;
+        }
+    }
+
+    // Eliminate light recovery data outside of matrix:
+    if (includeLightColumns) {
+        AddLightColumns(recovery, recoverySum, productSum);
+    }
+
+    productSum.Flush();
+
+    SIAMESE_DEBUG_ASSERT(recoveryBuffer.Bytes == ProductSum.Bytes);
+    const uint8_t RX = GetRowValue(metadata.Row);
+    recoverySum.MulAdd(ProductSum.Data, RX, ProductSum.Bytes);
+    recoverySum.Flush();
+
+    return true;
+}
+
+void Decoder::AddLightColumns(
+    RecoveryPacket* recovery,
+    MultiplyAccumulator& recoverySum,
+    MultiplyAccumulator& productSum)
+{
+    const RecoveryMetadata metadata = recovery->Metadata;
+    const unsigned elementStart     = recovery->ElementStart;
+    const unsigned recoveryBytes    = recovery->Buffer.Bytes;
+
+    PCGRandom prng;
+    prng.Seed(metadata.Row, metadata.LDPCCount);
+    SIAMESE_DEBUG_ASSERT(metadata.SumCount >= metadata.LDPCCount);
+
+    std::ostringstream* pDebugMsg = nullptr;
+    if (Logger.ShouldLog(logger::Level::Debug))
+    {
+        pDebugMsg = new std::ostringstream();
+        *pDebugMsg << "(Eliminate originals) LDPC columns (*=missing): ";
+    }
+
+    const unsigned pairCount = (metadata.LDPCCount + kPairAddRate - 1) / kPairAddRate;
+    for (unsigned i = 0; i < pairCount; ++i)
+    {
+        const unsigned element1   = elementStart + (prng.Next() % metadata.LDPCCount);
+        OriginalPacket* original1 = Window.GetWindowElement(element1);
+        unsigned addBytes1 = original1->Buffer.Bytes;
+        if (addBytes1 > 0)
+        {
+            if (addBytes1 > recoveryBytes)
+            {
+                SIAMESE_DEBUG_BREAK(); // Should never happen
+                addBytes1 = recoveryBytes;
+            }
+            original1->MulAddTo(recoverySum, 1, addBytes1);
+
+            if (pDebugMsg)
+                *pDebugMsg << element1 << " ";
+        }
+        else
+        {
+            if (pDebugMsg)
+                *pDebugMsg << element1 << "* ";
+        }
+
+        const unsigned elementRX   = elementStart + (prng.Next() % metadata.LDPCCount);
+        OriginalPacket* originalRX = Window.GetWindowElement(elementRX);
+        unsigned addBytesRX = originalRX->Buffer.Bytes;
+        if (addBytesRX > 0)
+        {
+            if (addBytesRX > recoveryBytes)
+            {
+                SIAMESE_DEBUG_BREAK(); // Should never happen
+                addBytesRX = recoveryBytes;
+            }
+            originalRX->MulAddTo(productSum, 1, addBytesRX);
+
+            if (pDebugMsg)
+                *pDebugMsg << elementRX << " ";
+        }
+        else
+        {
+            if (pDebugMsg)
+                *pDebugMsg << elementRX << "* ";
+        }
+    }
+
+    if (pDebugMsg)
+    {
+        Logger.Debug(pDebugMsg->str());
+        delete pDebugMsg;
+    }
+}
+
+bool Decoder::MultiplyLowerTriangle()
+{
+    // Note: This step tends to be slow because it is a dense triangular
+    // matrix-vector product
+
+    const unsigned columns = CheckedRegion.LostCount;
+
+    // For large solves, the rows are only grown here and the products are
+    // split into byte ranges that are independent on the solver threads
+    const bool parallel = UseSolverThreads();
+    unsigned parallelBytes = 0;
+
+    // Multiply lower triangle following solution order from left to right.
+    // Each row gathers all of the rows above it in one pass over its data:
+    for (unsigned col_j = 1; col_j < columns; ++col_j)
+    {
+        const unsigned matrixRowIndex_j = RecoveryMatrix.Pivots.GetRef(col_j);
+        GrowingAlignedDataBuffer& recovery_j = RecoveryMatrix.Rows.GetRef(matrixRowIndex_j).Recovery->Buffer;
+        SIAMESE_DEBUG_ASSERT(recovery_j.Data && recovery_j.Bytes > 0);
+
+        // Make room for the summation
+        unsigned sumBytes = recovery_j.Bytes;
+        for (unsigned col_i = 0; col_i < col_j; ++col_i)
+        {
+            // If this row does not reference this column:
+            if (RecoveryMatrix.Matrix.Get(matrixRowIndex_j, col_i) == 0) {
+                continue;
+            }
+
+            const unsigned matrixRowIndex_i = RecoveryMatrix.Pivots.GetRef(col_i);
+            const unsigned srcBytes = RecoveryMatrix.Rows.GetRef(matrixRowIndex_i).Recovery->Buffer.Bytes;
+            if (sumBytes < srcBytes) {
+                sumBytes = srcBytes;
+            }
+        }
+        if (!recovery_j.GrowZeroPadded(&TheAllocator, sumBytes)) {
+            return false;
+        }
+
+        if (parallel)
+        {
+            if (parallelBytes < sumBytes) {
+                parallelBytes = sumBytes;
+            }
+            continue;
+        }
+
+        MultiplyAccumulator accumulator;
+        accumulator.Start(recovery_j.Data);
+
+        for (unsigned col_i = 0; col_i < col_j; ++col_i)
+        {
+            const uint8_t y = RecoveryMatrix.Matrix.Get(matrixRowIndex_j, col_i);
+
+            // If this row does not reference this column:
+            if (y == 0) {
+                continue;
+            }
+
+            const unsigned matrixRowIndex_i = RecoveryMatrix.Pivots.GetRef(col_i);
+            const GrowingAlignedDataBuffer& recovery_i = RecoveryMatrix.Rows.GetRef(matrixRowIndex_i).Recovery->Buffer;
+            SIAMESE_DEBUG_ASSERT(recovery_i.Data && recovery_i.Bytes > 0);
+
+            accumulator.MulAdd(recovery_i.Data, y, recovery_i.Bytes);
+        }
+
+        accumulator.Flush();
+    }
+
+    if (parallel && parallelBytes > 0)
+    {
+        ParallelSolutionBytes = parallelBytes;
+        SolverPool.Run(MultiplyLowerTriangleJob, this);
+    }
+
+    return true;
+}
+
+void Decoder::MultiplyLowerTriangleJob(void* context, unsigned workerIndex, unsigned workerCount)
+{
+    Decoder* decoder = reinterpret_cast<Decoder*>(context);
+    RecoveryMatrixState& matrix = decoder->RecoveryMatrix;
+    const unsigned columns = decoder->CheckedRegion.LostCount;
+
+    unsigned rangeStart, rangeEnd;
+    GetWorkerByteRange(
+        0,
+        decoder->ParallelSolutionBytes,
+        workerIndex,
+        workerCount,
+        rangeStart,
+        rangeEnd);
+
+    // Multiply this byte range of each row in the same order as MultiplyLowerTriangle():
+    for (unsigned col_j = 1; col_j < columns; ++col_j)
+    {
+        const unsigned matrixRowIndex_j = matrix.Pivots.GetRef(col_j);
+        GrowingAlignedDataBuffer& recovery_j = matrix.Rows.GetRef(matrixRowIndex_j).Recovery->Buffer;
+        const unsigned end_j = (recovery_j.Bytes < rangeEnd) ? recovery_j.Bytes : rangeEnd;
+        if (end_j <= rangeStart) {
+            continue;
+        }
+
+        MultiplyAccumulator accumulator;
+        accumulator.Start(recovery_j.Data + rangeStart);
+
+        for (unsigned col_i = 0; col_i < col_j; ++col_i)
+        {
+            const uint8_t y = matrix.Matrix.Get(matrixRowIndex_j, col_i);
+
+            // If this row does not reference this column:
+            if (y == 0) {
+                continue;
+            }
+
+            const unsigned matrixRowIndex_i = matrix.Pivots.GetRef(col_i);
+            const GrowingAlignedDataBuffer& recovery_i = matrix.Rows.GetRef(matrixRowIndex_i).Recovery->Buffer;
+            const unsigned end_i = (recovery_i.Bytes < end_j) ? recovery_i.Bytes : end_j;
+            if (end_i > rangeStart) {
+                accumulator.MulAdd(recovery_i.Data + rangeStart, y, end_i - rangeStart);
+            }
+        }
+
+        accumulator.Flush();
+    }
+}
+
+SiameseResult Decoder::BackSubstitution()
+{
+    // Note: This step tends to be fast because the upper-right of the matrix
+    // while streaming is mostly zero
+
+    const unsigned columns = CheckedRegion.LostCount;
+    Window.RecoveredPackets.SetSize_NoCopy(columns);
+
+    // For large solves, only enough bytes of each column to read its length
+    // prefix are solved in this loop.  The rest of the data is split into
+    // byte ranges that are solved independently on the solver threads
+    const bool parallel = UseSolverThreads();
+    if (parallel && !ParallelSolutions.SetSize_NoCopy(columns))
+    {
+        Window.EmergencyDisabled = true;
+        SIAMESE_DEBUG_BREAK(); // OOM
+        return Siamese_Disabled;
+    }
+    unsigned parallelBytes = 0;
+
+    bool iterateNextExpected = false;
+
+    // For each column starting with the right-most column:
+    for (int col_i = columns - 1; col_i >= 0; --col_i)
+    {
+        const unsigned matrixRowIndex = RecoveryMatrix.Pivots.GetRef(col_i);
+        OriginalPacket* original = RecoveryMatrix.Columns.GetRef(col_i).Original;
+        RecoveryPacket* recovery = RecoveryMatrix.Rows.GetRef(matrixRowIndex).Recovery;
+        SIAMESE_DEBUG_ASSERT(original->Column == (unsigned)col_i && original->Buffer.Bytes == 0);
+
+        uint8_t* buffer = recovery->Buffer.Data;
+        const uint8_t y = RecoveryMatrix.Matrix.Get(matrixRowIndex, col_i);
+
+        SIAMESE_DEBUG_ASSERT(buffer && recovery->Buffer.Bytes > 0);
+        SIAMESE_DEBUG_ASSERT(y != 0);
+        const uint8_t inv_y = gf256_inv(y);
+
+        unsigned bufferBytes = recovery->Buffer.Bytes;
+
+        unsigned lengthCheckBytes = pktalloc::kAlignmentBytes;
+        if (lengthCheckBytes > bufferBytes) {
+            lengthCheckBytes = bufferBytes;
+        }
+
+        // Eliminate all of the columns to the right that were already solved:
+        const unsigned eliminateBytes = parallel ? lengthCheckBytes : bufferBytes;
+        MultiplyAccumulator accumulator;
+        accumulator.Start(buffer);
+        for (unsigned col_k = col_i + 1; col_k < columns; ++col_k)
+        {
+            const uint8_t x = RecoveryMatrix.Matrix.Get(matrixRowIndex, col_k);
+
+            if (x == 0) {
+                continue;
+            }
+
+            const OriginalPacket* solved_k = RecoveryMatrix.Columns.GetRef(col_k).Original;
+            SIAMESE_DEBUG_ASSERT((solved_k->Buffer.Data || solved_k->ExternalData) && solved_k->Buffer.Bytes > 0);
+
+            unsigned addBytes = solved_k->Buffer.Bytes;
+            if (addBytes > bufferBytes) {
+                SIAMESE_DEBUG_BREAK(); // This should never happen
+                addBytes = bufferBytes;
+            }
+
+            solved_k->MulAddTo(accumulator, x, (addBytes < eliminateBytes) ? addBytes : eliminateBytes);
+        }
+        accumulator.Flush();
+
+        // Reveal the first chunk of bytes of data
+        gf256_mul_mem_inplace(buffer, inv_y, lengthCheckBytes);
+
+        // Check the embedded length field
+        unsigned length;
+        int headerBytes = DeserializeHeader_PacketLength(buffer, lengthCheckBytes, length);
+        if (headerBytes < 0 || length == 0 || headerBytes + length > bufferBytes)
+        {
+            //------------------------------------------------------------------
+            // This error means that the Siamese FEC recovery has failed.
+            // Common causes:
+            // + Packet Numbers provided by application are incorrect.
+            // + Or some software bug in this library I need to fix.
+            //------------------------------------------------------------------
+            Window.EmergencyDisabled = true;
+            Logger.Error("BackSubstitution corrupted recovered data len");
+            SIAMESE_DEBUG_BREAK(); // Should never happen
+            return Siamese_Disabled;
+        }
+
+        const unsigned column = RecoveryMatrix.Columns.GetRef(col_i).Column;
+        uint8_t* outputData = StoreSolvedColumn(
+            original,
+            recovery,
+            column,
+            (unsigned)headerBytes,
+            length,
+            lengthCheckBytes,
+            inv_y,
+            parallel);
+
+        if (parallel)
+        {
+            ParallelSolution* solution = ParallelSolutions.GetPtr(col_i);
+            solution->Work        = buffer;
+            solution->Output      = outputData;
+            solution->Bytes       = headerBytes + length;
+            solution->HeaderBytes = headerBytes;
+            solution->InvY        = inv_y;
+
+            if (parallelBytes < solution->Bytes) {
+                parallelBytes = solution->Bytes;
+            }
+        }
+
+        // Write recovered packet data
+        SiameseOriginalPacket* recoveredPtr = Window.RecoveredPackets.GetPtr(col_i);
+        recoveredPtr->Data      = original->GetData();
+        recoveredPtr->DataBytes = length;
+        recoveredPtr->PacketNum = column;
+
+        if (!Window.RecoveredColumns.Append(original->Column))
+        {
+            Window.EmergencyDisabled = true;
+            SIAMESE_DEBUG_BREAK(); // OOM
+            return Siamese_Disabled;
+        }
+
+        Logger.Trace("GE Decoded: Column=", original->Column, " Row=", recovery->Metadata.Row);
+
+        iterateNextExpected |= Window.MarkGotColumn(original->Column);
+    }
+
+    // Finish solving the rest of the data before any buffers are released
+    if (parallel && parallelBytes > pktalloc::kAlignmentBytes)
+    {
+        ParallelSolutionBytes = parallelBytes;
+        SolverPool.Run(BackSubstitutionJob, this);
+    }
+
+    return FinishSolution(iterateNextExpected);
+}
+
+SiameseResult Decoder::FinishSolution(bool iterateNextExpected)
+{
+    // We always expect to have recovered the next expected packet
+    if (!iterateNextExpected)
+    {
+        Window.EmergencyDisabled = true;
+        Logger.Error("FinishSolution.iterateNextExpected failed");
+        SIAMESE_DEBUG_BREAK(); // Should never happen
+        return Siamese_Disabled;
+    }
+
+    // Iterate the next expected element beyond the recovery region
+    Window.IterateNextExpectedElement(CheckedRegion.NextCheckStart);
+
+    Logger.Debug("FinishSolution: Deleting recovery packets before element ", Window.NextExpectedElement, " column = ", (Window.NextExpectedElement + Window.ColumnStart));
+
+    RecoveryPackets.DeletePacketsBefore(Window.NextExpectedElement);
+
+    if (CheckedRegion.NextCheckStart >= kDecoderRemoveThreshold) {
+        Window.RemoveElements();
+    }
+
+    Stats.Counts[SiameseDecoderStats_SolveSuccessCount]++;
+
+    return Siamese_Success;
+}
+
+uint8_t* Decoder::StoreSolvedColumn(
+    OriginalPacket* original,
+    RecoveryPacket* recovery,
+    unsigned column,
+    unsigned headerBytes,
+    unsigned length,
+    unsigned revealedBytes,
+    uint8_t inv_y,
+    bool deferScaling)
+{
+    uint8_t* buffer = recovery->Buffer.Data;
+    const unsigned bufferBytes = headerBytes + length;
+    SIAMESE_DEBUG_ASSERT(headerBytes <= revealedBytes && revealedBytes <= recovery->Buffer.Bytes);
+
+    // If the application provides a buffer for this packet:
+    uint8_t* outputData = nullptr;
+    if (OutputProvider) {
+        outputData = OutputProvider(OutputContext, column, length);
+    }
+
+    if (outputData)
+    {
+        // Copy the revealed bytes and scale the rest directly into the
+        // application buffer
+        const unsigned revealedDataBytes = revealedBytes - headerBytes;
+        if (revealedDataBytes >= length) {
+            memcpy(outputData, buffer + headerBytes, length);
+        }
+        else
+        {
+            memcpy(outputData, buffer + headerBytes, revealedDataBytes);
+            if (!deferScaling)
+            {
+                gf256_mul_mem(
+                    outputData + revealedDataBytes,
+                    buffer + revealedBytes,
+                    inv_y,
+                    bufferBytes - revealedBytes);
+            }
+        }
+
+        // Reference the application buffer from the window.
+        // The recovery buffer is left in place to be reused
+        SiameseOriginalPacket solved;
+        solved.PacketNum = column;
+        solved.Data      = outputData;
+        solved.DataBytes = length;
+        original->InitializeExternal(solved, OutputRelease, OutputContext);
+        SIAMESE_DEBUG_ASSERT(original->HeaderBytes == headerBytes);
+        recovery->Buffer.Bytes = 0;
+    }
+    else
+    {
+        if (!deferScaling && bufferBytes > revealedBytes) {
+            gf256_mul_mem_inplace(
+                buffer + revealedBytes,
+                inv_y,
+                bufferBytes - revealedBytes);
+        }
+
+        // Swap original and recovery buffers
+        uint8_t* oldOriginalData = original->Buffer.Data;
+        original->Buffer.Data    = buffer;
+        original->Buffer.Bytes   = bufferBytes;
+        original->Column         = column;
+        original->HeaderBytes    = headerBytes;
+        recovery->Buffer.Data    = oldOriginalData;
+        recovery->Buffer.Bytes   = 0;
+    }
+
+    return outputData;
+}
+
+void Decoder::BackSubstitutionJob(void* context, unsigned workerIndex, unsigned workerCount)
+{
+    Decoder* decoder = reinterpret_cast<Decoder*>(context);
+    RecoveryMatrixState& matrix = decoder->RecoveryMatrix;
+    const unsigned columns = decoder->CheckedRegion.LostCount;
+
+    // The first bytes of each column were solved already
+    unsigned rangeStart, rangeEnd;
+    GetWorkerByteRange(
+        pktalloc::kAlignmentBytes,
+        decoder->ParallelSolutionBytes,
+        workerIndex,
+        workerCount,
+        rangeStart,
+        rangeEnd);
+
+    // Solve this byte range of each column in the same order as BackSubstitution():
+    for (int col_i = columns - 1; col_i >= 0; --col_i)
+    {
+        const ParallelSolution& solution_i = decoder->ParallelSolutions.GetRef(col_i);
+        const unsigned end_i = (solution_i.Bytes < rangeEnd) ? solution_i.Bytes : rangeEnd;
+        if (end_i <= rangeStart) {
+            continue;
+        }
+
+        const unsigned matrixRowIndex = matrix.Pivots.GetRef(col_i);
+
+        // Eliminate all of the columns to the right that were already solved:
+        MultiplyAccumulator accumulator;
+        accumulator.Start(solution_i.Work + rangeStart);
+        for (unsigned col_k = col_i + 1; col_k < columns; ++col_k)
+        {
+            const uint8_t x = matrix.Matrix.Get(matrixRowIndex, col_k);
+
+            if (x == 0) {
+                continue;
+            }
+
+            const ParallelSolution& solution_k = decoder->ParallelSolutions.GetRef(col_k);
+            const unsigned end_k = (solution_k.Bytes < end_i) ? solution_k.Bytes : end_i;
+            if (end_k > rangeStart) {
+                accumulator.MulAdd(solution_k.GetSolved(rangeStart), x, end_k - rangeStart);
+            }
+        }
+        accumulator.Flush();
+
+        gf256_mul_mem(
+            solution_i.GetSolved(rangeStart),
+            solution_i.Work + rangeStart,
+            solution_i.InvY,
+            end_i - rangeStart);
+    }
+}
+
+SiameseResult Decoder::GetStatistics(uint64_t* statsOut, unsigned statsCount)
+{
+    if (statsCount > SiameseDecoderStats_Count) {
+        statsCount = SiameseDecoderStats_Count;
+    }
+
+    // Fill in memory allocated
+    Stats.Counts[SiameseDecoderStats_MemoryUsed] = TheAllocator.GetMemoryAllocatedBytes();
+    Stats.Counts[SiameseDecoderStats_PoolMemoryUsed] = TheAllocator.GetPoolMemoryAllocatedBytes();
+
+    for (unsigned i = 0; i < statsCount; ++i) {
+        statsOut[i] = Stats.Counts[i];
+    }
+
+    return Siamese_Success;
+}
+
+SiameseResult Decoder::GetHistogram(
+    SiameseDecoderHistogram histogram,
+    uint64_t* bucketsOut,
+    unsigned bucketCount)
+{
+    SIAMESE_DEBUG_ASSERT((unsigned)histogram < SiameseDecoderHistogram_Count);
+    if (bucketCount > Histogram::kBucketCount) {
+        bucketCount = Histogram::kBucketCount;
+    }
+
+    const Histogram& source = Stats.Histograms[histogram];
+    for (unsigned i = 0; i < bucketCount; ++i) {
+        bucketsOut[i] = source.Buckets[i];
+    }
+
+    return Siamese_Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Decoder Snapshots
+
+/// Longest original, running sum or recovery packet, counting the length prefix
+static const unsigned kMaxSnapshotPacketBytes = SIAMESE_MAX_PACKET_BYTES + OriginalPacket::kMaxHeaderBytes;
+
+void DecoderPacketWindow::WriteSnapshot(SnapshotWriter& writer)
+{
+    writer.Write32(ColumnStart);
+    writer.Write32(Count);
+    writer.Write32(NextExpectedElement);
+
+    // Lost elements are written as 0 bytes.
+    // Data in application output buffers is copied into the snapshot
+    for (unsigned element = 0; element < Count; ++element)
+    {
+        const OriginalPacket* original = GetWindowElement(element);
+        if (original->Buffer.Bytes == 0)
+        {
+            writer.Write32(0);
+            continue;
+        }
+
+        const unsigned dataBytes = original->Buffer.Bytes - original->HeaderBytes;
+        writer.Write32(dataBytes);
+        writer.WriteBuffer(original->GetData(), dataBytes);
+    }
+
+    writer.Write32(SumColumnStart);
+    writer.Write32(SumColumnCount);
+    for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+    {
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+        {
+            const DecoderSum& sum = Lanes[laneIndex].Sums[sumIndex];
+            writer.Write32(sum.ElementStart);
+            writer.Write32(sum.ElementEnd);
+            writer.Write32(sum.Buffer.Bytes);
+            writer.WriteBuffer(sum.Buffer.Data, sum.Buffer.Bytes);
+        }
+    }
+
+    const unsigned recoveredColumnCount = RecoveredColumns.GetSize();
+    writer.Write32(recoveredColumnCount);
+    for (unsigned i = 0; i < recoveredColumnCount; ++i) {
+        writer.Write32(RecoveredColumns.GetRef(i));
+    }
+
+    // Packets recovered but not yet returned by Decode() are found in the
+    // window again by packet number
+    const unsigned recoveredPacketCount = HasRecoveredPackets ? RecoveredPackets.GetSize() : 0;
+    writer.Write32(recoveredPacketCount);
+    for (unsigned i = 0; i < recoveredPacketCount; ++i) {
+        writer.Write32(RecoveredPackets.GetRef(i).PacketNum);
+    }
+}
+
+SiameseResult DecoderPacketWindow::ReadSnapshot(SnapshotReader& reader)
+{
+    SIAMESE_DEBUG_ASSERT(Count == 0);
+
+    const unsigned columnStart  = reader.Read32();
+    const unsigned count        = reader.Read32();
+    const unsigned nextExpected = reader.Read32();
+
+    // Each element takes at least 4 bytes, so this stops a corrupted count
+    // from growing the window past the end of the snapshot
+    if (reader.Truncated ||
+        columnStart >= kColumnPeriod ||
+        count >= kColumnPeriod ||
+        count > reader.Stream.Remaining() / 4 ||
+        nextExpected > count)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    if (count > 0 && !GrowWindow(count)) {
+        return Siamese_Disabled;
+    }
+    ColumnStart         = columnStart;
+    NextExpectedElement = nextExpected;
+
+    for (unsigned element = 0; element < count; ++element)
+    {
+        const unsigned dataBytes = reader.Read32();
+        if (dataBytes == 0) {
+            continue;
+        }
+
+        const uint8_t* data = (dataBytes <= SIAMESE_MAX_PACKET_BYTES) ? reader.Read(dataBytes) : nullptr;
+        if (!data) {
+            return Siamese_InvalidInput;
+        }
+
+        SiameseOriginalPacket packet;
+        packet.PacketNum = ElementToColumn(element);
+        packet.Data      = data;
+        packet.DataBytes = dataBytes;
+        if (0 == GetWindowElement(element)->Initialize(TheAllocator, packet)) {
+            return Siamese_Disabled;
+        }
+
+        MarkGotElement(Subwindows.Get(element / kSubwindowSize), element);
+    }
+
+    // The next expected element is always a lost one
+    if (nextExpected < count && GetWindowElement(nextExpected)->Buffer.Bytes != 0) {
+        return Siamese_InvalidInput;
+    }
+
+    SumColumnStart = reader.Read32();
+    SumColumnCount = reader.Read32();
+    if (SumColumnStart >= kColumnPeriod || SumColumnCount > SIAMESE_MAX_PACKETS) {
+        return Siamese_InvalidInput;
+    }
+
+    for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+    {
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+        {
+            DecoderSum& sum = Lanes[laneIndex].Sums[sumIndex];
+            sum.ElementStart = reader.Read32();
+            sum.ElementEnd   = reader.Read32();
+
+            const unsigned sumBytes = reader.Read32();
+            const uint8_t* data     = (sumBytes <= kMaxSnapshotPacketBytes) ? reader.Read(sumBytes) : nullptr;
+            if (!data) {
+                return Siamese_InvalidInput;
+            }
+
+            sum.Buffer.Bytes = 0;
+            if (sumBytes > 0)
+            {
+                if (!sum.Buffer.Initialize(TheAllocator, sumBytes)) {
+                    return Siamese_Disabled;
+                }
+                memcpy(sum.Buffer.Data, data, sumBytes);
+            }
+        }
+    }
+
+    const unsigned recoveredColumnCount = reader.Read32();
+    if (recoveredColumnCount > reader.Stream.Remaining() / 4) {
+        return Siamese_InvalidInput;
+    }
+    RecoveredColumns.Clear();
+    for (unsigned i = 0; i < recoveredColumnCount; ++i)
+    {
+        if (!RecoveredColumns.Append(reader.Read32())) {
+            return Siamese_Disabled;
+        }
+    }
+
+    const unsigned recoveredPacketCount = reader.Read32();
+    if (recoveredPacketCount > reader.Stream.Remaining() / 4) {
+        return Siamese_InvalidInput;
+    }
+    RecoveredPackets.Clear();
+    for (unsigned i = 0; i < recoveredPacketCount; ++i)
+    {
+        const unsigned column  = reader.Read32();
+        const unsigned element = ColumnToElement(column);
+        if (InvalidElement(element)) {
+            return Siamese_InvalidInput;
+        }
+
+        const OriginalPacket* original = GetWindowElement(element);
+        if (original->Buffer.Bytes == 0) {
+            return Siamese_InvalidInput;
+        }
+
+        SiameseOriginalPacket packet;
+        packet.PacketNum = column;
+        packet.Data      = original->GetData();
+        packet.DataBytes = original->Buffer.Bytes - original->HeaderBytes;
+        if (!RecoveredPackets.Append(packet)) {
+            return Siamese_Disabled;
+        }
+    }
+    HasRecoveredPackets = (recoveredPacketCount > 0);
+
+    return reader.Truncated ? Siamese_InvalidInput : Siamese_Success;
+}
+
+/// Write a recovery packet for Decoder snapshots
+static void WriteRecoverySnapshot(SnapshotWriter& writer, const RecoveryPacket* recovery)
+{
+    writer.Write32(recovery->Metadata.Row);
+    writer.Write32(recovery->Metadata.ColumnStart);
+    writer.Write32(recovery->Metadata.SumCount);
+    writer.Write32(recovery->Metadata.LDPCCount);
+    writer.Write32(recovery->ElementStart);
+    writer.Write32(recovery->ElementEnd);
+    writer.Write32(recovery->LostCount);
+    writer.Write8(recovery->Eliminated ? 1 : 0);
+
+    const unsigned pendingCount = recovery->PendingColumns.GetSize();
+    writer.Write32(pendingCount);
+    for (unsigned i = 0; i < pendingCount; ++i) {
+        writer.Write32(recovery->PendingColumns.GetRef(i));
+    }
+
+    writer.Write32(recovery->Buffer.Bytes);
+    writer.WriteBuffer(recovery->Buffer.Data, recovery->Buffer.Bytes);
+}
+
+/// Read a recovery packet written by WriteRecoverySnapshot()
+static SiameseResult ReadRecoverySnapshot(
+    SnapshotReader& reader,
+    pktalloc::Allocator* allocator,
+    RecoveryPacket* recovery,
+    unsigned windowCount)
+{
+    recovery->Metadata.Row         = reader.Read32();
+    recovery->Metadata.ColumnStart = reader.Read32();
+    recovery->Metadata.SumCount    = reader.Read32();
+    recovery->Metadata.LDPCCount   = reader.Read32();
+    recovery->ElementStart         = reader.Read32();
+    recovery->ElementEnd           = reader.Read32();
+    recovery->LostCount            = reader.Read32();
+    recovery->Eliminated           = (reader.Read8() != 0);
+
+    if (reader.Truncated ||
+        recovery->Metadata.Row > SIAMESE_RECOVERY_NUM_MAX ||
+        recovery->Metadata.ColumnStart >= kColumnPeriod ||
+        recovery->Metadata.SumCount > SIAMESE_MAX_PACKETS ||
+        recovery->Metadata.LDPCCount > recovery->Metadata.SumCount ||
+        recovery->ElementStart > recovery->ElementEnd ||
+        recovery->ElementEnd > windowCount)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    const unsigned pendingCount = reader.Read32();
+    if (pendingCount > reader.Stream.Remaining() / 4) {
+        return Siamese_InvalidInput;
+    }
+    if (pendingCount > 0)
+    {
+        if (!recovery->PendingColumns.SetSize_Copy(pendingCount)) {
+            return Siamese_Disabled;
+        }
+        for (unsigned i = 0; i < pendingCount; ++i) {
+            recovery->PendingColumns.GetRef(i) = reader.Read32();
+        }
+    }
 
-            gf256_muladd_mem(recovery_j.Data, y, srcData, srcBytes);
+    const unsigned bufferBytes = reader.Read32();
+    const uint8_t* data        = (bufferBytes <= kMaxSnapshotPacketBytes) ? reader.Read(bufferBytes) : nullptr;
+    if (!data) {
+        return Siamese_InvalidInput;
+    }
+    if (bufferBytes > 0)
+    {
+        if (!recovery->Buffer.Initialize(allocator, bufferBytes)) {
+            return Siamese_Disabled;
         }
+        memcpy(recovery->Buffer.Data, data, bufferBytes);
     }
 
-    return true;
+    return Siamese_Success;
 }
 
-SiameseResult Decoder::BackSubstitution()
+void Decoder::WriteSnapshot(SnapshotWriter& writer, uint32_t totalBytes)
 {
-    // Note: This step tends to be fast because the upper-right of the matrix
-    // while streaming is mostly zero
+    WriteSnapshotHeader(writer, kDecoderSnapshotMagic, totalBytes);
 
-    const unsigned columns = CheckedRegion.LostCount;
-    Window.RecoveredPackets.SetSize_NoCopy(columns);
-
-    bool iterateNextExpected = false;
+    writer.Write32(LatestColumn);
+    writer.Write64(MemoryBudget);
+    writer.Write32(Window.LazySumElements);
 
-    // For each column starting with the right-most column:
-    for (int col_i = columns - 1; col_i >= 0; --col_i)
-    {
-        const unsigned matrixRowIndex = RecoveryMatrix.Pivots.GetRef(col_i);
-        OriginalPacket* original = RecoveryMatrix.Columns.GetRef(col_i).Original;
-        RecoveryPacket* recovery = RecoveryMatrix.Rows.GetRef(matrixRowIndex).Recovery;
-        SIAMESE_DEBUG_ASSERT(original->Column == (unsigned)col_i && original->Buffer.Bytes == 0);
+    // Histograms are not written because they only describe this process
+    writer.Write32(SiameseDecoderStats_Count);
+    for (unsigned i = 0; i < SiameseDecoderStats_Count; ++i) {
+        writer.Write64(Stats.Counts[i]);
+    }
 
-        uint8_t* buffer = recovery->Buffer.Data;
-        const uint8_t y = RecoveryMatrix.Matrix.Get(matrixRowIndex, col_i);
+    Window.WriteSnapshot(writer);
 
-        SIAMESE_DEBUG_ASSERT(buffer && recovery->Buffer.Bytes > 0);
-        SIAMESE_DEBUG_ASSERT(y != 0);
-        const uint8_t inv_y = gf256_inv(y);
+    // Recovery packets in list order, so inserting them again at the tail
+    // rebuilds the same list
+    writer.Write32(RecoveryPackets.RecoveryPacketCount);
+    for (const RecoveryPacket* recovery = RecoveryPackets.Head; recovery; recovery = recovery->Next) {
+        WriteRecoverySnapshot(writer, recovery);
+    }
 
-        // Reveal the first chunk of bytes of data
-        unsigned bufferBytes = recovery->Buffer.Bytes;
-        unsigned lengthCheckBytes = pktalloc::kAlignmentBytes;
-        if (lengthCheckBytes > bufferBytes) {
-            lengthCheckBytes = bufferBytes;
-        }
-        gf256_mul_mem(buffer, buffer, inv_y, lengthCheckBytes);
+    const RecoveryMetadata& metadata = RecoveryPackets.LastRecoveryMetadata;
+    writer.Write32(metadata.Row);
+    writer.Write32(metadata.ColumnStart);
+    writer.Write32(metadata.SumCount);
+    writer.Write32(metadata.LDPCCount);
+    writer.Write32(RecoveryPackets.LastRecoveryBytes);
+}
 
-        // Check the embedded length field
-        unsigned length;
-        int headerBytes = DeserializeHeader_PacketLength(buffer, lengthCheckBytes, length);
-        if (headerBytes < 0 || length == 0 || headerBytes + length > bufferBytes)
-        {
-            //------------------------------------------------------------------
-            // This error means that the Siamese FEC recovery has failed.
-            // Common causes:
-            // + Packet Numbers provided by application are incorrect.
-            // + Or some software bug in this library I need to fix.
-            //------------------------------------------------------------------
-            Window.EmergencyDisabled = true;
-            Logger.Error("BackSubstitution corrupted recovered data len");
-            SIAMESE_DEBUG_BREAK(); // Should never happen
-            return Siamese_Disabled;
-        }
+SiameseResult Decoder::ReadSnapshot(SnapshotReader& reader)
+{
+    const unsigned latestColumn = reader.Read32();
+    const uint64_t memoryBudget    = reader.Read64();
+    const unsigned lazySumElements = reader.Read32();
+    const unsigned statsCount      = reader.Read32();
+
+    if (reader.Truncated ||
+        latestColumn >= kColumnPeriod ||
+        lazySumElements > SIAMESE_MAX_PACKETS ||
+        statsCount != SiameseDecoderStats_Count)
+    {
+        return Siamese_InvalidInput;
+    }
 
-        // Reduce buffer bytes to only cover the original packet data
-        bufferBytes = headerBytes + length;
-        if (bufferBytes > lengthCheckBytes) {
-            gf256_mul_mem(
-                buffer + lengthCheckBytes,
-                buffer + lengthCheckBytes,
-                inv_y,
-                bufferBytes - lengthCheckBytes);
-        }
+    LatestColumn = latestColumn;
+    MemoryBudget = memoryBudget;
+    Window.LazySumElements = lazySumElements;
+    for (unsigned i = 0; i < SiameseDecoderStats_Count; ++i) {
+        Stats.Counts[i] = reader.Read64();
+    }
 
-        // Swap original and recovery buffers
-        uint8_t* oldOriginalData = original->Buffer.Data;
-        original->Buffer.Data    = buffer;
-        original->Buffer.Bytes   = bufferBytes;
-        original->Column         = RecoveryMatrix.Columns.GetRef(col_i).Column;
-        original->HeaderBytes    = (unsigned)headerBytes;
-        recovery->Buffer.Data    = oldOriginalData;
-        recovery->Buffer.Bytes   = 0;
+    SiameseResult result = Window.ReadSnapshot(reader);
+    if (result != Siamese_Success) {
+        return result;
+    }
 
-        // Write recovered packet data
-        SiameseOriginalPacket* recoveredPtr = Window.RecoveredPackets.GetPtr(col_i);
-        recoveredPtr->Data      = buffer + headerBytes;
-        recoveredPtr->DataBytes = length;
-        recoveredPtr->PacketNum = original->Column;
+    const unsigned recoveryCount = reader.Read32();
+    if (recoveryCount > reader.Stream.Remaining()) {
+        return Siamese_InvalidInput;
+    }
 
-        if (!Window.RecoveredColumns.Append(original->Column))
-        {
-            Window.EmergencyDisabled = true;
-            SIAMESE_DEBUG_BREAK(); // OOM
+    for (unsigned i = 0; i < recoveryCount; ++i)
+    {
+        RecoveryPacket* recovery = TheAllocator.Construct<RecoveryPacket>();
+        if (!recovery) {
             return Siamese_Disabled;
         }
 
-        Logger.Trace("GE Decoded: Column=", original->Column, " Row=", recovery->Metadata.Row);
-
-        iterateNextExpected |= Window.MarkGotColumn(original->Column);
-
-        // Eliminate from all other pivot rows above it:
-        for (unsigned col_j = 0; col_j < (unsigned)col_i; ++col_j)
+        result = ReadRecoverySnapshot(reader, &TheAllocator, recovery, Window.Count);
+        if (result == Siamese_Success && !RecoveryPackets.Insert(recovery, true)) {
+            result = Siamese_Disabled;
+        }
+        if (result != Siamese_Success)
         {
-            unsigned pivot_j = RecoveryMatrix.Pivots.GetRef(col_j);
-            const uint8_t x  = RecoveryMatrix.Matrix.Get(pivot_j, col_i);
+            recovery->Buffer.Free(&TheAllocator);
+            TheAllocator.Destruct(recovery);
+            return result;
+        }
+    }
 
-            if (x == 0) {
-                continue;
-            }
+    RecoveryMetadata& metadata = RecoveryPackets.LastRecoveryMetadata;
+    metadata.Row                      = reader.Read32();
+    metadata.ColumnStart              = reader.Read32();
+    metadata.SumCount                 = reader.Read32();
+    metadata.LDPCCount                = reader.Read32();
+    RecoveryPackets.LastRecoveryBytes = reader.Read32();
 
-            const GrowingAlignedDataBuffer& buffer_j = RecoveryMatrix.Rows.GetRef(pivot_j).Recovery->Buffer;
-            SIAMESE_DEBUG_ASSERT(buffer_j.Data && buffer_j.Bytes > 0);
+    if (!reader.IsComplete()) {
+        return Siamese_InvalidInput;
+    }
 
-            unsigned addBytes = bufferBytes;
-            if (addBytes > buffer_j.Bytes) {
-                SIAMESE_DEBUG_BREAK(); // This should never happen
-                addBytes = buffer_j.Bytes;
-            }
+    // The checked region and recovery matrix are rebuilt by the next Decode()
+    CheckedRegion.Reset();
 
-            gf256_muladd_mem(buffer_j.Data, x, buffer, addBytes);
-        }
-    }
+    return EnforceMemoryBudget();
+}
 
-    // We always expect to have recovered the next expected packet
-    if (!iterateNextExpected)
-    {
-        Window.EmergencyDisabled = true;
-        Logger.Error("BackSubstitution.iterateNextExpected failed");
-        SIAMESE_DEBUG_BREAK(); // Should never happen
+SiameseResult Decoder::Snapshot(uint8_t* buffer, unsigned bufferBytes, unsigned& usedBytesOut)
+{
+    usedBytesOut = 0;
+    if (Window.EmergencyDisabled) {
         return Siamese_Disabled;
     }
 
-    // Iterate the next expected element beyond the recovery region
-    Window.IterateNextExpectedElement(CheckedRegion.NextCheckStart);
-
-    Logger.Debug("BackSubstitution: Deleting recovery packets before element ", Window.NextExpectedElement, " column = ", (Window.NextExpectedElement + Window.ColumnStart));
-
-    RecoveryPackets.DeletePacketsBefore(Window.NextExpectedElement);
+    // Measure the snapshot by writing it without a buffer
+    SnapshotWriter measure;
+    WriteSnapshot(measure, 0);
+    if (measure.Bytes > 0xffffffff) {
+        return Siamese_InvalidInput;
+    }
+    const unsigned totalBytes = static_cast<unsigned>(measure.Bytes);
 
-    if (CheckedRegion.NextCheckStart >= kDecoderRemoveThreshold) {
-        Window.RemoveElements();
+    usedBytesOut = totalBytes;
+    if (!buffer || bufferBytes < totalBytes) {
+        return Siamese_NeedMoreData;
     }
 
-    Stats.Counts[SiameseDecoderStats_SolveSuccessCount]++;
+    SnapshotWriter writer;
+    writer.Stream = WriteByteStream(buffer, totalBytes);
+    WriteSnapshot(writer, totalBytes);
+    SIAMESE_DEBUG_ASSERT(writer.Bytes == totalBytes && writer.Stream.WrittenBytes == totalBytes);
 
     return Siamese_Success;
 }
 
-SiameseResult Decoder::GetStatistics(uint64_t* statsOut, unsigned statsCount)
+SiameseResult Decoder::Restore(const uint8_t* data, unsigned bytes)
 {
-    if (statsCount > SiameseDecoderStats_Count) {
-        statsCount = SiameseDecoderStats_Count;
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
     }
 
-    // Fill in memory allocated
-    Stats.Counts[SiameseDecoderStats_MemoryUsed] = TheAllocator.GetMemoryAllocatedBytes();
+    // Only a new decoder can be restored
+    if (Window.Count != 0 || !RecoveryPackets.IsEmpty()) {
+        return Siamese_InvalidInput;
+    }
 
-    for (unsigned i = 0; i < statsCount; ++i) {
-        statsOut[i] = Stats.Counts[i];
+    SnapshotReader reader(data, bytes);
+    if (!ReadSnapshotHeader(reader, kDecoderSnapshotMagic, bytes)) {
+        return Siamese_InvalidInput;
     }
 
-    return Siamese_Success;
+    const SiameseResult result = ReadSnapshot(reader);
+    if (result != Siamese_Success)
+    {
+        // The decoder may be partly restored, so it cannot be used
+        Window.EmergencyDisabled = true;
+        if (result == Siamese_Disabled) {
+            Logger.Error("Restore OOM");
+        }
+        else {
+            Logger.Error("Restore found invalid snapshot data");
+        }
+    }
+    return result;
 }
 
 
 //------------------------------------------------------------------------------
 // DecoderPacketWindow
 
+DecoderPacketWindow::~DecoderPacketWindow()
+{
+    for (unsigned element = 0; element < Count; ++element) {
+        GetWindowElement(element)->ReleaseExternal();
+    }
+}
+
 bool DecoderPacketWindow::MarkGotColumn(unsigned column)
 {
     // Convert to window element
@@ -1269,9 +2796,7 @@ bool DecoderPacketWindow::MarkGotColumn(unsigned column)
         return false;
     }
 
-    DecoderSubwindow* subwindow = Subwindows.GetRef(element / kSubwindowSize);
-    subwindow->GotCount++;
-    subwindow->Got.Set(element % kSubwindowSize);
+    MarkGotElement(Subwindows.Get(element / kSubwindowSize), element);
 
     return (element == NextExpectedElement);
 }
@@ -1281,139 +2806,62 @@ unsigned DecoderPacketWindow::RangeLostPackets(unsigned elementStart, unsigned e
     if (elementStart >= elementEnd) {
         return 0;
     }
-
-    unsigned lostCount = 0;
-
-    // Accumulate first partial subwindow (if any)
-    unsigned subwindowStart = elementStart / kSubwindowSize;
-    SIAMESE_DEBUG_ASSERT(subwindowStart < Subwindows.GetSize());
-    const unsigned bitStart = elementStart % kSubwindowSize;
-    if (bitStart > 0)
-    {
-        unsigned bitEnd = bitStart + elementEnd - elementStart;
-        if (bitEnd > kSubwindowSize) {
-            bitEnd = kSubwindowSize;
-        }
-        const unsigned bitMaxSet = bitEnd - bitStart; // Bit count in range
-        lostCount += bitMaxSet - Subwindows.GetRef(subwindowStart)->Got.RangePopcount(bitStart, bitEnd);
-        ++subwindowStart;
+    SIAMESE_DEBUG_ASSERT(elementEnd <= Subwindows.GetSize() * kSubwindowSize);
+
+    // Count up to the end of the ring, and then the rest from the first slot
+    const uint64_t* bitmap   = GotBitmap.GetPtr(0);
+    const unsigned ringBits  = Subwindows.GetCapacity() * kSubwindowSize;
+    const unsigned bitStart  = GetGotBit(elementStart);
+    const unsigned count     = elementEnd - elementStart;
+    const unsigned firstBits = (ringBits - bitStart < count) ? ringBits - bitStart : count;
+
+    unsigned gotCount = pktalloc::BitmapRangePopcount(bitmap, bitStart, bitStart + firstBits);
+    if (firstBits < count) {
+        gotCount += pktalloc::BitmapRangePopcount(bitmap, 0, count - firstBits);
     }
+    return count - gotCount;
+}
 
-    // Accumulate whole subwindows of losses
-    const unsigned subwindowEnd = elementEnd / kSubwindowSize;
-    SIAMESE_DEBUG_ASSERT(subwindowEnd <= Subwindows.GetSize());
-    for (unsigned i = subwindowStart; i < subwindowEnd; ++i) {
-        lostCount += kSubwindowSize - Subwindows.GetRef(i)->GotCount;
+unsigned DecoderPacketWindow::ScanGotBitmap(unsigned elementStart, unsigned elementEnd, bool findGot) const
+{
+    if (elementStart >= elementEnd) {
+        return elementEnd;
     }
-
-    // Accumulate last partial subwindow (if any, common case)
-    if (subwindowEnd >= subwindowStart)
-    {
-        const unsigned lastSubwindowBits = elementEnd - subwindowEnd * kSubwindowSize;
-
-        if (lastSubwindowBits > 0)
-        {
-            const unsigned gotCount = Subwindows.GetRef(subwindowEnd)->Got.RangePopcount(0, lastSubwindowBits);
-
-            lostCount += lastSubwindowBits - gotCount;
-        }
+    SIAMESE_DEBUG_ASSERT(elementEnd <= Subwindows.GetSize() * kSubwindowSize);
+
+    // Scan up to the end of the ring, and then the rest from the first slot
+    const uint64_t* bitmap   = GotBitmap.GetPtr(0);
+    const unsigned ringBits  = Subwindows.GetCapacity() * kSubwindowSize;
+    const unsigned bitStart  = GetGotBit(elementStart);
+    const unsigned count     = elementEnd - elementStart;
+    const unsigned firstBits = (ringBits - bitStart < count) ? ringBits - bitStart : count;
+    const unsigned bitEnd    = bitStart + firstBits;
+
+    unsigned found = findGot ?
+        pktalloc::BitmapFindFirstSet(bitmap, bitStart, bitEnd) :
+        pktalloc::BitmapFindFirstClear(bitmap, bitStart, bitEnd);
+    if (found < bitEnd) {
+        return elementStart + (found - bitStart);
+    }
+    if (firstBits >= count) {
+        return elementEnd;
     }
 
-    return lostCount;
+    const unsigned restBits = count - firstBits;
+    found = findGot ?
+        pktalloc::BitmapFindFirstSet(bitmap, 0, restBits) :
+        pktalloc::BitmapFindFirstClear(bitmap, 0, restBits);
+    return elementStart + firstBits + found;
 }
 
 unsigned DecoderPacketWindow::FindNextLostElement(unsigned elementStart)
 {
-    if (elementStart >= Count) {
-        return Count;
-    }
-
-    const unsigned subwindowEnd = (Count + kSubwindowSize - 1) / kSubwindowSize;
-    unsigned subwindowIndex = elementStart / kSubwindowSize;
-    unsigned bitIndex = elementStart % kSubwindowSize;
-    SIAMESE_DEBUG_ASSERT(subwindowEnd <= Subwindows.GetSize());
-    SIAMESE_DEBUG_ASSERT(subwindowIndex < Subwindows.GetSize());
-
-    while (subwindowIndex < subwindowEnd)
-    {
-        // If there may be any lost packets in this subwindow:
-        if (Subwindows.GetRef(subwindowIndex)->GotCount < kSubwindowSize)
-        {
-            for (;;)
-            {
-                // Seek next clear bit
-                bitIndex = Subwindows.GetRef(subwindowIndex)->Got.FindFirstClear(bitIndex);
-
-                // If there were none, skip this subwindow
-                if (bitIndex >= kSubwindowSize) {
-                    break;
-                }
-
-                // Calculate element index and stop if we hit the end of the valid data
-                unsigned nextElement = subwindowIndex * kSubwindowSize + bitIndex;
-                if (nextElement > Count) {
-                    nextElement = Count;
-                }
-
-                return nextElement;
-            }
-        }
-
-        // Reset bit index to the front of the next subwindow
-        bitIndex = 0;
-
-        // Check next subwindow
-        ++subwindowIndex;
-    }
-
-    return Count;
+    return ScanGotBitmap(elementStart, Count, false);
 }
 
 unsigned DecoderPacketWindow::FindNextGotElement(unsigned elementStart)
 {
-    if (elementStart >= Count) {
-        return Count;
-    }
-
-    const unsigned subwindowEnd = (Count + kSubwindowSize - 1) / kSubwindowSize;
-    unsigned subwindowIndex = elementStart / kSubwindowSize;
-    unsigned bitIndex = elementStart % kSubwindowSize;
-    SIAMESE_DEBUG_ASSERT(subwindowEnd <= Subwindows.GetSize());
-    SIAMESE_DEBUG_ASSERT(subwindowIndex < Subwindows.GetSize());
-
-    while (subwindowIndex < subwindowEnd)
-    {
-        // If there may be any got packets in this subwindow:
-        if (Subwindows.GetRef(subwindowIndex)->GotCount > 0)
-        {
-            for (;;)
-            {
-                // Seek next set bit
-                bitIndex = Subwindows.GetRef(subwindowIndex)->Got.FindFirstSet(bitIndex);
-
-                // If there were none, skip this subwindow
-                if (bitIndex >= kSubwindowSize) {
-                    break;
-                }
-
-                // Calculate element index and stop if we hit the end of the valid data
-                unsigned nextElement = subwindowIndex * kSubwindowSize + bitIndex;
-                if (nextElement > Count) {
-                    nextElement = Count;
-                }
-
-                return nextElement;
-            }
-        }
-
-        // Reset bit index to the front of the next subwindow
-        bitIndex = 0;
-
-        // Check next subwindow
-        ++subwindowIndex;
-    }
-
-    return Count;
+    return ScanGotBitmap(elementStart, Count, true);
 }
 
 void DecoderPacketWindow::IterateNextExpectedElement(unsigned elementStart)
@@ -1442,10 +2890,26 @@ bool DecoderPacketWindow::GrowWindow(const unsigned windowElementEnd)
 
     if (subwindowsNeeded > subwindowCount)
     {
-        // Note resizing larger will keep old data in the vector
-        if (!Subwindows.SetSize_Copy(subwindowsNeeded))
+        const unsigned oldCapacity = Subwindows.GetCapacity();
+        const unsigned oldHead     = Subwindows.Head;
+        if (!Subwindows.Reserve(subwindowsNeeded))
             return false;
 
+        // If the ring grew, move the bitmap words the same way as its slots
+        const unsigned newCapacity = Subwindows.GetCapacity();
+        if (newCapacity > oldCapacity)
+        {
+            if (!GotBitmap.SetSize_Copy(newCapacity * kGotWordsPerSubwindow))
+                return false;
+
+            uint64_t* words = GotBitmap.GetPtr(0);
+            const unsigned headWords = oldHead * kGotWordsPerSubwindow;
+            const unsigned tailWords = (oldCapacity + oldHead) * kGotWordsPerSubwindow;
+            memcpy(words + oldCapacity * kGotWordsPerSubwindow, words, headWords * sizeof(uint64_t));
+            memset(words, 0, headWords * sizeof(uint64_t));
+            memset(words + tailWords, 0, (newCapacity * kGotWordsPerSubwindow - tailWords) * sizeof(uint64_t));
+        }
+
         // For each subwindow to initialize:
         for (unsigned i = subwindowCount; i < subwindowsNeeded; ++i)
         {
@@ -1453,7 +2917,7 @@ bool DecoderPacketWindow::GrowWindow(const unsigned windowElementEnd)
             if (!subwindow)
                 return false; // Out of memory
 
-            Subwindows.GetRef(i) = subwindow;
+            Subwindows.Append(subwindow); // Cannot fail after Reserve()
         }
     }
 
@@ -1464,6 +2928,50 @@ bool DecoderPacketWindow::GrowWindow(const unsigned windowElementEnd)
     return true;
 }
 
+SiameseResult DecoderPacketWindow::StoreOriginal(
+    OriginalPacket* original,
+    const SiameseOriginalPacket& packet,
+    unsigned element)
+{
+    // Make space for the packet data
+    if (0 == original->Initialize(TheAllocator, packet))
+    {
+        EmergencyDisabled = true;
+        Logger.Error("AddOriginal.Initialize OOM");
+        return Siamese_Disabled;
+    }
+    SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes > 1);
+
+    // If the running sums have already been accumulated past this element
+    // for a failed solve, then it is a hole that must be plugged later:
+    const DecoderColumnLane& lane = Lanes[packet.PacketNum % kColumnLaneCount];
+    for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+    {
+        if (element < lane.Sums[sumIndex].ElementEnd)
+        {
+            if (!RecoveredColumns.Append(packet.PacketNum))
+            {
+                EmergencyDisabled = true;
+                Logger.Error("AddOriginal.RecoveredColumns OOM");
+                return Siamese_Disabled;
+            }
+            break;
+        }
+    }
+
+    // If the added element is somewhere inside the previously checked region:
+    if (element >= CheckedRegion->ElementStart &&
+        element < CheckedRegion->NextCheckStart)
+    {
+        CheckedRegion->Reset();
+    }
+
+    Stats->Counts[SiameseDecoderStats_OriginalCount]++;
+    Stats->Counts[SiameseDecoderStats_OriginalBytes] += packet.DataBytes;
+
+    return Siamese_Success;
+}
+
 SiameseResult DecoderPacketWindow::AddOriginal(const SiameseOriginalPacket& packet)
 {
     if (EmergencyDisabled)
@@ -1488,7 +2996,7 @@ SiameseResult DecoderPacketWindow::AddOriginal(const SiameseOriginalPacket& pack
     }
 
     // Grab the window element for this packet
-    DecoderSubwindow* subwindowPtr  = Subwindows.GetRef(element / kSubwindowSize);
+    DecoderSubwindow* subwindowPtr  = Subwindows.Get(element / kSubwindowSize);
     const unsigned subwindowElement = element % kSubwindowSize;
 
     OriginalPacket* original = &subwindowPtr->Originals[subwindowElement];
@@ -1499,38 +3007,166 @@ SiameseResult DecoderPacketWindow::AddOriginal(const SiameseOriginalPacket& pack
         return Siamese_DuplicateData;
     }
 
-    // Make space for the packet data
-    if (0 == original->Initialize(TheAllocator, packet))
+    const SiameseResult result = StoreOriginal(original, packet, element);
+    if (result != Siamese_Success) {
+        return result;
+    }
+
+    // Increment the number of packets filled in for this subwindow
+    MarkGotElement(subwindowPtr, element);
+
+    // If this was the next expected element:
+    if (element == NextExpectedElement)
+    {
+        IterateNextExpectedElement(element + 1);
+
+        Logger.Debug("AddOriginal: Deleting recovery packets before element ", NextExpectedElement, " column = ", (NextExpectedElement + ColumnStart));
+
+        RecoveryPackets->DeletePacketsBefore(NextExpectedElement);
+    }
+
+    return Siamese_Success;
+}
+
+SiameseResult DecoderPacketWindow::AddOriginalBatch(
+    const SiameseOriginalPacket* packets,
+    unsigned count)
+{
+    if (EmergencyDisabled)
+        return Siamese_Disabled;
+
+    SIAMESE_DEBUG_ASSERT(count > 0 && count <= SIAMESE_MAX_ORIGINAL_BATCH);
+
+    // Sort keys hold the window element in the high bits and the batch
+    // index in the low bits, so the first copy of a duplicate sorts first
+    uint64_t keys[SIAMESE_MAX_ORIGINAL_BATCH];
+    unsigned keyCount = 0;
+    unsigned elementEnd = 0;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        SIAMESE_DEBUG_ASSERT(packets[i].Data && packets[i].DataBytes > 0);
+        const unsigned element = ColumnToElement(packets[i].PacketNum);
+
+        // If we just received an old element before our window:
+        if (IsColumnDeltaNegative(element))
+        {
+            Stats->Counts[SiameseDecoderStats_DupedOriginalCount]++;
+            continue;
+        }
+
+        const uint64_t key = ((uint64_t)element << 32) | i;
+
+        // Insertion sort: Packets from the network are nearly in order
+        unsigned j = keyCount++;
+        while (j > 0 && keys[j - 1] > key)
+        {
+            keys[j] = keys[j - 1];
+            --j;
+        }
+        keys[j] = key;
+
+        if (elementEnd <= element) {
+            elementEnd = element + 1;
+        }
+    }
+
+    if (keyCount <= 0) {
+        return Siamese_DuplicateData;
+    }
+
+    if (!GrowWindow(elementEnd))
     {
         EmergencyDisabled = true;
-        Logger.Error("AddOriginal.Initialize OOM");
+        Logger.Error("AddOriginalBatch.GrowWindow OOM");
         return Siamese_Disabled;
     }
-    SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes > 1);
 
-    // Increment the number of packets filled in for this subwindow
-    subwindowPtr->GotCount++;
-    subwindowPtr->Got.Set(subwindowElement);
+    // Got bits are collected for one bitfield word at a time
+    typedef pktalloc::CustomBitSet<kSubwindowSize> GotBitSet;
+    static_assert(kSubwindowSize % GotBitSet::kWordBits == 0, "Update this");
 
-    // If this was the next expected element:
-    if (element == NextExpectedElement)
+    static_assert(GotBitSet::kWordBits == 64, "Update this");
+
+    DecoderSubwindow* gotSubwindow = nullptr;
+    unsigned gotWord = 0, gotBitmapWord = 0;
+    GotBitSet::WordT gotMask = 0;
+
+    unsigned addedCount = 0;
+    unsigned lastElement = 0;
+
+    for (unsigned k = 0; k < keyCount; ++k)
     {
-        IterateNextExpectedElement(element + 1);
+        const unsigned element = (unsigned)(keys[k] >> 32);
+        const SiameseOriginalPacket& packet = packets[(uint32_t)keys[k]];
 
-        Logger.Debug("AddOriginal: Deleting recovery packets before element ", NextExpectedElement, " column = ", (NextExpectedElement + ColumnStart));
+        // Start loading the next element and its data while this one is copied
+        if (k + 1 < keyCount)
+        {
+            const unsigned nextElement = (unsigned)(keys[k + 1] >> 32);
+            SIAMESE_PREFETCH(GetWindowElement(nextElement));
+            SIAMESE_PREFETCH(packets[(uint32_t)keys[k + 1]].Data);
+        }
 
-        RecoveryPackets->DeletePacketsBefore(NextExpectedElement);
+        DecoderSubwindow* subwindowPtr  = Subwindows.Get(element / kSubwindowSize);
+        const unsigned subwindowElement = element % kSubwindowSize;
+        OriginalPacket* original = &subwindowPtr->Originals[subwindowElement];
+
+        // If this is a repeat within the batch or was already received:
+        if ((addedCount > 0 && element == lastElement) ||
+            original->Buffer.Bytes > 0)
+        {
+            Stats->Counts[SiameseDecoderStats_DupedOriginalCount]++;
+            continue;
+        }
+
+        const SiameseResult result = StoreOriginal(original, packet, element);
+        if (result != Siamese_Success) {
+            return result;
+        }
+
+        // Flush the Got bits collected for the previous word when moving on
+        const unsigned word = subwindowElement / GotBitSet::kWordBits;
+        if (subwindowPtr != gotSubwindow || word != gotWord)
+        {
+            if (gotSubwindow)
+            {
+                gotSubwindow->Got.Words[gotWord] |= gotMask;
+                gotSubwindow->GotCount += pktalloc::PopCount64(gotMask);
+                GotBitmap.GetRef(gotBitmapWord) |= gotMask;
+            }
+            gotSubwindow  = subwindowPtr;
+            gotWord       = word;
+            gotBitmapWord = GetGotBit(element) / 64;
+            gotMask       = 0;
+        }
+        gotMask |= (GotBitSet::WordT)1 << (subwindowElement % GotBitSet::kWordBits);
+
+        ++addedCount;
+        lastElement = element;
     }
 
-    // If the added element is somewhere inside the previously checked region:
-    if (element >= CheckedRegion->ElementStart &&
-        element < CheckedRegion->NextCheckStart)
+    if (gotSubwindow)
     {
-        CheckedRegion->Reset();
+        gotSubwindow->Got.Words[gotWord] |= gotMask;
+        gotSubwindow->GotCount += pktalloc::PopCount64(gotMask);
+        GotBitmap.GetRef(gotBitmapWord) |= gotMask;
     }
 
-    Stats->Counts[SiameseDecoderStats_OriginalCount]++;
-    Stats->Counts[SiameseDecoderStats_OriginalBytes] += packet.DataBytes;
+    if (addedCount <= 0) {
+        return Siamese_DuplicateData;
+    }
+
+    // If the next expected element arrived in this batch:
+    if (NextExpectedElement < Count &&
+        Subwindows.Get(NextExpectedElement / kSubwindowSize)->Got.Check(NextExpectedElement % kSubwindowSize))
+    {
+        IterateNextExpectedElement(NextExpectedElement + 1);
+
+        Logger.Debug("AddOriginalBatch: Deleting recovery packets before element ", NextExpectedElement, " column = ", (NextExpectedElement + ColumnStart));
+
+        RecoveryPackets->DeletePacketsBefore(NextExpectedElement);
+    }
 
     return Siamese_Success;
 }
@@ -1579,7 +3215,7 @@ bool DecoderPacketWindow::PlugSumHoles(unsigned elementStart)
 
                 // Sum += PacketData
                 if (sumIndex == 0)
-                    gf256_add_mem(sum.Buffer.Data, original->Buffer.Data, originalBytes);
+                    original->MulAddTo(sum.Buffer.Data, 1);
                 else
                 {
                     uint8_t CX = GetColumnValue(column);
@@ -1587,7 +3223,7 @@ bool DecoderPacketWindow::PlugSumHoles(unsigned elementStart)
                         CX = gf256_sqr(CX);
 
                     // Sum += CX * PacketData
-                    gf256_muladd_mem(sum.Buffer.Data, CX, original->Buffer.Data, originalBytes);
+                    original->MulAddTo(sum.Buffer.Data, CX);
                 }
 
                 Logger.Debug("Filled hole in sum for ", laneIndex, " sum ", sumIndex, " at column ", element + ColumnStart);
@@ -1605,6 +3241,8 @@ void DecoderPacketWindow::ResetSums(unsigned elementStart)
 {
     Logger.Info("ResetSums at ", elementStart);
 
+    Stats->Counts[SiameseDecoderStats_SumResetCount]++;
+
     // For each lane:
     for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
     {
@@ -1690,45 +3328,61 @@ const GrowingAlignedDataBuffer* DecoderPacketWindow::GetSum(unsigned laneIndex,
         return &sum.Buffer;
     }
 
-    // For each element to accumulate in this lane:
-    do
     {
-        SIAMESE_DEBUG_ASSERT((element + ColumnStart) % kColumnLaneCount == laneIndex);
-        OriginalPacket* original     = GetWindowElement(element);
-        const unsigned originalBytes = original->Buffer.Bytes;
+        // Grow sum to encompass the original data.
+        // This is done up front so the sum does not move while accumulating
+        unsigned sumBytes = sum.Buffer.Bytes;
+        for (unsigned i = element; i < elementEnd; i += kColumnLaneCount)
+        {
+            const unsigned originalBytes = GetWindowElement(i)->Buffer.Bytes;
+            if (sumBytes < originalBytes)
+                sumBytes = originalBytes;
+        }
+        if (sumBytes > sum.Buffer.Bytes &&
+            !sum.Buffer.GrowZeroPadded(TheAllocator, sumBytes))
+        {
+            EmergencyDisabled = true;
+            goto ExitSum;
+        }
+    }
 
-        Logger.Info("Lane ", laneIndex,  " sum ",  sumIndex,  " accumulating column: ",  element + ColumnStart,  ". Got = ",  (originalBytes > 0));
+    {
+        MultiplyAccumulator accumulator;
+        accumulator.Start(sum.Buffer.Data);
 
-        if (originalBytes > 0)
+        // For each element to accumulate in this lane:
+        do
         {
-            SIAMESE_DEBUG_ASSERT(original->Column % kColumnLaneCount == laneIndex);
-            if (originalBytes > sum.Buffer.Bytes)
+            SIAMESE_DEBUG_ASSERT((element + ColumnStart) % kColumnLaneCount == laneIndex);
+            OriginalPacket* original     = GetWindowElement(element);
+            const unsigned originalBytes = original->Buffer.Bytes;
+
+            Logger.Info("Lane ", laneIndex,  " sum ",  sumIndex,  " accumulating column: ",  element + ColumnStart,  ". Got = ",  (originalBytes > 0));
+
+            if (originalBytes > 0)
             {
-                // Grow sum to encompass the original data
-                if (!sum.Buffer.GrowZeroPadded(TheAllocator, originalBytes))
+                SIAMESE_DEBUG_ASSERT(original->Column % kColumnLaneCount == laneIndex);
+
+                // Sum += PacketData
+                uint8_t CX = 1;
+                if (sumIndex != 0)
                 {
-                    EmergencyDisabled = true;
-                    goto ExitSum;
+                    CX = GetColumnValue(original->Column);
+                    if (sumIndex == 2)
+                        CX = gf256_sqr(CX);
                 }
-            }
-
-            // Sum += PacketData
-            if (sumIndex == 0)
-                gf256_add_mem(sum.Buffer.Data, original->Buffer.Data, originalBytes);
-            else
-            {
-                uint8_t CX = GetColumnValue(original->Column);
-                if (sumIndex == 2)
-                    CX = gf256_sqr(CX);
 
                 // Sum += CX * PacketData
-                gf256_muladd_mem(sum.Buffer.Data, CX, original->Buffer.Data, originalBytes);
+                original->MulAddTo(accumulator, CX);
+                Stats->Counts[SiameseDecoderStats_SumAddCount]++;
             }
-        }
 
-        SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes == 0 || original->Column % kColumnLaneCount == laneIndex);
-        element += kColumnLaneCount;
-    } while (element < elementEnd);
+            SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes == 0 || original->Column % kColumnLaneCount == laneIndex);
+            element += kColumnLaneCount;
+        } while (element < elementEnd);
+
+        accumulator.Flush();
+    }
 
     SIAMESE_DEBUG_ASSERT((element + ColumnStart) % kColumnLaneCount == laneIndex);
 
@@ -1738,6 +3392,60 @@ ExitSum:
     return &sum.Buffer;
 }
 
+void DecoderPacketWindow::FreeSpareBuffers()
+{
+    // Subwindows past this are only kept for reuse.  See GrowWindow()
+    unsigned subwindowsUsed = (Count + kColumnLaneCount + kSubwindowSize - 1) / kSubwindowSize;
+    const unsigned subwindowCount = Subwindows.GetSize();
+    if (subwindowsUsed > subwindowCount) {
+        subwindowsUsed = subwindowCount;
+    }
+
+    for (unsigned i = 0; i < subwindowCount; ++i)
+    {
+        DecoderSubwindow* subwindow = Subwindows.Get(i);
+
+        // Free buffers for slots that have not been filled
+        for (unsigned j = 0; j < kSubwindowSize; ++j)
+        {
+            OriginalPacket& original = subwindow->Originals[j];
+            if (original.Buffer.Bytes == 0) {
+                original.Buffer.Free(TheAllocator);
+            }
+        }
+
+        if (i >= subwindowsUsed)
+        {
+            memset(GotBitmap.GetPtr(Subwindows.GetSlot(i) * kGotWordsPerSubwindow), 0, kGotWordsPerSubwindow * sizeof(uint64_t));
+            TheAllocator->Destruct(subwindow);
+        }
+    }
+
+    Subwindows.Truncate(subwindowsUsed);
+}
+
+bool DecoderPacketWindow::FreeSums()
+{
+    // If the sums are running, they can only be rebuilt if none of the data
+    // they include was removed
+    if (IsRunningSums())
+    {
+        const unsigned sumElementStart = ColumnToElement(SumColumnStart);
+        if (InvalidElement(sumElementStart)) {
+            return false;
+        }
+        ResetSums(sumElementStart);
+    }
+
+    for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex) {
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex) {
+            Lanes[laneIndex].Sums[sumIndex].Buffer.Free(TheAllocator);
+        }
+    }
+
+    return true;
+}
+
 /*
     We need to eventually remove elements from the window to avoid using
     a lot of memory.  One easy way to simplify this would be to wait
@@ -1775,7 +3483,7 @@ ExitSum:
     for these rows only includes the last few packets.
 */
 
-void DecoderPacketWindow::RemoveElements()
+void DecoderPacketWindow::RemoveElements(bool rollUpSums)
 {
     // Quick sanity check to make sure we keep some elements around
     if (NextExpectedElement < kDecoderRemoveThreshold) {
@@ -1836,7 +3544,19 @@ void DecoderPacketWindow::RemoveElements()
             if (sumCount > SIAMESE_CAUCHY_THRESHOLD)
 #endif
             {
-                if (!seenSum)
+                if (recovery->Eliminated)
+                {
+                    // Rows eliminated by a failed solve do not read the sums
+                    // again, and the sums may have been restarted for a later
+                    // row since.  So these rows just keep the current sums
+                    if (!seenSum && SumColumnCount != 0)
+                    {
+                        targetSumStartColumn = SumColumnStart;
+                        targetSumColumnCount = SumColumnCount;
+                        seenSum = true;
+                    }
+                }
+                else if (!seenSum)
                 {
                     // This should only take the first sum start/count into
                     // account because if we accumulate any data it will be
@@ -1889,22 +3609,30 @@ void DecoderPacketWindow::RemoveElements()
         return;
     }
 
-    const unsigned firstKeptSubwindow  = firstKeptElement / kSubwindowSize;
-    const unsigned removedElementCount = firstKeptSubwindow * kSubwindowSize;
+    unsigned firstKeptSubwindow  = firstKeptElement / kSubwindowSize;
+    unsigned removedElementCount = firstKeptSubwindow * kSubwindowSize;
     SIAMESE_DEBUG_ASSERT(firstKeptSubwindow >= 1);
     SIAMESE_DEBUG_ASSERT(Subwindows.GetSize() > firstKeptSubwindow);
     SIAMESE_DEBUG_ASSERT(removedElementCount % kColumnLaneCount == 0);
     SIAMESE_DEBUG_ASSERT(removedElementCount <= NextExpectedElement);
 
-    Logger.Info("********* Removing up to ", removedElementCount);
+    // Sums that are not running cannot be started before the window
+    if (seenSum && SumColumnCount == 0 &&
+        InvalidElement(ColumnToElement(targetSumStartColumn)))
+    {
+        seenSum = false;
+    }
 
     // If there is a sum we should be maintaining:
     if (seenSum)
     {
         unsigned sumElementStart = ColumnToElement(targetSumStartColumn);
 
-        // If the sum start point is changing:
-        if (SumColumnStart != targetSumStartColumn ||
+        // If the sums are not running yet or the sum start point is changing.
+        // Note that the sums start at column 0 like the encoder's, so the
+        // start column alone does not tell if they are running
+        if (SumColumnCount == 0 ||
+            SumColumnStart != targetSumStartColumn ||
             SumColumnCount > targetSumColumnCount)
         {
             // If the new sum start point is already clipped:
@@ -1941,6 +3669,36 @@ void DecoderPacketWindow::RemoveElements()
             }
         }
 
+        // In lazy sum mode, stop at the subwindow where the sums left off
+        // so a solve can add the rest only if it needs them
+        if (LazySumElements != 0 && !rollUpSums)
+        {
+            unsigned sumElementEnd = removedElementCount;
+            for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex) {
+                for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex) {
+                    if (sumElementEnd > Lanes[laneIndex].Sums[sumIndex].ElementEnd) {
+                        sumElementEnd = Lanes[laneIndex].Sums[sumIndex].ElementEnd;
+                    }
+                }
+            }
+            unsigned lazyKeptSubwindow = sumElementEnd / kSubwindowSize;
+
+            // Subwindows beyond the limit are summed after all
+            if (removedElementCount > LazySumElements)
+            {
+                const unsigned limitSubwindow = (removedElementCount - LazySumElements) / kSubwindowSize;
+                if (lazyKeptSubwindow < limitSubwindow) {
+                    lazyKeptSubwindow = limitSubwindow;
+                }
+            }
+
+            if (lazyKeptSubwindow == 0) {
+                return;
+            }
+            firstKeptSubwindow  = lazyKeptSubwindow;
+            removedElementCount = firstKeptSubwindow * kSubwindowSize;
+        }
+
         // Roll up all the sums past the point of removal
         for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
         {
@@ -1976,43 +3734,17 @@ void DecoderPacketWindow::RemoveElements()
         SumColumnCount = 0;
     }
 
-    // Reset windows before putting them on the back
-    for (unsigned i = 0; i < firstKeptSubwindow; ++i) {
-        Subwindows.GetRef(i)->Reset();
-    }
-
-    // Shift kept subwindows to the front of the vector:
+    Logger.Info("********* Removing up to ", removedElementCount);
 
-    // Resize a temporary buffer for removed subwindows
-    if (!SubwindowsShift.SetSize_NoCopy(firstKeptSubwindow))
+    // Reset windows and their bitmap words before putting them on the back
+    for (unsigned i = 0; i < firstKeptSubwindow; ++i)
     {
-        SIAMESE_DEBUG_BREAK(); // OOM
-        EmergencyDisabled = true;
-        return;
+        Subwindows.Get(i)->Reset();
+        memset(GotBitmap.GetPtr(Subwindows.GetSlot(i) * kGotWordsPerSubwindow), 0, kGotWordsPerSubwindow * sizeof(uint64_t));
     }
 
-    // Store removed subwindows temporarily
-    memcpy(
-        SubwindowsShift.GetPtr(0),
-        Subwindows.GetPtr(0),
-        firstKeptSubwindow * sizeof(DecoderSubwindow*)
-    );
-
-    const unsigned subwindowsShifted = Subwindows.GetSize() - firstKeptSubwindow;
-
-    // Shift subwindows to front that are being kept
-    memmove(
-        Subwindows.GetPtr(0),
-        Subwindows.GetPtr(firstKeptSubwindow),
-        subwindowsShifted * sizeof(DecoderSubwindow*)
-    );
-
-    // Removed subwindows are moved to the end (unordered) for later reuse
-    memcpy(
-        Subwindows.GetPtr(subwindowsShifted),
-        SubwindowsShift.GetPtr(0),
-        firstKeptSubwindow * sizeof(DecoderSubwindow*)
-    );
+    // Removed subwindows are moved to the back of the ring for later reuse
+    Subwindows.RotateFront(firstKeptSubwindow);
 
     // Update the count of elements in the window
     SIAMESE_DEBUG_ASSERT(Count >= removedElementCount);
@@ -2020,13 +3752,15 @@ void DecoderPacketWindow::RemoveElements()
 
     // Roll up the ColumnStart member
     ColumnStart = ElementToColumn(removedElementCount);
-    SIAMESE_DEBUG_ASSERT(ColumnStart == Subwindows.GetRef(0)->Originals[0].Column || Subwindows.GetRef(0)->Originals[0].Buffer.Bytes == 0);
+    SIAMESE_DEBUG_ASSERT(ColumnStart == Subwindows.Get(0)->Originals[0].Column || Subwindows.Get(0)->Originals[0].Buffer.Bytes == 0);
 
     // Roll up the FirstUnremovedElement member
     SIAMESE_DEBUG_ASSERT(NextExpectedElement >= removedElementCount);
     NextExpectedElement -= removedElementCount;
 
-    // Decrement element counters
+    // Decrement element counters.  This visits each outstanding recovery
+    // packet but nothing per window element, so it stays small next to the
+    // rest of the removal
     RecoveryPackets->DecrementElementCounters(removedElementCount);
     CheckedRegion->DecrementElementCounters(removedElementCount);
     RecoveryMatrix->DecrementElementCounters(removedElementCount);
@@ -2046,6 +3780,7 @@ void RecoveryMatrixState::Reset()
 
     PreviousNextCheckStart = 0;
     GEResumePivot = 0;
+    DependentRows = 0;
 }
 
 void RecoveryMatrixState::DecrementElementCounters(const unsigned elementCount)
@@ -2073,56 +3808,27 @@ void RecoveryMatrixState::PopulateColumns(const unsigned oldColumns, const unsig
     // The column count increased which means we should have some columns to check
     SIAMESE_DEBUG_ASSERT(elementStart < elementEnd);
 
-    // Check the current subwindow for next lost packet:
-    const unsigned subwindowEnd = (elementEnd + kSubwindowSize - 1) / kSubwindowSize;
-    unsigned subwindowIndex     = elementStart / kSubwindowSize;
-
-    unsigned bitIndex = elementStart % kSubwindowSize;
-    unsigned column   = oldColumns;
+    unsigned column = oldColumns;
 
-    while (subwindowIndex < subwindowEnd)
+    // For each lost packet in the range:
+    for (unsigned element = elementStart;; ++element)
     {
-        SIAMESE_DEBUG_ASSERT(subwindowIndex < Window->Subwindows.GetSize());
-
-        DecoderSubwindow* subwindowPtr = Window->Subwindows.GetRef(subwindowIndex);
-
-        // If there may be any lost packets in this subwindow:
-        if (subwindowPtr->GotCount < kSubwindowSize)
-        {
-            do
-            {
-                // Seek next clear bit
-                bitIndex = subwindowPtr->Got.FindFirstClear(bitIndex);
-
-                // If there were none, skip this subwindow
-                if (bitIndex >= kSubwindowSize)
-                    break;
-
-                // Calculate element index and stop if we hit the end of the valid data
-                const unsigned element = subwindowIndex * kSubwindowSize + bitIndex;
-                SIAMESE_DEBUG_ASSERT(element < elementEnd);
-
-                ColumnInfo* columnPtr = Columns.GetPtr(column);
-                columnPtr->Column     = Window->ElementToColumn(element);
-                columnPtr->Original   = &subwindowPtr->Originals[bitIndex];
-                columnPtr->CX         = GetColumnValue(columnPtr->Column);
-
-                // Point lost original packet to recovery matrix column
-                SIAMESE_DEBUG_ASSERT(columnPtr->Original->Buffer.Bytes == 0);
-                columnPtr->Original->Column = column;
-
-                // If we just added the last column:
-                if (++column >= newColumns)
-                    return;
+        element = Window->ScanGotBitmap(element, elementEnd, false);
+        if (element >= elementEnd)
+            break;
 
-            } while (++bitIndex < kSubwindowSize);
-        }
+        ColumnInfo* columnPtr = Columns.GetPtr(column);
+        columnPtr->Column     = Window->ElementToColumn(element);
+        columnPtr->Original   = Window->GetWindowElement(element);
+        columnPtr->CX         = GetColumnValue(columnPtr->Column);
 
-        // Reset bit index to the front of the next subwindow
-        bitIndex = 0;
+        // Point lost original packet to recovery matrix column
+        SIAMESE_DEBUG_ASSERT(columnPtr->Original->Buffer.Bytes == 0);
+        columnPtr->Original->Column = column;
 
-        // Check next subwindow
-        ++subwindowIndex;
+        // If we just added the last column:
+        if (++column >= newColumns)
+            return;
     }
 
     SIAMESE_DEBUG_BREAK(); // Should never get here
@@ -2249,6 +3955,23 @@ bool RecoveryMatrixState::GenerateMatrix()
         // Calculate row multiplier RX
         const uint8_t RX = GetRowValue(metadata.Row);
 
+        // Interpret the opcode for each lane up front.
+        // Each row element j is then factors[0] + factors[1] * CX + factors[2] * CX^2
+        uint8_t laneFactors[kColumnLaneCount][kColumnSumCount];
+        for (unsigned lane = 0; lane < kColumnLaneCount; ++lane)
+        {
+            const unsigned opcode = GetRowOpcode(lane, metadata.Row);
+            for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+            {
+                uint8_t factor = 0;
+                if (opcode & (1 << sumIndex))
+                    factor ^= 1;
+                if (opcode & (1 << (sumIndex + kColumnSumCount)))
+                    factor ^= RX;
+                laneFactors[lane][sumIndex] = factor;
+            }
+        }
+
         if (Logger.ShouldLog(logger::Level::Debug))
         {
             delete pDebugMsg;
@@ -2275,29 +3998,11 @@ bool RecoveryMatrixState::GenerateMatrix()
             if (pDebugMsg)
                 *pDebugMsg << column << " ";
 
-            // Generate opcode and parameters
-            const uint8_t CX      = Columns.GetRef(j).CX;
-            const uint8_t CX2     = gf256_sqr(CX);
-            const unsigned lane   = column % kColumnLaneCount;
-            const unsigned opcode = GetRowOpcode(lane, metadata.Row);
-
-            unsigned value = 0;
+            // Calculate matrix row element j from the lane factors
+            const uint8_t CX       = Columns.GetRef(j).CX;
+            const uint8_t* factors = laneFactors[column % kColumnLaneCount];
 
-            // Interpret opcode to calculate matrix row element j
-            if (opcode & 1)
-                value ^= 1;
-            if (opcode & 2)
-                value ^= CX;
-            if (opcode & 4)
-                value ^= CX2;
-            if (opcode & 8)
-                value ^= RX;
-            if (opcode & 16)
-                value ^= gf256_mul(CX, RX);
-            if (opcode & 32)
-                value ^= gf256_mul(CX2, RX);
-
-            rowData[j] = (uint8_t)value;
+            rowData[j] = factors[0] ^ gf256_mul(CX, factors[1]) ^ gf256_mul(gf256_sqr(CX), factors[2]);
         }
 
         if (pDebugMsg)
@@ -2429,6 +4134,15 @@ bool RecoveryMatrixState::GaussianElimination()
     if (GEResumePivot > 0)
         return PivotedGaussianElimination(GEResumePivot);
 
+    // For large matrices split the work for each pivot across the solver threads
+    if (Pool && Pool->GetWorkerCount() > 1 && Matrix.Columns >= ParallelGEMinColumns)
+    {
+        const unsigned pivot_i = ParallelGaussianElimination();
+        if (pivot_i < Matrix.Columns)
+            return PivotedGaussianElimination(pivot_i);
+        return true;
+    }
+
     const unsigned columns = Matrix.Columns;
     const unsigned stride  = Matrix.AllocatedColumns;
     const unsigned rows    = Matrix.Rows;
@@ -2464,6 +4178,95 @@ bool RecoveryMatrixState::GaussianElimination()
     return true;
 }
 
+/// Shared state for ParallelGaussianElimination()
+struct ParallelGaussianEliminationState
+{
+    RecoveryMatrixState* Matrix = nullptr;
+
+    /// Number of pivots each worker has applied to all of its rows
+    WorkerCounter Progress[kWorkerPoolMaxWorkers];
+
+    /// Pivot where the workers stopped
+    unsigned StopPivot = 0;
+};
+
+unsigned RecoveryMatrixState::ParallelGaussianElimination()
+{
+    SIAMESE_DEBUG_ASSERT(GEResumePivot == 0);
+
+    ParallelGaussianEliminationState state;
+    state.Matrix = this;
+    state.StopPivot = Matrix.Columns;
+
+    Pool->Run(ParallelGaussianEliminationJob, &state);
+
+    for (unsigned pivot_i = 0; pivot_i < state.StopPivot; ++pivot_i) {
+        Rows.GetRef(pivot_i).UsedForSolution = true;
+    }
+
+    return state.StopPivot;
+}
+
+void RecoveryMatrixState::ParallelGaussianEliminationJob(void* context, unsigned workerIndex, unsigned workerCount)
+{
+    /*
+        Each worker owns the rows where (row % workerCount == workerIndex) and
+        applies the pivots to its rows in order.  A pivot row is ready to use
+        once its owner has applied all of the earlier pivots to it, so workers
+        only wait on each other as needed rather than for every pivot.
+
+        If a zero is found on the diagonal then every worker stops at the same
+        pivot, leaving the matrix as the serial version would for pivoting.
+    */
+    ParallelGaussianEliminationState* state = reinterpret_cast<ParallelGaussianEliminationState*>(context);
+    RecoveryMatrixState* matrix = state->Matrix;
+
+    const unsigned columns = matrix->Matrix.Columns;
+    const unsigned stride  = matrix->Matrix.AllocatedColumns;
+    const unsigned rows    = matrix->Matrix.Rows;
+    uint8_t* data          = matrix->Matrix.Data;
+    WorkerCounter& progress = state->Progress[workerIndex];
+
+    for (unsigned pivot_i = 0; pivot_i < columns; ++pivot_i)
+    {
+        // Wait for the pivot row to be ready
+        const WorkerCounter& ownerProgress = state->Progress[pivot_i % workerCount];
+        while (ownerProgress.Value.load(std::memory_order_acquire) < pivot_i) {
+            std::this_thread::yield();
+        }
+
+        const uint8_t* ge_row = data + stride * pivot_i;
+        const uint8_t val_i   = ge_row[pivot_i];
+        if (val_i == 0)
+        {
+            if (workerIndex == 0) {
+                state->StopPivot = pivot_i;
+            }
+            return;
+        }
+
+        const unsigned pivotColumnCount = matrix->Rows.GetRef(pivot_i).MatrixColumnCount;
+
+        // For each remaining row owned by this worker:
+        unsigned pivot_j = pivot_i + 1;
+        pivot_j += (workerIndex + workerCount - pivot_j % workerCount) % workerCount;
+        for (; pivot_j < rows; pivot_j += workerCount)
+        {
+            uint8_t* rem_row = data + stride * pivot_j;
+            if (matrix->EliminateRow(ge_row, rem_row, pivot_i, pivotColumnCount, val_i))
+            {
+#ifdef SIAMESE_DECODER_TRACK_ZERO_COLUMNS
+                // Grow the column count of this row if we just filled it in on the right
+                if (matrix->Rows[pivot_j].MatrixColumnCount < pivotColumnCount)
+                    matrix->Rows[pivot_j].MatrixColumnCount = pivotColumnCount;
+#endif
+            }
+        }
+
+        progress.Value.store(pivot_i + 1, std::memory_order_release);
+    }
+}
+
 bool RecoveryMatrixState::PivotedGaussianElimination(unsigned pivot_i)
 {
     const unsigned columns = Matrix.Columns;
@@ -2523,6 +4326,12 @@ UsePivoting:
         // Remember where we failed last time
         GEResumePivot = pivot_i;
 
+        // Every column left of the pivot has a pivot row, so the rank of the
+        // matrix is that plus the rank of the rows that are left
+        SIAMESE_DEBUG_ASSERT(rows >= columns);
+        DependentRows = rows - pivot_i - RemainingRank(pivot_i);
+        SIAMESE_DEBUG_ASSERT(DependentRows > 0);
+
         return false;
 NextPivot:;
     }
@@ -2530,6 +4339,66 @@ NextPivot:;
     return true;
 }
 
+unsigned RecoveryMatrixState::RemainingRank(unsigned pivot_i)
+{
+    const unsigned stride       = Matrix.AllocatedColumns;
+    const unsigned columnStart  = pivot_i + 1;
+    const unsigned columnCount  = Matrix.Columns - columnStart;
+    const unsigned rowCount     = Matrix.Rows - pivot_i;
+
+    if (columnCount == 0) {
+        return 0;
+    }
+
+    // Copy the coefficients of the remaining rows so the elimination state
+    // is left as it is for ResumeGE()
+    if (!RankWorkspace.SetSize_NoCopy(rowCount * columnCount)) {
+        return columnCount; // Out of memory: Assume the rest is full rank
+    }
+    uint8_t* workspace = RankWorkspace.GetPtr(0);
+    for (unsigned i = 0; i < rowCount; ++i)
+    {
+        const uint8_t* ge_row = Matrix.Data + stride * Pivots.GetRef(pivot_i + i);
+        memcpy(workspace + i * columnCount, ge_row + columnStart, columnCount);
+    }
+
+    // Run GE over the copy, skipping columns that have no pivot
+    unsigned rank = 0;
+    for (unsigned j = 0; j < columnCount && rank < rowCount; ++j)
+    {
+        unsigned pivotRow = rank;
+        while (pivotRow < rowCount && workspace[pivotRow * columnCount + j] == 0) {
+            ++pivotRow;
+        }
+        if (pivotRow >= rowCount) {
+            continue;
+        }
+
+        uint8_t* ge_row = workspace + rank * columnCount;
+        if (pivotRow != rank)
+        {
+            uint8_t* swap_row = workspace + pivotRow * columnCount;
+            for (unsigned k = j; k < columnCount; ++k) {
+                std::swap(ge_row[k], swap_row[k]);
+            }
+        }
+
+        const uint8_t val_i = ge_row[j];
+        for (unsigned i = rank + 1; i < rowCount; ++i)
+        {
+            uint8_t* rem_row = workspace + i * columnCount;
+            const uint8_t val_j = rem_row[j];
+            if (val_j != 0) {
+                gf256_muladd_mem(rem_row + j, gf256_div(val_j, val_i), ge_row + j, columnCount - j);
+            }
+        }
+
+        ++rank;
+    }
+
+    return rank;
+}
+
 
 //------------------------------------------------------------------------------
 // CheckedRegionState
@@ -2564,41 +4433,85 @@ void CheckedRegionState::DecrementElementCounters(const unsigned elementCount)
 //------------------------------------------------------------------------------
 // RecoveryPacketList
 
-void RecoveryPacketList::Insert(RecoveryPacket* recovery, bool outOfOrder)
+/// Returns true if prev belongs before a recovery packet with the given
+/// ElementEnd and ColumnStart in the list
+static SIAMESE_FORCE_INLINE bool RecoveryPrecedes(
+    const RecoveryPacket* prev,
+    unsigned recoveryEnd,
+    unsigned recoveryStart)
+{
+    /*
+        This insertion order guarantees that the left and right side of
+        the recovery input ranges are monotonically increasing as in:
+
+            recovery 0: 012345
+            recovery 1:   23456 <- Cauchy row
+            recovery 2: 01234567
+            recovery 3:     45678
+            recovery 4:     456789
+    */
+    if (prev->ElementEnd != recoveryEnd) {
+        return prev->ElementEnd < recoveryEnd;
+    }
+
+    // Equal ranges keep arrival order, so a repeated row lands at the tail
+    // rather than resetting the checked region
+    const unsigned startDelta = SubtractColumns(recoveryStart, prev->Metadata.ColumnStart);
+    return startDelta == 0 || IsColumnDeltaNegative(startDelta);
+}
+
+/// Returns true if prev sorts strictly before the given ElementEnd and
+/// ColumnStart, so a binary search on it finds the first packet with that key
+static SIAMESE_FORCE_INLINE bool RecoveryKeyLess(
+    const RecoveryPacket* prev,
+    unsigned recoveryEnd,
+    unsigned recoveryStart)
+{
+    if (prev->ElementEnd != recoveryEnd) {
+        return prev->ElementEnd < recoveryEnd;
+    }
+    return IsColumnDeltaNegative(SubtractColumns(recoveryStart, prev->Metadata.ColumnStart));
+}
+
+bool RecoveryPacketList::Insert(RecoveryPacket* recovery, bool outOfOrder)
 {
-    RecoveryPacket* prev = Tail;
-    RecoveryPacket* next = nullptr;
+    SIAMESE_DEBUG_ASSERT(Index.GetSize() == RecoveryPacketCount);
 
     const unsigned recoveryStart = recovery->Metadata.ColumnStart;
     const unsigned recoveryEnd   = recovery->ElementEnd;
+    const unsigned count         = RecoveryPacketCount;
 
-    // Search for insertion point:
-    for (; prev; next = prev, prev = prev->Prev)
+    // Search for insertion point, which is usually the end of the list:
+    unsigned position = count;
+    if (count > 0 && !RecoveryPrecedes(Index.GetRef(count - 1), recoveryEnd, recoveryStart))
     {
-        const unsigned prevStart = prev->Metadata.ColumnStart;
-        const unsigned prevEnd   = prev->ElementEnd;
-
-        /*
-            This insertion order guarantees that the left and right side of
-            the recovery input ranges are monotonically increasing as in:
-
-                recovery 0: 012345
-                recovery 1:   23456 <- Cauchy row
-                recovery 2: 01234567
-                recovery 3:     45678
-                recovery 4:     456789
-        */
-        if (recoveryEnd >= prevEnd)
+        // Find the first packet that does not precede this one
+        unsigned low = 0, high = count - 1;
+        while (low < high)
         {
-            if (recoveryEnd > prevEnd) {
-                break;
+            const unsigned middle = (low + high) / 2;
+            if (RecoveryPrecedes(Index.GetRef(middle), recoveryEnd, recoveryStart)) {
+                low = middle + 1;
             }
-            if (IsColumnDeltaNegative(SubtractColumns(recoveryStart, prevStart))) {
-                break;
+            else {
+                high = middle;
             }
         }
+        position = low;
     }
 
+    if (!Index.SetSize_Copy(count + 1)) {
+        return false;
+    }
+    RecoveryPacket** index = Index.GetPtr(0);
+    memmove(index + position + 1, index + position, (count - position) * sizeof(RecoveryPacket*));
+    index[position] = recovery;
+
+    RecoveryPacket* prev = (position > 0) ? index[position - 1] : nullptr;
+    RecoveryPacket* next = (position < count) ? index[position + 1] : nullptr;
+    SIAMESE_DEBUG_ASSERT(!prev || RecoveryPrecedes(prev, recoveryEnd, recoveryStart));
+    SIAMESE_DEBUG_ASSERT(!next || !RecoveryPrecedes(next, recoveryEnd, recoveryStart));
+
     // Insert into linked list
     recovery->Next = next;
     recovery->Prev = prev;
@@ -2632,43 +4545,61 @@ void RecoveryPacketList::Insert(RecoveryPacket* recovery, bool outOfOrder)
         LastRecoveryMetadata = recovery->Metadata;
         LastRecoveryBytes = recovery->Buffer.Bytes;
     }
+
+    return true;
 }
 
 void RecoveryPacketList::DeletePacketsBefore(const unsigned element)
 {
-    RecoveryPacket* recovery = Head;
-    unsigned deleteCount     = 0;
+    // Stop once we eclipse the element
+    if (!Head || Head->ElementEnd > element) {
+        return;
+    }
 
-    // Examine recovery packets starting with the oldest
-    for (RecoveryPacket* next; recovery; recovery = next)
+    // Find the first packet that ends after the element
+    const unsigned count = RecoveryPacketCount;
+    unsigned low = 1, high = count;
+    while (low < high)
     {
-        // Stop once we eclipse the element
-        if (recovery->ElementEnd > element)
-            break;
+        const unsigned middle = (low + high) / 2;
+        if (Index.GetRef(middle)->ElementEnd <= element) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    const unsigned deleteCount = low;
 
-        next = recovery->Next;
-        recovery->Buffer.Free(TheAllocator);
-        TheAllocator->Destruct(recovery);
-        ++deleteCount;
+    RecoveryPacket** index = Index.GetPtr(0);
+    for (unsigned i = 0; i < deleteCount; ++i)
+    {
+        index[i]->Buffer.Free(TheAllocator);
+        TheAllocator->Destruct(index[i]);
     }
 
-    Head = recovery;
-    if (recovery)
+    memmove(index, index + deleteCount, (count - deleteCount) * sizeof(RecoveryPacket*));
+    Index.SetSize_Copy(count - deleteCount);
+    RecoveryPacketCount = count - deleteCount;
+
+    if (RecoveryPacketCount > 0)
     {
-        recovery->Prev = nullptr;
-        RecoveryPacketCount -= deleteCount;
+        Head = index[0];
+        Head->Prev = nullptr;
     }
     else
     {
+        Head = nullptr;
         Tail = nullptr;
-        RecoveryPacketCount = 0;
     }
 }
 
 void RecoveryPacketList::DecrementElementCounters(const unsigned elementCount)
 {
-    for (RecoveryPacket* recovery = Head; recovery; recovery = recovery->Next)
+    for (unsigned i = 0, count = RecoveryPacketCount; i < count; ++i)
     {
+        RecoveryPacket* recovery = Index.GetRef(i);
+
         SIAMESE_DEBUG_ASSERT(recovery->ElementEnd >= elementCount);
         recovery->ElementEnd -= elementCount;
 
@@ -2683,6 +4614,30 @@ void RecoveryPacketList::Delete(RecoveryPacket* recovery)
     RecoveryPacket* prev = recovery->Prev;
     RecoveryPacket* next = recovery->Next;
 
+    // Find the packet in the index, starting from the first one with its key
+    const unsigned count = RecoveryPacketCount;
+    unsigned position = 0;
+    if (Index.GetRef(0) != recovery)
+    {
+        unsigned low = 0, high = count;
+        while (low < high)
+        {
+            const unsigned middle = (low + high) / 2;
+            if (RecoveryKeyLess(Index.GetRef(middle), recovery->ElementEnd, recovery->Metadata.ColumnStart)) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        for (position = low; Index.GetRef(position) != recovery; ++position) {
+            SIAMESE_DEBUG_ASSERT(position + 1 < count);
+        }
+    }
+    RecoveryPacket** index = Index.GetPtr(0);
+    memmove(index + position, index + position + 1, (count - position - 1) * sizeof(RecoveryPacket*));
+    Index.SetSize_Copy(count - 1);
+
     if (prev)
         prev->Next = next;
     else
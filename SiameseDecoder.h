@@ -102,6 +102,9 @@
 
 namespace siamese {
 
+struct SnapshotWriter;
+struct SnapshotReader;
+
 
 //------------------------------------------------------------------------------
 // DecoderStats
@@ -111,6 +114,9 @@ struct DecoderStats
     /// SiameseDecoderStats
     uint64_t Counts[SiameseDecoderStats_Count];
 
+    /// SiameseDecoderHistogram, collected for sampled solution attempts
+    Histogram Histograms[SiameseDecoderHistogram_Count];
+
     DecoderStats();
 };
 
@@ -164,6 +170,15 @@ struct RecoveryPacket
 
     /// Packet data
     GrowingAlignedDataBuffer Buffer;
+
+    /// Set once the received original data has been eliminated from Buffer.
+    /// This is done when a solve fails so later attempts can reuse the work
+    bool Eliminated = false;
+
+    /// Columns that were lost when Buffer was eliminated.
+    /// Originals that arrive later for these columns are eliminated one at a
+    /// time by EliminateLateOriginals() instead of repeating the whole row
+    pktalloc::LightVector<unsigned> PendingColumns;
 };
 
 
@@ -230,6 +245,10 @@ struct RecoveryPacketList
     /// Number of recovery packets in the list
     unsigned RecoveryPacketCount = 0;
 
+    /// The same recovery packets in list order, to binary search by
+    /// (ElementEnd, ColumnStart) instead of walking the list
+    pktalloc::LightVector<RecoveryPacket*> Index;
+
     /// Last recovery packet metadata that was received in order
     RecoveryMetadata LastRecoveryMetadata;
     unsigned LastRecoveryBytes = 0;
@@ -241,8 +260,9 @@ struct RecoveryPacketList
     }
 
     /// Insert recovery packet into sorted list.
-    /// Out of order RecoveryPackets will not update LastRecoveryMetadata
-    void Insert(RecoveryPacket* packet, bool outOfOrder);
+    /// Out of order RecoveryPackets will not update LastRecoveryMetadata.
+    /// Returns false if memory could not be allocated
+    bool Insert(RecoveryPacket* packet, bool outOfOrder);
 
     /// Delete all packets before this element
     void DeletePacketsBefore(const unsigned element);
@@ -250,7 +270,8 @@ struct RecoveryPacketList
     /// Decrement all the element counters by a given amount
     void DecrementElementCounters(const unsigned elementCount);
 
-    /// Delete the given recovery packet from the list - Used only by unit test
+    /// Delete the given recovery packet from the list.
+    /// Precondition: The checked region does not include it
     void Delete(RecoveryPacket* recovery);
 };
 
@@ -275,12 +296,17 @@ struct DecoderSubwindow
 
         for (unsigned i = 0; i < kSubwindowSize; ++i)
         {
+            Originals[i].ReleaseExternal();
             Originals[i].Column = 0;
             Originals[i].Buffer.Bytes = 0;
         }
     }
 };
 
+/// Words of DecoderPacketWindow::GotBitmap for each subwindow
+static const unsigned kGotWordsPerSubwindow = kSubwindowSize / 64;
+static_assert(kSubwindowSize % 64 == 0, "Subwindows must fill whole bitmap words");
+
 
 //------------------------------------------------------------------------------
 // DecoderPacketWindow
@@ -304,13 +330,23 @@ struct DecoderPacketWindow
     unsigned NextExpectedElement = 0;
 
     /// Allocated Subwindows
-    pktalloc::LightVector<DecoderSubwindow*> Subwindows;
+    SubwindowRing<DecoderSubwindow> Subwindows;
+
+    /// Flat copy of the Got bits of every subwindow, with kGotWordsPerSubwindow
+    /// words for each ring slot, so that loss scans run over contiguous memory.
+    /// Bits for empty slots and for subwindows past the window are clear
+    pktalloc::LightVector<uint64_t> GotBitmap;
 
     /// Set of lanes we're maintaining
     DecoderColumnLane Lanes[kColumnLaneCount];
     unsigned SumColumnStart = 0;
     unsigned SumColumnCount = 0;
 
+    /// Number of originals that RemoveElements() may keep in the window past
+    /// the removal point instead of adding them into the sums, or 0 to add
+    /// them as they are removed.  See siamese_decoder_set_lazy_sums()
+    unsigned LazySumElements = 0;
+
     /// Packets returned by RecoverOriginalPackets() on success
     pktalloc::LightVector<SiameseOriginalPacket> RecoveredPackets;
     bool HasRecoveredPackets = false;
@@ -318,14 +354,14 @@ struct DecoderPacketWindow
     /// List of columns that have been recovered
     pktalloc::LightVector<unsigned> RecoveredColumns;
 
-    /// Temporary workspace reused each time subwindows must be shifted
-    pktalloc::LightVector<DecoderSubwindow*> SubwindowsShift;
-
     /// If input is invalid or we run out of memory, the decoder is disabled
     /// to prevent it from allowing exploits to run or cause crashes
     bool EmergencyDisabled = false;
 
 
+    /// Returns any application buffers still referenced by the window
+    ~DecoderPacketWindow();
+
     /// Are we running any sums right now?
     SIAMESE_FORCE_INLINE bool IsRunningSums() const
     {
@@ -369,9 +405,20 @@ struct DecoderPacketWindow
     SIAMESE_FORCE_INLINE OriginalPacket* GetWindowElement(unsigned windowElement)
     {
         SIAMESE_DEBUG_ASSERT(windowElement < Count);
-        return &(Subwindows.GetRef(windowElement / kSubwindowSize)->Originals[windowElement % kSubwindowSize]);
+        return &(Subwindows.Get(windowElement / kSubwindowSize)->Originals[windowElement % kSubwindowSize]);
+    }
+
+    /// Get the GotBitmap bit for a window element, following the ring of slots
+    /// Precondition: element < Subwindows.GetSize() * kSubwindowSize
+    SIAMESE_FORCE_INLINE unsigned GetGotBit(unsigned element) const
+    {
+        return (Subwindows.Head * kSubwindowSize + element) & (Subwindows.GetCapacity() * kSubwindowSize - 1);
     }
 
+    /// Returns elementEnd if no element in the range was lost (findGot = false)
+    /// or received (findGot = true).  Otherwise returns the first such element
+    unsigned ScanGotBitmap(unsigned elementStart, unsigned elementEnd, bool findGot) const;
+
     /// Returns the number of lost packets in the given range (inclusive)
     /// windowElementStart < Count: First element to test
     /// windowElementStart <= Count: One element beyond the last one to test
@@ -391,10 +438,31 @@ struct DecoderPacketWindow
     /// Append a packet to the end of the set
     SiameseResult AddOriginal(const SiameseOriginalPacket& packet);
 
+    /// Add a batch of packets in one pass over the window, in element order.
+    /// Returns Siamese_DuplicateData if none of them were new
+    /// Precondition: 0 < count <= SIAMESE_MAX_ORIGINAL_BATCH
+    SiameseResult AddOriginalBatch(const SiameseOriginalPacket* packets, unsigned count);
+
+    /// Copy a new packet into its empty window element, and note if the
+    /// running sums already passed it.  Does not mark the element received
+    SiameseResult StoreOriginal(
+        OriginalPacket* original,
+        const SiameseOriginalPacket& packet,
+        unsigned element);
+
     /// Mark that we got a column
     /// Returns true if this was the next expected element
     bool MarkGotColumn(unsigned column);
 
+    /// Mark an element received in its subwindow and in the flat bitmap
+    SIAMESE_FORCE_INLINE void MarkGotElement(DecoderSubwindow* subwindow, unsigned element)
+    {
+        subwindow->GotCount++;
+        subwindow->Got.Set(element % kSubwindowSize);
+        const unsigned bit = GetGotBit(element);
+        GotBitmap.GetRef(bit / 64) |= (uint64_t)1 << (bit % 64);
+    }
+
     /// Make sure the window contains the given end element
     bool GrowWindow(unsigned windowElementEnd);
 
@@ -410,12 +478,26 @@ struct DecoderPacketWindow
     /// Plug holes in the running sum from previous recovery action
     bool PlugSumHoles(unsigned elementStart);
 
-    /// Removes elements from the front if they are no longer needed
-    void RemoveElements();
+    /// Removes elements from the front if they are no longer needed.
+    /// rollUpSums: Add all removable data into the sums even in lazy sum mode
+    void RemoveElements(bool rollUpSums = false);
+
+    /// Free buffers kept for reuse by empty window slots, and subwindows
+    /// kept for reuse past the end of the window
+    void FreeSpareBuffers();
+
+    /// Free the running sum buffers.  They are rebuilt from the window data
+    /// the next time they are needed.
+    /// Returns false if the sums include removed data so cannot be freed
+    bool FreeSums();
 
     /// Returns the first window element that must be kept for recovery.
     /// This is used to determine how many window elements to remove
     unsigned GetFirstUsedWindowElement();
+
+    /// Write/read the window for Decoder snapshots
+    void WriteSnapshot(SnapshotWriter& writer);
+    SiameseResult ReadSnapshot(SnapshotReader& reader);
 };
 
 
@@ -436,6 +518,11 @@ struct RecoveryMatrixState
     pktalloc::Allocator* TheAllocator = nullptr;
     DecoderPacketWindow* Window = nullptr;
     CheckedRegionState* CheckedRegion = nullptr;
+    WorkerPool* Pool = nullptr;
+
+    /// Minimum number of matrix columns before GE is split across the solver
+    /// threads, set by Decoder::SetSolverThreads()
+    unsigned ParallelGEMinColumns = ~0u;
 
     struct RowInfo
     {
@@ -476,6 +563,14 @@ struct RecoveryMatrixState
     /// Pivot to resume at when we get more data
     unsigned GEResumePivot = 0;
 
+    /// Number of rows the last failed GE found to be linearly dependent on
+    /// the others.  New columns only appear to the right of all the old rows,
+    /// so a solution needs at least this many more rows than columns
+    unsigned DependentRows = 0;
+
+    /// Workspace for measuring the rank of the rows left after a failed GE
+    pktalloc::LightVector<uint8_t> RankWorkspace;
+
 
     /// Reset to initial state
     void Reset();
@@ -500,6 +595,19 @@ protected:
     /// Run GE with pivots after a column is found to be zero
     bool PivotedGaussianElimination(unsigned pivot_i);
 
+    /// Returns the rank of the rows remaining below the given failed pivot,
+    /// over the columns to its right.  The matrix itself is not modified
+    unsigned RemainingRank(unsigned pivot_i);
+
+    /// Run GE without pivots from the first column, splitting the remaining
+    /// rows for each pivot across the worker pool.
+    /// Returns the first pivot column that was found to be zero, or
+    /// Matrix.Columns if the matrix was solved
+    unsigned ParallelGaussianElimination();
+
+    /// Worker job for ParallelGaussianElimination()
+    static void ParallelGaussianEliminationJob(void* context, unsigned workerIndex, unsigned workerCount);
+
     /// rem_row[] += ge_row[] * y
     SIAMESE_FORCE_INLINE void MulAddRows(
         const uint8_t* ge_row, uint8_t* rem_row, unsigned columnStart,
@@ -549,17 +657,44 @@ protected:
 static const unsigned kDecoderRemoveThreshold = 2 * kSubwindowSize;
 static_assert(kDecoderRemoveThreshold % kSubwindowSize == 0, "It removes on window boundaries");
 
+/// Solver thread threshold that keeps the work on the calling thread
+static const uint64_t kParallelSolveDisabledBytes = ~(uint64_t)0;
+
+/// Largest number of lost packets solved directly from the recovery rows,
+/// skipping the recovery matrix
+static const unsigned kSmallSolveMaxLosses = 2;
+
+
 class Decoder
 {
 public:
-    Decoder();
+    /// Optional `pool` shared with other codecs, which must outlive this one.
+    /// `hugePages` and `numaNode` choose where the pool maps memory for this
+    /// codec, or leave both unset to use the pool's own placement
+    explicit Decoder(pktalloc::WindowPool* pool = nullptr, bool hugePages = false, int numaNode = -1);
 
     SiameseResult AddRecovery(const SiameseRecoveryPacket& packet);
 
     SIAMESE_FORCE_INLINE SiameseResult AddOriginal(
         const SiameseOriginalPacket& packet)
     {
-        return Window.AddOriginal(packet);
+        const SiameseResult result = Window.AddOriginal(packet);
+        if (result != Siamese_Success) {
+            return result;
+        }
+        return EnforceMemoryBudget();
+    }
+
+    /// Precondition: 0 < count <= SIAMESE_MAX_ORIGINAL_BATCH
+    SIAMESE_FORCE_INLINE SiameseResult AddOriginalBatch(
+        const SiameseOriginalPacket* packets,
+        unsigned count)
+    {
+        const SiameseResult result = Window.AddOriginalBatch(packets, count);
+        if (result != Siamese_Success) {
+            return result;
+        }
+        return EnforceMemoryBudget();
     }
 
     SIAMESE_FORCE_INLINE SiameseResult IsReadyToDecode()
@@ -579,6 +714,53 @@ public:
 
     SiameseResult Get(SiameseOriginalPacket& packet);
 
+    /// Set the callbacks used to write recovered packets into application
+    /// buffers, or nullptr to store them internally
+    SIAMESE_FORCE_INLINE void SetOutputBuffers(
+        SiameseBufferProvider provider,
+        SiameseReleaseCallback release,
+        void* context)
+    {
+        OutputProvider = provider;
+        OutputRelease  = release;
+        OutputContext  = context;
+    }
+
+    /// Set the number of threads used to solve large recovery problems,
+    /// including the calling thread.  1 or less disables the thread pool.
+    /// This times the thread handoffs and row multiply-adds on this machine
+    /// to pick the smallest solves that are worth splitting
+    void SetSolverThreads(unsigned threadCount);
+
+    /// Replace the measured solver thread thresholds, so tests can split
+    /// small solves
+    SIAMESE_FORCE_INLINE void SetSolverThresholds(uint64_t minBytes, unsigned minColumns)
+    {
+        ParallelSolveMinBytes = minBytes;
+        RecoveryMatrix.ParallelGEMinColumns = minColumns;
+    }
+
+    /// Limit the packet memory held by the decoder, or 0 for no limit
+    SIAMESE_FORCE_INLINE SiameseResult SetMemoryBudget(uint64_t budgetBytes)
+    {
+        if (Window.EmergencyDisabled) {
+            return Siamese_Disabled;
+        }
+        MemoryBudget = budgetBytes;
+        return EnforceMemoryBudget();
+    }
+
+    /// Keep up to maxPackets originals unsummed until a solve needs them,
+    /// or 0 to disable.  See siamese_decoder_set_lazy_sums()
+    SIAMESE_FORCE_INLINE SiameseResult SetLazySums(unsigned maxPackets)
+    {
+        if (Window.EmergencyDisabled) {
+            return Siamese_Disabled;
+        }
+        Window.LazySumElements = maxPackets;
+        return Siamese_Success;
+    }
+
     SiameseResult GenerateAcknowledgement(
         uint8_t* buffer,
         unsigned byteLimit,
@@ -588,6 +770,24 @@ public:
         uint64_t* statsOut,
         unsigned statsCount);
 
+    /// Profile one of every samplePeriod solution attempts, or 0 to stop
+    SIAMESE_FORCE_INLINE void SetProfiling(unsigned samplePeriod)
+    {
+        Profiler.Period  = samplePeriod;
+        Profiler.Counter = 0;
+    }
+
+    SiameseResult GetHistogram(
+        SiameseDecoderHistogram histogram,
+        uint64_t* bucketsOut,
+        unsigned bucketCount);
+
+    /// Write the decoder state to `buffer`, see siamese_decoder_snapshot()
+    SiameseResult Snapshot(uint8_t* buffer, unsigned bufferBytes, unsigned& usedBytesOut);
+
+    /// Restore a snapshot into this new decoder, see siamese_decoder_restore()
+    SiameseResult Restore(const uint8_t* data, unsigned bytes);
+
 protected:
     /// When the allocator goes out of scope all our buffer allocations are freed
     pktalloc::Allocator TheAllocator;
@@ -614,6 +814,77 @@ protected:
     /// the latest column seen so far
     unsigned LatestColumn = 0;
 
+    /// Limit on TheAllocator.GetMemoryLiveBytes(), or 0 for no limit
+    uint64_t MemoryBudget = 0;
+
+    /// Selects the solution attempts measured for the histograms
+    ProfileSampler Profiler;
+
+    /// Application callbacks for recovered packet buffers
+    SiameseBufferProvider OutputProvider = nullptr;
+    SiameseReleaseCallback OutputRelease = nullptr;
+    void* OutputContext = nullptr;
+
+    /// Threads used to solve large recovery problems
+    WorkerPool SolverPool;
+
+    /// Smallest estimated multiply-add bytes in one data-side recovery step
+    /// before it is split across the solver threads
+    uint64_t ParallelSolveMinBytes = kParallelSolveDisabledBytes;
+
+    /// Product sum workspace for each solver thread
+    GrowingAlignedDataBuffer SolverProductSums[kWorkerPoolMaxWorkers];
+
+    /// Matrix rows left to finish eliminating on the solver threads
+    pktalloc::LightVector<unsigned> ParallelRows;
+
+    /// Next entry in ParallelRows to be claimed by a solver thread
+    std::atomic<unsigned> ParallelNextRow = ATOMIC_VAR_INIT(0);
+
+    /// Data for each column being solved by BackSubstitution() on the solver threads
+    struct ParallelSolution
+    {
+        /// Buffer holding the length prefix and data that is being solved
+        uint8_t* Work = nullptr;
+
+        /// Application buffer for the data, or nullptr to solve it in place
+        uint8_t* Output = nullptr;
+
+        /// Number of bytes for the length prefix and data
+        unsigned Bytes = 0;
+        unsigned HeaderBytes = 0;
+
+        /// Inverse of the pivot value
+        uint8_t InvY = 0;
+
+        /// Get the solved data at the given offset past the length prefix
+        SIAMESE_FORCE_INLINE uint8_t* GetSolved(unsigned offset) const
+        {
+            SIAMESE_DEBUG_ASSERT(offset >= HeaderBytes);
+            return Output ? Output + (offset - HeaderBytes) : Work + offset;
+        }
+    };
+    pktalloc::LightVector<ParallelSolution> ParallelSolutions;
+
+    /// Number of bytes at the front of each solution that are solved serially
+    /// to read the length prefix, before the rest is split across threads
+    unsigned ParallelSolutionBytes = 0;
+
+
+    /// Free memory if the budget is exceeded.
+    /// Returns Siamese_Disabled if the decoder had to be disabled
+    SIAMESE_FORCE_INLINE SiameseResult EnforceMemoryBudget()
+    {
+        if (MemoryBudget == 0 || TheAllocator.GetMemoryLiveBytes() <= MemoryBudget) {
+            return Siamese_Success;
+        }
+        return ShedMemory();
+    }
+
+    /// Drop spare buffers, then the originals kept unsummed by lazy sums, then
+    /// the oldest recovery packets, then the sums until the budget is met.
+    /// If that is not enough, disable the decoder
+    SiameseResult ShedMemory();
 
     /// Handle single recovery packet
     bool AddSingleRecovery(const SiameseRecoveryPacket& packet, const RecoveryMetadata& metadata, int footerSize);
@@ -621,17 +892,98 @@ protected:
     /// Attempt to solve the checked region matrix
     SiameseResult DecodeCheckedRegion();
 
+    /// Solve a checked region with up to kSmallSolveMaxLosses losses directly
+    /// from the rows without generating the recovery matrix.
+    /// Returns Siamese_NeedMoreData without touching any data if the rows do
+    /// not have full rank, so that the general solver records the failure
+    SiameseResult SolveSmallRegion();
+
+    /// Eliminate original data from a row used by SolveSmallRegion()
+    bool EliminateSmallRow(RecoveryPacket* recovery);
+
+    /// Check the length prefix of a fully solved column and store it in the
+    /// window as recovered packet number `index`
+    bool StoreSmallSolution(unsigned element, RecoveryPacket* recovery, unsigned index);
+
     /// Returns true if recovery is possible
     bool CheckRecoveryPossible();
 
+    /// Returns true if the data-side recovery steps should use the solver threads
+    SIAMESE_FORCE_INLINE bool UseSolverThreads() const
+    {
+        if (SolverPool.GetWorkerCount() <= 1) {
+            return false;
+        }
+
+        // The triangular steps multiply-add about n*n/2 recovery rows
+        const uint64_t lostCount = CheckedRegion.LostCount;
+        return lostCount * lostCount / 2 * RecoveryPackets.LastRecoveryBytes >= ParallelSolveMinBytes;
+    }
+
     /// Recovery step: Eliminate original data that was successfully received
     bool EliminateOriginalData();
 
+    /// Eliminate received original data from matrix rows after a failed solve.
+    /// The rows remember which columns were still lost so that the next
+    /// attempt only has to eliminate originals that arrive in the meantime
+    bool EliminateUnsolvedRows();
+
+    /// Eliminate originals that arrived for the PendingColumns of a row
+    void EliminateLateOriginals(RecoveryPacket* recovery);
+
+    /// Returns the coefficient of the given window element in a recovery row
+    uint8_t GetRowCoefficient(const RecoveryPacket* recovery, unsigned element);
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+    /// Eliminate original data from a Cauchy or parity row
+    void EliminateCauchyRow(RecoveryPacket* recovery);
+#endif // SIAMESE_ENABLE_CAUCHY
+
+    /// Eliminate original data from a Siamese row.
+    /// The light columns are left for later if includeLightColumns is false
+    bool EliminateSumRow(RecoveryPacket* recovery, bool includeLightColumns);
+
+    /// Accumulate original data for the light (paired) columns of a Siamese row
+    void AddLightColumns(
+        RecoveryPacket* recovery,
+        MultiplyAccumulator& recoverySum,
+        MultiplyAccumulator& productSum);
+
+    /// Worker job that finishes the rows in ParallelRows
+    static void EliminateParallelRowsJob(void* context, unsigned workerIndex, unsigned workerCount);
+
     /// Recovery step: Multiply lower triangle following solution order
     bool MultiplyLowerTriangle();
 
+    /// Worker job for MultiplyLowerTriangle() on a range of data bytes
+    static void MultiplyLowerTriangleJob(void* context, unsigned workerIndex, unsigned workerCount);
+
     /// Recovery step: Back-substitute upper triangle to reveal original data
     SiameseResult BackSubstitution();
+
+    /// Worker job that finishes BackSubstitution() on a range of data bytes
+    static void BackSubstitutionJob(void* context, unsigned workerIndex, unsigned workerCount);
+
+    /// Advance past the solved region and release the recovery packets it used
+    SiameseResult FinishSolution(bool iterateNextExpected);
+
+    /// Move a solved column into its slot in the window.
+    /// The first revealedBytes of the buffer are already divided by the pivot,
+    /// and the rest are divided by inv_y here unless deferScaling is set.
+    /// Returns the application buffer that was used, or nullptr
+    uint8_t* StoreSolvedColumn(
+        OriginalPacket* original,
+        RecoveryPacket* recovery,
+        unsigned column,
+        unsigned headerBytes,
+        unsigned length,
+        unsigned revealedBytes,
+        uint8_t inv_y,
+        bool deferScaling);
+
+    /// Snapshot() and Restore() after the header sizes are checked
+    void WriteSnapshot(SnapshotWriter& writer, uint32_t totalBytes);
+    SiameseResult ReadSnapshot(SnapshotReader& reader);
 };
 
 
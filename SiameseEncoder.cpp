@@ -33,9 +33,9 @@
 namespace siamese {
 
 #ifdef SIAMESE_ENCODER_DUMP_VERBOSE
-    static logger::Channel Logger("Encoder", logger::Level::Debug);
+    static logger::CompiledChannel<SIAMESE_LOG_MIN_LEVEL> Logger("Encoder", logger::Level::Debug);
 #else
-    static logger::Channel Logger("Encoder", logger::Level::Error);
+    static logger::CompiledChannel<SIAMESE_LOG_MIN_LEVEL> Logger("Encoder", logger::Level::Error);
 #endif
 
 
@@ -50,6 +50,65 @@ EncoderStats::EncoderStats()
 }
 
 
+//------------------------------------------------------------------------------
+// EncoderColumnLane
+
+bool EncoderColumnLane::PushLengthBound(unsigned element, unsigned bytes)
+{
+    unsigned size = LengthBounds.GetSize();
+    if (LengthBoundsHead >= size) {
+        LengthBoundsHead = 0;
+        size = 0;
+    }
+
+    // Earlier packets that are not longer can never bound the length again
+    while (size > LengthBoundsHead && LengthBounds.GetRef(size - 1).Bytes <= bytes) {
+        --size;
+    }
+
+    if (!LengthBounds.SetSize_Copy(size + 1)) {
+        return false;
+    }
+    LengthBound& bound = LengthBounds.GetRef(size);
+    bound.Element = element;
+    bound.Bytes   = bytes;
+
+    LongestPacket = LengthBounds.GetRef(LengthBoundsHead).Bytes;
+    return true;
+}
+
+void EncoderColumnLane::PopLengthBounds(unsigned firstKeptElement)
+{
+    const unsigned size = LengthBounds.GetSize();
+    while (LengthBoundsHead < size && LengthBounds.GetRef(LengthBoundsHead).Element < firstKeptElement) {
+        ++LengthBoundsHead;
+    }
+
+    LongestPacket = (LengthBoundsHead < size) ? LengthBounds.GetRef(LengthBoundsHead).Bytes : 0;
+}
+
+void EncoderColumnLane::ShiftLengthBounds(unsigned removedElementCount)
+{
+    const unsigned count = LengthBounds.GetSize() - LengthBoundsHead;
+    LengthBound* bounds = LengthBounds.GetPtr(0);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        SIAMESE_DEBUG_ASSERT(bounds[LengthBoundsHead + i].Element >= removedElementCount);
+        bounds[i].Element = bounds[LengthBoundsHead + i].Element - removedElementCount;
+        bounds[i].Bytes   = bounds[LengthBoundsHead + i].Bytes;
+    }
+    LengthBounds.SetSize_Copy(count); // Shrinking does not allocate
+    LengthBoundsHead = 0;
+}
+
+void EncoderColumnLane::ClearLengthBounds()
+{
+    LengthBounds.Clear();
+    LengthBoundsHead = 0;
+    LongestPacket    = 0;
+}
+
+
 //------------------------------------------------------------------------------
 // EncoderPacketWindow
 
@@ -61,11 +120,25 @@ EncoderPacketWindow::EncoderPacketWindow()
     ClearWindow();
 }
 
+EncoderPacketWindow::~EncoderPacketWindow()
+{
+    ReleaseExternal(0, Count);
+}
+
+void EncoderPacketWindow::ReleaseExternal(unsigned elementStart, unsigned elementEnd)
+{
+    SIAMESE_DEBUG_ASSERT(elementEnd <= Subwindows.GetSize() * kSubwindowSize);
+    for (unsigned element = elementStart; element < elementEnd; ++element) {
+        Subwindows.Get(element / kSubwindowSize)->Originals[element % kSubwindowSize].ReleaseExternal();
+    }
+}
+
 void EncoderPacketWindow::ClearWindow()
 {
     FirstUnremovedElement = 0;
     Count                 = 0;
     LongestPacket         = 0;
+    OriginalBytes         = 0;
     SumStartElement       = 0;
     SumEndElement         = 0;
 
@@ -78,12 +151,19 @@ void EncoderPacketWindow::ClearWindow()
             lane.Sum[sumIndex].Bytes   = 0;
             lane.NextElement[sumIndex] = laneIndex;
         }
-        lane.LongestPacket = 0;
+        lane.ClearLengthBounds();
     }
 }
 
-SiameseResult EncoderPacketWindow::Add(SiameseOriginalPacket& packet)
+SiameseResult EncoderPacketWindow::Add(
+    SiameseOriginalPacket& packet,
+    SiameseReleaseCallback release,
+    void* context,
+    const SiameseFragment* fragments,
+    unsigned fragmentCount)
 {
+    SIAMESE_DEBUG_ASSERT(!release || !fragments);
+
     if (EmergencyDisabled) {
         return Siamese_Disabled;
     }
@@ -129,7 +209,12 @@ SiameseResult EncoderPacketWindow::Add(SiameseOriginalPacket& packet)
 
     // Initialize original packet with received data
     OriginalPacket* original = GetWindowElement(element);
-    if (0 == original->Initialize(TheAllocator, packet))
+    if (release) {
+        original->InitializeExternal(packet, release, context);
+    }
+    else if (0 == (fragments ?
+        original->InitializeGather(TheAllocator, packet, fragments, fragmentCount) :
+        original->Initialize(TheAllocator, packet)))
     {
         EmergencyDisabled = true;
         Logger.Error("WindowAdd.Initialize OOM");
@@ -147,13 +232,17 @@ SiameseResult EncoderPacketWindow::Add(SiameseOriginalPacket& packet)
     // Update longest packet
     const unsigned originalBytes = original->Buffer.Bytes;
     const unsigned laneIndex     = column % kColumnLaneCount;
-    EncoderColumnLane& lane      = Lanes[laneIndex];
-    if (lane.LongestPacket < originalBytes) {
-        lane.LongestPacket = originalBytes;
+    if (!Lanes[laneIndex].PushLengthBound(element, originalBytes))
+    {
+        EmergencyDisabled = true;
+        Logger.Error("WindowAdd.PushLengthBound OOM");
+        SIAMESE_DEBUG_BREAK();
+        return Siamese_Disabled;
     }
     if (LongestPacket < originalBytes) {
         LongestPacket = originalBytes;
     }
+    OriginalBytes += originalBytes;
 
     Stats->Counts[SiameseEncoderStats_OriginalCount]++;
     Stats->Counts[SiameseEncoderStats_OriginalBytes] += packet.DataBytes;
@@ -170,11 +259,18 @@ void EncoderPacketWindow::StartNewWindow(unsigned column)
     SumEndElement          = element;
     FirstUnremovedElement  = element;
     Count                  = element + 1;
+    OriginalBytes          = 0;
+
+    // The skipped elements are not counted in OriginalBytes, so clear any
+    // lengths left over from an earlier window before RemoveElements() sees them
+    for (unsigned i = 0; i < element; ++i) {
+        GetWindowElement(i)->Buffer.Bytes = 0;
+    }
 
     // Reset longest packet
     LongestPacket = 0;
     for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex) {
-        Lanes[laneIndex].LongestPacket = 0;
+        Lanes[laneIndex].ClearLengthBounds();
     }
 
     Logger.Info(">>> Starting a new window from column ", ColumnStart);
@@ -199,7 +295,13 @@ void EncoderPacketWindow::RemoveBefore(unsigned firstKeptColumn)
         else
         {
             // Removed everything
-            Count = 0;
+            ReleaseExternal(0, Count);
+            Count         = 0;
+            LongestPacket = 0;
+            OriginalBytes = 0;
+            for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex) {
+                Lanes[laneIndex].ClearLengthBounds();
+            }
 
             Logger.Info("Remove before column ", firstKeptColumn, " - Removed everything");
         }
@@ -209,8 +311,21 @@ void EncoderPacketWindow::RemoveBefore(unsigned firstKeptColumn)
         Logger.Info("Remove before column ", firstKeptColumn, " element ", firstKeptElement);
 
         // Mark these elements for removal next time we generate output
-        if (FirstUnremovedElement < firstKeptElement) {
+        if (FirstUnremovedElement < firstKeptElement)
+        {
             FirstUnremovedElement = firstKeptElement;
+
+            // Recovery packets only need to be as long as the unacknowledged data
+            unsigned longestPacket = 0;
+            for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+            {
+                EncoderColumnLane& lane = Lanes[laneIndex];
+                lane.PopLengthBounds(firstKeptElement);
+                if (longestPacket < lane.LongestPacket) {
+                    longestPacket = lane.LongestPacket;
+                }
+            }
+            LongestPacket = longestPacket;
         }
     }
 }
@@ -281,38 +396,19 @@ void EncoderPacketWindow::RemoveElements()
         }
     }
 
-    // Shift kept subwindows to the front of the vector:
-
-    // Resize a temporary buffer for removed subwindows
-    if (!SubwindowsShift.SetSize_NoCopy(firstKeptSubwindow))
+    // The sums no longer need the removed data
+    uint64_t removedBytes = 0;
+    for (unsigned element = 0; element < removedElementCount; ++element)
     {
-        SIAMESE_DEBUG_BREAK(); // OOM
-        EmergencyDisabled = true;
-        return;
+        OriginalPacket* original = GetWindowElement(element);
+        removedBytes += original->Buffer.Bytes;
+        original->ReleaseExternal();
     }
+    SIAMESE_DEBUG_ASSERT(OriginalBytes >= removedBytes);
+    OriginalBytes -= removedBytes;
 
-    // Store removed subwindows temporarily
-    memcpy(
-        SubwindowsShift.GetPtr(0),
-        Subwindows.GetPtr(0),
-        firstKeptSubwindow * sizeof(EncoderSubwindow*)
-    );
-
-    const unsigned subwindowsShifted = Subwindows.GetSize() - firstKeptSubwindow;
-
-    // Shift subwindows to front that are being kept
-    memmove(
-        Subwindows.GetPtr(0),
-        Subwindows.GetPtr(firstKeptSubwindow),
-        subwindowsShifted * sizeof(EncoderSubwindow*)
-    );
-
-    // Removed subwindows are moved to the end (unordered) for later reuse
-    memcpy(
-        Subwindows.GetPtr(subwindowsShifted),
-        SubwindowsShift.GetPtr(0),
-        firstKeptSubwindow * sizeof(EncoderSubwindow*)
-    );
+    // Removed subwindows are moved to the back of the ring for later reuse
+    Subwindows.RotateFront(firstKeptSubwindow);
 
     // Update the count of elements in the window
     SIAMESE_DEBUG_ASSERT(Count >= removedElementCount);
@@ -320,34 +416,16 @@ void EncoderPacketWindow::RemoveElements()
 
     // Roll up the ColumnStart member
     ColumnStart = ElementToColumn(removedElementCount);
-    SIAMESE_DEBUG_ASSERT(ColumnStart == Subwindows.GetRef(0)->Originals[0].Column);
+    SIAMESE_DEBUG_ASSERT(ColumnStart == Subwindows.Get(0)->Originals[0].Column);
 
     // Roll up the FirstUnremovedElement member
     SIAMESE_DEBUG_ASSERT(FirstUnremovedElement % kSubwindowSize == FirstUnremovedElement - removedElementCount);
     SIAMESE_DEBUG_ASSERT(FirstUnremovedElement >= removedElementCount);
     FirstUnremovedElement -= removedElementCount;
 
-    // Determine the new longest packets
-    unsigned longestPacket = 0;
-    unsigned laneLongest[kColumnLaneCount] = { 0 };
-    for (unsigned i = FirstUnremovedElement, count = Count; i < count; ++i)
-    {
-        OriginalPacket* original     = GetWindowElement(i);
-        const unsigned originalBytes = original->Buffer.Bytes;
-        if (longestPacket < originalBytes) {
-            longestPacket = originalBytes;
-        }
-        SIAMESE_DEBUG_ASSERT(original->Column % kColumnLaneCount == i % kColumnLaneCount);
-        const unsigned laneIndex = i % kColumnLaneCount;
-        if (laneLongest[laneIndex] < originalBytes) {
-            laneLongest[laneIndex] = originalBytes;
-        }
-    }
-
-    // Update longest packet fields
-    LongestPacket = longestPacket;
+    // Longest packet fields already track the unacknowledged elements
     for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex) {
-        Lanes[laneIndex].LongestPacket = laneLongest[laneIndex];
+        Lanes[laneIndex].ShiftLengthBounds(removedElementCount);
     }
 
     // If there are no running sums:
@@ -367,47 +445,52 @@ const GrowingAlignedDataBuffer* EncoderPacketWindow::GetSum(unsigned laneIndex,
     {
         GrowingAlignedDataBuffer& sum = lane.Sum[sumIndex];
 
-        // Grow this sum for this lane to fit new (larger) data if needed
-        if (lane.LongestPacket > 0 &&
-            !sum.GrowZeroPadded(TheAllocator, lane.LongestPacket))
+        // Grow this sum for this lane to fit new (larger) data if needed.
+        // This is done up front so the sum does not move while accumulating
+        unsigned sumBytes = lane.LongestPacket;
+        for (unsigned i = element; i < elementEnd; i += kColumnLaneCount)
+        {
+            const unsigned addBytes = GetWindowElement(i)->Buffer.Bytes;
+            if (sumBytes < addBytes) {
+                sumBytes = addBytes;
+            }
+        }
+        if (sumBytes > 0 &&
+            !sum.GrowZeroPadded(TheAllocator, sumBytes))
         {
             EmergencyDisabled = true;
             goto ExitSum;
         }
 
-        do
         {
-            Logger.Info("Lane ", laneIndex, " sum ", sumIndex, " accumulating column: ", ColumnStart + element);
+            MultiplyAccumulator accumulator;
+            accumulator.Start(sum.Data);
 
-            OriginalPacket* original = GetWindowElement(element);
-            const unsigned column    = original->Column;
-            unsigned addBytes        = original->Buffer.Bytes;
-
-            if (!sum.GrowZeroPadded(TheAllocator, addBytes))
+            do
             {
-                EmergencyDisabled = true;
-                goto ExitSum;
-            }
+                Logger.Info("Lane ", laneIndex, " sum ", sumIndex, " accumulating column: ", ColumnStart + element);
 
-            SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes <= sum.Bytes || element < FirstUnremovedElement);
+                OriginalPacket* original = GetWindowElement(element);
+                SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes <= sum.Bytes || element < FirstUnremovedElement);
 
-            // Sum += PacketData
-            if (sumIndex == 0) {
-                gf256_add_mem(sum.Data, original->Buffer.Data, addBytes);
-            }
-            else
-            {
-                // Sum += CX[2] * PacketData
-                uint8_t CX = GetColumnValue(column);
-                if (sumIndex == 2) {
-                    CX = gf256_sqr(CX);
+                // Sum += PacketData
+                uint8_t CX = 1;
+                if (sumIndex != 0)
+                {
+                    // Sum += CX[2] * PacketData
+                    CX = GetColumnValue(original->Column);
+                    if (sumIndex == 2) {
+                        CX = gf256_sqr(CX);
+                    }
                 }
-                gf256_muladd_mem(sum.Data, CX, original->Buffer.Data, addBytes);
-            }
+                original->MulAddTo(accumulator, CX);
 
-            SIAMESE_DEBUG_ASSERT(original->Column % kColumnLaneCount == laneIndex);
-            element += kColumnLaneCount;
-        } while (element < elementEnd);
+                SIAMESE_DEBUG_ASSERT(original->Column % kColumnLaneCount == laneIndex);
+                element += kColumnLaneCount;
+            } while (element < elementEnd);
+
+            accumulator.Flush();
+        }
 
         // Store next element to accumulate
         lane.NextElement[sumIndex] = element;
@@ -800,10 +883,172 @@ void EncoderAcknowledgementState::Clear()
 }
 
 
+//------------------------------------------------------------------------------
+// EncoderAddQueue
+
+EncoderAddQueue::~EncoderAddQueue()
+{
+    if (!Slots) {
+        return;
+    }
+
+    // Release any external packets that were never drained into the window
+    const unsigned writeIndex = WriteIndex.load(std::memory_order_acquire);
+    for (unsigned i = ReadIndex.load(std::memory_order_relaxed); i != writeIndex; ++i)
+    {
+        const Slot& slot = Slots[i & SlotMask];
+        if (slot.Release) {
+            slot.Release(slot.Context, &slot.Packet);
+        }
+    }
+
+    for (unsigned i = 0; i < SlotCount; ++i) {
+        delete[] Slots[i].CopyData;
+    }
+    delete[] Slots;
+}
+
+bool EncoderAddQueue::Initialize(unsigned slotCount, unsigned nextColumn, unsigned remainingSlots)
+{
+    SIAMESE_DEBUG_ASSERT(!Slots && slotCount > 0);
+
+    unsigned count = 1;
+    while (count < slotCount) {
+        count *= 2;
+    }
+
+    Slots = new(std::nothrow) Slot[count];
+    if (!Slots) {
+        return false;
+    }
+    for (unsigned i = 0; i < count; ++i)
+    {
+        Slots[i].CopyData      = nullptr;
+        Slots[i].CopyAllocated = 0;
+    }
+
+    SlotCount  = count;
+    SlotMask   = count - 1;
+    NextColumn = nextColumn;
+    SetWindowRemainingSlots(remainingSlots);
+    return true;
+}
+
+unsigned EncoderAddQueue::GetRemainingSlots() const
+{
+    const unsigned writeIndex = WriteIndex.load(std::memory_order_relaxed);
+    const unsigned queued     = writeIndex - ReadIndex.load(std::memory_order_acquire);
+    SIAMESE_DEBUG_ASSERT(queued <= SlotCount);
+
+    // Packets pushed since the window was last checked will use window slots.
+    // Starting a new window may also skip up to a lane of slots
+    const uint64_t windowSlots = WindowSlots.load(std::memory_order_acquire);
+    const unsigned undrained   = writeIndex - (unsigned)(windowSlots >> 32);
+    const unsigned windowFree  = (unsigned)windowSlots;
+    if (windowFree <= undrained + kColumnLaneCount) {
+        return 0;
+    }
+
+    const unsigned remaining = windowFree - undrained - kColumnLaneCount;
+    const unsigned queueFree = SlotCount - queued;
+    return (remaining < queueFree) ? remaining : queueFree;
+}
+
+SiameseResult EncoderAddQueue::Push(
+    SiameseOriginalPacket& packet,
+    SiameseReleaseCallback release,
+    void* context,
+    const SiameseFragment* fragments,
+    unsigned fragmentCount)
+{
+    SIAMESE_DEBUG_ASSERT(!release || !fragments);
+
+    if (Disabled.load(std::memory_order_relaxed)) {
+        return Siamese_Disabled;
+    }
+
+    if (GetRemainingSlots() <= 0) {
+        return Siamese_MaxPacketsReached;
+    }
+
+    // If there is a memory budget:
+    SiameseResult result = Siamese_Success;
+    const uint64_t budgetBytes = BudgetBytes.load(std::memory_order_relaxed);
+    if (budgetBytes != 0)
+    {
+        // Note: Unsigned wrap-around cancels out between the two terms
+        const uint64_t usedBytes = BudgetBase.load(std::memory_order_acquire) + PushedBytes + packet.DataBytes;
+        if (usedBytes > budgetBytes) {
+            return Siamese_MaxPacketsReached;
+        }
+        if (usedBytes >= GetBackpressureBytes(budgetBytes)) {
+            result = Siamese_Backpressure;
+        }
+    }
+
+    const unsigned writeIndex = WriteIndex.load(std::memory_order_relaxed);
+    Slot& slot = Slots[writeIndex & SlotMask];
+
+    // Assign packet number, matching the order the window will add them
+    packet.PacketNum = NextColumn;
+
+    slot.Packet   = packet;
+    slot.Release  = release;
+    slot.Context  = context;
+    slot.SendMsec = static_cast<uint32_t>(GetTimeMsec());
+
+    // If the data must be copied:
+    if (!release)
+    {
+        if (slot.CopyAllocated < packet.DataBytes)
+        {
+            uint8_t* copyData = new(std::nothrow) uint8_t[packet.DataBytes];
+            if (!copyData) {
+                return Siamese_Disabled;
+            }
+            delete[] slot.CopyData;
+            slot.CopyData      = copyData;
+            slot.CopyAllocated = packet.DataBytes;
+        }
+        if (fragments) {
+            GatherFragments(slot.CopyData, fragments, fragmentCount);
+        }
+        else {
+            memcpy(slot.CopyData, packet.Data, packet.DataBytes);
+        }
+        slot.Packet.Data = slot.CopyData;
+    }
+
+    NextColumn = IncrementColumn1(NextColumn);
+    PushedBytes += packet.DataBytes;
+
+    // Publish the slot to the consumer
+    WriteIndex.store(writeIndex + 1, std::memory_order_release);
+    return result;
+}
+
+bool EncoderAddQueue::IsUnderBackpressure() const
+{
+    const uint64_t budgetBytes = BudgetBytes.load(std::memory_order_relaxed);
+    if (budgetBytes == 0) {
+        return false;
+    }
+    const uint64_t usedBytes = BudgetBase.load(std::memory_order_acquire) + PushedBytes;
+    return usedBytes >= GetBackpressureBytes(budgetBytes);
+}
+
+void EncoderAddQueue::SetWindowRemainingSlots(unsigned remainingSlots)
+{
+    const uint64_t readIndex = ReadIndex.load(std::memory_order_relaxed);
+    WindowSlots.store((readIndex << 32) | remainingSlots, std::memory_order_release);
+}
+
+
 //------------------------------------------------------------------------------
 // Encoder
 
-Encoder::Encoder()
+Encoder::Encoder(pktalloc::WindowPool* pool, bool hugePages, int numaNode)
+    : TheAllocator(pool, hugePages, numaNode)
 {
     Window.TheAllocator = &TheAllocator;
     Window.Stats        = &Stats;
@@ -811,16 +1056,112 @@ Encoder::Encoder()
     Ack.TheWindow       = &Window;
 }
 
+SiameseResult Encoder::SetAddQueue(unsigned queueSize)
+{
+    if (AddQueue.IsEnabled()) {
+        return Siamese_InvalidInput;
+    }
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
+    }
+
+    if (!AddQueue.Initialize(queueSize, Window.NextColumn, Window.GetRemainingSlots()))
+    {
+        Window.EmergencyDisabled = true;
+        Logger.Error("SetAddQueue.Initialize OOM");
+        return Siamese_Disabled;
+    }
+    AddQueue.SetMemoryBudget(MemoryBudget);
+    UpdateAddQueueSlots();
+
+    return Siamese_Success;
+}
+
+void Encoder::SetMemoryBudget(uint64_t budgetBytes)
+{
+    MemoryBudget = budgetBytes;
+
+    if (AddQueue.IsEnabled())
+    {
+        DrainAddQueue();
+        AddQueue.SetMemoryBudget(budgetBytes);
+    }
+}
+
+SiameseResult Encoder::AddWithinBudget(
+    SiameseOriginalPacket& packet,
+    SiameseReleaseCallback release,
+    void* context,
+    const SiameseFragment* fragments,
+    unsigned fragmentCount)
+{
+    // Acknowledged data is usually removed while encoding.
+    // If it is in the way, then remove it now instead
+    if (Window.GetBudgetBytes(packet.DataBytes) > MemoryBudget &&
+        Window.Count > 0 &&
+        Window.FirstUnremovedElement >= kSubwindowSize &&
+        !Window.EmergencyDisabled)
+    {
+        Window.RemoveElements();
+    }
+
+    if (Window.GetBudgetBytes(packet.DataBytes) > MemoryBudget) {
+        return Window.EmergencyDisabled ? Siamese_Disabled : Siamese_MaxPacketsReached;
+    }
+
+    const SiameseResult result = Window.Add(packet, release, context, fragments, fragmentCount);
+    if (result == Siamese_Success &&
+        Window.GetBudgetBytes() >= GetBackpressureBytes(MemoryBudget))
+    {
+        return Siamese_Backpressure;
+    }
+    return result;
+}
+
+void Encoder::DrainAddQueueSlow()
+{
+    for (EncoderAddQueue::Slot* slot; (slot = AddQueue.Peek()) != nullptr; AddQueue.Pop())
+    {
+        SiameseOriginalPacket packet = slot->Packet;
+
+        const SiameseResult result = Window.Add(packet, slot->Release, slot->Context);
+        if (result != Siamese_Success || packet.PacketNum != slot->Packet.PacketNum)
+        {
+            // The producer already reported success, so this cannot be undone
+            SIAMESE_DEBUG_BREAK(); // Should never happen
+            Window.EmergencyDisabled = true;
+            Logger.Error("DrainAddQueue.Add failed: ", result);
+            if (result != Siamese_Success && slot->Release) {
+                slot->Release(slot->Context, &slot->Packet);
+            }
+            continue;
+        }
+
+        // Use the time the application added it rather than the drain time
+        *Window.GetWindowElementTimestampPtr(Window.ColumnToElement(packet.PacketNum)) = slot->SendMsec;
+    }
+
+    if (Window.EmergencyDisabled) {
+        AddQueue.Disable();
+    }
+
+    UpdateAddQueueSlots();
+}
+
 SiameseResult Encoder::Acknowledge(
     const uint8_t* data,
     unsigned bytes,
     unsigned& nextExpectedPacketNumOut)
 {
+    DrainAddQueue();
+
     if (Window.EmergencyDisabled) {
         return Siamese_Disabled;
     }
 
-    if (!Ack.OnAcknowledgementData(data, bytes)) {
+    const bool success = Ack.OnAcknowledgementData(data, bytes);
+    UpdateAddQueueSlots();
+    if (!success) {
         return Siamese_InvalidInput;
     }
 
@@ -841,7 +1182,7 @@ static unsigned LoadOriginal(OriginalPacket* original, SiameseOriginalPacket& or
 #ifdef SIAMESE_DEBUG
     // Check: Deserialize length from the front
     unsigned lengthCheck;
-    int headerBytesCheck = DeserializeHeader_PacketLength(original->Buffer.Data, original->Buffer.Bytes, lengthCheck);
+    int headerBytesCheck = DeserializeHeader_PacketLength(original->GetHeader(), headerBytes, lengthCheck);
 
     if (lengthCheck != length || (int)headerBytes != headerBytesCheck ||
         headerBytesCheck < 1 || lengthCheck == 0 ||
@@ -853,7 +1194,7 @@ static unsigned LoadOriginal(OriginalPacket* original, SiameseOriginalPacket& or
 #endif // SIAMESE_DEBUG
 
     originalOut.PacketNum = original->Column;
-    originalOut.Data = original->Buffer.Data + headerBytes;
+    originalOut.Data = original->GetData();
     originalOut.DataBytes = length;
     return length;
 }
@@ -879,6 +1220,8 @@ SiameseResult Encoder::Retransmit(SiameseOriginalPacket& originalOut)
     originalOut.Data = nullptr;
     originalOut.DataBytes = 0;
 
+    DrainAddQueue();
+
     if (Window.EmergencyDisabled) {
         return Siamese_Disabled;
     }
@@ -917,7 +1260,7 @@ SiameseResult Encoder::Retransmit(SiameseOriginalPacket& originalOut)
             element < count)
         {
             OriginalPacket* original = Window.GetWindowElement(element);
-            SIAMESE_DEBUG_ASSERT(original->Buffer.Data != nullptr);
+            SIAMESE_DEBUG_ASSERT(original->Buffer.Data != nullptr || original->ExternalData != nullptr);
             SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes > 0);
             uint32_t* lastSendMsecPtr = Window.GetWindowElementTimestampPtr(element);
             const uint32_t lastSendMsec = *lastSendMsecPtr;
@@ -981,7 +1324,7 @@ SiameseResult Encoder::Retransmit(SiameseOriginalPacket& originalOut)
 
             // Lookup original packet and send time
             OriginalPacket* original = Window.GetWindowElement(nackElement);
-            SIAMESE_DEBUG_ASSERT(original->Buffer.Data != nullptr);
+            SIAMESE_DEBUG_ASSERT(original->Buffer.Data != nullptr || original->ExternalData != nullptr);
             SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes > 0);
             uint32_t* lastSendMsecPtr = Window.GetWindowElementTimestampPtr(nackElement);
             const uint32_t lastSendMsec = *lastSendMsecPtr;
@@ -1012,7 +1355,7 @@ SiameseResult Encoder::Retransmit(SiameseOriginalPacket& originalOut)
     {
         // If the element needs to be retransmitted:
         OriginalPacket* original = Window.GetWindowElement(element);
-        SIAMESE_DEBUG_ASSERT(original->Buffer.Data != nullptr);
+        SIAMESE_DEBUG_ASSERT(original->Buffer.Data != nullptr || original->ExternalData != nullptr);
         SIAMESE_DEBUG_ASSERT(original->Buffer.Bytes > 0);
         uint32_t* lastSendMsecPtr = Window.GetWindowElementTimestampPtr(element);
         const uint32_t lastSendMsec = *lastSendMsecPtr;
@@ -1043,53 +1386,55 @@ SiameseResult Encoder::Retransmit(SiameseOriginalPacket& originalOut)
     return Siamese_NeedMoreData;
 }
 
-void Encoder::AddDenseColumns(unsigned row, uint8_t* productWorkspace)
+void Encoder::AddDenseColumns(const unsigned* rows, unsigned count)
 {
     const unsigned recoveryBytes = Window.LongestPacket;
 
+    unsigned opcodes[SIAMESE_MAX_ENCODE_BATCH];
+    SIAMESE_DEBUG_ASSERT(count <= SIAMESE_MAX_ENCODE_BATCH);
+
     // For each lane:
     for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
     {
-        // Compute the operations to run for this lane and row
-        unsigned opcode = GetRowOpcode(laneIndex, row);
+        // Compute the operations to run for this lane and each row
+        unsigned lanesUsed = 0;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            opcodes[i] = GetRowOpcode(laneIndex, rows[i]);
+            lanesUsed |= opcodes[i];
+        }
 
-        // For summations into the RecoveryPacket buffer:
-        unsigned mask = 1;
+        // For each running sum in this lane:
         for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
         {
-            if (opcode & mask)
-            {
-                const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, Window.Count);
-                unsigned addBytes = sum->Bytes;
+            // Opcode bits for summations into the RecoveryPacket buffer,
+            // followed by the bits for summations into the ProductWorkspace
+            const unsigned recoveryMask = 1 << sumIndex;
+            const unsigned productMask  = 1 << (sumIndex + kColumnSumCount);
 
-                if (addBytes > 0)
-                {
-                    if (addBytes > recoveryBytes) {
-                        addBytes = recoveryBytes;
-                    }
-                    gf256_add_mem(RecoveryPacket.Data, sum->Data, addBytes);
-                }
+            if (0 == (lanesUsed & (recoveryMask | productMask))) {
+                continue;
             }
-            mask <<= 1;
-        }
 
-        // For summations into the ProductWorkspace buffer:
-        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
-        {
-            if (opcode & mask)
-            {
-                const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, Window.Count);
-                unsigned addBytes = sum->Bytes;
+            const GrowingAlignedDataBuffer* sum = Window.GetSum(laneIndex, sumIndex, Window.Count);
+            unsigned addBytes = sum->Bytes;
 
-                if (addBytes > 0)
-                {
-                    if (addBytes > recoveryBytes) {
-                        addBytes = recoveryBytes;
-                    }
-                    gf256_add_mem(productWorkspace, sum->Data, addBytes);
+            if (addBytes <= 0) {
+                continue;
+            }
+            if (addBytes > recoveryBytes) {
+                addBytes = recoveryBytes;
+            }
+
+            for (unsigned i = 0; i < count; ++i)
+            {
+                if (opcodes[i] & recoveryMask) {
+                    RecoverySums[i].Add(sum->Data, addBytes);
+                }
+                if (opcodes[i] & productMask) {
+                    ProductSums[i].Add(sum->Data, addBytes);
                 }
             }
-            mask <<= 1;
         }
     }
 
@@ -1097,7 +1442,7 @@ void Encoder::AddDenseColumns(unsigned row, uint8_t* productWorkspace)
     Window.SumEndElement = Window.Count;
 }
 
-void Encoder::AddLightColumns(unsigned row, uint8_t* productWorkspace)
+void Encoder::AddLightColumns(unsigned row, MultiplyAccumulator& recoverySum, MultiplyAccumulator& productSum)
 {
     const unsigned startElement = Window.FirstUnremovedElement;
     SIAMESE_DEBUG_ASSERT(Window.SumEndElement >= startElement);
@@ -1132,8 +1477,8 @@ void Encoder::AddLightColumns(unsigned row, uint8_t* productWorkspace)
         SIAMESE_DEBUG_ASSERT(Window.LongestPacket >= original1->Buffer.Bytes);
         SIAMESE_DEBUG_ASSERT(Window.LongestPacket >= originalRX->Buffer.Bytes);
 
-        gf256_add_mem(RecoveryPacket.Data, original1->Buffer.Data,  original1->Buffer.Bytes);
-        gf256_add_mem(productWorkspace,    originalRX->Buffer.Data, originalRX->Buffer.Bytes);
+        original1->MulAddTo(recoverySum, 1);
+        originalRX->MulAddTo(productSum, 1);
     }
 
     if (pDebugMsg)
@@ -1143,22 +1488,51 @@ void Encoder::AddLightColumns(unsigned row, uint8_t* productWorkspace)
     }
 }
 
-SiameseResult Encoder::Encode(SiameseRecoveryPacket& packet)
+SiameseResult Encoder::SetCauchyCrossover(unsigned count)
 {
-    if (Window.EmergencyDisabled) {
-        return Siamese_Disabled;
+    if (count > SIAMESE_CAUCHY_CROSSOVER_MAX) {
+        return Siamese_InvalidInput;
     }
 
-    // If there are no packets so far:
-    if (Window.Count <= 0)
-    {
-        packet.DataBytes = 0;
-        return Siamese_NeedMoreData;
+#ifdef SIAMESE_ENABLE_CAUCHY
+    static_assert(SIAMESE_CAUCHY_CROSSOVER_MAX == SIAMESE_CAUCHY_THRESHOLD, "Update this too");
+    CauchyCrossover = count;
+#endif // SIAMESE_ENABLE_CAUCHY
+
+    return Siamese_Success;
+}
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+
+bool Encoder::PreferCauchyRows(unsigned unacknowledgedCount) const
+{
+    if (CauchyCrossover != SIAMESE_CAUCHY_CROSSOVER_AUTO) {
+        return unacknowledgedCount <= CauchyCrossover;
+    }
+    return IsCauchyRowCheaper(unacknowledgedCount, AddedPerRecovery256);
+}
+
+#endif // SIAMESE_ENABLE_CAUCHY
+
+Encoder::RecoveryMode Encoder::SelectRecoveryMode(unsigned recoveryCount)
+{
+    SIAMESE_DEBUG_ASSERT(Window.Count > 0 && recoveryCount > 0);
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+    // Track how many originals are sent per recovery packet, which follows
+    // the redundancy the application picked for its loss rate
+    const unsigned added = SubtractColumns(Window.NextColumn, LastRecoveryColumn);
+    LastRecoveryColumn = Window.NextColumn;
+    if (added < SIAMESE_MAX_PACKETS) {
+        AddedPerRecovery256 = (AddedPerRecovery256 * 7 + (added * 256) / recoveryCount) / 8;
     }
+#endif // SIAMESE_ENABLE_CAUCHY
 
     // Remove any data from the window at this point
-    if (Window.FirstUnremovedElement >= kEncoderRemoveThreshold) {
+    if (Window.FirstUnremovedElement >= kEncoderRemoveThreshold)
+    {
         Window.RemoveElements();
+        UpdateAddQueueSlots();
     }
 
     // Get the number of packets in the window that are in flight (unacked)
@@ -1166,7 +1540,7 @@ SiameseResult Encoder::Encode(SiameseRecoveryPacket& packet)
 
     // If there is only a single packet so far:
     if (unacknowledgedCount == 1) {
-        return GenerateSinglePacket(packet);
+        return RecoveryMode::Single;
     }
 
     // Calculate upper bound on width of sum for this recovery packet
@@ -1180,20 +1554,21 @@ SiameseResult Encoder::Encode(SiameseRecoveryPacket& packet)
 #ifdef SIAMESE_ENABLE_CAUCHY
         // If the number of packets in flight is small enough, use Cauchy rows for now:
         if (unacknowledgedCount <= SIAMESE_CAUCHY_THRESHOLD) {
-            return GenerateCauchyPacket(packet);
+            return RecoveryMode::Cauchy;
         }
 #endif // SIAMESE_ENABLE_CAUCHY
 
         Logger.Debug("Resetting sums at element ", Window.FirstUnremovedElement);
 
         Window.ResetSums(Window.FirstUnremovedElement);
+        Stats.Counts[SiameseEncoderStats_SumResetCount]++;
     }
 #ifdef SIAMESE_ENABLE_CAUCHY
     else
     {
         // If the number of packets in flight may indicate Cauchy is better or we need to use it:
-        if (unacknowledgedCount <= SIAMESE_SUM_RESET_THRESHOLD ||
-            newSumCountUB <= SIAMESE_CAUCHY_THRESHOLD)
+        if (newSumCountUB <= SIAMESE_CAUCHY_THRESHOLD ||
+            PreferCauchyRows(unacknowledgedCount))
         {
             SIAMESE_DEBUG_ASSERT(newSumCountUB >= unacknowledgedCount);
             static_assert(SIAMESE_SUM_RESET_THRESHOLD <= SIAMESE_CAUCHY_THRESHOLD, "Update this too");
@@ -1201,54 +1576,202 @@ SiameseResult Encoder::Encode(SiameseRecoveryPacket& packet)
             // Stop using sums
             Window.SumEndElement = Window.SumStartElement;
 
-            return GenerateCauchyPacket(packet);
+            return RecoveryMode::Cauchy;
         }
     }
 #endif // SIAMESE_ENABLE_CAUCHY
 
-    // Advance row index
-    const unsigned row = NextRow;
-    if (++NextRow >= kRowPeriod) {
-        NextRow = 0;
-    }
+    return RecoveryMode::Sums;
+}
 
-    // Reset workspaces
-    const unsigned recoveryBytes = Window.LongestPacket;
-    const unsigned alignedBytes = pktalloc::NextAlignedOffset(recoveryBytes);
-    if (!RecoveryPacket.Initialize(&TheAllocator, 2 * alignedBytes + kMaxRecoveryMetadataBytes))
-    {
-        Window.EmergencyDisabled = true;
-        return Siamese_Disabled;
-    }
-    SIAMESE_DEBUG_ASSERT(RecoveryPacket.Bytes >= alignedBytes * 2);
-    memset(RecoveryPacket.Data, 0, alignedBytes * 2);
-    uint8_t* productWorkspace = RecoveryPacket.Data + alignedBytes;
+SiameseResult Encoder::Encode(SiameseRecoveryPacket& packet)
+{
+    const bool profile = Profiler.Sample();
+    const uint64_t t0 = GetProfileTimeUsec(profile);
 
-    // Generate the recovery packet
-    AddDenseColumns(row, productWorkspace);
-    AddLightColumns(row, productWorkspace);
+    const SiameseResult result = GenerateRecovery(packet);
 
-    // RecoveryPacket += RX * ProductWorkspace
-    const uint8_t RX = GetRowValue(row);
-    gf256_muladd_mem(RecoveryPacket.Data, RX, productWorkspace, recoveryBytes);
+    if (profile) {
+        Stats.Histograms[SiameseEncoderHistogram_EncodeUsec].Add(GetSystemTimeUsec() - t0);
+    }
+    return result;
+}
 
-    RecoveryMetadata metadata;
-    SIAMESE_DEBUG_ASSERT(Window.SumEndElement + Window.SumErasedCount >= Window.SumStartElement);
-    metadata.SumCount    = Window.SumEndElement - Window.SumStartElement + Window.SumErasedCount;
-    metadata.LDPCCount   = unacknowledgedCount;
-    metadata.ColumnStart = Window.SumColumnStart;
-    metadata.Row         = row;
+SiameseResult Encoder::EncodeBatch(SiameseRecoveryPacket* packets, unsigned count)
+{
+    const bool profile = Profiler.Sample();
+    const uint64_t t0 = GetProfileTimeUsec(profile);
 
-    // Serialize metadata into the last few bytes of the packet
-    // Note: This saves an extra copy to move the data around
-    const unsigned footerBytes = SerializeFooter_RecoveryMetadata(metadata, RecoveryPacket.Data + recoveryBytes);
-    packet.Data      = RecoveryPacket.Data;
-    packet.DataBytes = recoveryBytes + footerBytes;
+    const SiameseResult result = GenerateRecoveryBatch(packets, count);
 
-    Stats.Counts[SiameseEncoderStats_RecoveryCount]++;
-    Stats.Counts[SiameseEncoderStats_RecoveryBytes] += packet.DataBytes;
+    if (profile) {
+        Stats.Histograms[SiameseEncoderHistogram_EncodeUsec].Add(GetSystemTimeUsec() - t0);
+    }
+    return result;
+}
+
+SiameseResult Encoder::GenerateRecovery(SiameseRecoveryPacket& packet)
+{
+    DrainAddQueue();
+
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
+    }
+
+    // If there are no packets so far:
+    if (Window.Count <= 0)
+    {
+        packet.DataBytes = 0;
+        return Siamese_NeedMoreData;
+    }
+
+    switch (SelectRecoveryMode(1))
+    {
+    case RecoveryMode::Single:
+        return GenerateSinglePacket(packet);
+#ifdef SIAMESE_ENABLE_CAUCHY
+    case RecoveryMode::Cauchy:
+        return GenerateCauchyPacket(packet);
+#endif // SIAMESE_ENABLE_CAUCHY
+    default:
+        break;
+    }
+
+    return GenerateSumPackets(&packet, 1, RecoveryPacket);
+}
+
+SiameseResult Encoder::GenerateRecoveryBatch(SiameseRecoveryPacket* packets, unsigned count)
+{
+    SIAMESE_DEBUG_ASSERT(count > 0 && count <= SIAMESE_MAX_ENCODE_BATCH);
+
+    DrainAddQueue();
+
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
+    }
+
+    // If there are no packets so far:
+    if (Window.Count <= 0)
+    {
+        for (unsigned i = 0; i < count; ++i) {
+            packets[i].DataBytes = 0;
+        }
+        return Siamese_NeedMoreData;
+    }
+
+    const RecoveryMode mode = SelectRecoveryMode(count);
+
+    if (mode == RecoveryMode::Sums) {
+        return GenerateSumPackets(packets, count, BatchPackets);
+    }
+
+    // The other modes are only used for small windows, so generate those one
+    // at a time and copy each one out before the next overwrites it
+    const unsigned stride = pktalloc::NextAlignedOffset(Window.LongestPacket + kMaxRecoveryMetadataBytes);
+    if (!BatchPackets.Initialize(&TheAllocator, stride * count))
+    {
+        Window.EmergencyDisabled = true;
+        return Siamese_Disabled;
+    }
 
-    Logger.Info("Generated Siamese sum recovery packet start=", metadata.ColumnStart, " ldpcCount=", metadata.LDPCCount, " sumCount=", metadata.SumCount, " row=", metadata.Row);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        SiameseRecoveryPacket& packet = packets[i];
+
+        SiameseResult result;
+#ifdef SIAMESE_ENABLE_CAUCHY
+        if (mode == RecoveryMode::Cauchy) {
+            result = GenerateCauchyPacket(packet);
+        }
+        else
+#endif // SIAMESE_ENABLE_CAUCHY
+        {
+            result = GenerateSinglePacket(packet);
+        }
+
+        if (result != Siamese_Success) {
+            return result;
+        }
+
+        SIAMESE_DEBUG_ASSERT(packet.DataBytes <= stride);
+        uint8_t* copy = BatchPackets.Data + stride * i;
+        memcpy(copy, packet.Data, packet.DataBytes);
+        packet.Data = copy;
+    }
+
+    return Siamese_Success;
+}
+
+SiameseResult Encoder::GenerateSumPackets(
+    SiameseRecoveryPacket* packets,
+    unsigned count,
+    GrowingAlignedDataBuffer& workspace)
+{
+    SIAMESE_DEBUG_ASSERT(count > 0 && count <= SIAMESE_MAX_ENCODE_BATCH);
+
+    // Each row gets a recovery packet followed by a product workspace
+    const unsigned recoveryBytes = Window.LongestPacket;
+    const unsigned alignedBytes = pktalloc::NextAlignedOffset(recoveryBytes);
+    const unsigned stride = pktalloc::NextAlignedOffset(2 * alignedBytes + kMaxRecoveryMetadataBytes);
+    if (!workspace.Initialize(&TheAllocator, stride * count))
+    {
+        Window.EmergencyDisabled = true;
+        return Siamese_Disabled;
+    }
+    SIAMESE_DEBUG_ASSERT(workspace.Bytes >= stride * count);
+
+    // Reset workspaces and advance row index for each packet
+    unsigned rows[SIAMESE_MAX_ENCODE_BATCH];
+    for (unsigned i = 0; i < count; ++i)
+    {
+        rows[i] = NextRow;
+        if (++NextRow >= kRowPeriod) {
+            NextRow = 0;
+        }
+
+        uint8_t* recoveryData = workspace.Data + stride * i;
+        memset(recoveryData, 0, alignedBytes * 2);
+        RecoverySums[i].Start(recoveryData);
+        ProductSums[i].Start(recoveryData + alignedBytes);
+    }
+
+    // Generate the recovery packets
+    AddDenseColumns(rows, count);
+
+    SIAMESE_DEBUG_ASSERT(Window.SumEndElement + Window.SumErasedCount >= Window.SumStartElement);
+    const unsigned unacknowledgedCount = Window.GetUnacknowledgedCount();
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const unsigned row = rows[i];
+        uint8_t* recoveryData     = RecoverySums[i].Destination;
+        uint8_t* productWorkspace = ProductSums[i].Destination;
+
+        AddLightColumns(row, RecoverySums[i], ProductSums[i]);
+        ProductSums[i].Flush();
+
+        // RecoveryPacket += RX * ProductWorkspace
+        const uint8_t RX = GetRowValue(row);
+        RecoverySums[i].MulAdd(productWorkspace, RX, recoveryBytes);
+        RecoverySums[i].Flush();
+
+        RecoveryMetadata metadata;
+        metadata.SumCount    = Window.SumEndElement - Window.SumStartElement + Window.SumErasedCount;
+        metadata.LDPCCount   = unacknowledgedCount;
+        metadata.ColumnStart = Window.SumColumnStart;
+        metadata.Row         = row;
+
+        // Serialize metadata into the last few bytes of the packet
+        // Note: This saves an extra copy to move the data around
+        const unsigned footerBytes = SerializeFooter_RecoveryMetadata(metadata, recoveryData + recoveryBytes);
+        packets[i].Data      = recoveryData;
+        packets[i].DataBytes = recoveryBytes + footerBytes;
+
+        Stats.Counts[SiameseEncoderStats_RecoveryCount]++;
+        Stats.Counts[SiameseEncoderStats_RecoveryBytes] += packets[i].DataBytes;
+
+        Logger.Info("Generated Siamese sum recovery packet start=", metadata.ColumnStart, " ldpcCount=", metadata.LDPCCount, " sumCount=", metadata.SumCount, " row=", metadata.Row);
+    }
 
     return Siamese_Success;
 }
@@ -1257,6 +1780,8 @@ SiameseResult Encoder::Get(SiameseOriginalPacket& originalOut)
 {
     // Note: Keep this in sync with Decoder::Get
 
+    DrainAddQueue();
+
     if (Window.EmergencyDisabled) {
         return Siamese_Disabled;
     }
@@ -1297,16 +1822,32 @@ SiameseResult Encoder::GenerateSinglePacket(SiameseRecoveryPacket& packet)
 {
     OriginalPacket* original     = Window.GetWindowElement(Window.FirstUnremovedElement);
     const unsigned originalBytes = original->Buffer.Bytes;
+    uint8_t* packetData          = nullptr;
 
-    // Note: This often does not actually reallocate or move since we overallocate
-    if (!original->Buffer.GrowZeroPadded(&TheAllocator, originalBytes + kMaxRecoveryMetadataBytes))
+    // If the application owns the data, then it must be copied to append the footer
+    if (original->ExternalData)
     {
-        Window.EmergencyDisabled = true;
-        return Siamese_Disabled;
+        if (!RecoveryPacket.Initialize(&TheAllocator, originalBytes + kMaxRecoveryMetadataBytes))
+        {
+            Window.EmergencyDisabled = true;
+            return Siamese_Disabled;
+        }
+        original->MulTo(RecoveryPacket.Data, 1);
+        packetData = RecoveryPacket.Data;
     }
+    else
+    {
+        // Note: This often does not actually reallocate or move since we overallocate
+        if (!original->Buffer.GrowZeroPadded(&TheAllocator, originalBytes + kMaxRecoveryMetadataBytes))
+        {
+            Window.EmergencyDisabled = true;
+            return Siamese_Disabled;
+        }
 
-    // Set bytes back to original
-    original->Buffer.Bytes = originalBytes;
+        // Set bytes back to original
+        original->Buffer.Bytes = originalBytes;
+        packetData = original->Buffer.Data;
+    }
 
     // Serialize metadata into the last few bytes of the packet
     // Note: This saves an extra copy to move the data around
@@ -1316,8 +1857,8 @@ SiameseResult Encoder::GenerateSinglePacket(SiameseRecoveryPacket& packet)
     metadata.ColumnStart = original->Column;
     metadata.Row         = 0;
 
-    const unsigned footerBytes = SerializeFooter_RecoveryMetadata(metadata, original->Buffer.Data + originalBytes);
-    packet.Data      = original->Buffer.Data;
+    const unsigned footerBytes = SerializeFooter_RecoveryMetadata(metadata, packetData + originalBytes);
+    packet.Data      = packetData;
     packet.DataBytes = originalBytes + footerBytes;
 
     Logger.Info("Generated single recovery packet start=", metadata.ColumnStart, " ldpcCount=", metadata.LDPCCount, " sumCount=", metadata.SumCount, " row=", metadata.Row);
@@ -1366,13 +1907,16 @@ SiameseResult Encoder::GenerateCauchyPacket(SiameseRecoveryPacket& packet)
         OriginalPacket* original = Window.GetWindowElement(firstElement);
         unsigned originalBytes   = original->Buffer.Bytes;
 
-        memcpy(RecoveryPacket.Data, original->Buffer.Data, originalBytes);
+        original->MulTo(RecoveryPacket.Data, 1);
         // Pad the rest out with zeros to avoid corruption
         SIAMESE_DEBUG_ASSERT(RecoveryPacket.Bytes >= originalBytes);
         memset(RecoveryPacket.Data + originalBytes, 0, recoveryBytes - originalBytes);
 
         usedBytes = originalBytes;
 
+        MultiplyAccumulator accumulator;
+        accumulator.Start(RecoveryPacket.Data);
+
         // For each remaining column:
         for (unsigned element = firstElement + 1, count = Window.Count; element < count; ++element)
         {
@@ -1381,11 +1925,13 @@ SiameseResult Encoder::GenerateCauchyPacket(SiameseRecoveryPacket& packet)
 
             SIAMESE_DEBUG_ASSERT(RecoveryPacket.Bytes >= originalBytes);
 
-            gf256_add_mem(RecoveryPacket.Data, original->Buffer.Data, originalBytes);
+            original->MulAddTo(accumulator, 1);
 
             if (usedBytes < originalBytes)
                 usedBytes = originalBytes;
         }
+
+        accumulator.Flush();
     }
     else
     {
@@ -1401,7 +1947,7 @@ SiameseResult Encoder::GenerateCauchyPacket(SiameseRecoveryPacket& packet)
         uint8_t y                = CauchyElement(cauchyRow, cauchyColumn);
         unsigned originalBytes   = original->Buffer.Bytes;
 
-        gf256_mul_mem(RecoveryPacket.Data, original->Buffer.Data, y, originalBytes);
+        original->MulTo(RecoveryPacket.Data, y);
         // Pad the rest out with zeros to avoid corruption
         SIAMESE_DEBUG_ASSERT(recoveryBytes >= originalBytes);
         SIAMESE_DEBUG_ASSERT(RecoveryPacket.Bytes >= originalBytes);
@@ -1409,6 +1955,9 @@ SiameseResult Encoder::GenerateCauchyPacket(SiameseRecoveryPacket& packet)
 
         usedBytes = originalBytes;
 
+        MultiplyAccumulator accumulator;
+        accumulator.Start(RecoveryPacket.Data);
+
         // For each remaining column:
         for (unsigned element = firstElement + 1, count = Window.Count; element < count; ++element)
         {
@@ -1419,11 +1968,13 @@ SiameseResult Encoder::GenerateCauchyPacket(SiameseRecoveryPacket& packet)
 
             SIAMESE_DEBUG_ASSERT(RecoveryPacket.Bytes >= originalBytes);
 
-            gf256_muladd_mem(RecoveryPacket.Data, y, original->Buffer.Data, originalBytes);
+            original->MulAddTo(accumulator, y);
 
             if (usedBytes < originalBytes)
                 usedBytes = originalBytes;
         }
+
+        accumulator.Flush();
     }
 
     // Slap metadata footer on the end
@@ -1447,8 +1998,11 @@ SiameseResult Encoder::GetStatistics(uint64_t* statsOut, unsigned statsCount)
     if (statsCount > SiameseEncoderStats_Count)
         statsCount = SiameseEncoderStats_Count;
 
+    DrainAddQueue();
+
     // Fill in memory allocated
     Stats.Counts[SiameseEncoderStats_MemoryUsed] = TheAllocator.GetMemoryAllocatedBytes();
+    Stats.Counts[SiameseEncoderStats_PoolMemoryUsed] = TheAllocator.GetPoolMemoryAllocatedBytes();
 
     for (unsigned i = 0; i < statsCount; ++i)
         statsOut[i] = Stats.Counts[i];
@@ -1456,5 +2010,433 @@ SiameseResult Encoder::GetStatistics(uint64_t* statsOut, unsigned statsCount)
     return Siamese_Success;
 }
 
+SiameseResult Encoder::GetHistogram(SiameseEncoderHistogram histogram, uint64_t* bucketsOut, unsigned bucketCount)
+{
+    SIAMESE_DEBUG_ASSERT((unsigned)histogram < SiameseEncoderHistogram_Count);
+    if (bucketCount > Histogram::kBucketCount) {
+        bucketCount = Histogram::kBucketCount;
+    }
+
+    const Histogram& source = Stats.Histograms[histogram];
+    for (unsigned i = 0; i < bucketCount; ++i) {
+        bucketsOut[i] = source.Buckets[i];
+    }
+
+    return Siamese_Success;
+}
+
+
+//------------------------------------------------------------------------------
+// Encoder Snapshots
+
+/// Longest original or running sum, counting the length prefix
+static const unsigned kMaxSnapshotPacketBytes = SIAMESE_MAX_PACKET_BYTES + OriginalPacket::kMaxHeaderBytes;
+
+void EncoderPacketWindow::WriteSnapshot(SnapshotWriter& writer, uint32_t nowMsec)
+{
+    writer.Write32(NextColumn);
+    writer.Write32(Count);
+    writer.Write32(ColumnStart);
+    writer.Write32(LongestPacket);
+    writer.Write32(FirstUnremovedElement);
+    writer.Write32(SumStartElement);
+    writer.Write32(SumEndElement);
+    writer.Write32(SumColumnStart);
+    writer.Write32(SumErasedCount);
+
+    // Elements skipped at the front of the window are written as 0 bytes.
+    // External data is copied into the snapshot
+    for (unsigned element = 0; element < Count; ++element)
+    {
+        const OriginalPacket* original = GetWindowElement(element);
+        if (original->Buffer.Bytes == 0)
+        {
+            writer.Write32(0);
+            continue;
+        }
+
+        const unsigned dataBytes = original->Buffer.Bytes - original->HeaderBytes;
+        writer.Write32(dataBytes);
+        writer.Write32(nowMsec - *GetWindowElementTimestampPtr(element));
+        writer.WriteBuffer(original->GetData(), dataBytes);
+    }
+
+    for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+    {
+        const EncoderColumnLane& lane = Lanes[laneIndex];
+
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+        {
+            writer.Write32(lane.NextElement[sumIndex]);
+            writer.Write32(lane.Sum[sumIndex].Bytes);
+            writer.WriteBuffer(lane.Sum[sumIndex].Data, lane.Sum[sumIndex].Bytes);
+        }
+
+        // Only the bounds from the head onward are still used
+        const unsigned size       = lane.LengthBounds.GetSize();
+        const unsigned boundCount = (size > lane.LengthBoundsHead) ? size - lane.LengthBoundsHead : 0;
+        writer.Write32(boundCount);
+        for (unsigned i = 0; i < boundCount; ++i)
+        {
+            const EncoderColumnLane::LengthBound& bound = lane.LengthBounds.GetRef(lane.LengthBoundsHead + i);
+            writer.Write32(bound.Element);
+            writer.Write32(bound.Bytes);
+        }
+    }
+}
+
+SiameseResult EncoderPacketWindow::ReadSnapshot(SnapshotReader& reader, uint32_t nowMsec)
+{
+    SIAMESE_DEBUG_ASSERT(Count == 0);
+
+    const unsigned nextColumn     = reader.Read32();
+    const unsigned count          = reader.Read32();
+    const unsigned columnStart    = reader.Read32();
+    const unsigned longestPacket  = reader.Read32();
+    const unsigned firstUnremoved = reader.Read32();
+    const unsigned sumStart       = reader.Read32();
+    const unsigned sumEnd         = reader.Read32();
+    const unsigned sumColumnStart = reader.Read32();
+    const unsigned sumErasedCount = reader.Read32();
+
+    if (reader.Truncated ||
+        nextColumn >= kColumnPeriod ||
+        columnStart >= kColumnPeriod ||
+        sumColumnStart >= kColumnPeriod ||
+        count > SIAMESE_MAX_PACKETS ||
+        longestPacket > kMaxSnapshotPacketBytes)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    // The other fields are only used while there is data in the window
+    if (count > 0 &&
+        (AddColumns(columnStart, count) != nextColumn ||
+         firstUnremoved >= count ||
+         sumStart > count ||
+         sumEnd > count))
+    {
+        return Siamese_InvalidInput;
+    }
+
+    // Allocate subwindows the same way Add() would have
+    const unsigned subwindowCount = (count > 0) ? (count + kColumnLaneCount + kSubwindowSize - 1) / kSubwindowSize : 0;
+    while (Subwindows.GetSize() < subwindowCount)
+    {
+        EncoderSubwindow* subwindow = TheAllocator->Construct<EncoderSubwindow>();
+        if (!subwindow || !Subwindows.Append(subwindow)) {
+            return Siamese_Disabled;
+        }
+    }
+
+    NextColumn            = nextColumn;
+    Count                 = count;
+    ColumnStart           = columnStart;
+    LongestPacket         = longestPacket;
+    FirstUnremovedElement = firstUnremoved;
+    SumStartElement       = sumStart;
+    SumEndElement         = sumEnd;
+    SumColumnStart        = sumColumnStart;
+    SumErasedCount        = sumErasedCount;
+    OriginalBytes         = 0;
+
+    for (unsigned element = 0; element < count; ++element)
+    {
+        OriginalPacket* original = GetWindowElement(element);
+        original->Column = ElementToColumn(element);
+
+        const unsigned dataBytes = reader.Read32();
+        if (dataBytes == 0)
+        {
+            original->Buffer.Bytes = 0;
+            continue;
+        }
+
+        const uint32_t ageMsec = reader.Read32();
+        const uint8_t* data    = (dataBytes <= SIAMESE_MAX_PACKET_BYTES) ? reader.Read(dataBytes) : nullptr;
+        if (!data) {
+            return Siamese_InvalidInput;
+        }
+
+        SiameseOriginalPacket packet;
+        packet.PacketNum = original->Column;
+        packet.Data      = data;
+        packet.DataBytes = dataBytes;
+        if (0 == original->Initialize(TheAllocator, packet)) {
+            return Siamese_Disabled;
+        }
+
+        *GetWindowElementTimestampPtr(element) = nowMsec - ageMsec;
+        OriginalBytes += original->Buffer.Bytes;
+    }
+
+    for (unsigned laneIndex = 0; laneIndex < kColumnLaneCount; ++laneIndex)
+    {
+        EncoderColumnLane& lane = Lanes[laneIndex];
+
+        for (unsigned sumIndex = 0; sumIndex < kColumnSumCount; ++sumIndex)
+        {
+            const unsigned nextElement = reader.Read32();
+            const unsigned sumBytes    = reader.Read32();
+            if (sumBytes > kMaxSnapshotPacketBytes) {
+                return Siamese_InvalidInput;
+            }
+
+            GrowingAlignedDataBuffer& sum = lane.Sum[sumIndex];
+            lane.NextElement[sumIndex] = nextElement;
+            sum.Bytes = 0;
+            if (sumBytes > 0)
+            {
+                const uint8_t* data = reader.Read(sumBytes);
+                if (!data) {
+                    return Siamese_InvalidInput;
+                }
+                if (!sum.Initialize(TheAllocator, sumBytes)) {
+                    return Siamese_Disabled;
+                }
+                memcpy(sum.Data, data, sumBytes);
+            }
+        }
+
+        const unsigned boundCount = reader.Read32();
+        if (boundCount > count) {
+            return Siamese_InvalidInput;
+        }
+
+        lane.ClearLengthBounds();
+        if (boundCount > 0)
+        {
+            if (!lane.LengthBounds.SetSize_Copy(boundCount)) {
+                return Siamese_Disabled;
+            }
+            for (unsigned i = 0; i < boundCount; ++i)
+            {
+                EncoderColumnLane::LengthBound& bound = lane.LengthBounds.GetRef(i);
+                bound.Element = reader.Read32();
+                bound.Bytes   = reader.Read32();
+                if (bound.Element >= count || bound.Bytes > kMaxSnapshotPacketBytes) {
+                    return Siamese_InvalidInput;
+                }
+            }
+            lane.LongestPacket = lane.LengthBounds.GetRef(0).Bytes;
+        }
+    }
+
+    return reader.Truncated ? Siamese_InvalidInput : Siamese_Success;
+}
+
+void EncoderAcknowledgementState::WriteSnapshot(SnapshotWriter& writer, uint64_t nowMsec)
+{
+    writer.Write32(DataBytes);
+    writer.WriteBuffer(Data, DataBytes);
+    writer.Write32(Offset);
+    writer.Write32(LossColumn);
+    writer.Write32(LossCount);
+    writer.Write32(NextColumnExpected);
+    writer.Write32(NextRTOColumn);
+    writer.Write8(FoundOldest ? 1 : 0);
+    writer.Write32(OldestColumn);
+    writer.Write32(RetransmitTimeoutMsec);
+
+    for (unsigned i = 0; i < MaxWindowedRTT.kSampleCount; ++i)
+    {
+        writer.Write32(MaxWindowedRTT.Samples[i].Value);
+        writer.Write64(nowMsec - MaxWindowedRTT.Samples[i].Timestamp);
+    }
+}
+
+SiameseResult EncoderAcknowledgementState::ReadSnapshot(SnapshotReader& reader, uint64_t nowMsec)
+{
+    const unsigned dataBytes = reader.Read32();
+    const uint8_t* data      = (dataBytes > 0) ? reader.Read(dataBytes) : nullptr;
+    if (dataBytes > 0)
+    {
+        if (!data) {
+            return Siamese_InvalidInput;
+        }
+
+        // Copy the data into place with some padding at the end
+        Data = TheAllocator->Reallocate(Data, dataBytes + kPaddingBytes,
+            pktalloc::Realloc::Uninitialized);
+        if (!Data) {
+            return Siamese_Disabled;
+        }
+        memcpy(Data, data, dataBytes);
+        memset(Data + dataBytes, 0, kPaddingBytes); // Zero guard bytes
+    }
+    DataBytes = dataBytes;
+
+    Offset                = reader.Read32();
+    LossColumn            = reader.Read32();
+    LossCount             = reader.Read32();
+    NextColumnExpected    = reader.Read32();
+    NextRTOColumn         = reader.Read32();
+    FoundOldest           = (reader.Read8() != 0);
+    OldestColumn          = reader.Read32();
+    RetransmitTimeoutMsec = reader.Read32();
+
+    for (unsigned i = 0; i < MaxWindowedRTT.kSampleCount; ++i)
+    {
+        MaxWindowedRTT.Samples[i].Value     = reader.Read32();
+        MaxWindowedRTT.Samples[i].Timestamp = nowMsec - reader.Read64();
+    }
+
+    if (reader.Truncated ||
+        Offset > DataBytes ||
+        LossColumn >= kColumnPeriod ||
+        NextColumnExpected >= kColumnPeriod ||
+        NextRTOColumn >= kColumnPeriod ||
+        OldestColumn >= kColumnPeriod)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    return Siamese_Success;
+}
+
+void Encoder::WriteSnapshot(SnapshotWriter& writer, uint32_t totalBytes)
+{
+    WriteSnapshotHeader(writer, kEncoderSnapshotMagic, totalBytes);
+
+    const uint64_t nowMsec = GetTimeMsec();
+
+    writer.Write32(NextRow);
+    writer.Write32(NextParityColumn);
+#ifdef SIAMESE_ENABLE_CAUCHY
+    writer.Write32(NextCauchyRow);
+    writer.Write32(CauchyCrossover);
+    writer.Write32(LastRecoveryColumn);
+    writer.Write32(AddedPerRecovery256);
+#else // SIAMESE_ENABLE_CAUCHY
+    // Same layout with or without Cauchy rows
+    writer.Write32(0);
+    writer.Write32(SIAMESE_SUM_RESET_THRESHOLD);
+    writer.Write32(0);
+    writer.Write32(0);
+#endif // SIAMESE_ENABLE_CAUCHY
+    writer.Write64(MemoryBudget);
+
+    // Histograms are not written because they only describe this process
+    writer.Write32(SiameseEncoderStats_Count);
+    for (unsigned i = 0; i < SiameseEncoderStats_Count; ++i) {
+        writer.Write64(Stats.Counts[i]);
+    }
+
+    Window.WriteSnapshot(writer, static_cast<uint32_t>(nowMsec));
+    Ack.WriteSnapshot(writer, nowMsec);
+}
+
+SiameseResult Encoder::ReadSnapshot(SnapshotReader& reader)
+{
+    const uint64_t nowMsec = GetTimeMsec();
+
+    const unsigned nextRow             = reader.Read32();
+    const unsigned nextParityColumn    = reader.Read32();
+    const unsigned nextCauchyRow       = reader.Read32();
+    const unsigned cauchyCrossover     = reader.Read32();
+    const unsigned lastRecoveryColumn  = reader.Read32();
+    const unsigned addedPerRecovery256 = reader.Read32();
+    const uint64_t memoryBudget        = reader.Read64();
+    const unsigned statsCount          = reader.Read32();
+
+    if (reader.Truncated ||
+        nextRow >= kRowPeriod ||
+        nextParityColumn >= kColumnPeriod ||
+        nextCauchyRow >= kCauchyMaxRows ||
+        cauchyCrossover > SIAMESE_CAUCHY_CROSSOVER_MAX ||
+        lastRecoveryColumn >= kColumnPeriod ||
+        statsCount != SiameseEncoderStats_Count)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    NextRow          = nextRow;
+    NextParityColumn = nextParityColumn;
+#ifdef SIAMESE_ENABLE_CAUCHY
+    NextCauchyRow       = nextCauchyRow;
+    CauchyCrossover     = cauchyCrossover;
+    LastRecoveryColumn  = lastRecoveryColumn;
+    AddedPerRecovery256 = addedPerRecovery256;
+#else // SIAMESE_ENABLE_CAUCHY
+    (void)addedPerRecovery256;
+#endif // SIAMESE_ENABLE_CAUCHY
+    MemoryBudget = memoryBudget;
+
+    for (unsigned i = 0; i < SiameseEncoderStats_Count; ++i) {
+        Stats.Counts[i] = reader.Read64();
+    }
+
+    SiameseResult result = Window.ReadSnapshot(reader, static_cast<uint32_t>(nowMsec));
+    if (result == Siamese_Success) {
+        result = Ack.ReadSnapshot(reader, nowMsec);
+    }
+    if (result == Siamese_Success && !reader.IsComplete()) {
+        result = Siamese_InvalidInput;
+    }
+    return result;
+}
+
+SiameseResult Encoder::Snapshot(uint8_t* buffer, unsigned bufferBytes, unsigned& usedBytesOut)
+{
+    // Packets waiting in the AddQueue are part of the state
+    DrainAddQueue();
+
+    usedBytesOut = 0;
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
+    }
+
+    // Measure the snapshot by writing it without a buffer
+    SnapshotWriter measure;
+    WriteSnapshot(measure, 0);
+    if (measure.Bytes > 0xffffffff) {
+        return Siamese_InvalidInput;
+    }
+    const unsigned totalBytes = static_cast<unsigned>(measure.Bytes);
+
+    usedBytesOut = totalBytes;
+    if (!buffer || bufferBytes < totalBytes) {
+        return Siamese_NeedMoreData;
+    }
+
+    SnapshotWriter writer;
+    writer.Stream = WriteByteStream(buffer, totalBytes);
+    WriteSnapshot(writer, totalBytes);
+    SIAMESE_DEBUG_ASSERT(writer.Bytes == totalBytes && writer.Stream.WrittenBytes == totalBytes);
+
+    return Siamese_Success;
+}
+
+SiameseResult Encoder::Restore(const uint8_t* data, unsigned bytes)
+{
+    if (Window.EmergencyDisabled) {
+        return Siamese_Disabled;
+    }
+
+    // Only a new encoder can be restored
+    if (Window.Count != 0 || Window.NextColumn != 0 || AddQueue.IsEnabled()) {
+        return Siamese_InvalidInput;
+    }
+
+    SnapshotReader reader(data, bytes);
+    if (!ReadSnapshotHeader(reader, kEncoderSnapshotMagic, bytes)) {
+        return Siamese_InvalidInput;
+    }
+
+    const SiameseResult result = ReadSnapshot(reader);
+    if (result != Siamese_Success)
+    {
+        // The encoder may be partly restored, so it cannot be used
+        Window.EmergencyDisabled = true;
+        if (result == Siamese_Disabled) {
+            Logger.Error("Restore OOM");
+        }
+        else {
+            Logger.Error("Restore found invalid snapshot data");
+        }
+    }
+    return result;
+}
+
 
 } // namespace siamese
@@ -41,6 +41,9 @@
 
 namespace siamese {
 
+struct SnapshotWriter;
+struct SnapshotReader;
+
 
 /**
     Terminology:
@@ -63,6 +66,9 @@ struct EncoderStats
     /// SiameseEncoderStats
     uint64_t Counts[SiameseEncoderStats_Count];
 
+    /// SiameseEncoderHistogram, collected for sampled calls
+    Histogram Histograms[SiameseEncoderHistogram_Count];
+
     EncoderStats();
 };
 
@@ -78,10 +84,36 @@ struct EncoderColumnLane
     /// Running sums.  See kColumnSumCount definition
     GrowingAlignedDataBuffer Sum[kColumnSumCount];
 
-    /// Longest packet in this lane
+    /// Longest unacknowledged packet in this lane
     /// Note: I think it's a win to keep this per-lane because if the
     /// data size is highly variable we may reduce memory accesses
     unsigned LongestPacket = 0;
+
+    /// Unacknowledged packet in this lane that bounds the length of the ones before it
+    struct LengthBound
+    {
+        unsigned Element;
+        unsigned Bytes;
+    };
+
+    /// Queue of length bounds with strictly decreasing Bytes starting from
+    /// LengthBoundsHead.  The head is the longest unacknowledged packet, and
+    /// as it is acknowledged the next longest packet after it takes over
+    pktalloc::LightVector<LengthBound> LengthBounds;
+    unsigned LengthBoundsHead = 0;
+
+    /// Add a length bound for a new packet at the end of the window.
+    /// Returns false on OOM
+    bool PushLengthBound(unsigned element, unsigned bytes);
+
+    /// Drop length bounds for elements before the given element
+    void PopLengthBounds(unsigned firstKeptElement);
+
+    /// Shift length bounds down after elements are removed from the front
+    void ShiftLengthBounds(unsigned removedElementCount);
+
+    /// Clear all length bounds
+    void ClearLengthBounds();
 };
 
 
@@ -116,13 +148,18 @@ struct EncoderPacketWindow
     /// Note: When Count == 0, this is undefined
     unsigned ColumnStart = 0;
 
-    /// Longest packet
+    /// Longest unacknowledged packet, which bounds the recovery packet size.
+    /// This shrinks as RemoveBefore() acknowledges long packets.
     /// Note: Undefined if count == 0
     unsigned LongestPacket = 0;
 
     /// Note: This is updated by RemoveUpTo()
     unsigned FirstUnremovedElement = 0;
 
+    /// Bytes of original data in the window, including length prefixes.
+    /// Acknowledged data is counted until RemoveElements() drops it
+    uint64_t OriginalBytes = 0;
+
     /// Sum element range [start...end)
     /// Note: End is the first element outside of the range
     unsigned SumStartElement = 0;
@@ -131,14 +168,11 @@ struct EncoderPacketWindow
     unsigned SumErasedCount = 0;
 
     /// Allocated Subwindows
-    pktalloc::LightVector<EncoderSubwindow*> Subwindows;
+    SubwindowRing<EncoderSubwindow> Subwindows;
 
     /// Running summations for each lane
     EncoderColumnLane Lanes[kColumnLaneCount];
 
-    /// Temporary workspace reused each time subwindows must be shifted
-    pktalloc::LightVector<EncoderSubwindow*> SubwindowsShift;
-
     /// If input is invalid or we run out of memory, the encoder is disabled
     /// to prevent it from allowing exploits to run or cause crashes
     bool EmergencyDisabled = false;
@@ -147,6 +181,9 @@ struct EncoderPacketWindow
     /// Ctor initializes elements to default values
     EncoderPacketWindow();
 
+    /// Dtor releases any external data still in the window
+    ~EncoderPacketWindow();
+
     /// Convert a column to a window element
     SIAMESE_FORCE_INLINE unsigned ColumnToElement(unsigned column) const
     {
@@ -170,7 +207,7 @@ struct EncoderPacketWindow
     SIAMESE_FORCE_INLINE OriginalPacket* GetWindowElement(unsigned windowElement)
     {
         SIAMESE_DEBUG_ASSERT(windowElement < Count);
-        return &(Subwindows.GetRef(windowElement / kSubwindowSize)->Originals[windowElement % kSubwindowSize]);
+        return &(Subwindows.Get(windowElement / kSubwindowSize)->Originals[windowElement % kSubwindowSize]);
     }
 
     /// Get element send timestamp from the window, indexed by window offset not column number
@@ -178,7 +215,7 @@ struct EncoderPacketWindow
     SIAMESE_FORCE_INLINE uint32_t* GetWindowElementTimestampPtr(unsigned windowElement)
     {
         SIAMESE_DEBUG_ASSERT(windowElement < Count);
-        return &(Subwindows.GetRef(windowElement / kSubwindowSize)->LastSendMsec[windowElement % kSubwindowSize]);
+        return &(Subwindows.Get(windowElement / kSubwindowSize)->LastSendMsec[windowElement % kSubwindowSize]);
     }
 
     /// How many slots remain in the window?
@@ -188,8 +225,28 @@ struct EncoderPacketWindow
         return SIAMESE_MAX_PACKETS - Count;
     }
 
-    /// Append a packet to the end of the set
-    SiameseResult Add(SiameseOriginalPacket& packet);
+    /// Bytes counted against the memory budget if a packet with the given
+    /// number of bytes were added: Original data plus the running sums
+    SIAMESE_FORCE_INLINE uint64_t GetBudgetBytes(unsigned addedBytes = 0) const
+    {
+        const unsigned longest = (LongestPacket < addedBytes) ? addedBytes : LongestPacket;
+        return OriginalBytes + addedBytes + (uint64_t)kColumnLaneCount * kColumnSumCount * longest;
+    }
+
+    /// Append a packet to the end of the set.
+    /// If a release callback is provided, the packet data is referenced
+    /// rather than copied, and released once it is removed from the window.
+    /// If fragments are provided, the data is gathered from them instead of
+    /// packet.Data, and packet.DataBytes is their total length
+    SiameseResult Add(
+        SiameseOriginalPacket& packet,
+        SiameseReleaseCallback release = nullptr,
+        void* context = nullptr,
+        const SiameseFragment* fragments = nullptr,
+        unsigned fragmentCount = 0);
+
+    /// Release external data for window elements in [elementStart, elementEnd)
+    void ReleaseExternal(unsigned elementStart, unsigned elementEnd);
 
     /// Removes elements up to the given column
     void RemoveBefore(unsigned firstKeptColumn);
@@ -229,6 +286,11 @@ struct EncoderPacketWindow
 
     /// Precondition: FirstUsedElement >= kSubwindowSize
     void RemoveElements();
+
+    /// Write/read the window for Encoder snapshots.
+    /// Send times are written as ages relative to nowMsec
+    void WriteSnapshot(SnapshotWriter& writer, uint32_t nowMsec);
+    SiameseResult ReadSnapshot(SnapshotReader& reader, uint32_t nowMsec);
 };
 
 
@@ -318,6 +380,11 @@ struct EncoderAcknowledgementState
     /// Clear the ack data
     void Clear();
 
+    /// Write/read the acknowledgement state for Encoder snapshots.
+    /// RTT sample times are written as ages relative to nowMsec
+    void WriteSnapshot(SnapshotWriter& writer, uint64_t nowMsec);
+    SiameseResult ReadSnapshot(SnapshotReader& reader, uint64_t nowMsec);
+
 protected:
     /// Decode the next NACK range
     bool DecodeNextRange();
@@ -327,6 +394,151 @@ protected:
 };
 
 
+//------------------------------------------------------------------------------
+// EncoderAddQueue
+
+/**
+    Lock-free single-producer single-consumer queue of added packets.
+
+    When enabled, siamese_encoder_add() on the application thread only copies
+    the packet into a queue slot and assigns its packet number.  The thread
+    that calls the rest of the encoder API drains the queue into the window
+    before using it, so the window, running sums, and allocator are only ever
+    touched by that thread.
+*/
+class EncoderAddQueue
+{
+public:
+    struct Slot
+    {
+        /// Packet to add.  Data points to CopyData unless it is external
+        SiameseOriginalPacket Packet;
+
+        /// Release callback for external packets, or nullptr
+        SiameseReleaseCallback Release;
+        void* Context;
+
+        /// Time the application added the packet
+        uint32_t SendMsec;
+
+        /// Copy of the packet data owned by the slot and reused
+        uint8_t* CopyData;
+        unsigned CopyAllocated;
+    };
+
+    ~EncoderAddQueue();
+
+    /// Returns true if the queue is in use
+    SIAMESE_FORCE_INLINE bool IsEnabled() const
+    {
+        return SlotCount != 0;
+    }
+
+    /// Allocate slotCount queue slots, rounded up to a power of two.
+    /// nextColumn and remainingSlots start from the current window state.
+    /// Returns false on OOM
+    bool Initialize(unsigned slotCount, unsigned nextColumn, unsigned remainingSlots);
+
+    /// Producer: Queue a packet and set its packet number.
+    /// If fragments are provided, they are gathered into the slot instead
+    /// of packet.Data.
+    /// Returns Siamese_MaxPacketsReached if the queue or window is full, or
+    /// Siamese_Backpressure if it was queued close to the memory budget
+    SiameseResult Push(
+        SiameseOriginalPacket& packet,
+        SiameseReleaseCallback release,
+        void* context,
+        const SiameseFragment* fragments = nullptr,
+        unsigned fragmentCount = 0);
+
+    /// Producer: Number of packets that can be pushed right now
+    unsigned GetRemainingSlots() const;
+
+    /// Producer: Returns true if the memory budget is nearly used up
+    bool IsUnderBackpressure() const;
+
+    /// Consumer: Returns the next queued packet, or nullptr if empty
+    SIAMESE_FORCE_INLINE Slot* Peek()
+    {
+        const unsigned readIndex = ReadIndex.load(std::memory_order_relaxed);
+        if (readIndex == WriteIndex.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &Slots[readIndex & SlotMask];
+    }
+
+    /// Consumer: Hand the slot from Peek() back to the producer
+    SIAMESE_FORCE_INLINE void Pop()
+    {
+        DrainedBytes += Slots[ReadIndex.load(std::memory_order_relaxed) & SlotMask].Packet.DataBytes;
+        ReadIndex.store(ReadIndex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /// Consumer: Publish the number of free window slots after the packets
+    /// popped so far, which limits how many the producer may push
+    void SetWindowRemainingSlots(unsigned remainingSlots);
+
+    /// Consumer: Set the memory budget, or 0 for no limit
+    SIAMESE_FORCE_INLINE void SetMemoryBudget(uint64_t budgetBytes)
+    {
+        BudgetBytes.store(budgetBytes, std::memory_order_relaxed);
+    }
+
+    /// Consumer: Publish the budget bytes used by the window after the
+    /// packets popped so far
+    SIAMESE_FORCE_INLINE void SetWindowBudgetBytes(uint64_t windowBytes)
+    {
+        // The producer adds up everything it pushed, so subtract what was drained
+        BudgetBase.store(windowBytes - DrainedBytes, std::memory_order_release);
+    }
+
+    /// Consumer: Stop accepting packets after the window was disabled
+    SIAMESE_FORCE_INLINE void Disable()
+    {
+        Disabled.store(true, std::memory_order_relaxed);
+    }
+
+protected:
+    Slot* Slots = nullptr;
+    unsigned SlotCount = 0;
+    unsigned SlotMask = 0;
+
+    /// Producer state: Next packet number to assign
+    unsigned NextColumn = 0;
+
+    /// Producer state: Total data bytes pushed
+    uint64_t PushedBytes = 0;
+
+    /// Memory budget, or 0 for no limit
+    std::atomic<uint64_t> BudgetBytes = ATOMIC_VAR_INIT(0);
+
+    /// Set by the consumer if the encoder is disabled
+    std::atomic<bool> Disabled = ATOMIC_VAR_INIT(false);
+
+    /// Padding keeps the producer and consumer indices on separate cache lines
+    uint8_t Padding0[64];
+
+    /// Number of packets pushed, written by the producer
+    std::atomic<unsigned> WriteIndex = ATOMIC_VAR_INIT(0);
+
+    uint8_t Padding1[64];
+
+    /// Number of packets popped, written by the consumer
+    std::atomic<unsigned> ReadIndex = ATOMIC_VAR_INIT(0);
+
+    /// Window slots free at a given ReadIndex: (ReadIndex << 32) | slots.
+    /// Written by the consumer
+    std::atomic<uint64_t> WindowSlots = ATOMIC_VAR_INIT(0);
+
+    /// Consumer state: Total data bytes popped
+    uint64_t DrainedBytes = 0;
+
+    /// Window budget bytes minus DrainedBytes, so adding PushedBytes gives
+    /// the bytes used including the queue.  Written by the consumer
+    std::atomic<uint64_t> BudgetBase = ATOMIC_VAR_INIT(0);
+};
+
+
 //------------------------------------------------------------------------------
 // Encoder
 
@@ -334,26 +546,97 @@ protected:
 static const unsigned kEncoderRemoveThreshold = 2 * kSubwindowSize;
 static_assert(kEncoderRemoveThreshold % kSubwindowSize == 0, "It removes on window boundaries");
 
+/// Add() reports backpressure once 3/4 of the memory budget is used
+SIAMESE_FORCE_INLINE uint64_t GetBackpressureBytes(uint64_t budgetBytes)
+{
+    return budgetBytes - budgetBytes / 4;
+}
+
 class Encoder
 {
 public:
-    Encoder();
+    /// Optional `pool` shared with other codecs, which must outlive this one.
+    /// `hugePages` and `numaNode` choose where the pool maps memory for this
+    /// codec, or leave both unset to use the pool's own placement
+    explicit Encoder(pktalloc::WindowPool* pool = nullptr, bool hugePages = false, int numaNode = -1);
 
     SIAMESE_FORCE_INLINE unsigned GetRemainingSlots() const
     {
+        if (AddQueue.IsEnabled()) {
+            return AddQueue.GetRemainingSlots();
+        }
         return Window.GetRemainingSlots();
     }
 
     /// Add an original data packet to the encoder
     SIAMESE_FORCE_INLINE SiameseResult Add(SiameseOriginalPacket& packet)
     {
+        if (AddQueue.IsEnabled()) {
+            return AddQueue.Push(packet, nullptr, nullptr);
+        }
+        if (MemoryBudget != 0) {
+            return AddWithinBudget(packet, nullptr, nullptr);
+        }
         return Window.Add(packet);
     }
 
+    /// Add an original data packet gathered from fragments to the encoder.
+    /// packet.DataBytes must be the total length of the fragments
+    SIAMESE_FORCE_INLINE SiameseResult AddGather(
+        SiameseOriginalPacket& packet,
+        const SiameseFragment* fragments,
+        unsigned fragmentCount)
+    {
+        if (AddQueue.IsEnabled()) {
+            return AddQueue.Push(packet, nullptr, nullptr, fragments, fragmentCount);
+        }
+        if (MemoryBudget != 0) {
+            return AddWithinBudget(packet, nullptr, nullptr, fragments, fragmentCount);
+        }
+        return Window.Add(packet, nullptr, nullptr, fragments, fragmentCount);
+    }
+
+    /// Add an original data packet to the encoder without copying it
+    SIAMESE_FORCE_INLINE SiameseResult Add(
+        SiameseOriginalPacket& packet,
+        SiameseReleaseCallback release,
+        void* context)
+    {
+        if (AddQueue.IsEnabled()) {
+            return AddQueue.Push(packet, release, context);
+        }
+        if (MemoryBudget != 0) {
+            return AddWithinBudget(packet, release, context);
+        }
+        return Window.Add(packet, release, context);
+    }
+
+    /// Returns true if the memory budget is nearly used up
+    SIAMESE_FORCE_INLINE bool IsUnderBackpressure() const
+    {
+        if (AddQueue.IsEnabled()) {
+            return AddQueue.IsUnderBackpressure();
+        }
+        return MemoryBudget != 0 && Window.GetBudgetBytes() >= GetBackpressureBytes(MemoryBudget);
+    }
+
+    /// Limit the bytes held by the window, or 0 for no limit
+    void SetMemoryBudget(uint64_t budgetBytes);
+
+    /// Let Add() be called from a different thread than the rest of the API.
+    /// Must be called before the threads start using the encoder
+    SiameseResult SetAddQueue(unsigned queueSize);
+
+    /// Set the number of packets in flight at/below which running sums give
+    /// way to Cauchy rows, or SIAMESE_CAUCHY_CROSSOVER_AUTO to compare costs
+    SiameseResult SetCauchyCrossover(unsigned count);
+
     /// Remove original data packet up to the given column
     SIAMESE_FORCE_INLINE void RemoveBefore(unsigned firstKeptColumn)
     {
+        DrainAddQueue();
         Window.RemoveBefore(firstKeptColumn);
+        UpdateAddQueueSlots();
     }
 
     /// Process an acknowledgement from the decoder
@@ -368,12 +651,32 @@ public:
     /// Generate the next recovery packet for the data
     SiameseResult Encode(SiameseRecoveryPacket& recoveryOut);
 
+    /// Generate the next 'count' recovery packets for the data
+    /// Precondition: 0 < count <= SIAMESE_MAX_ENCODE_BATCH
+    SiameseResult EncodeBatch(SiameseRecoveryPacket* recoveryOut, unsigned count);
+
     /// Get a packet in the set
     SiameseResult Get(SiameseOriginalPacket& packet);
 
     /// Get statistics
     SiameseResult GetStatistics(uint64_t* statsOut, unsigned statsCount);
 
+    /// Profile one of every samplePeriod encodes, or 0 to stop
+    SIAMESE_FORCE_INLINE void SetProfiling(unsigned samplePeriod)
+    {
+        Profiler.Period  = samplePeriod;
+        Profiler.Counter = 0;
+    }
+
+    /// Get histogram buckets
+    SiameseResult GetHistogram(SiameseEncoderHistogram histogram, uint64_t* bucketsOut, unsigned bucketCount);
+
+    /// Write the encoder state to `buffer`, see siamese_encoder_snapshot()
+    SiameseResult Snapshot(uint8_t* buffer, unsigned bufferBytes, unsigned& usedBytesOut);
+
+    /// Restore a snapshot into this new encoder, see siamese_encoder_restore()
+    SiameseResult Restore(const uint8_t* data, unsigned bytes);
+
 protected:
     /// When the allocator goes out of scope all our buffer allocations are freed
     pktalloc::Allocator TheAllocator;
@@ -384,12 +687,28 @@ protected:
     /// Set of encoded packets in the sliding window
     EncoderPacketWindow Window;
 
+    /// Packets added from another thread, if enabled by SetAddQueue()
+    EncoderAddQueue AddQueue;
+
+    /// Selects the encodes measured for the histograms
+    ProfileSampler Profiler;
+
     /// Acknowledgement state
     EncoderAcknowledgementState Ack;
 
     /// Keeps a copy of the last recovery packet to speed up generating the next one
     GrowingAlignedDataBuffer RecoveryPacket;
 
+    /// Holds the recovery packets generated by EncodeBatch()
+    GrowingAlignedDataBuffer BatchPackets;
+
+    /// Row accumulators used by GenerateSumPackets()
+    MultiplyAccumulator RecoverySums[SIAMESE_MAX_ENCODE_BATCH];
+    MultiplyAccumulator ProductSums[SIAMESE_MAX_ENCODE_BATCH];
+
+    /// Limit on Window.GetBudgetBytes(), or 0 for no limit
+    uint64_t MemoryBudget = 0;
+
     /// Next row to generate for Siamese rows
     unsigned NextRow = 0;
 
@@ -399,12 +718,80 @@ protected:
 #ifdef SIAMESE_ENABLE_CAUCHY
     /// Next row to generate for Cauchy rows
     unsigned NextCauchyRow = 0;
+
+    /// Packets in flight at/below which running sums give way to Cauchy rows,
+    /// or SIAMESE_CAUCHY_CROSSOVER_AUTO to use IsCauchyRowCheaper()
+    unsigned CauchyCrossover = SIAMESE_SUM_RESET_THRESHOLD;
+
+    /// NextColumn when the last recovery packet was generated
+    unsigned LastRecoveryColumn = 0;
+
+    /// Moving average of originals added per recovery packet, in units of 1/256
+    unsigned AddedPerRecovery256 = 0;
 #endif // SIAMESE_ENABLE_CAUCHY
 
 
-    /// Normal case of generating recovery packet
-    void AddDenseColumns(unsigned row, uint8_t* productWorkspace);
-    void AddLightColumns(unsigned row, uint8_t* productWorkspace);
+    /// Ways to generate a recovery packet, chosen by SelectRecoveryMode()
+    enum class RecoveryMode
+    {
+        Single, ///< Only one packet in flight: Send a copy of it
+        Cauchy, ///< Few packets in flight: Use a parity/Cauchy row
+        Sums    ///< Normal case: Use a Siamese row built from the running sums
+    };
+
+    /// Move packets from the AddQueue into the window
+    SIAMESE_FORCE_INLINE void DrainAddQueue()
+    {
+        if (AddQueue.IsEnabled()) {
+            DrainAddQueueSlow();
+        }
+    }
+    void DrainAddQueueSlow();
+
+    /// Add() when there is a memory budget and no AddQueue
+    SiameseResult AddWithinBudget(
+        SiameseOriginalPacket& packet,
+        SiameseReleaseCallback release,
+        void* context,
+        const SiameseFragment* fragments = nullptr,
+        unsigned fragmentCount = 0);
+
+    /// Let the AddQueue producer know how many window slots and budget bytes
+    /// are in use
+    SIAMESE_FORCE_INLINE void UpdateAddQueueSlots()
+    {
+        if (AddQueue.IsEnabled())
+        {
+            AddQueue.SetWindowBudgetBytes(Window.GetBudgetBytes());
+            AddQueue.SetWindowRemainingSlots(Window.GetRemainingSlots());
+        }
+    }
+
+    /// Encode() and EncodeBatch() without profiling
+    SiameseResult GenerateRecovery(SiameseRecoveryPacket& packet);
+    SiameseResult GenerateRecoveryBatch(SiameseRecoveryPacket* packets, unsigned count);
+
+    /// Remove acknowledged data and choose how to generate the next
+    /// `recoveryCount` recovery packets, resetting the running sums if needed.
+    /// Precondition: Window.Count > 0
+    RecoveryMode SelectRecoveryMode(unsigned recoveryCount);
+
+#ifdef SIAMESE_ENABLE_CAUCHY
+    /// Returns true if running sums should give way to Cauchy rows
+    bool PreferCauchyRows(unsigned unacknowledgedCount) const;
+#endif // SIAMESE_ENABLE_CAUCHY
+
+    /// Normal case of generating recovery packets.
+    /// Generates 'count' consecutive Siamese rows into the given workspace
+    SiameseResult GenerateSumPackets(
+        SiameseRecoveryPacket* packets,
+        unsigned count,
+        GrowingAlignedDataBuffer& workspace);
+
+    /// Collects data to add into the recovery packet and product workspace.
+    /// The lane sums are read once and added to all 'count' rows
+    void AddDenseColumns(const unsigned* rows, unsigned count);
+    void AddLightColumns(unsigned row, MultiplyAccumulator& recoverySum, MultiplyAccumulator& productSum);
 
     /// Generate output for the case of a single input packet
     SiameseResult GenerateSinglePacket(SiameseRecoveryPacket& packet);
@@ -418,6 +805,10 @@ protected:
     SiameseResult AttemptRetransmit(
         OriginalPacket* original,
         SiameseOriginalPacket& originalOut);
+
+    /// Snapshot() and Restore() after the header sizes are checked
+    void WriteSnapshot(SnapshotWriter& writer, uint32_t totalBytes);
+    SiameseResult ReadSnapshot(SnapshotReader& reader);
 };
 
 
@@ -42,6 +42,10 @@
     + Packet Count (1-2 bytes)
     + Packet Length (1-4 bytes)
     + NACK Loss Range (1-7 bytes)
+
+    Codec state serialization:
+
+    + SnapshotWriter / SnapshotReader for siamese_*_snapshot() and restore()
 */
 
 #include "siamese.h"
@@ -994,4 +998,140 @@ SIAMESE_FORCE_INLINE int DeserializeHeader_NACKLossRange(const uint8_t* buffer,
 }
 
 
+//------------------------------------------------------------------------------
+// Codec Snapshots
+
+/**
+    Codec snapshots are a flat byte stream written and read front to back in
+    one pass, so they can be streamed to a socket or file and restored from a
+    memory mapped file without copying it first:
+
+        Magic (4 bytes)
+        Version (4 bytes)
+        Total snapshot bytes including this header (4 bytes)
+        Codec state, see Encoder::WriteSnapshot() and Decoder::WriteSnapshot()
+
+    All fields are little-endian with no alignment or padding, and no
+    pointers: Recovery packets and window elements are written in order and
+    referenced by position.  Timestamps are written as ages in milliseconds
+    so they carry over to a process with a different clock.
+*/
+
+/// Snapshot magic numbers: "SIAE" and "SIAD"
+static const uint32_t kEncoderSnapshotMagic = 0x45414953;
+static const uint32_t kDecoderSnapshotMagic = 0x44414953;
+
+/// Incremented when the snapshot layout changes
+static const uint32_t kSnapshotVersion = 2;
+
+/// Bytes in the snapshot header
+static const unsigned kSnapshotHeaderBytes = 12;
+
+/// WriteByteStream wrapper that only counts the bytes if no buffer is set,
+/// so that the same code measures the snapshot size and then writes it
+struct SnapshotWriter
+{
+    /// Output buffer, or Data = nullptr to only count bytes
+    WriteByteStream Stream;
+
+    /// Number of bytes written so far, or that would have been written
+    uint64_t Bytes = 0;
+
+    SIAMESE_FORCE_INLINE void Write8(uint8_t value)
+    {
+        if (Stream.Data) {
+            Stream.Write8(value);
+        }
+        Bytes += 1;
+    }
+    SIAMESE_FORCE_INLINE void Write32(uint32_t value)
+    {
+        if (Stream.Data) {
+            Stream.Write32(value);
+        }
+        Bytes += 4;
+    }
+    SIAMESE_FORCE_INLINE void Write64(uint64_t value)
+    {
+        if (Stream.Data) {
+            Stream.Write64(value);
+        }
+        Bytes += 8;
+    }
+    SIAMESE_FORCE_INLINE void WriteBuffer(const void* source, unsigned bytes)
+    {
+        if (Stream.Data && bytes > 0) {
+            Stream.WriteBuffer(source, bytes);
+        }
+        Bytes += bytes;
+    }
+};
+
+/// ReadByteStream wrapper that checks each read against the end of the data.
+/// After the first read past the end, Truncated is set and reads return 0
+struct SnapshotReader
+{
+    ReadByteStream Stream;
+
+    /// Set if a read went past the end of the data
+    bool Truncated = false;
+
+    SnapshotReader(const uint8_t* data, unsigned bytes)
+        : Stream(data, bytes)
+    {
+    }
+
+    /// Returns true if the given number of bytes can be read
+    SIAMESE_FORCE_INLINE bool CanRead(unsigned bytes)
+    {
+        if (!Truncated && Stream.Remaining() < bytes) {
+            Truncated = true;
+        }
+        return !Truncated;
+    }
+
+    SIAMESE_FORCE_INLINE uint8_t Read8()
+    {
+        return CanRead(1) ? Stream.Read8() : 0;
+    }
+    SIAMESE_FORCE_INLINE uint32_t Read32()
+    {
+        return CanRead(4) ? Stream.Read32() : 0;
+    }
+    SIAMESE_FORCE_INLINE uint64_t Read64()
+    {
+        return CanRead(8) ? Stream.Read64() : 0;
+    }
+
+    /// Returns nullptr if there are not enough bytes
+    SIAMESE_FORCE_INLINE const uint8_t* Read(unsigned bytes)
+    {
+        return CanRead(bytes) ? Stream.Read(bytes) : nullptr;
+    }
+
+    /// Returns true if all of the data was read without going past the end
+    SIAMESE_FORCE_INLINE bool IsComplete()
+    {
+        return !Truncated && Stream.Remaining() == 0;
+    }
+};
+
+/// Write the snapshot header
+SIAMESE_FORCE_INLINE void WriteSnapshotHeader(SnapshotWriter& writer, uint32_t magic, uint32_t totalBytes)
+{
+    writer.Write32(magic);
+    writer.Write32(kSnapshotVersion);
+    writer.Write32(totalBytes);
+}
+
+/// Returns true if the header matches the given magic number and data size
+SIAMESE_FORCE_INLINE bool ReadSnapshotHeader(SnapshotReader& reader, uint32_t magic, unsigned totalBytes)
+{
+    return reader.Read32() == magic &&
+        reader.Read32() == kSnapshotVersion &&
+        reader.Read32() == totalBytes &&
+        !reader.Truncated;
+}
+
+
 } // namespace siamese
@@ -51,6 +51,16 @@ namespace siamese {
 //------------------------------------------------------------------------------
 // Timing
 
+// Application clock set with SetClock(), or null for the system clock
+static std::atomic<ClockCallback> m_ClockCallback = ATOMIC_VAR_INIT(nullptr);
+static std::atomic<void*> m_ClockContext = ATOMIC_VAR_INIT(nullptr);
+
+void SetClock(ClockCallback callback, void* context)
+{
+    m_ClockContext.store(context, std::memory_order_relaxed);
+    m_ClockCallback.store(callback, std::memory_order_release);
+}
+
 #ifdef _WIN32
 // Precomputed frequency inverse
 static double PerfFrequencyInverseUsec = 0.;
@@ -79,6 +89,16 @@ static void InitClockServ()
 #endif // _WIN32
 
 uint64_t GetTimeUsec()
+{
+    const ClockCallback callback = m_ClockCallback.load(std::memory_order_acquire);
+    if (callback) {
+        return callback(m_ClockContext.load(std::memory_order_relaxed));
+    }
+
+    return GetSystemTimeUsec();
+}
+
+uint64_t GetSystemTimeUsec()
 {
 #ifdef _WIN32
     LARGE_INTEGER timeStamp = {};
@@ -96,14 +116,19 @@ uint64_t GetTimeUsec()
 
     return 1000000 * tv.tv_sec + tv.tv_nsec / 1000;
 #else
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    return 1000000 * tv.tv_sec + tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000 * (uint64_t)ts.tv_sec + ts.tv_nsec / 1000;
 #endif
 }
 
 uint64_t GetTimeMsec()
 {
+    const ClockCallback callback = m_ClockCallback.load(std::memory_order_acquire);
+    if (callback) {
+        return callback(m_ClockContext.load(std::memory_order_relaxed)) / 1000;
+    }
+
 #ifdef _WIN32
     LARGE_INTEGER timeStamp = {};
     if (!::QueryPerformanceCounter(&timeStamp))
@@ -111,11 +136,110 @@ uint64_t GetTimeMsec()
     if (PerfFrequencyInverseMsec == 0.)
         InitPerfFrequencyInverse();
     return (uint64_t)(PerfFrequencyInverseMsec * timeStamp.QuadPart);
+#elif defined(CLOCK_MONOTONIC_COARSE)
+    // The coarse clock is read from the vDSO without touching the clock
+    // source, so it stays cheap on VMs where clock_gettime() would syscall.
+    // It only ticks every few milliseconds, which is enough for RTO timing
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return 1000 * (uint64_t)ts.tv_sec + ts.tv_nsec / 1000000;
 #else
-    // TBD: Optimize this?
     return GetTimeUsec() / 1000;
 #endif
 }
 
 
+//------------------------------------------------------------------------------
+// WorkerPool
+
+void WorkerPool::Start(unsigned workerCount)
+{
+    Stop();
+
+    if (workerCount > kWorkerPoolMaxWorkers) {
+        workerCount = kWorkerPoolMaxWorkers;
+    }
+    if (workerCount <= 1) {
+        return;
+    }
+
+    Terminated = false;
+    WorkerCount = workerCount;
+    for (unsigned i = 1; i < workerCount; ++i) {
+        Threads.push_back(std::make_shared<std::thread>(&WorkerPool::Loop, this, i, JobNumber));
+    }
+}
+
+void WorkerPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Terminated = true;
+    }
+    StartCondition.notify_all();
+
+    for (auto& thread : Threads)
+    {
+        if (thread->joinable()) {
+            thread->join();
+        }
+    }
+    Threads.clear();
+
+    WorkerCount = 1;
+}
+
+void WorkerPool::Run(JobFunction job, void* context)
+{
+    if (WorkerCount <= 1)
+    {
+        job(context, 0, 1);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Job          = job;
+        JobContext   = context;
+        RunningCount = WorkerCount - 1;
+        ++JobNumber;
+    }
+    StartCondition.notify_all();
+
+    job(context, 0, WorkerCount);
+
+    std::unique_lock<std::mutex> locker(Lock);
+    while (RunningCount > 0) {
+        DoneCondition.wait(locker);
+    }
+}
+
+void WorkerPool::Loop(unsigned workerIndex, uint64_t lastJobNumber)
+{
+    std::unique_lock<std::mutex> locker(Lock);
+    for (;;)
+    {
+        while (!Terminated && JobNumber == lastJobNumber) {
+            StartCondition.wait(locker);
+        }
+        if (Terminated) {
+            break;
+        }
+        lastJobNumber = JobNumber;
+
+        const JobFunction job = Job;
+        void* context         = JobContext;
+        const unsigned count  = WorkerCount;
+
+        locker.unlock();
+        job(context, workerIndex, count);
+        locker.lock();
+
+        if (--RunningCount == 0) {
+            DoneCondition.notify_one();
+        }
+    }
+}
+
+
 } // namespace siamese
@@ -37,12 +37,24 @@
     + Compiler-specific code wrappers
     + PCGRandom implementation
     + Microsecond timing
+    + Sampled histograms
     + Windowed minimum/maximum
+    + Worker thread pool
 */
 
 #include <stdint.h> // uint32_t
 #include <string.h> // memcpy
 #include <new> // std::nothrow
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+    #include <intrin.h> // _BitScanReverse
+#endif
 
 
 //------------------------------------------------------------------------------
@@ -69,6 +81,13 @@
     #define SIAMESE_FORCE_INLINE inline __attribute__((always_inline))
 #endif
 
+// Compiler-specific hint to start loading memory that will be used soon
+#if defined(__GNUC__) || defined(__clang__)
+    #define SIAMESE_PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+    #define SIAMESE_PREFETCH(ptr) do {} while (false);
+#endif
+
 
 namespace siamese {
 
@@ -105,10 +124,100 @@ public:
 //------------------------------------------------------------------------------
 // Timing
 
-/// Platform independent high-resolution timers
+/// Platform independent timers.
+/// GetTimeUsec() is high-resolution, while GetTimeMsec() may use a cheaper
+/// coarse clock.  Both return the application clock if one is set
 uint64_t GetTimeUsec();
 uint64_t GetTimeMsec();
 
+/// Application clock returning monotonic time in microseconds
+typedef uint64_t (*ClockCallback)(void* context);
+
+/// Replace the system clock with an application clock, or null to restore it
+void SetClock(ClockCallback callback, void* context);
+
+/// High-resolution system clock in microseconds, ignoring SetClock()
+uint64_t GetSystemTimeUsec();
+
+
+//------------------------------------------------------------------------------
+// Histogram
+
+/// Returns the highest set bit index 0..63, plus one, or 0 if x == 0
+SIAMESE_FORCE_INLINE unsigned BitLength64(uint64_t x)
+{
+    if (x == 0) {
+        return 0;
+    }
+#ifdef _MSC_VER
+#ifdef _WIN64
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return (unsigned)index + 1;
+#else
+    unsigned long index;
+    if (0 != _BitScanReverse(&index, (uint32_t)(x >> 32)))
+        return (unsigned)index + 33;
+    _BitScanReverse(&index, (uint32_t)x);
+    return (unsigned)index + 1;
+#endif
+#else
+    return 64 - (unsigned)__builtin_clzll(x);
+#endif
+}
+
+/// Histogram with power-of-two buckets, cheap enough to update on hot paths.
+/// Bucket 0 counts zeros and bucket i counts values in [2^(i-1), 2^i).
+/// The last bucket also counts all larger values
+struct Histogram
+{
+    static const unsigned kBucketCount = 32;
+
+    uint64_t Buckets[kBucketCount];
+
+    Histogram()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        memset(Buckets, 0, sizeof(Buckets));
+    }
+
+    SIAMESE_FORCE_INLINE void Add(uint64_t value)
+    {
+        unsigned bucket = BitLength64(value);
+        if (bucket >= kBucketCount) {
+            bucket = kBucketCount - 1;
+        }
+        ++Buckets[bucket];
+    }
+};
+
+/// Picks one of every Period events to profile.  A Period of 0 disables it
+struct ProfileSampler
+{
+    unsigned Period = 0;
+    unsigned Counter = 0;
+
+    /// Should this event be profiled?
+    SIAMESE_FORCE_INLINE bool Sample()
+    {
+        if (Period == 0 || ++Counter < Period) {
+            return false;
+        }
+        Counter = 0;
+        return true;
+    }
+};
+
+/// Read the profiling clock only for sampled events
+SIAMESE_FORCE_INLINE uint64_t GetProfileTimeUsec(bool profile)
+{
+    return profile ? GetSystemTimeUsec() : 0;
+}
+
 
 //------------------------------------------------------------------------------
 // WindowedMinMax
@@ -236,4 +345,78 @@ public:
 };
 
 
+//------------------------------------------------------------------------------
+// WorkerPool
+
+/// Maximum number of workers in a WorkerPool, including the calling thread
+static const unsigned kWorkerPoolMaxWorkers = 16;
+
+/// Small pool of threads that all run the same job and then wait for the next.
+/// The thread calling Run() takes part in the job as worker 0.
+class WorkerPool
+{
+public:
+    /// Job entry point, called once by each worker
+    typedef void (*JobFunction)(void* context, unsigned workerIndex, unsigned workerCount);
+
+    ~WorkerPool()
+    {
+        Stop();
+    }
+
+    /// Start with the given number of workers including the calling thread.
+    /// A worker count of 1 or less stops the pool
+    void Start(unsigned workerCount);
+
+    /// Stop all the background threads
+    void Stop();
+
+    /// Number of workers including the calling thread
+    SIAMESE_FORCE_INLINE unsigned GetWorkerCount() const
+    {
+        return WorkerCount;
+    }
+
+    /// Run job(context, i, count) for each worker i and wait for all of them
+    void Run(JobFunction job, void* context);
+
+protected:
+    /// Number of workers including the calling thread
+    unsigned WorkerCount = 1;
+
+    /// Background threads for workers 1..WorkerCount-1
+    std::vector< std::shared_ptr<std::thread> > Threads;
+
+    /// Lock protecting the members below
+    std::mutex Lock;
+    std::condition_variable StartCondition;
+    std::condition_variable DoneCondition;
+
+    /// Current job
+    JobFunction Job = nullptr;
+    void* JobContext = nullptr;
+
+    /// Incremented each time a new job is started
+    uint64_t JobNumber = 0;
+
+    /// Number of background workers still running the current job
+    unsigned RunningCount = 0;
+
+    /// Set to stop the background threads
+    bool Terminated = false;
+
+
+    /// Background thread loop, which waits for jobs after lastJobNumber
+    void Loop(unsigned workerIndex, uint64_t lastJobNumber);
+};
+
+
+/// Pads an atomic counter out to its own cache line to avoid false sharing
+/// between the workers that update neighboring counters
+struct alignas(64) WorkerCounter
+{
+    std::atomic<unsigned> Value = ATOMIC_VAR_INIT(0);
+};
+
+
 } // namespace siamese
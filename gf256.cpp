@@ -71,8 +71,9 @@ static GF256_FORCE_INLINE uint8x16_t vqtbl1q_u8(uint8x16_t a, uint8x16_t b)
 //
 // This is executed during initialization to make sure the library is working
 
-static const unsigned kTestBufferBytes = 32 + 16 + 8 + 4 + 2 + 1;
-static const unsigned kTestBufferAllocated = 64;
+// Long enough to exercise the unrolled 512-bit loops and every tail case
+static const unsigned kTestBufferBytes = 256 + 64 + 32 + 16 + 8 + 4 + 2 + 1;
+static const unsigned kTestBufferAllocated = 384;
 struct SelfTestBuffersT
 {
     GF256_ALIGNED uint8_t A[kTestBufferAllocated];
@@ -178,6 +179,68 @@ static bool gf256_self_test()
         if (m_SelfTestBuffers.A[i] != expectedMul)
             return false;
 
+    // Test gf256_mul_mem_inplace()
+    const uint8_t expectedMulInPlace = gf256_mul(0x3d, expectedMul);
+    gf256_mul_mem_inplace(m_SelfTestBuffers.A, 0x3d, kTestBufferBytes);
+    for (unsigned i = 0; i < kTestBufferBytes; ++i)
+        if (m_SelfTestBuffers.A[i] != expectedMulInPlace)
+            return false;
+
+    // Test gf256_mul_mem() and gf256_muladd_mem() for every x and y
+    for (unsigned y = 0; y < 256; ++y)
+    {
+        for (unsigned i = 0; i < kTestBufferBytes; ++i)
+        {
+            m_SelfTestBuffers.A[i] = 0x33;
+            m_SelfTestBuffers.B[i] = (uint8_t)i;
+        }
+        gf256_mul_mem(m_SelfTestBuffers.C, m_SelfTestBuffers.B, (uint8_t)y, kTestBufferBytes);
+        gf256_muladd_mem(m_SelfTestBuffers.A, (uint8_t)y, m_SelfTestBuffers.B, kTestBufferBytes);
+        for (unsigned i = 0; i < kTestBufferBytes; ++i)
+        {
+            const uint8_t expected = gf256_mul((uint8_t)i, (uint8_t)y);
+            if (m_SelfTestBuffers.C[i] != expected)
+                return false;
+            if (m_SelfTestBuffers.A[i] != (expected ^ 0x33))
+                return false;
+        }
+    }
+
+    // Test gf256_muladd_multi_mem() with sources of different lengths
+    for (unsigned i = 0; i < kTestBufferBytes; ++i)
+    {
+        m_SelfTestBuffers.A[i] = 0x1f;
+        m_SelfTestBuffers.B[i] = (uint8_t)(i * 3);
+        m_SelfTestBuffers.C[i] = (uint8_t)(i ^ 0x5a);
+    }
+    {
+        const void* sources[3] = { m_SelfTestBuffers.B, m_SelfTestBuffers.C, m_SelfTestBuffers.B + 1 };
+        const int sourceBytes[3] = { (int)kTestBufferBytes, (int)kTestBufferBytes - 37, (int)kTestBufferBytes - 1 };
+        const uint8_t coefficients[3] = { 1, 0x8e, 0x35 };
+        gf256_muladd_multi_mem(m_SelfTestBuffers.A, 3, coefficients, sources, sourceBytes);
+    }
+    for (unsigned i = 0; i < kTestBufferBytes; ++i)
+    {
+        uint8_t expected = 0x1f ^ m_SelfTestBuffers.B[i];
+        if (i < kTestBufferBytes - 37)
+            expected ^= gf256_mul(m_SelfTestBuffers.C[i], 0x8e);
+        if (i < kTestBufferBytes - 1)
+            expected ^= gf256_mul(m_SelfTestBuffers.B[i + 1], 0x35);
+        if (m_SelfTestBuffers.A[i] != expected)
+            return false;
+    }
+
+    // Test gf256_memswap()
+    for (unsigned i = 0; i < kTestBufferBytes; ++i)
+    {
+        m_SelfTestBuffers.A[i] = (uint8_t)i;
+        m_SelfTestBuffers.B[i] = (uint8_t)~i;
+    }
+    gf256_memswap(m_SelfTestBuffers.A, m_SelfTestBuffers.B, kTestBufferBytes);
+    for (unsigned i = 0; i < kTestBufferBytes; ++i)
+        if (m_SelfTestBuffers.A[i] != (uint8_t)~i || m_SelfTestBuffers.B[i] != (uint8_t)i)
+            return false;
+
     if (m_SelfTestBuffers.A[kTestBufferBytes] != 0x5a)
         return false;
     if (m_SelfTestBuffers.B[kTestBufferBytes] != 0x5a)
@@ -202,8 +265,8 @@ static bool gf256_self_test()
 #if defined(GF256_TRY_NEON)
 # if defined(IOS) && defined(__ARM_NEON__)
 // Requires iPhone 5S or newer
-static const bool CpuHasNeon = true;
-static const bool CpuHasNeon64 = true;
+static bool CpuHasNeon = true;
+static bool CpuHasNeon64 = true;
 # else // ANDROID or LINUX_ARM
 #  if defined(__aarch64__)
 static bool CpuHasNeon = true;      // if AARCH64, then we have NEON for sure...
@@ -222,13 +285,41 @@ static bool CpuHasNeon64 = false;   // And we don't have ASIMD
     #pragma warning(disable: 4752) // found Intel(R) Advanced Vector Extensions; consider using /arch:AVX
 #endif
 
+#if defined(GF256_TRY_AVX512) && defined(__GNUC__) && !defined(__clang__)
+    // GCC flags _mm512_undefined_epi32() inside its own AVX-512 intrinsics
+    #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    #pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+
+#if defined(GF256_USE_TARGET_ATTRIBUTES)
+    // AVX-512 and GFNI kernels are only called once CPUID reports them
+    #define GF256_AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+    #define GF256_GFNI_TARGET __attribute__((target("avx512f,avx512bw,gfni")))
+#else
+    #define GF256_AVX512_TARGET
+    #define GF256_GFNI_TARGET
+#endif
+
 #ifdef GF256_TRY_AVX2
 static bool CpuHasAVX2 = false;
 #endif
+#ifdef GF256_TRY_AVX512
+static bool CpuHasAVX512BW = false;
+#endif
+#ifdef GF256_TRY_GFNI
+static bool CpuHasGFNI = false;
+#endif
 static bool CpuHasSSSE3 = false;
 
-#define CPUID_EBX_AVX2    0x00000020
-#define CPUID_ECX_SSSE3   0x00000200
+#define CPUID_EBX_AVX2     0x00000020
+#define CPUID_EBX_AVX512F  0x00010000
+#define CPUID_EBX_AVX512BW 0x40000000
+#define CPUID_ECX_GFNI     0x00000100
+#define CPUID_ECX_SSSE3    0x00000200
+#define CPUID_ECX_OSXSAVE  0x08000000
+
+// XCR0 bits for SSE, AVX, opmask, ZMM0-15 upper halves and ZMM16-31
+#define XCR0_AVX512_STATE  0x000000e6
 
 static void _cpuid(unsigned int cpu_info[4U], const unsigned int cpu_info_type)
 {
@@ -267,6 +358,26 @@ static void _cpuid(unsigned int cpu_info[4U], const unsigned int cpu_info_type)
 #endif
 }
 
+#ifdef GF256_TRY_AVX512
+// Returns true if the OS saves the AVX-512 register state on context switch
+static bool OSHasAVX512State()
+{
+    unsigned int cpu_info[4];
+    _cpuid(cpu_info, 1);
+    if ((cpu_info[2] & CPUID_ECX_OSXSAVE) == 0)
+        return false;
+
+#if defined(_MSC_VER)
+    const unsigned xcr0 = (unsigned)_xgetbv(0);
+#else
+    unsigned xcr0, xcr0_hi;
+    __asm__ __volatile__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0U));
+    (void)xcr0_hi;
+#endif
+    return (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE;
+}
+#endif // GF256_TRY_AVX512
+
 #else
 #if defined(LINUX_ARM)
 static void checkLinuxARMNeonCapabilities( bool& cpuHasNeon )
@@ -327,11 +438,26 @@ static void gf256_architecture_init()
     _cpuid(cpu_info, 1);
     CpuHasSSSE3 = ((cpu_info[2] & CPUID_ECX_SSSE3) != 0);
 
-#if defined(GF256_TRY_AVX2)
+#if defined(GF256_TRY_AVX2) || defined(GF256_TRY_AVX512)
     _cpuid(cpu_info, 7);
+#endif
+#if defined(GF256_TRY_AVX2)
     CpuHasAVX2 = ((cpu_info[1] & CPUID_EBX_AVX2) != 0);
 #endif // GF256_TRY_AVX2
 
+#if defined(GF256_TRY_AVX512)
+    // Note: cpu_info still holds leaf 7 results here
+    const bool hasAVX512 = (cpu_info[1] & CPUID_EBX_AVX512F) != 0 &&
+                           (cpu_info[1] & CPUID_EBX_AVX512BW) != 0;
+    if (hasAVX512 && OSHasAVX512State())
+    {
+        CpuHasAVX512BW = true;
+# if defined(GF256_TRY_GFNI)
+        CpuHasGFNI = ((cpu_info[2] & CPUID_ECX_GFNI) != 0);
+# endif // GF256_TRY_GFNI
+    }
+#endif // GF256_TRY_AVX512
+
     // When AVX2 and SSSE3 are unavailable, Siamese takes 4x longer to decode
     // and 2.6x longer to encode.  Encoding requires a lot more simple XOR ops
     // so it is still pretty fast.  Decoding is usually really quick because
@@ -342,6 +468,95 @@ static void gf256_architecture_init()
 }
 
 
+//------------------------------------------------------------------------------
+// Instruction Set Selection
+
+// Fastest path found by gf256_architecture_init()
+static int DetectedISA = GF256_ISA_PORTABLE;
+
+static void gf256_isa_init()
+{
+    DetectedISA = GF256_ISA_PORTABLE;
+
+#if defined(GF256_TRY_NEON)
+    if (CpuHasNeon)
+        DetectedISA = GF256_ISA_VECTOR128;
+#elif !defined(GF256_TARGET_MOBILE)
+    if (CpuHasSSSE3)
+        DetectedISA = GF256_ISA_VECTOR128;
+# ifdef GF256_TRY_AVX2
+    if (CpuHasAVX2)
+        DetectedISA = GF256_ISA_AVX2;
+# endif // GF256_TRY_AVX2
+# ifdef GF256_TRY_AVX512
+    if (CpuHasAVX512BW)
+        DetectedISA = GF256_ISA_AVX512;
+# endif // GF256_TRY_AVX512
+# ifdef GF256_TRY_GFNI
+    if (CpuHasGFNI)
+        DetectedISA = GF256_ISA_GFNI;
+# endif // GF256_TRY_GFNI
+#endif // GF256_TARGET_MOBILE
+}
+
+extern "C" int gf256_detected_isa()
+{
+    return DetectedISA;
+}
+
+extern "C" int gf256_set_max_isa(int maxIsa)
+{
+    if (maxIsa > DetectedISA)
+        maxIsa = DetectedISA;
+    if (maxIsa < GF256_ISA_PORTABLE)
+        maxIsa = GF256_ISA_PORTABLE;
+
+    // The detected flags can be rebuilt from the level since each level
+    // implies the ones below it.  The tables for every detected path were
+    // already filled in by gf256_init(), so raising the level is safe.
+#if defined(GF256_TRY_NEON)
+    CpuHasNeon = (maxIsa >= GF256_ISA_VECTOR128);
+#elif !defined(GF256_TARGET_MOBILE)
+    CpuHasSSSE3 = (maxIsa >= GF256_ISA_VECTOR128);
+# ifdef GF256_TRY_AVX2
+    CpuHasAVX2 = (maxIsa >= GF256_ISA_AVX2);
+# endif // GF256_TRY_AVX2
+# ifdef GF256_TRY_AVX512
+    CpuHasAVX512BW = (maxIsa >= GF256_ISA_AVX512);
+# endif // GF256_TRY_AVX512
+# ifdef GF256_TRY_GFNI
+    CpuHasGFNI = (maxIsa >= GF256_ISA_GFNI);
+# endif // GF256_TRY_GFNI
+#endif // GF256_TARGET_MOBILE
+
+    return maxIsa;
+}
+
+extern "C" const char* gf256_isa_name(int isa)
+{
+    switch (isa)
+    {
+    case GF256_ISA_PORTABLE:
+        return "portable";
+    case GF256_ISA_VECTOR128:
+#if defined(GF256_TARGET_MOBILE)
+        return "neon";
+#else
+        return "ssse3";
+#endif
+    case GF256_ISA_AVX2:
+        return "avx2";
+    case GF256_ISA_AVX512:
+        return "avx512bw";
+    case GF256_ISA_GFNI:
+        return "gfni";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+
 //------------------------------------------------------------------------------
 // Context Object
 
@@ -555,6 +770,18 @@ static void gf256_sqr_init()
         Computes the bitwise XOR of the 128-bit value in a and the 128-bit value in b.
 */
 
+#if defined(GF256_TRY_AVX512)
+// Fill in the 512-bit tables for y from the 128-bit ones
+GF256_AVX512_TARGET static void gf256_mul_mem_init_avx512(
+    int y, GF256_M128 table_lo, GF256_M128 table_hi)
+{
+    const GF256_M512 table_lo4 = _mm512_broadcast_i32x4(table_lo);
+    const GF256_M512 table_hi4 = _mm512_broadcast_i32x4(table_hi);
+    _mm512_storeu_si512(GF256Ctx.MM512.TABLE_LO_Y + y, table_lo4);
+    _mm512_storeu_si512(GF256Ctx.MM512.TABLE_HI_Y + y, table_hi4);
+}
+#endif // GF256_TRY_AVX512
+
 // Initialize the multiplication tables using gf256_mul()
 static void gf256_mul_mem_init()
 {
@@ -591,6 +818,27 @@ static void gf256_mul_mem_init()
             _mm256_storeu_si256(GF256Ctx.MM256.TABLE_HI_Y + y, table_hi2);
         }
 # endif // GF256_TRY_AVX2
+# ifdef GF256_TRY_AVX512
+        if (CpuHasAVX512BW)
+            gf256_mul_mem_init_avx512(y, table_lo, table_hi);
+# endif // GF256_TRY_AVX512
+# ifdef GF256_TRY_GFNI
+        /*
+            Multiplication by y is linear over GF(2), so it can be written as
+            an 8x8 bit matrix.  vgf2p8affineqb computes output bit i as the
+            parity of (matrix byte 7-i AND x), so byte 7-i holds the bit i of
+            each product y * 2^j for j = 0..7.
+        */
+        uint64_t matrix = 0;
+        for (unsigned i = 0; i < 8; ++i)
+        {
+            unsigned row = 0;
+            for (unsigned j = 0; j < 8; ++j)
+                row |= ((gf256_mul((uint8_t)(1 << j), static_cast<uint8_t>( y )) >> i) & 1) << j;
+            matrix |= (uint64_t)row << ((7 - i) * 8);
+        }
+        GF256Ctx.GFNI_AFFINE_Y[y] = matrix;
+# endif // GF256_TRY_GFNI
 #endif // GF256_TARGET_MOBILE
     }
 }
@@ -633,6 +881,7 @@ extern "C" int gf256_init_(int version)
         return -2; // Unexpected byte order.
 
     gf256_architecture_init();
+    gf256_isa_init();
     gf256_poly_init(kDefaultPolynomialIndex);
     gf256_explog_init();
     gf256_muldiv_init();
@@ -650,6 +899,54 @@ extern "C" int gf256_init_(int version)
 //------------------------------------------------------------------------------
 // Operations
 
+#if defined(GF256_TRY_AVX512)
+/// Handles the multiples of 64 bytes for gf256_add_mem()
+GF256_AVX512_TARGET static void gf256_add_mem_avx512(
+    GF256_M128 * GF256_RESTRICT & x16, const GF256_M128 * GF256_RESTRICT & y16, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<GF256_M512 *>(x16);
+    const GF256_M512 * GF256_RESTRICT y64 = reinterpret_cast<const GF256_M512 *>(y16);
+
+    while (bytes >= 256)
+    {
+        GF256_M512 x0 = _mm512_loadu_si512(x64);
+        GF256_M512 y0 = _mm512_loadu_si512(y64);
+        x0 = _mm512_xor_si512(x0, y0);
+        GF256_M512 x1 = _mm512_loadu_si512(x64 + 1);
+        GF256_M512 y1 = _mm512_loadu_si512(y64 + 1);
+        x1 = _mm512_xor_si512(x1, y1);
+        GF256_M512 x2 = _mm512_loadu_si512(x64 + 2);
+        GF256_M512 y2 = _mm512_loadu_si512(y64 + 2);
+        x2 = _mm512_xor_si512(x2, y2);
+        GF256_M512 x3 = _mm512_loadu_si512(x64 + 3);
+        GF256_M512 y3 = _mm512_loadu_si512(y64 + 3);
+        x3 = _mm512_xor_si512(x3, y3);
+
+        _mm512_storeu_si512(x64, x0);
+        _mm512_storeu_si512(x64 + 1, x1);
+        _mm512_storeu_si512(x64 + 2, x2);
+        _mm512_storeu_si512(x64 + 3, x3);
+
+        bytes -= 256, x64 += 4, y64 += 4;
+    }
+
+    // Handle multiples of 64 bytes
+    while (bytes >= 64)
+    {
+        // x[i] = x[i] xor y[i]
+        _mm512_storeu_si512(x64,
+            _mm512_xor_si512(
+                _mm512_loadu_si512(x64),
+                _mm512_loadu_si512(y64)));
+
+        bytes -= 64, ++x64, ++y64;
+    }
+
+    x16 = reinterpret_cast<GF256_M128 *>(x64);
+    y16 = reinterpret_cast<const GF256_M128 *>(y64);
+}
+#endif // GF256_TRY_AVX512
+
 extern "C" void gf256_add_mem(void * GF256_RESTRICT vx,
                               const void * GF256_RESTRICT vy, int bytes)
 {
@@ -707,6 +1004,10 @@ extern "C" void gf256_add_mem(void * GF256_RESTRICT vx,
         bytes -= (count * 8);
     }
 #else // GF256_TARGET_MOBILE
+# if defined(GF256_TRY_AVX512)
+    if (CpuHasAVX512BW)
+        gf256_add_mem_avx512(x16, y16, bytes);
+# endif // GF256_TRY_AVX512
 # if defined(GF256_TRY_AVX2)
     if (CpuHasAVX2)
     {
@@ -829,6 +1130,35 @@ extern "C" void gf256_add_mem(void * GF256_RESTRICT vx,
     }
 }
 
+#if defined(GF256_TRY_AVX512)
+/// Handles the multiples of 64 bytes for gf256_add2_mem()
+GF256_AVX512_TARGET static void gf256_add2_mem_avx512(
+    GF256_M128 * GF256_RESTRICT & z16, const GF256_M128 * GF256_RESTRICT & x16,
+    const GF256_M128 * GF256_RESTRICT & y16, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT z64 = reinterpret_cast<GF256_M512 *>(z16);
+    const GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<const GF256_M512 *>(x16);
+    const GF256_M512 * GF256_RESTRICT y64 = reinterpret_cast<const GF256_M512 *>(y16);
+
+    const unsigned count = bytes / 64;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        // z[i] = z[i] xor x[i] xor y[i] : 0x96 is the 3-input XOR truth table
+        _mm512_storeu_si512(z64 + i,
+            _mm512_ternarylogic_epi64(
+                _mm512_loadu_si512(z64 + i),
+                _mm512_loadu_si512(x64 + i),
+                _mm512_loadu_si512(y64 + i),
+                0x96));
+    }
+
+    bytes -= count * 64;
+    z16 = reinterpret_cast<GF256_M128 *>(z64 + count);
+    x16 = reinterpret_cast<const GF256_M128 *>(x64 + count);
+    y16 = reinterpret_cast<const GF256_M128 *>(y64 + count);
+}
+#endif // GF256_TRY_AVX512
+
 extern "C" void gf256_add2_mem(void * GF256_RESTRICT vz, const void * GF256_RESTRICT vx,
                                const void * GF256_RESTRICT vy, int bytes)
 {
@@ -873,6 +1203,10 @@ extern "C" void gf256_add2_mem(void * GF256_RESTRICT vz, const void * GF256_REST
         bytes -= (count * 8);
     }
 #else // GF256_TARGET_MOBILE
+# if defined(GF256_TRY_AVX512)
+    if (CpuHasAVX512BW)
+        gf256_add2_mem_avx512(z16, x16, y16, bytes);
+# endif // GF256_TRY_AVX512
 # if defined(GF256_TRY_AVX2)
     if (CpuHasAVX2)
     {
@@ -952,6 +1286,32 @@ extern "C" void gf256_add2_mem(void * GF256_RESTRICT vz, const void * GF256_REST
     }
 }
 
+#if defined(GF256_TRY_AVX512)
+/// Handles the multiples of 64 bytes for gf256_addset_mem()
+GF256_AVX512_TARGET static void gf256_addset_mem_avx512(
+    GF256_M128 * GF256_RESTRICT & z16, const GF256_M128 * GF256_RESTRICT & x16,
+    const GF256_M128 * GF256_RESTRICT & y16, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT z64 = reinterpret_cast<GF256_M512 *>(z16);
+    const GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<const GF256_M512 *>(x16);
+    const GF256_M512 * GF256_RESTRICT y64 = reinterpret_cast<const GF256_M512 *>(y16);
+
+    const unsigned count = bytes / 64;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        _mm512_storeu_si512(z64 + i,
+            _mm512_xor_si512(
+                _mm512_loadu_si512(x64 + i),
+                _mm512_loadu_si512(y64 + i)));
+    }
+
+    bytes -= count * 64;
+    z16 = reinterpret_cast<GF256_M128 *>(z64 + count);
+    x16 = reinterpret_cast<const GF256_M128 *>(x64 + count);
+    y16 = reinterpret_cast<const GF256_M128 *>(y64 + count);
+}
+#endif // GF256_TRY_AVX512
+
 extern "C" void gf256_addset_mem(void * GF256_RESTRICT vz, const void * GF256_RESTRICT vx,
                                  const void * GF256_RESTRICT vy, int bytes)
 {
@@ -1013,6 +1373,10 @@ extern "C" void gf256_addset_mem(void * GF256_RESTRICT vz, const void * GF256_RE
         bytes -= (count * 8);
     }
 #else // GF256_TARGET_MOBILE
+# if defined(GF256_TRY_AVX512)
+    if (CpuHasAVX512BW)
+        gf256_addset_mem_avx512(z16, x16, y16, bytes);
+# endif // GF256_TRY_AVX512
 # if defined(GF256_TRY_AVX2)
     if (CpuHasAVX2)
     {
@@ -1110,7 +1474,71 @@ extern "C" void gf256_addset_mem(void * GF256_RESTRICT vz, const void * GF256_RE
     }
 }
 
-extern "C" void gf256_mul_mem(void * GF256_RESTRICT vz, const void * GF256_RESTRICT vx, uint8_t y, int bytes)
+#if defined(GF256_TRY_GFNI)
+/// Handles the multiples of 64 bytes for gf256_mul_mem() with GFNI
+GF256_GFNI_TARGET static void gf256_mul_mem_gfni(
+    GF256_M128 * GF256_RESTRICT & z16, const GF256_M128 * GF256_RESTRICT & x16,
+    uint8_t y, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT z64 = reinterpret_cast<GF256_M512 *>(z16);
+    const GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<const GF256_M512 *>(x16);
+
+    // Bit matrix that multiplies by y; see gf256_mul_mem_init()
+    const GF256_M512 matrix_y = _mm512_set1_epi64((long long)GF256Ctx.GFNI_AFFINE_Y[y]);
+
+    // Handle multiples of 64 bytes
+    do
+    {
+        const GF256_M512 x0 = _mm512_loadu_si512(x64);
+        _mm512_storeu_si512(z64, _mm512_gf2p8affine_epi64_epi8(x0, matrix_y, 0));
+
+        bytes -= 64, ++x64, ++z64;
+    } while (bytes >= 64);
+
+    z16 = reinterpret_cast<GF256_M128 *>(z64);
+    x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
+#endif // GF256_TRY_GFNI
+
+#if defined(GF256_TRY_AVX512)
+/// Handles the multiples of 64 bytes for gf256_mul_mem()
+GF256_AVX512_TARGET static void gf256_mul_mem_avx512(
+    GF256_M128 * GF256_RESTRICT & z16, const GF256_M128 * GF256_RESTRICT & x16,
+    uint8_t y, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT z64 = reinterpret_cast<GF256_M512 *>(z16);
+    const GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<const GF256_M512 *>(x16);
+
+    // Partial product tables; see above
+    const GF256_M512 table_lo_y = _mm512_loadu_si512(GF256Ctx.MM512.TABLE_LO_Y + y);
+    const GF256_M512 table_hi_y = _mm512_loadu_si512(GF256Ctx.MM512.TABLE_HI_Y + y);
+
+    // clr_mask = 0x0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f
+    const GF256_M512 clr_mask = _mm512_set1_epi8(0x0f);
+
+    // Handle multiples of 64 bytes
+    do
+    {
+        // See above comments for details
+        GF256_M512 x0 = _mm512_loadu_si512(x64);
+        GF256_M512 l0 = _mm512_and_si512(x0, clr_mask);
+        x0 = _mm512_srli_epi64(x0, 4);
+        GF256_M512 h0 = _mm512_and_si512(x0, clr_mask);
+        l0 = _mm512_shuffle_epi8(table_lo_y, l0);
+        h0 = _mm512_shuffle_epi8(table_hi_y, h0);
+        _mm512_storeu_si512(z64, _mm512_xor_si512(l0, h0));
+
+        bytes -= 64, ++x64, ++z64;
+    } while (bytes >= 64);
+
+    z16 = reinterpret_cast<GF256_M128 *>(z64);
+    x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
+#endif // GF256_TRY_AVX512
+
+/// Shared by gf256_mul_mem() and gf256_mul_mem_inplace().
+/// Each block of x[] is loaded before z[] is stored, so vz may equal vx
+static void gf256_mul_mem_kernel(void * vz, const void * vx, uint8_t y, int bytes)
 {
     // Use a single if-statement to handle special cases
     if (y <= 1)
@@ -1153,6 +1581,17 @@ extern "C" void gf256_mul_mem(void * GF256_RESTRICT vz, const void * GF256_RESTR
     }
 #endif
 #else
+# if defined(GF256_TRY_AVX512)
+    if (bytes >= 64 && CpuHasAVX512BW)
+    {
+#  if defined(GF256_TRY_GFNI)
+        if (CpuHasGFNI)
+            gf256_mul_mem_gfni(z16, x16, y, bytes);
+        else
+#  endif // GF256_TRY_GFNI
+            gf256_mul_mem_avx512(z16, x16, y, bytes);
+    }
+# endif // GF256_TRY_AVX512
 # if defined(GF256_TRY_AVX2)
     if (bytes >= 32 && CpuHasAVX2)
     {
@@ -1163,8 +1602,8 @@ extern "C" void gf256_mul_mem(void * GF256_RESTRICT vz, const void * GF256_RESTR
         // clr_mask = 0x0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f
         const GF256_M256 clr_mask = _mm256_set1_epi8(0x0f);
 
-        GF256_M256 * GF256_RESTRICT z32 = reinterpret_cast<GF256_M256 *>(vz);
-        const GF256_M256 * GF256_RESTRICT x32 = reinterpret_cast<const GF256_M256 *>(vx);
+        GF256_M256 * GF256_RESTRICT z32 = reinterpret_cast<GF256_M256 *>(z16);
+        const GF256_M256 * GF256_RESTRICT x32 = reinterpret_cast<const GF256_M256 *>(x16);
 
         // Handle multiples of 32 bytes
         do
@@ -1277,6 +1716,90 @@ extern "C" void gf256_mul_mem(void * GF256_RESTRICT vz, const void * GF256_RESTR
     }
 }
 
+extern "C" void gf256_mul_mem(void * GF256_RESTRICT vz, const void * GF256_RESTRICT vx, uint8_t y, int bytes)
+{
+    gf256_mul_mem_kernel(vz, vx, y, bytes);
+}
+
+extern "C" void gf256_mul_mem_inplace(void * vz, uint8_t y, int bytes)
+{
+    gf256_mul_mem_kernel(vz, vz, y, bytes);
+}
+
+#if defined(GF256_TRY_GFNI)
+/// Handles the multiples of 64 bytes for gf256_muladd_mem() with GFNI
+GF256_GFNI_TARGET static void gf256_muladd_mem_gfni(
+    GF256_M128 * GF256_RESTRICT & z16, uint8_t y,
+    const GF256_M128 * GF256_RESTRICT & x16, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT z64 = reinterpret_cast<GF256_M512 *>(z16);
+    const GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<const GF256_M512 *>(x16);
+
+    // Bit matrix that multiplies by y; see gf256_mul_mem_init()
+    const GF256_M512 matrix_y = _mm512_set1_epi64((long long)GF256Ctx.GFNI_AFFINE_Y[y]);
+
+    while (bytes >= 128)
+    {
+        const GF256_M512 p0 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64), matrix_y, 0);
+        const GF256_M512 p1 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64 + 1), matrix_y, 0);
+        _mm512_storeu_si512(z64, _mm512_xor_si512(p0, _mm512_loadu_si512(z64)));
+        _mm512_storeu_si512(z64 + 1, _mm512_xor_si512(p1, _mm512_loadu_si512(z64 + 1)));
+
+        bytes -= 128, x64 += 2, z64 += 2;
+    }
+
+    // Handle multiples of 64 bytes
+    while (bytes >= 64)
+    {
+        const GF256_M512 p0 = _mm512_gf2p8affine_epi64_epi8(_mm512_loadu_si512(x64), matrix_y, 0);
+        _mm512_storeu_si512(z64, _mm512_xor_si512(p0, _mm512_loadu_si512(z64)));
+
+        bytes -= 64, ++x64, ++z64;
+    }
+
+    z16 = reinterpret_cast<GF256_M128 *>(z64);
+    x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
+#endif // GF256_TRY_GFNI
+
+#if defined(GF256_TRY_AVX512)
+/// Handles the multiples of 64 bytes for gf256_muladd_mem()
+GF256_AVX512_TARGET static void gf256_muladd_mem_avx512(
+    GF256_M128 * GF256_RESTRICT & z16, uint8_t y,
+    const GF256_M128 * GF256_RESTRICT & x16, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT z64 = reinterpret_cast<GF256_M512 *>(z16);
+    const GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<const GF256_M512 *>(x16);
+
+    // Partial product tables; see above
+    const GF256_M512 table_lo_y = _mm512_loadu_si512(GF256Ctx.MM512.TABLE_LO_Y + y);
+    const GF256_M512 table_hi_y = _mm512_loadu_si512(GF256Ctx.MM512.TABLE_HI_Y + y);
+
+    // clr_mask = 0x0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f
+    const GF256_M512 clr_mask = _mm512_set1_epi8(0x0f);
+
+    // Handle multiples of 64 bytes
+    do
+    {
+        // See above comments for details
+        GF256_M512 x0 = _mm512_loadu_si512(x64);
+        GF256_M512 l0 = _mm512_and_si512(x0, clr_mask);
+        x0 = _mm512_srli_epi64(x0, 4);
+        const GF256_M512 z0 = _mm512_loadu_si512(z64);
+        GF256_M512 h0 = _mm512_and_si512(x0, clr_mask);
+        l0 = _mm512_shuffle_epi8(table_lo_y, l0);
+        h0 = _mm512_shuffle_epi8(table_hi_y, h0);
+        // z0 ^ l0 ^ h0
+        _mm512_storeu_si512(z64, _mm512_ternarylogic_epi64(z0, l0, h0, 0x96));
+
+        bytes -= 64, ++x64, ++z64;
+    } while (bytes >= 64);
+
+    z16 = reinterpret_cast<GF256_M128 *>(z64);
+    x16 = reinterpret_cast<const GF256_M128 *>(x64);
+}
+#endif // GF256_TRY_AVX512
+
 extern "C" void gf256_muladd_mem(void * GF256_RESTRICT vz, uint8_t y,
                                  const void * GF256_RESTRICT vx, int bytes)
 {
@@ -1322,6 +1845,17 @@ extern "C" void gf256_muladd_mem(void * GF256_RESTRICT vz, uint8_t y,
     }
 #endif
 #else // GF256_TARGET_MOBILE
+# if defined(GF256_TRY_AVX512)
+    if (bytes >= 64 && CpuHasAVX512BW)
+    {
+#  if defined(GF256_TRY_GFNI)
+        if (CpuHasGFNI)
+            gf256_muladd_mem_gfni(z16, y, x16, bytes);
+        else
+#  endif // GF256_TRY_GFNI
+            gf256_muladd_mem_avx512(z16, y, x16, bytes);
+    }
+# endif // GF256_TRY_AVX512
 # if defined(GF256_TRY_AVX2)
     if (bytes >= 32 && CpuHasAVX2)
     {
@@ -1509,6 +2043,335 @@ extern "C" void gf256_muladd_mem(void * GF256_RESTRICT vz, uint8_t y,
     }
 }
 
+//------------------------------------------------------------------------------
+// Multi-Source Multiply-Add
+
+#if !defined(GF256_TARGET_MOBILE)
+
+/// Number of sources combined in each pass over the destination
+static const unsigned kMultiMaxSources = 16;
+
+/// Number of destination bytes accumulated in registers at a time
+static const unsigned kMultiBlockBytes = 256;
+
+# if defined(GF256_TRY_GFNI)
+/// AVX-512 block of gf256_muladd_multi_block() with GFNI
+GF256_GFNI_TARGET static void gf256_muladd_multi_block_gfni(
+    uint8_t * GF256_RESTRICT z, unsigned count,
+    const uint8_t * GF256_RESTRICT y,
+    const uint8_t * const * GF256_RESTRICT x,
+    unsigned offset)
+{
+    GF256_M512 z0 = _mm512_loadu_si512(z);
+    GF256_M512 z1 = _mm512_loadu_si512(z + 64);
+    GF256_M512 z2 = _mm512_loadu_si512(z + 128);
+    GF256_M512 z3 = _mm512_loadu_si512(z + 192);
+
+    for (unsigned s = 0; s < count; ++s)
+    {
+        const uint8_t * GF256_RESTRICT xs = x[s] + offset;
+        GF256_M512 x0 = _mm512_loadu_si512(xs);
+        GF256_M512 x1 = _mm512_loadu_si512(xs + 64);
+        GF256_M512 x2 = _mm512_loadu_si512(xs + 128);
+        GF256_M512 x3 = _mm512_loadu_si512(xs + 192);
+        if (y[s] != 1)
+        {
+            // See gf256_mul_mem_init() for the bit matrix layout
+            const GF256_M512 matrix_y = _mm512_set1_epi64((long long)GF256Ctx.GFNI_AFFINE_Y[y[s]]);
+            x0 = _mm512_gf2p8affine_epi64_epi8(x0, matrix_y, 0);
+            x1 = _mm512_gf2p8affine_epi64_epi8(x1, matrix_y, 0);
+            x2 = _mm512_gf2p8affine_epi64_epi8(x2, matrix_y, 0);
+            x3 = _mm512_gf2p8affine_epi64_epi8(x3, matrix_y, 0);
+        }
+        z0 = _mm512_xor_si512(z0, x0);
+        z1 = _mm512_xor_si512(z1, x1);
+        z2 = _mm512_xor_si512(z2, x2);
+        z3 = _mm512_xor_si512(z3, x3);
+    }
+
+    _mm512_storeu_si512(z, z0);
+    _mm512_storeu_si512(z + 64, z1);
+    _mm512_storeu_si512(z + 128, z2);
+    _mm512_storeu_si512(z + 192, z3);
+}
+# endif // GF256_TRY_GFNI
+
+# if defined(GF256_TRY_AVX512)
+/// AVX-512 block of gf256_muladd_multi_block()
+GF256_AVX512_TARGET static void gf256_muladd_multi_block_avx512(
+    uint8_t * GF256_RESTRICT z, unsigned count,
+    const uint8_t * GF256_RESTRICT y,
+    const uint8_t * const * GF256_RESTRICT x,
+    unsigned offset)
+{
+    GF256_M512 z0 = _mm512_loadu_si512(z);
+    GF256_M512 z1 = _mm512_loadu_si512(z + 64);
+    GF256_M512 z2 = _mm512_loadu_si512(z + 128);
+    GF256_M512 z3 = _mm512_loadu_si512(z + 192);
+
+    const GF256_M512 clr_mask = _mm512_set1_epi8(0x0f);
+
+    for (unsigned s = 0; s < count; ++s)
+    {
+        const uint8_t * GF256_RESTRICT xs = x[s] + offset;
+        GF256_M512 x0 = _mm512_loadu_si512(xs);
+        GF256_M512 x1 = _mm512_loadu_si512(xs + 64);
+        GF256_M512 x2 = _mm512_loadu_si512(xs + 128);
+        GF256_M512 x3 = _mm512_loadu_si512(xs + 192);
+        if (y[s] != 1)
+        {
+            // See above comments for details
+            const GF256_M512 table_lo_y = _mm512_loadu_si512(GF256Ctx.MM512.TABLE_LO_Y + y[s]);
+            const GF256_M512 table_hi_y = _mm512_loadu_si512(GF256Ctx.MM512.TABLE_HI_Y + y[s]);
+#  define GF256_MULTI_MUL512(xn) \
+            { \
+                GF256_M512 l = _mm512_and_si512(xn, clr_mask); \
+                GF256_M512 h = _mm512_and_si512(_mm512_srli_epi64(xn, 4), clr_mask); \
+                xn = _mm512_xor_si512(_mm512_shuffle_epi8(table_lo_y, l), _mm512_shuffle_epi8(table_hi_y, h)); \
+            }
+            GF256_MULTI_MUL512(x0)
+            GF256_MULTI_MUL512(x1)
+            GF256_MULTI_MUL512(x2)
+            GF256_MULTI_MUL512(x3)
+#  undef GF256_MULTI_MUL512
+        }
+        z0 = _mm512_xor_si512(z0, x0);
+        z1 = _mm512_xor_si512(z1, x1);
+        z2 = _mm512_xor_si512(z2, x2);
+        z3 = _mm512_xor_si512(z3, x3);
+    }
+
+    _mm512_storeu_si512(z, z0);
+    _mm512_storeu_si512(z + 64, z1);
+    _mm512_storeu_si512(z + 128, z2);
+    _mm512_storeu_si512(z + 192, z3);
+}
+# endif // GF256_TRY_AVX512
+
+// Performs z[offset..offset+256) += x[0][] * y[0] + ... for sources that all cover the block.
+// The block of z is loaded once, accumulates all sources in registers, and is stored once
+static void gf256_muladd_multi_block(uint8_t * GF256_RESTRICT z, unsigned count,
+                                     const uint8_t * GF256_RESTRICT y,
+                                     const uint8_t * const * GF256_RESTRICT x,
+                                     unsigned offset)
+{
+    z += offset;
+
+# if defined(GF256_TRY_AVX512)
+    if (CpuHasAVX512BW)
+    {
+#  if defined(GF256_TRY_GFNI)
+        if (CpuHasGFNI)
+            gf256_muladd_multi_block_gfni(z, count, y, x, offset);
+        else
+#  endif // GF256_TRY_GFNI
+            gf256_muladd_multi_block_avx512(z, count, y, x, offset);
+        return;
+    }
+# endif // GF256_TRY_AVX512
+# if defined(GF256_TRY_AVX2)
+    if (CpuHasAVX2)
+    {
+        const GF256_M256 clr_mask = _mm256_set1_epi8(0x0f);
+
+        for (unsigned i = 0; i < kMultiBlockBytes; i += 128)
+        {
+            GF256_M256 * GF256_RESTRICT z32 = reinterpret_cast<GF256_M256 *>(z + i);
+            GF256_M256 z0 = _mm256_loadu_si256(z32);
+            GF256_M256 z1 = _mm256_loadu_si256(z32 + 1);
+            GF256_M256 z2 = _mm256_loadu_si256(z32 + 2);
+            GF256_M256 z3 = _mm256_loadu_si256(z32 + 3);
+
+            for (unsigned s = 0; s < count; ++s)
+            {
+                const GF256_M256 * GF256_RESTRICT x32 = reinterpret_cast<const GF256_M256 *>(x[s] + offset + i);
+                GF256_M256 x0 = _mm256_loadu_si256(x32);
+                GF256_M256 x1 = _mm256_loadu_si256(x32 + 1);
+                GF256_M256 x2 = _mm256_loadu_si256(x32 + 2);
+                GF256_M256 x3 = _mm256_loadu_si256(x32 + 3);
+                if (y[s] != 1)
+                {
+                    // See above comments for details
+                    const GF256_M256 table_lo_y = _mm256_loadu_si256(GF256Ctx.MM256.TABLE_LO_Y + y[s]);
+                    const GF256_M256 table_hi_y = _mm256_loadu_si256(GF256Ctx.MM256.TABLE_HI_Y + y[s]);
+# define GF256_MULTI_MUL256(xn) \
+                    { \
+                        GF256_M256 l = _mm256_and_si256(xn, clr_mask); \
+                        GF256_M256 h = _mm256_and_si256(_mm256_srli_epi64(xn, 4), clr_mask); \
+                        xn = _mm256_xor_si256(_mm256_shuffle_epi8(table_lo_y, l), _mm256_shuffle_epi8(table_hi_y, h)); \
+                    }
+                    GF256_MULTI_MUL256(x0)
+                    GF256_MULTI_MUL256(x1)
+                    GF256_MULTI_MUL256(x2)
+                    GF256_MULTI_MUL256(x3)
+# undef GF256_MULTI_MUL256
+                }
+                z0 = _mm256_xor_si256(z0, x0);
+                z1 = _mm256_xor_si256(z1, x1);
+                z2 = _mm256_xor_si256(z2, x2);
+                z3 = _mm256_xor_si256(z3, x3);
+            }
+
+            _mm256_storeu_si256(z32, z0);
+            _mm256_storeu_si256(z32 + 1, z1);
+            _mm256_storeu_si256(z32 + 2, z2);
+            _mm256_storeu_si256(z32 + 3, z3);
+        }
+        return;
+    }
+# endif // GF256_TRY_AVX2
+
+    const GF256_M128 clr_mask = _mm_set1_epi8(0x0f);
+
+    for (unsigned i = 0; i < kMultiBlockBytes; i += 64)
+    {
+        GF256_M128 * GF256_RESTRICT z16 = reinterpret_cast<GF256_M128 *>(z + i);
+        GF256_M128 z0 = _mm_loadu_si128(z16);
+        GF256_M128 z1 = _mm_loadu_si128(z16 + 1);
+        GF256_M128 z2 = _mm_loadu_si128(z16 + 2);
+        GF256_M128 z3 = _mm_loadu_si128(z16 + 3);
+
+        for (unsigned s = 0; s < count; ++s)
+        {
+            const GF256_M128 * GF256_RESTRICT x16 = reinterpret_cast<const GF256_M128 *>(x[s] + offset + i);
+            GF256_M128 x0 = _mm_loadu_si128(x16);
+            GF256_M128 x1 = _mm_loadu_si128(x16 + 1);
+            GF256_M128 x2 = _mm_loadu_si128(x16 + 2);
+            GF256_M128 x3 = _mm_loadu_si128(x16 + 3);
+            if (y[s] != 1)
+            {
+                // See above comments for details
+                const GF256_M128 table_lo_y = _mm_loadu_si128(GF256Ctx.MM128.TABLE_LO_Y + y[s]);
+                const GF256_M128 table_hi_y = _mm_loadu_si128(GF256Ctx.MM128.TABLE_HI_Y + y[s]);
+#define GF256_MULTI_MUL128(xn) \
+                { \
+                    GF256_M128 l = _mm_and_si128(xn, clr_mask); \
+                    GF256_M128 h = _mm_and_si128(_mm_srli_epi64(xn, 4), clr_mask); \
+                    xn = _mm_xor_si128(_mm_shuffle_epi8(table_lo_y, l), _mm_shuffle_epi8(table_hi_y, h)); \
+                }
+                GF256_MULTI_MUL128(x0)
+                GF256_MULTI_MUL128(x1)
+                GF256_MULTI_MUL128(x2)
+                GF256_MULTI_MUL128(x3)
+#undef GF256_MULTI_MUL128
+            }
+            z0 = _mm_xor_si128(z0, x0);
+            z1 = _mm_xor_si128(z1, x1);
+            z2 = _mm_xor_si128(z2, x2);
+            z3 = _mm_xor_si128(z3, x3);
+        }
+
+        _mm_storeu_si128(z16, z0);
+        _mm_storeu_si128(z16 + 1, z1);
+        _mm_storeu_si128(z16 + 2, z2);
+        _mm_storeu_si128(z16 + 3, z3);
+    }
+}
+
+#endif // GF256_TARGET_MOBILE
+
+extern "C" void gf256_muladd_multi_mem(void * GF256_RESTRICT vz, unsigned count,
+                                       const uint8_t * GF256_RESTRICT y,
+                                       const void * const * GF256_RESTRICT vx,
+                                       const int * GF256_RESTRICT xbytes)
+{
+#if !defined(GF256_TARGET_MOBILE)
+    if (CpuHasSSSE3)
+    {
+        uint8_t * GF256_RESTRICT z = reinterpret_cast<uint8_t *>(vz);
+
+        while (count > 0)
+        {
+            const unsigned batch = count < kMultiMaxSources ? count : kMultiMaxSources;
+
+            // Collect the sources that contribute, sorted longest first
+            const uint8_t * activeX[kMultiMaxSources];
+            uint8_t activeY[kMultiMaxSources];
+            unsigned activeBytes[kMultiMaxSources];
+            unsigned active = 0;
+
+            for (unsigned s = 0; s < batch; ++s)
+            {
+                const uint8_t ys = y ? y[s] : (uint8_t)1;
+                if (ys == 0 || xbytes[s] <= 0)
+                    continue;
+
+                unsigned j = active++;
+                for (; j > 0 && activeBytes[j - 1] < (unsigned)xbytes[s]; --j)
+                {
+                    activeX[j] = activeX[j - 1];
+                    activeY[j] = activeY[j - 1];
+                    activeBytes[j] = activeBytes[j - 1];
+                }
+                activeX[j] = reinterpret_cast<const uint8_t *>(vx[s]);
+                activeY[j] = ys;
+                activeBytes[j] = (unsigned)xbytes[s];
+            }
+
+            /*
+                Walk the destination in blocks that every remaining source
+                covers, so each block of z[] is loaded and stored once.
+                As each source runs out, its partial last block is added on
+                its own; and once only one source remains the regular
+                single-source routine finishes it.
+            */
+            for (unsigned offset = 0; active > 0; offset += kMultiBlockBytes)
+            {
+                while (active > 0 && activeBytes[active - 1] < offset + kMultiBlockBytes)
+                {
+                    --active;
+                    if (activeBytes[active] > offset)
+                        gf256_muladd_mem(z + offset, activeY[active], activeX[active] + offset, (int)(activeBytes[active] - offset));
+                }
+
+                if (active == 1)
+                {
+                    gf256_muladd_mem(z + offset, activeY[0], activeX[0] + offset, (int)(activeBytes[0] - offset));
+                    break;
+                }
+
+                if (active > 0)
+                    gf256_muladd_multi_block(z, active, activeY, activeX, offset);
+            }
+
+            count -= batch, vx += batch, xbytes += batch;
+            if (y)
+                y += batch;
+        }
+        return;
+    }
+#endif // GF256_TARGET_MOBILE
+
+    // Fall back to one pass per source
+    for (unsigned s = 0; s < count; ++s)
+        if (xbytes[s] > 0)
+            gf256_muladd_mem(vz, y ? y[s] : (uint8_t)1, vx[s], xbytes[s]);
+}
+
+#if defined(GF256_TRY_AVX512)
+/// Handles the multiples of 64 bytes for gf256_memswap()
+GF256_AVX512_TARGET static void gf256_memswap_avx512(
+    GF256_M128 * GF256_RESTRICT & x16, GF256_M128 * GF256_RESTRICT & y16, int & bytes)
+{
+    GF256_M512 * GF256_RESTRICT x64 = reinterpret_cast<GF256_M512 *>(x16);
+    GF256_M512 * GF256_RESTRICT y64 = reinterpret_cast<GF256_M512 *>(y16);
+
+    // Handle blocks of 64 bytes
+    while (bytes >= 64)
+    {
+        GF256_M512 x0 = _mm512_loadu_si512(x64);
+        GF256_M512 y0 = _mm512_loadu_si512(y64);
+        _mm512_storeu_si512(x64, y0);
+        _mm512_storeu_si512(y64, x0);
+
+        bytes -= 64, ++x64, ++y64;
+    }
+
+    x16 = reinterpret_cast<GF256_M128 *>(x64);
+    y16 = reinterpret_cast<GF256_M128 *>(y64);
+}
+#endif // GF256_TRY_AVX512
+
 extern "C" void gf256_memswap(void * GF256_RESTRICT vx, void * GF256_RESTRICT vy, int bytes)
 {
 #if defined(GF256_TARGET_MOBILE)
@@ -1530,6 +2393,11 @@ extern "C" void gf256_memswap(void * GF256_RESTRICT vx, void * GF256_RESTRICT vy
     GF256_M128 * GF256_RESTRICT x16 = reinterpret_cast<GF256_M128 *>(vx);
     GF256_M128 * GF256_RESTRICT y16 = reinterpret_cast<GF256_M128 *>(vy);
 
+# if defined(GF256_TRY_AVX512)
+    if (CpuHasAVX512BW)
+        gf256_memswap_avx512(x16, y16, bytes);
+# endif // GF256_TRY_AVX512
+
     // Handle blocks of 16 bytes
     while (bytes >= 16)
     {
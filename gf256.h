@@ -70,6 +70,23 @@
     #define GF256_ALIGN_BYTES 16
 #endif // __AVX2__
 
+// GCC and Clang can build the AVX-512 and GFNI paths with target attributes,
+// so they are chosen at runtime and do not need -mavx512bw or -mgfni
+#if defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 8) && \
+    (defined(__x86_64__) || defined(__i386__)) && !defined(GF256_TARGET_MOBILE)
+    #define GF256_USE_TARGET_ATTRIBUTES
+#endif
+
+// Note: Buffers are still only aligned to 32 bytes, so 512-bit loads are unaligned
+#if defined(GF256_USE_TARGET_ATTRIBUTES) || \
+    (defined(GF256_TRY_AVX2) && defined(__AVX512F__) && defined(__AVX512BW__))
+    #define GF256_TRY_AVX512 /* 512-bit */
+    #include <immintrin.h>
+# if defined(GF256_USE_TARGET_ATTRIBUTES) || defined(__GFNI__)
+    #define GF256_TRY_GFNI /* vgf2p8affineqb */
+# endif // __GFNI__
+#endif // __AVX512BW__
+
 #if !defined(GF256_TARGET_MOBILE)
     // Note: MSVC currently only supports SSSE3 but not AVX2
     #include <tmmintrin.h> // SSSE3: _mm_shuffle_epi8
@@ -104,6 +121,11 @@
     #define GF256_M256 __m256i
 #endif
 
+#ifdef GF256_TRY_AVX512
+    // Compiler-specific 512-bit SIMD register keyword
+    #define GF256_M512 __m512i
+#endif
+
 // Compiler-specific C++11 restrict keyword
 #define GF256_RESTRICT __restrict
 
@@ -159,6 +181,18 @@ struct gf256_ctx
         GF256_ALIGNED GF256_M256 TABLE_HI_Y[256];
     } MM256;
 #endif // GF256_TRY_AVX2
+#ifdef GF256_TRY_AVX512
+    struct
+    {
+        GF256_ALIGNED GF256_M512 TABLE_LO_Y[256];
+        GF256_ALIGNED GF256_M512 TABLE_HI_Y[256];
+    } MM512;
+#endif // GF256_TRY_AVX512
+#ifdef GF256_TRY_GFNI
+    /// 8x8 bit matrices for vgf2p8affineqb that multiply each byte by y.
+    /// Note: vgf2p8mulb is hardwired to the 0x11b polynomial so it is not used
+    uint64_t GFNI_AFFINE_Y[256];
+#endif // GF256_TRY_GFNI
 
     /// Mul/Div/Inv/Sqr tables
     uint8_t GF256_MUL_TABLE[256 * 256];
@@ -206,6 +240,41 @@ extern int gf256_init_(int version);
 #define gf256_init() gf256_init_(GF256_VERSION)
 
 
+//------------------------------------------------------------------------------
+// Instruction Set Selection
+
+/// SIMD paths that the bulk memory operations choose between, from slowest
+/// to fastest.  Each level also allows all of the levels below it.
+enum
+{
+    GF256_ISA_PORTABLE = 0, ///< No shuffles: 64-bit words, or SSE2 for XOR on PC
+    GF256_ISA_VECTOR128 = 1, ///< SSSE3 on PC or NEON on ARM
+    GF256_ISA_AVX2 = 2,
+    GF256_ISA_AVX512 = 3,
+    GF256_ISA_GFNI = 4,
+
+    GF256_ISA_COUNT
+};
+
+/// Returns the fastest path that gf256_init() detected for this CPU
+extern int gf256_detected_isa();
+
+/**
+    Restrict the bulk memory operations to paths no faster than maxIsa.
+
+    This is meant for benchmarks and tests that compare the paths on one CPU.
+    maxIsa is clamped to gf256_detected_isa(), so passing GF256_ISA_COUNT
+    restores the default.  It must be called after gf256_init() and while no
+    other thread is calling the bulk memory operations.
+
+    Returns the selected level.
+*/
+extern int gf256_set_max_isa(int maxIsa);
+
+/// Returns a short name like "avx2" for the given level on this platform
+extern const char* gf256_isa_name(int isa);
+
+
 //------------------------------------------------------------------------------
 // Math Operations
 
@@ -261,10 +330,36 @@ extern void gf256_addset_mem(void * GF256_RESTRICT vz, const void * GF256_RESTRI
 extern void gf256_mul_mem(void * GF256_RESTRICT vz,
                           const void * GF256_RESTRICT vx, uint8_t y, int bytes);
 
+/// Performs "z[] *= y" bulk memory operation
+extern void gf256_mul_mem_inplace(void * vz, uint8_t y, int bytes);
+
 /// Performs "z[] += x[] * y" bulk memory operation
 extern void gf256_muladd_mem(void * GF256_RESTRICT vz, uint8_t y,
                              const void * GF256_RESTRICT vx, int bytes);
 
+/**
+    Performs "z[] += x[0][] * y[0] + x[1][] * y[1] + ..." in one pass over z[]
+
+    Each source x[i] is xbytes[i] long (<= 0 means empty), and z[] must be at
+    least as long as the longest source.  Sources with y[i] = 0 are skipped.
+    If y is null then every coefficient is 1 and this is a multi-way XOR.
+
+    This is faster than calling gf256_muladd_mem() for each source because
+    the destination is only loaded and stored once rather than once per source.
+*/
+extern void gf256_muladd_multi_mem(void * GF256_RESTRICT vz, unsigned count,
+                                   const uint8_t * GF256_RESTRICT y,
+                                   const void * const * GF256_RESTRICT vx,
+                                   const int * GF256_RESTRICT xbytes);
+
+/// Performs "z[] += x[0][] + x[1][] + ..." in one pass over z[]
+static GF256_FORCE_INLINE void gf256_add_multi_mem(void * GF256_RESTRICT vz, unsigned count,
+                                                   const void * const * GF256_RESTRICT vx,
+                                                   const int * GF256_RESTRICT xbytes)
+{
+    gf256_muladd_multi_mem(vz, count, 0, vx, xbytes);
+}
+
 /// Performs "x[] /= y" bulk memory operation
 static GF256_FORCE_INLINE void gf256_div_mem(void * GF256_RESTRICT vz,
                                              const void * GF256_RESTRICT vx, uint8_t y, int bytes)
@@ -48,10 +48,62 @@ SIAMESE_EXPORT int siamese_init_(int version)
     if (0 != gf256_init())
         return Siamese_Disabled;
 
+    siamese::InitializeTables();
+#ifdef SIAMESE_ENABLE_CAUCHY
+    siamese::CalibrateRowCosts();
+#endif // SIAMESE_ENABLE_CAUCHY
+
     m_Initialized = true;
     return Siamese_Success;
 }
 
+SIAMESE_EXPORT void siamese_set_clock(
+    SiameseClockCallback callback,
+    void* context)
+{
+    siamese::SetClock(callback, context);
+}
+
+
+//------------------------------------------------------------------------------
+// Memory Pool API
+
+SIAMESE_EXPORT SiameseMemoryPool siamese_memory_pool_create(
+    uint64_t maxBytes)
+{
+    SIAMESE_DEBUG_ASSERT(m_Initialized); // Must call siamese_init() first
+    if (!m_Initialized)
+        return nullptr;
+
+    pktalloc::WindowPool* pool = new(std::nothrow) pktalloc::WindowPool(maxBytes);
+
+    return reinterpret_cast<SiameseMemoryPool>(pool);
+}
+
+SIAMESE_EXPORT SiameseMemoryPool siamese_memory_pool_create_ex(
+    uint64_t maxBytes,
+    unsigned flags,
+    int numaNode)
+{
+    SIAMESE_DEBUG_ASSERT(m_Initialized); // Must call siamese_init() first
+    if (!m_Initialized)
+        return nullptr;
+    if (numaNode < -1 || numaNode >= pktalloc::kWindowPoolMaxNumaNodes)
+        return nullptr;
+
+    const bool hugePages = (flags & SIAMESE_MEMORY_POOL_HUGE_PAGES) != 0;
+    pktalloc::WindowPool* pool = new(std::nothrow) pktalloc::WindowPool(maxBytes, hugePages, numaNode);
+
+    return reinterpret_cast<SiameseMemoryPool>(pool);
+}
+
+SIAMESE_EXPORT void siamese_memory_pool_free(
+    SiameseMemoryPool pool_t)
+{
+    pktalloc::WindowPool* pool = reinterpret_cast<pktalloc::WindowPool*>(pool_t);
+    delete pool;
+}
+
 
 //------------------------------------------------------------------------------
 // Encoder API
@@ -67,6 +119,37 @@ SIAMESE_EXPORT SiameseEncoder siamese_encoder_create()
     return reinterpret_cast<SiameseEncoder>(encoder);
 }
 
+SIAMESE_EXPORT SiameseEncoder siamese_encoder_create_pooled(
+    SiameseMemoryPool pool_t)
+{
+    SIAMESE_DEBUG_ASSERT(m_Initialized); // Must call siamese_init() first
+    if (!m_Initialized || !pool_t)
+        return nullptr;
+
+    pktalloc::WindowPool* pool = reinterpret_cast<pktalloc::WindowPool*>(pool_t);
+    siamese::Encoder* encoder = new(std::nothrow) siamese::Encoder(pool);
+
+    return reinterpret_cast<SiameseEncoder>(encoder);
+}
+
+SIAMESE_EXPORT SiameseEncoder siamese_encoder_create_pooled_ex(
+    SiameseMemoryPool pool_t,
+    unsigned flags,
+    int numaNode)
+{
+    SIAMESE_DEBUG_ASSERT(m_Initialized); // Must call siamese_init() first
+    if (!m_Initialized || !pool_t)
+        return nullptr;
+    if (numaNode < -1 || numaNode >= pktalloc::kWindowPoolMaxNumaNodes)
+        return nullptr;
+
+    const bool hugePages = (flags & SIAMESE_MEMORY_POOL_HUGE_PAGES) != 0;
+    pktalloc::WindowPool* pool = reinterpret_cast<pktalloc::WindowPool*>(pool_t);
+    siamese::Encoder* encoder = new(std::nothrow) siamese::Encoder(pool, hugePages, numaNode);
+
+    return reinterpret_cast<SiameseEncoder>(encoder);
+}
+
 SIAMESE_EXPORT void siamese_encoder_free(
     SiameseEncoder encoder_t)
 {
@@ -90,6 +173,10 @@ SIAMESE_EXPORT SiameseResult siamese_encoder_is_ready(
         return Siamese_MaxPacketsReached;
     }
 
+    if (encoder->IsUnderBackpressure()) {
+        return Siamese_Backpressure;
+    }
+
     return Siamese_Success;
 }
 
@@ -107,6 +194,90 @@ SIAMESE_EXPORT SiameseResult siamese_encoder_add(
     return encoder->Add(*packet);
 }
 
+SIAMESE_EXPORT SiameseResult siamese_encoder_add_gather(
+    SiameseEncoder encoder_t,
+    const SiameseFragment* fragments,
+    unsigned fragmentCount,
+    unsigned* packetNumOut)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || !fragments || !packetNumOut)
+        return Siamese_InvalidInput;
+
+    unsigned totalBytes = 0;
+    for (unsigned i = 0; i < fragmentCount; ++i)
+    {
+        const unsigned bytes = fragments[i].DataBytes;
+        if ((bytes > 0 && !fragments[i].Data) ||
+            bytes > SIAMESE_MAX_PACKET_BYTES - totalBytes)
+        {
+            return Siamese_InvalidInput;
+        }
+        totalBytes += bytes;
+    }
+    if (totalBytes <= 0)
+        return Siamese_InvalidInput;
+
+    SiameseOriginalPacket packet;
+    packet.PacketNum = 0;
+    packet.DataBytes = totalBytes;
+    packet.Data      = nullptr;
+
+    const SiameseResult result = encoder->AddGather(packet, fragments, fragmentCount);
+    *packetNumOut = packet.PacketNum;
+    return result;
+}
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_add_external(
+    SiameseEncoder encoder_t,
+    SiameseOriginalPacket* packet,
+    SiameseReleaseCallback release,
+    void* context)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || !packet || !packet->Data || !release ||
+        packet->DataBytes <= 0 || packet->DataBytes > SIAMESE_MAX_PACKET_BYTES)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    return encoder->Add(*packet, release, context);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_add_queue(
+    SiameseEncoder encoder_t,
+    unsigned queueSize)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || queueSize <= 0 || queueSize > SIAMESE_MAX_PACKETS)
+        return Siamese_InvalidInput;
+
+    return encoder->SetAddQueue(queueSize);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_memory_budget(
+    SiameseEncoder encoder_t,
+    uint64_t budgetBytes)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder)
+        return Siamese_InvalidInput;
+
+    encoder->SetMemoryBudget(budgetBytes);
+    return Siamese_Success;
+}
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_cauchy_crossover(
+    SiameseEncoder encoder_t,
+    unsigned count)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder)
+        return Siamese_InvalidInput;
+
+    return encoder->SetCauchyCrossover(count);
+}
+
 SIAMESE_EXPORT SiameseResult siamese_encoder_get(
     SiameseEncoder encoder_t,
     SiameseOriginalPacket* packet)
@@ -167,6 +338,18 @@ SIAMESE_EXPORT SiameseResult siamese_encode(
     return encoder->Encode(*recovery);
 }
 
+SIAMESE_EXPORT SiameseResult siamese_encode_batch(
+    SiameseEncoder encoder_t,
+    unsigned count,
+    SiameseRecoveryPacket* recoveryArray)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || !recoveryArray || count <= 0 || count > SIAMESE_MAX_ENCODE_BATCH)
+        return Siamese_InvalidInput;
+
+    return encoder->EncodeBatch(recoveryArray, count);
+}
+
 SIAMESE_EXPORT SiameseResult siamese_encoder_stats(
     SiameseEncoder encoder_t,
     uint64_t* statsOut,
@@ -194,6 +377,37 @@ SIAMESE_EXPORT SiameseDecoder siamese_decoder_create()
     return reinterpret_cast<SiameseDecoder>(decoder);
 }
 
+SIAMESE_EXPORT SiameseDecoder siamese_decoder_create_pooled(
+    SiameseMemoryPool pool_t)
+{
+    SIAMESE_DEBUG_ASSERT(m_Initialized); // Must call siamese_init() first
+    if (!m_Initialized || !pool_t)
+        return nullptr;
+
+    pktalloc::WindowPool* pool = reinterpret_cast<pktalloc::WindowPool*>(pool_t);
+    siamese::Decoder* decoder = new(std::nothrow) siamese::Decoder(pool);
+
+    return reinterpret_cast<SiameseDecoder>(decoder);
+}
+
+SIAMESE_EXPORT SiameseDecoder siamese_decoder_create_pooled_ex(
+    SiameseMemoryPool pool_t,
+    unsigned flags,
+    int numaNode)
+{
+    SIAMESE_DEBUG_ASSERT(m_Initialized); // Must call siamese_init() first
+    if (!m_Initialized || !pool_t)
+        return nullptr;
+    if (numaNode < -1 || numaNode >= pktalloc::kWindowPoolMaxNumaNodes)
+        return nullptr;
+
+    const bool hugePages = (flags & SIAMESE_MEMORY_POOL_HUGE_PAGES) != 0;
+    pktalloc::WindowPool* pool = reinterpret_cast<pktalloc::WindowPool*>(pool_t);
+    siamese::Decoder* decoder = new(std::nothrow) siamese::Decoder(pool, hugePages, numaNode);
+
+    return reinterpret_cast<SiameseDecoder>(decoder);
+}
+
 SIAMESE_EXPORT void siamese_decoder_free(
     SiameseDecoder decoder_t)
 {
@@ -219,6 +433,29 @@ SIAMESE_EXPORT SiameseResult siamese_decoder_add_original(
     return decoder->AddOriginal(*packet);
 }
 
+SIAMESE_EXPORT SiameseResult siamese_decoder_add_original_batch(
+    SiameseDecoder decoder_t,
+    const SiameseOriginalPacket* packets,
+    unsigned count)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder || !packets || count <= 0 || count > SIAMESE_MAX_ORIGINAL_BATCH)
+        return Siamese_InvalidInput;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const SiameseOriginalPacket& packet = packets[i];
+        if (!packet.Data || packet.DataBytes <= 0 ||
+            packet.DataBytes > SIAMESE_MAX_PACKET_BYTES ||
+            packet.PacketNum > SIAMESE_PACKET_NUM_MAX)
+        {
+            return Siamese_InvalidInput;
+        }
+    }
+
+    return decoder->AddOriginalBatch(packets, count);
+}
+
 SIAMESE_EXPORT SiameseResult siamese_decoder_add_recovery(
     SiameseDecoder decoder_t,
     const SiameseRecoveryPacket* packet)
@@ -268,6 +505,54 @@ SIAMESE_EXPORT SiameseResult siamese_decode(
         countOut);
 }
 
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_output(
+    SiameseDecoder decoder_t,
+    SiameseBufferProvider provider,
+    SiameseReleaseCallback release,
+    void* context)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder || (provider && !release))
+        return Siamese_InvalidInput;
+
+    decoder->SetOutputBuffers(provider, release, context);
+    return Siamese_Success;
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_solver_threads(
+    SiameseDecoder decoder_t,
+    unsigned threadCount)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder)
+        return Siamese_InvalidInput;
+
+    decoder->SetSolverThreads(threadCount);
+    return Siamese_Success;
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_memory_budget(
+    SiameseDecoder decoder_t,
+    uint64_t budgetBytes)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder)
+        return Siamese_InvalidInput;
+
+    return decoder->SetMemoryBudget(budgetBytes);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_lazy_sums(
+    SiameseDecoder decoder_t,
+    unsigned maxPackets)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder || maxPackets > SIAMESE_MAX_PACKETS)
+        return Siamese_InvalidInput;
+
+    return decoder->SetLazySums(maxPackets);
+}
+
 SIAMESE_EXPORT SiameseResult siamese_decoder_ack(
     SiameseDecoder decoder_t,
     void* buffer,
@@ -299,4 +584,124 @@ SIAMESE_EXPORT SiameseResult siamese_decoder_stats(
 }
 
 
+//------------------------------------------------------------------------------
+// Profiling API
+
+static_assert(siamese::Histogram::kBucketCount == SIAMESE_HISTOGRAM_BUCKETS, "Update SIAMESE_HISTOGRAM_BUCKETS");
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_profiling(
+    SiameseEncoder encoder_t,
+    unsigned samplePeriod)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder)
+        return Siamese_InvalidInput;
+
+    encoder->SetProfiling(samplePeriod);
+    return Siamese_Success;
+}
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_histogram(
+    SiameseEncoder encoder_t,
+    SiameseEncoderHistogram histogram,
+    uint64_t* bucketsOut,
+    unsigned bucketCount)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || !bucketsOut || bucketCount <= 0 ||
+        (unsigned)histogram >= SiameseEncoderHistogram_Count)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    return encoder->GetHistogram(histogram, bucketsOut, bucketCount);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_profiling(
+    SiameseDecoder decoder_t,
+    unsigned samplePeriod)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder)
+        return Siamese_InvalidInput;
+
+    decoder->SetProfiling(samplePeriod);
+    return Siamese_Success;
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_histogram(
+    SiameseDecoder decoder_t,
+    SiameseDecoderHistogram histogram,
+    uint64_t* bucketsOut,
+    unsigned bucketCount)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder || !bucketsOut || bucketCount <= 0 ||
+        (unsigned)histogram >= SiameseDecoderHistogram_Count)
+    {
+        return Siamese_InvalidInput;
+    }
+
+    return decoder->GetHistogram(histogram, bucketsOut, bucketCount);
+}
+
+
+//------------------------------------------------------------------------------
+// Snapshot API
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_snapshot(
+    SiameseEncoder encoder_t,
+    uint8_t* buffer,
+    unsigned bufferBytes,
+    unsigned* usedBytesOut)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || !usedBytesOut) {
+        return Siamese_InvalidInput;
+    }
+
+    return encoder->Snapshot(buffer, bufferBytes, *usedBytesOut);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_encoder_restore(
+    SiameseEncoder encoder_t,
+    const uint8_t* data,
+    unsigned bytes)
+{
+    siamese::Encoder* encoder = reinterpret_cast<siamese::Encoder*>(encoder_t);
+    if (!encoder || !data || bytes <= 0) {
+        return Siamese_InvalidInput;
+    }
+
+    return encoder->Restore(data, bytes);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_snapshot(
+    SiameseDecoder decoder_t,
+    uint8_t* buffer,
+    unsigned bufferBytes,
+    unsigned* usedBytesOut)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder || !usedBytesOut) {
+        return Siamese_InvalidInput;
+    }
+
+    return decoder->Snapshot(buffer, bufferBytes, *usedBytesOut);
+}
+
+SIAMESE_EXPORT SiameseResult siamese_decoder_restore(
+    SiameseDecoder decoder_t,
+    const uint8_t* data,
+    unsigned bytes)
+{
+    siamese::Decoder* decoder = reinterpret_cast<siamese::Decoder*>(decoder_t);
+    if (!decoder || !data || bytes <= 0) {
+        return Siamese_InvalidInput;
+    }
+
+    return decoder->Restore(data, bytes);
+}
+
+
 } // extern "C"
@@ -128,6 +128,29 @@ extern "C" {
 SIAMESE_EXPORT int siamese_init_(int version);
 #define siamese_init() siamese_init_(SIAMESE_VERSION)
 
+/// Clock callback returning the current time in microseconds.
+/// The time may start from any point but must never go backwards
+typedef uint64_t (*SiameseClockCallback)(void* context);
+
+/**
+    Supply the time used to stamp packets and time retransmissions.
+
+    By default the library reads a coarse monotonic clock, which is cheap but
+    only ticks every few milliseconds on some platforms.  An application with
+    an event loop can instead hand out the time it already read for the
+    current iteration, so the codecs never read the system clock themselves.
+
+    The clock is shared by all encoders and decoders, and the callback may be
+    invoked from any thread using them.  It should be set before codecs are
+    created, and not changed while they are in use.
+
+    Pass a null callback to restore the default clock.
+*/
+SIAMESE_EXPORT void siamese_set_clock(
+    SiameseClockCallback callback, ///< [in] Clock to read, or 0 for default
+    void* context                  ///< [in] Passed to the callback
+);
+
 
 //------------------------------------------------------------------------------
 // Shared Constants/Datatypes
@@ -149,6 +172,12 @@ typedef enum SiameseResultT
     /// All further API calls will return this error code to avoid exploitation.
     Siamese_Disabled          = 5,
 
+    /// The packet was added, but the memory budget set with
+    /// siamese_encoder_set_memory_budget() is nearly used up, so the
+    /// application should slow down until data is acknowledged.
+    /// This is a success code even though it is not zero
+    Siamese_Backpressure      = 6,
+
     SiameseResult_Count,                ///< For asserts
     SiameseResult_Padding = 0x7fffffff  ///< int32_t type
 } SiameseResult;
@@ -180,6 +209,19 @@ typedef enum SiameseResultT
 /// Note that the actual overhead is closer to 6 bytes.
 #define SIAMESE_MAX_ENCODE_OVERHEAD     8
 
+/// Maximum number of recovery packets generated by one siamese_encode_batch()
+#define SIAMESE_MAX_ENCODE_BATCH       32
+
+/// Maximum number of originals passed to one siamese_decoder_add_original_batch()
+#define SIAMESE_MAX_ORIGINAL_BATCH     256
+
+/// Largest crossover for siamese_encoder_set_cauchy_crossover()
+#define SIAMESE_CAUCHY_CROSSOVER_MAX    64
+
+/// Crossover for siamese_encoder_set_cauchy_crossover() that compares the
+/// measured row costs for each recovery packet
+#define SIAMESE_CAUCHY_CROSSOVER_AUTO    0
+
 /// Minimum number of bytes in an acknowledgement buffer
 #define SIAMESE_ACK_MIN_BYTES          16
 
@@ -191,6 +233,13 @@ struct SiameseOriginalPacket
     const unsigned char* Data; ///< Original packet data
 };
 
+/// Piece of an original data packet, for siamese_encoder_add_gather()
+struct SiameseFragment
+{
+    unsigned DataBytes;        ///< Length of data in bytes
+    const unsigned char* Data; ///< Fragment data
+};
+
 /// Recovery data packet
 struct SiameseRecoveryPacket
 {
@@ -199,6 +248,72 @@ struct SiameseRecoveryPacket
 };
 
 
+//------------------------------------------------------------------------------
+// Memory Pool API
+
+/// Memory pool object type
+typedef struct SiameseMemoryPoolImpl { int impl; }* SiameseMemoryPool;
+
+/**
+    Create a memory pool that can be shared by many encoders and decoders.
+
+    Codecs created with a pool do not preallocate memory.  They take packet
+    memory from the pool as needed and hand it back as soon as it is unused,
+    so idle codecs hold almost nothing.  The pool keeps freed memory in
+    per-thread caches for reuse by other codecs.
+
+    If maxBytes is non-zero, the packet memory of all codecs attached to the
+    pool is limited to this many bytes.  A codec that cannot allocate memory
+    under the limit behaves as if the system ran out of memory.
+
+    The pool is thread-safe.  Codecs attached to it are not, as usual.
+
+    Returns 0 on failure.
+*/
+SIAMESE_EXPORT SiameseMemoryPool siamese_memory_pool_create(
+    uint64_t maxBytes ///< [in] Memory limit in bytes, or 0 for no limit
+);
+
+/// siamese_memory_pool_create_ex() flag: Back the pool with 2 MB huge pages
+#define SIAMESE_MEMORY_POOL_HUGE_PAGES 1
+
+/**
+    Create a memory pool with control over where its memory comes from.
+
+    This is the same as siamese_memory_pool_create() with these options:
+
+    If SIAMESE_MEMORY_POOL_HUGE_PAGES is set in flags, the pool maps its memory
+    from the OS in 2 MB huge pages.  On Linux it uses reserved huge pages if
+    there are any, and otherwise asks for transparent huge pages.  On Windows
+    large pages are used if the process has SeLockMemoryPrivilege.  Otherwise
+    it silently falls back to normal pages.
+
+    If numaNode is 0 or more, the pool memory is placed on that NUMA node
+    where possible.  This should be the node of the core serving the codecs
+    created with this pool.  Pass -1 for no preference.
+
+    Memory is mapped 2 MB at a time, so maxBytes is enforced in steps of 2 MB.
+    Packets and buffers too large for the pool windows are carved out of the
+    same 2 MB chunks and reused, unless they are too large for a chunk.
+
+    Returns 0 on failure.
+*/
+SIAMESE_EXPORT SiameseMemoryPool siamese_memory_pool_create_ex(
+    uint64_t maxBytes, ///< [in] Memory limit in bytes, or 0 for no limit
+    unsigned flags,    ///< [in] SIAMESE_MEMORY_POOL_* flags
+    int numaNode       ///< [in] NUMA node to allocate on, or -1 for any
+);
+
+/**
+    Free memory for the pool.
+
+    All codecs created with the pool must be freed first.
+*/
+SIAMESE_EXPORT void siamese_memory_pool_free(
+    SiameseMemoryPool pool ///< [in] Pool to free
+);
+
+
 //------------------------------------------------------------------------------
 // Encoder API
 
@@ -212,6 +327,35 @@ typedef struct SiameseEncoderImpl { int impl; }* SiameseEncoder;
 */
 SIAMESE_EXPORT SiameseEncoder siamese_encoder_create();
 
+/**
+    Create a Siamese encoder that takes its memory from the given pool.
+
+    Returns 0 on failure.
+*/
+SIAMESE_EXPORT SiameseEncoder siamese_encoder_create_pooled(
+    SiameseMemoryPool pool ///< [in] Pool from siamese_memory_pool_create()
+);
+
+/**
+    Create a Siamese encoder that takes its memory from the given pool, placed
+    where it is served.
+
+    This is the same as siamese_encoder_create_pooled(), except that flags and
+    numaNode choose where the pool maps memory for this encoder, as they do for
+    siamese_memory_pool_create_ex().  This lets one pool serve codecs on
+    several NUMA nodes.  Passing 0 and -1 uses the placement of the pool.
+
+    A pool keeps memory for up to 8 placements including its own.  Codecs
+    asking for more use the placement of the pool.
+
+    Returns 0 on failure.
+*/
+SIAMESE_EXPORT SiameseEncoder siamese_encoder_create_pooled_ex(
+    SiameseMemoryPool pool, ///< [in] Pool from siamese_memory_pool_create()
+    unsigned flags,         ///< [in] SIAMESE_MEMORY_POOL_* flags
+    int numaNode            ///< [in] NUMA node to allocate on, or -1 for any
+);
+
 /// Free memory for encoder
 SIAMESE_EXPORT void siamese_encoder_free(
     SiameseEncoder encoder ///< [in] Encoder to free
@@ -225,6 +369,8 @@ SIAMESE_EXPORT void siamese_encoder_free(
     better to avoid compressing data that cannot be sent.
 
     Returns 0 if the encoder can accept more data.
+    Returns Siamese_Backpressure if it can accept more data but is close to
+    its memory budget.
     Returns other values if the encoder CANNOT accept more data.
 */
 SIAMESE_EXPORT SiameseResult siamese_encoder_is_ready(
@@ -243,13 +389,163 @@ SIAMESE_EXPORT SiameseResult siamese_encoder_is_ready(
     within about a millisecond of when the packet is sent.
 
     Returns 0 on success and other codes on error.
-    Returns Siamese_MaxPacketsReached if SIAMESE_MAX_PACKETS are added.
+    Returns Siamese_Backpressure if the packet was added but the encoder is
+    close to its memory budget.  This is also success: Checking for any
+    non-zero result would treat a packet that was added as lost.
+    Returns Siamese_MaxPacketsReached if SIAMESE_MAX_PACKETS are added, or if
+    adding the packet would exceed the memory budget.
 */
 SIAMESE_EXPORT SiameseResult siamese_encoder_add(
     SiameseEncoder encoder,          ///< [in] Encoder to add to
     SiameseOriginalPacket* packet    ///< [in, out] Packet to add
 );
 
+/**
+    Add a packet of data made of several fragments to the end of the
+    protected set.
+
+    This works like siamese_encoder_add() for a packet made of the given
+    fragments in order, such as a header buffer followed by a payload slice.
+    The fragments are copied straight into the encoder, so the application
+    does not need to put them together in a buffer first.
+
+    Fragments may be empty, but the packet must contain at least one byte and
+    no more than SIAMESE_MAX_PACKET_BYTES.
+
+    Returns 0 on success and other codes on error, like siamese_encoder_add().
+    Siamese_Backpressure also means the packet was added.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_add_gather(
+    SiameseEncoder encoder,           ///< [in] Encoder to add to
+    const SiameseFragment* fragments, ///< [in] Fragments of the packet
+    unsigned fragmentCount,           ///< [in] Number of fragments
+    unsigned* packetNumOut            ///< [out] Packet number assigned
+);
+
+/// Callback invoked when the codec no longer needs application packet data
+/// provided with siamese_encoder_add_external() or siamese_decoder_set_output().
+/// The packet data may then be reused.
+typedef void (*SiameseReleaseCallback)(
+    void* context,                      ///< [in] Context provided with the callback
+    const SiameseOriginalPacket* packet ///< [in] Packet that is released
+);
+
+/**
+    Add an original packet to the encoder without copying its data.
+
+    This works like siamese_encoder_add(), except that the encoder keeps a
+    reference to the application's packet data instead of making a copy.
+    The data must stay valid and unmodified until release(context, packet)
+    is called, which happens some time after the packet is acknowledged from
+    within siamese_encode(), siamese_encode_batch(), or
+    siamese_encoder_remove_before(), or at the latest by siamese_encoder_free().
+
+    If this function fails, then the release callback is not called.
+
+    Siamese_Backpressure is not a failure: The packet was added and the
+    encoder now references its data until the release callback is called.
+    An application that frees the buffer on any non-zero result would free
+    data that the encoder still uses.
+
+    Returns 0 on success and other codes on error.
+    Returns Siamese_Backpressure if the packet was added but the encoder is
+    close to its memory budget.
+    Returns Siamese_MaxPacketsReached if SIAMESE_MAX_PACKETS are added, or if
+    adding the packet would exceed the memory budget.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_add_external(
+    SiameseEncoder encoder,          ///< [in] Encoder to add to
+    SiameseOriginalPacket* packet,   ///< [in, out] Packet to add
+    SiameseReleaseCallback release,  ///< [in] Called when the data is released
+    void* context                    ///< [in] Passed to the release callback
+);
+
+/**
+    Allow siamese_encoder_add() to run on a different thread than the rest of
+    the encoder API.
+
+    After this call, one thread (such as the application send thread) may call
+    siamese_encoder_add(), siamese_encoder_add_gather(),
+    siamese_encoder_add_external(), and siamese_encoder_is_ready() while one
+    other thread (such as a dedicated FEC thread) calls all of the other
+    encoder functions, without any locking.
+
+    Added packets are copied into a lock-free queue of 'queueSize' packets
+    and numbered right away.  They are moved into the encoder by the other
+    thread the next time it calls into the encoder, so the cost of encoding
+    is not felt by the adding thread.  siamese_encoder_add() returns
+    Siamese_MaxPacketsReached while the queue is full.
+
+    For siamese_encoder_add_external(), only the reference is queued, and the
+    release callback is called from the other thread.
+
+    This must be called before the two threads start using the encoder, and
+    it can only be called once.  queueSize is rounded up to a power of two.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_add_queue(
+    SiameseEncoder encoder, ///< [in] Encoder to use
+    unsigned queueSize      ///< [in] Number of packets that can be queued
+);
+
+/**
+    Limit the memory held by the encoder for original data.
+
+    Callers must treat Siamese_Backpressure as success.  With a budget set,
+    siamese_encoder_add(), siamese_encoder_add_gather() and
+    siamese_encoder_add_external() can return this non-zero code for a packet
+    that was added.  For siamese_encoder_add_external() the encoder then owns
+    a reference to the data, so the buffer must not be freed or reused until
+    the release callback is called.
+
+    The budget counts the bytes of original data that have not been removed
+    from the encoder, including data added by siamese_encoder_add_external(),
+    plus the running sums kept for the longest packet.
+
+    Once 3/4 of the budget is used, siamese_encoder_add() still adds packets
+    but returns Siamese_Backpressure.  A packet that would go over the budget
+    is not added and Siamese_MaxPacketsReached is returned instead, which is
+    the same feedback as when the window is full.  Acknowledged data is
+    removed early to make room when possible.
+
+    With siamese_encoder_set_add_queue(), packets still in the queue are
+    counted against the budget as well.
+
+    Passing 0 removes the budget, which is the default.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_memory_budget(
+    SiameseEncoder encoder, ///< [in] Encoder to use
+    uint64_t budgetBytes    ///< [in] Byte budget, or 0 for no limit
+);
+
+/**
+    Choose when the encoder goes back from Siamese sum rows to Cauchy rows.
+
+    While at most SIAMESE_CAUCHY_CROSSOVER_MAX packets are in flight, recovery
+    packets use Cauchy rows.  Once more are in flight the encoder switches to
+    rows built from running sums, and keeps using them as the window shrinks
+    until 'count' or fewer packets are in flight.
+
+    A Cauchy row costs one multiply-add per packet in flight, while a sum row
+    costs about the same for any window, so the best crossover depends on the
+    CPU and on how many originals are sent per recovery packet.  The default
+    is 32.  With SIAMESE_CAUCHY_CROSSOVER_AUTO the encoder compares the two
+    costs for each recovery packet instead, using the relative speed of the
+    XOR and multiply-add kernels measured by siamese_init().
+
+    The decoder handles either row type, so this can be changed at any time.
+
+    Returns 0 on success and other codes on error.
+    Returns Siamese_InvalidInput if 'count' exceeds SIAMESE_CAUCHY_CROSSOVER_MAX.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_cauchy_crossover(
+    SiameseEncoder encoder, ///< [in] Encoder to use
+    unsigned count          ///< [in] Packets in flight, or SIAMESE_CAUCHY_CROSSOVER_AUTO
+);
+
 /**
     Get a packet that was submitted to the codec.
 
@@ -351,6 +647,28 @@ SIAMESE_EXPORT SiameseResult siamese_encode(
     SiameseRecoveryPacket* recovery ///< [out] Recovery Packet generated
 );
 
+/**
+    Encode several recovery packets at once.
+
+    This produces the same packets as calling siamese_encode() 'count' times,
+    but it is faster for bursts of recovery packets because the window is
+    only walked once for all of the rows rather than once per row.
+
+    The recovery packet data pointers are written into the 'recoveryArray'.
+    Each packet has its own buffer, and they are all valid until the next
+    call to siamese_encode_batch().
+
+    Returns 0 on success.
+    Returns Siamese_NeedMoreData if there is no data to encode.
+    Returns Siamese_InvalidInput if count is above SIAMESE_MAX_ENCODE_BATCH.
+    Returns other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encode_batch(
+    SiameseEncoder encoder,              ///< [in] Encoder to use
+    unsigned count,                      ///< [in] Number of packets to generate
+    SiameseRecoveryPacket* recoveryArray ///< [out] Array of 'count' packets
+);
+
 
 //------------------------------------------------------------------------------
 // Decoder API
@@ -365,6 +683,35 @@ typedef struct SiameseDecoderImpl { int impl; }* SiameseDecoder;
 */
 SIAMESE_EXPORT SiameseDecoder siamese_decoder_create();
 
+/**
+    Create a Siamese decoder that takes its memory from the given pool.
+
+    Returns 0 on failure.
+*/
+SIAMESE_EXPORT SiameseDecoder siamese_decoder_create_pooled(
+    SiameseMemoryPool pool ///< [in] Pool from siamese_memory_pool_create()
+);
+
+/**
+    Create a Siamese decoder that takes its memory from the given pool, placed
+    where it is served.
+
+    This is the same as siamese_decoder_create_pooled(), except that flags and
+    numaNode choose where the pool maps memory for this decoder, as they do for
+    siamese_memory_pool_create_ex().  This lets one pool serve codecs on
+    several NUMA nodes.  Passing 0 and -1 uses the placement of the pool.
+
+    A pool keeps memory for up to 8 placements including its own.  Codecs
+    asking for more use the placement of the pool.
+
+    Returns 0 on failure.
+*/
+SIAMESE_EXPORT SiameseDecoder siamese_decoder_create_pooled_ex(
+    SiameseMemoryPool pool, ///< [in] Pool from siamese_memory_pool_create()
+    unsigned flags,         ///< [in] SIAMESE_MEMORY_POOL_* flags
+    int numaNode            ///< [in] NUMA node to allocate on, or -1 for any
+);
+
 /// Free memory for decoder
 SIAMESE_EXPORT void siamese_decoder_free(
     SiameseDecoder decoder  ///< [in] Decoder to free
@@ -383,6 +730,29 @@ SIAMESE_EXPORT SiameseResult siamese_decoder_add_original(
     const SiameseOriginalPacket* packet ///< [in] Original Packet to add
 );
 
+/**
+    Pass several original packets to the decoder at once.
+
+    This has the same effect as calling siamese_decoder_add_original() for
+    each packet, but it is faster for packets read from the network in bursts
+    because the window is walked once in packet number order for the batch.
+    The packets may be in any order.
+
+    Duplicates and packets that arrived too late are skipped, and are counted
+    in SiameseDecoderStats_DupedOriginalCount.
+
+    Returns 0 on success if any of the packets were new.
+    Returns Siamese_DuplicateData if none of them were new.
+    Returns Siamese_InvalidInput if count is above SIAMESE_MAX_ORIGINAL_BATCH
+    or any of the packets is invalid, in which case none of them are added.
+    Returns other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_add_original_batch(
+    SiameseDecoder decoder,               ///< [in] Decoder to use
+    const SiameseOriginalPacket* packets, ///< [in] Array of 'count' packets to add
+    unsigned count                        ///< [in] Number of packets
+);
+
 /**
     Pass recovery data to the decoder from the encoder.
 
@@ -460,6 +830,123 @@ SIAMESE_EXPORT SiameseResult siamese_decode(
     unsigned* countOut                      ///< [out] Number of packets recovered
 );
 
+/// Callback invoked from siamese_decode() to get application memory for a
+/// recovered packet.  Returns a buffer of at least dataBytes bytes, or 0 to
+/// have the decoder store this packet internally instead.
+typedef unsigned char* (*SiameseBufferProvider)(
+    void* context,      ///< [in] Context from siamese_decoder_set_output()
+    unsigned packetNum, ///< [in] Packet number that was recovered
+    unsigned dataBytes  ///< [in] Number of bytes needed for the packet data
+);
+
+/**
+    Have siamese_decode() write recovered packets into application buffers.
+
+    When a packet is recovered, provider(context, packetNum, dataBytes) is
+    called and the recovered data is written directly into the buffer it
+    returns, so no copy is needed to keep the data.  The packets returned by
+    siamese_decode() and siamese_decoder_get() then point into that buffer.
+
+    The decoder keeps reading the buffer to recover other packets, so it must
+    stay valid and unmodified until release(context, packet) is called.  This
+    happens from within siamese_decoder_add_recovery() or siamese_decode(), or
+    at the latest by siamese_decoder_free().  Note that release may be called
+    before siamese_decode() returns the packet, in which case the application
+    should not reuse the buffer until it has processed the packet.
+
+    Passing provider = 0 restores the default behavior for packets recovered
+    after this call.  Buffers already handed out are still released.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_output(
+    SiameseDecoder decoder,          ///< [in] Decoder to use
+    SiameseBufferProvider provider,  ///< [in] Called to get a recovered packet buffer
+    SiameseReleaseCallback release,  ///< [in] Called when the buffer is released
+    void* context                    ///< [in] Passed to both callbacks
+);
+
+/**
+    Set the number of threads that siamese_decode() may use to solve large
+    recovery problems, including the calling thread.
+
+    By default only the calling thread is used.  When more threads are set,
+    large solves are split across a pool of threads owned by the decoder.
+    This call times the thread handoffs and multiply-adds on this machine, and
+    only splits a solve when the work it moves off the calling thread is worth
+    more than the handoffs.  With the costs measured on one test machine this
+    works out to about 40 or more lost packets of 1000 bytes on 2 cores.
+    Smaller solves, and every solve on a single core machine, still run
+    entirely on the calling thread.
+
+    The timing takes up to a few milliseconds, so call this once per decoder
+    rather than before each siamese_decode().
+
+    Passing 0 or 1 stops the thread pool.  At most 16 threads are used.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_solver_threads(
+    SiameseDecoder decoder,  ///< [in] Decoder to use
+    unsigned threadCount     ///< [in] Number of threads to use
+);
+
+/**
+    Limit the packet memory held by the decoder.
+
+    The budget counts all packet data allocated by the decoder, including
+    recovery packets, original packets, and the running sums it uses to solve.
+
+    When the budget is exceeded after adding data, the decoder first frees
+    spare buffers, then sums and drops any originals kept by
+    siamese_decoder_set_lazy_sums(), then drops its oldest recovery packets,
+    and then frees the running sums, which are rebuilt the next time they are
+    needed.  Dropped recovery packets are counted in
+    SiameseDecoderStats_DroppedRecoveryCount.  Original data after the first
+    lost packet cannot be dropped, so if the decoder is still over budget it
+    is disabled and returns Siamese_Disabled.
+
+    Passing 0 removes the budget, which is the default.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_memory_budget(
+    SiameseDecoder decoder, ///< [in] Decoder to use
+    uint64_t budgetBytes    ///< [in] Byte budget, or 0 for no limit
+);
+
+/**
+    Build the running sums only when a solve needs them.
+
+    By default the decoder adds every received original into its running
+    sums as it drops the original from its window, because a recovery packet
+    that arrives later may need them.  On a link that rarely loses data this
+    is a large part of the decoder CPU time, and the sums are thrown away
+    unused when the encoder restarts them.
+
+    In lazy sum mode the decoder instead keeps up to `maxPackets` originals
+    past the point where it would have dropped them, and adds them into the
+    sums only if a solve needs them.  The sums are kept at that point between
+    solves, so the next solve picks up where the last one stopped.  Originals
+    that are still unsummed when the encoder restarts its sums are dropped
+    without being summed, so a loss-free stream costs little more than
+    buffering each original.  Originals past the limit are summed and dropped
+    as before, and so are all of them if the memory budget is exceeded.
+
+    A limit of SIAMESE_MAX_PACKETS covers the longest sums the encoder runs,
+    at the cost of holding that many originals.  Smaller limits only save
+    work if the encoder restarts its sums within that many packets.  The
+    first solve after a long loss-free run adds all of the kept originals,
+    so it takes longer than it would with the default.  Passing 0 turns
+    lazy sums off, which is the default.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_lazy_sums(
+    SiameseDecoder decoder, ///< [in] Decoder to use
+    unsigned maxPackets     ///< [in] Originals to keep unsummed, or 0 to disable
+);
+
 /**
     This writes an acknowledgement message to the provided buffer, which
     includes the next expected packet number and a list of negative
@@ -516,6 +1003,14 @@ typedef enum SiameseEncoderStatsT
     // Return number of bytes of memory used by the codec
     SiameseEncoderStats_MemoryUsed,
 
+    // Return number of bytes of memory allocated by the shared memory pool
+    // for all attached codecs, or 0 if the encoder has no pool
+    SiameseEncoderStats_PoolMemoryUsed,
+
+    // Number of times the running sums were restarted, which makes the
+    // next recovery packet re-add every unacknowledged packet
+    SiameseEncoderStats_SumResetCount,
+
     SiameseEncoderStats_Count
 } SiameseEncoderStats;
 
@@ -568,6 +1063,21 @@ typedef enum SiameseDecoderStatsT
     // Return number of bytes of memory used by the codec
     SiameseDecoderStats_MemoryUsed,
 
+    // Return number of bytes of memory allocated by the shared memory pool
+    // for all attached codecs, or 0 if the decoder has no pool
+    SiameseDecoderStats_PoolMemoryUsed,
+
+    // Number of recovery packets dropped to stay within the memory budget
+    SiameseDecoderStats_DroppedRecoveryCount,
+
+    // Number of times the running sums were restarted, which makes the
+    // next solution re-add every received original in the sum range
+    SiameseDecoderStats_SumResetCount,
+
+    // Number of received originals added into the running sums.  With
+    // siamese_decoder_set_lazy_sums() this only grows when a solve needs them
+    SiameseDecoderStats_SumAddCount,
+
     SiameseDecoderStats_Count
 } SiameseDecoderStats;
 
@@ -583,6 +1093,200 @@ SIAMESE_EXPORT SiameseResult siamese_decoder_stats(
 );
 
 
+//------------------------------------------------------------------------------
+// Profiling API
+
+/**
+    Histograms are collected for a sample of operations once profiling is
+    enabled, so they are cheap enough to leave on in production.
+
+    Each histogram has power-of-two buckets: Bucket 0 counts zero values and
+    bucket i counts values in [2^(i-1), 2^i).  The last bucket also counts
+    all larger values.
+
+    Times are measured with the system clock, not siamese_set_clock().
+*/
+#define SIAMESE_HISTOGRAM_BUCKETS 32
+
+/// Encoder histograms
+typedef enum SiameseEncoderHistogramT
+{
+    // Wall time of siamese_encode() or siamese_encode_batch() in microseconds
+    SiameseEncoderHistogram_EncodeUsec,
+
+    SiameseEncoderHistogram_Count
+} SiameseEncoderHistogram;
+
+/// Decoder histograms
+typedef enum SiameseDecoderHistogramT
+{
+    // Wall time of a solution attempt in microseconds, including failures
+    SiameseDecoderHistogram_SolveUsec,
+
+    // Solution phases in microseconds.  Failed attempts stop after
+    // GaussianElimination
+    SiameseDecoderHistogram_GenerateMatrixUsec,
+    SiameseDecoderHistogram_GaussianEliminationUsec,
+    SiameseDecoderHistogram_EliminateOriginalDataUsec,
+    SiameseDecoderHistogram_MultiplyLowerTriangleUsec,
+    SiameseDecoderHistogram_BackSubstitutionUsec,
+
+    // Recovery matrix rows (recovery packets) and columns (lost packets)
+    SiameseDecoderHistogram_MatrixRows,
+    SiameseDecoderHistogram_MatrixColumns,
+
+    // Recovery packets used beyond the number of lost packets for
+    // successful solutions
+    SiameseDecoderHistogram_ExtraRecoveryCount,
+
+    SiameseDecoderHistogram_Count
+} SiameseDecoderHistogram;
+
+/**
+    Enable profiling histograms for the encoder.
+
+    One of every samplePeriod calls to siamese_encode() or
+    siamese_encode_batch() is measured.  Pass 1 to measure every call,
+    or 0 to stop profiling (the default).
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_set_profiling(
+    SiameseEncoder encoder, ///< [in] Encoder to use
+    unsigned samplePeriod   ///< [in] Sample one of this many calls, or 0
+);
+
+/**
+    Return the bucket counts of an encoder histogram for all time.
+
+    Up to SIAMESE_HISTOGRAM_BUCKETS buckets are returned.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_histogram(
+    SiameseEncoder encoder,            ///< [in] Encoder to use
+    SiameseEncoderHistogram histogram, ///< [in] Histogram to return
+    uint64_t* bucketsOut,              ///< [out] Returned bucket counts
+    unsigned bucketCount               ///< [in] Number of buckets to return
+);
+
+/**
+    Enable profiling histograms for the decoder.
+
+    One of every samplePeriod solution attempts is measured.  Pass 1 to
+    measure every attempt, or 0 to stop profiling (the default).
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_set_profiling(
+    SiameseDecoder decoder, ///< [in] Decoder to use
+    unsigned samplePeriod   ///< [in] Sample one of this many attempts, or 0
+);
+
+/**
+    Return the bucket counts of a decoder histogram for all time.
+
+    Up to SIAMESE_HISTOGRAM_BUCKETS buckets are returned.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_histogram(
+    SiameseDecoder decoder,            ///< [in] Decoder to use
+    SiameseDecoderHistogram histogram, ///< [in] Histogram to return
+    uint64_t* bucketsOut,              ///< [out] Returned bucket counts
+    unsigned bucketCount               ///< [in] Number of buckets to return
+);
+
+
+//------------------------------------------------------------------------------
+// Snapshots
+
+/**
+    Write the state of an encoder to a buffer, so that it can be moved to a
+    new encoder with siamese_encoder_restore(), for example in another process.
+
+    The snapshot includes the unacknowledged original data, the running sums,
+    the last acknowledgement and the statistics.  It does not include the
+    add queue or the profiling histograms.
+    Data added with siamese_encoder_add_external() is copied into the snapshot.
+    If an add queue is enabled, this must be called from the thread that
+    calls siamese_encode().
+
+    If buffer is null or bufferBytes is too small, usedBytesOut is set to the
+    number of bytes needed and Siamese_NeedMoreData is returned.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_snapshot(
+    SiameseEncoder encoder, ///< [in] Encoder to use
+    uint8_t* buffer,        ///< [out] Buffer for the snapshot, or null
+    unsigned bufferBytes,   ///< [in] Number of bytes available in the buffer
+    unsigned* usedBytesOut  ///< [out] Number of bytes used or needed
+);
+
+/**
+    Restore a snapshot written by siamese_encoder_snapshot().
+
+    The encoder must be newly created, and siamese_encoder_set_add_queue()
+    may only be called after it is restored.  The data is not referenced
+    after this returns.
+
+    Returns Siamese_InvalidInput if the snapshot is truncated or corrupted.
+    If the snapshot was only partly restored the encoder is disabled, and
+    Siamese_Disabled is returned by the other functions.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_encoder_restore(
+    SiameseEncoder encoder, ///< [in] Encoder to restore into
+    const uint8_t* data,    ///< [in] Snapshot data
+    unsigned bytes          ///< [in] Number of snapshot bytes
+);
+
+/**
+    Write the state of a decoder to a buffer, so that it can be moved to a
+    new decoder with siamese_decoder_restore(), for example in another process.
+
+    The snapshot includes the received and recovered original data, the
+    running sums, the recovery packets waiting to be used and the statistics.
+    Packets recovered but not yet returned by siamese_decode() are returned
+    by the restored decoder.  Data in buffers provided through
+    siamese_decoder_set_output() is copied into the snapshot, and restored
+    into buffers owned by the decoder.
+
+    If buffer is null or bufferBytes is too small, usedBytesOut is set to the
+    number of bytes needed and Siamese_NeedMoreData is returned.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_snapshot(
+    SiameseDecoder decoder, ///< [in] Decoder to use
+    uint8_t* buffer,        ///< [out] Buffer for the snapshot, or null
+    unsigned bufferBytes,   ///< [in] Number of bytes available in the buffer
+    unsigned* usedBytesOut  ///< [out] Number of bytes used or needed
+);
+
+/**
+    Restore a snapshot written by siamese_decoder_snapshot().
+
+    The decoder must be newly created.  Settings such as the output buffers
+    and solver threads are not part of the snapshot, and the memory budget
+    and lazy sum limit set here are replaced by the ones in the snapshot.
+    The data is not referenced after this returns.
+
+    Returns Siamese_InvalidInput if the snapshot is truncated or corrupted.
+    If the snapshot was only partly restored the decoder is disabled, and
+    Siamese_Disabled is returned by the other functions.
+
+    Returns 0 on success and other codes on error.
+*/
+SIAMESE_EXPORT SiameseResult siamese_decoder_restore(
+    SiameseDecoder decoder, ///< [in] Decoder to restore into
+    const uint8_t* data,    ///< [in] Snapshot data
+    unsigned bytes          ///< [in] Number of snapshot bytes
+);
+
+
 #ifdef __cplusplus
 }
 #endif
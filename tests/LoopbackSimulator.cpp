@@ -0,0 +1,939 @@
+/*
+    Copyright (c) 2016 Christopher A. Taylor.  All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Siamese nor the names of its contributors may be
+      used to endorse or promote products derived from this software without
+      specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "LoopbackSimulator.h"
+#include "../SiameseTools.h"
+#include "../SiameseSerializers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+static uint64_t GetNsec()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Adds the time spent in its scope to a counter
+class ScopedCallTimer
+{
+public:
+    explicit ScopedCallTimer(uint64_t& totalNsec)
+        : TotalNsec(totalNsec)
+        , StartNsec(GetNsec())
+    {
+    }
+    ~ScopedCallTimer()
+    {
+        TotalNsec += GetNsec() - StartNsec;
+    }
+
+private:
+    uint64_t& TotalNsec;
+    uint64_t StartNsec;
+};
+
+static void ComputePercentiles(std::vector<uint64_t>& samples, SimulatorPercentiles& percentiles)
+{
+    percentiles = SimulatorPercentiles();
+
+    const size_t count = samples.size();
+    if (count == 0) {
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    uint64_t sum = 0;
+    for (uint64_t sample : samples) {
+        sum += sample;
+    }
+
+    percentiles.Count = count;
+    percentiles.Mean = sum / (double)count;
+    percentiles.P50 = samples[(size_t)(0.5 * count)];
+    percentiles.P99 = samples[std::min(count - 1, (size_t)(0.99 * count))];
+    percentiles.P999 = samples[std::min(count - 1, (size_t)(0.999 * count))];
+    percentiles.Max = samples[count - 1];
+}
+
+// Simulated clock for the flow running on this thread
+static thread_local uint64_t FlowClockUsec = 0;
+
+static uint64_t OnFlowClock(void* /*context*/)
+{
+    return FlowClockUsec;
+}
+
+
+//------------------------------------------------------------------------------
+// SimulatedLink
+
+/**
+    One direction of the link.
+
+    Packets wait for the bottleneck in a drop-tail queue, and then the loss
+    model decides if they arrive.  Burst losses use a Gilbert-Elliott channel
+    with a lossless good state and a bad state that loses everything.  Leaving
+    the bad state with probability 1/L gives an average burst of L packets.
+*/
+class SimulatedLink
+{
+public:
+    void Initialize(const SimulatorLinkParams& params, unsigned oneWayUsec, uint64_t seed, uint64_t stream)
+    {
+        Params = params;
+        OneWayUsec = oneWayUsec;
+        NextFreeUsec = 0;
+        Prng.Seed(seed, stream);
+
+        const double lossRate = params.Loss.LossRate;
+        ExitBad = 1. / params.Loss.BurstLength;
+        EnterBad = lossRate * ExitBad / (1. - lossRate);
+        InBadState = false;
+    }
+
+    /// Returns true and sets arrivalUsec if the packet will arrive.
+    /// Sets queueDrop if it was dropped because the queue was full
+    bool Send(uint64_t nowUsec, unsigned bytes, uint64_t& arrivalUsec, bool& queueDrop)
+    {
+        queueDrop = false;
+
+        const uint64_t startUsec = std::max(nowUsec, NextFreeUsec);
+        if (startUsec - nowUsec > Params.QueueLimitUsec)
+        {
+            queueDrop = true;
+            return false;
+        }
+
+        if (Params.BandwidthBps > 0) {
+            NextFreeUsec = startUsec + (uint64_t)bytes * 8 * 1000000 / Params.BandwidthBps;
+        }
+        else {
+            NextFreeUsec = startUsec;
+        }
+
+        if (IsLost()) {
+            return false;
+        }
+
+        arrivalUsec = NextFreeUsec + OneWayUsec;
+        if (Params.JitterUsec > 0) {
+            arrivalUsec += Prng.Next() % Params.JitterUsec;
+        }
+        if (Params.ReorderRate > 0. && NextUniform() < Params.ReorderRate) {
+            arrivalUsec += Params.ReorderDelayUsec;
+        }
+        return true;
+    }
+
+private:
+    SimulatorLinkParams Params;
+    unsigned OneWayUsec = 0;
+    uint64_t NextFreeUsec = 0;
+    siamese::PCGRandom Prng;
+    double EnterBad = 0., ExitBad = 1.;
+    bool InBadState = false;
+
+    double NextUniform()
+    {
+        return Prng.Next() / 4294967296.;
+    }
+
+    bool IsLost()
+    {
+        if (Params.Loss.BurstLength <= 1.) {
+            return NextUniform() < Params.Loss.LossRate;
+        }
+
+        if (InBadState)
+        {
+            if (NextUniform() < ExitBad) {
+                InBadState = false;
+            }
+        }
+        else if (NextUniform() < EnterBad) {
+            InBadState = true;
+        }
+        return InBadState;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// SimulatedFlow
+
+/// Results of one flow before they are combined
+struct FlowResult
+{
+    SimulatorResult Totals;
+    std::vector<uint64_t> DeliveryDelays, RecoveryDelays;
+};
+
+class SimulatedFlow
+{
+public:
+    SimulatedFlow(const SimulatorParams& params, unsigned flowIndex, FlowResult& result);
+    ~SimulatedFlow();
+
+    /// Returns false and sets the result error on failure
+    bool Run();
+
+private:
+    enum OpCodes
+    {
+        OpCode_Data,
+        OpCode_Recovery,
+        OpCode_Ack
+    };
+
+    enum EventTypes
+    {
+        Event_ClientSend,
+        Event_ClientReceive,
+        Event_ServerReceive,
+        Event_ServerAck
+    };
+
+    struct Event
+    {
+        uint64_t TimeUsec;
+        uint64_t Sequence;
+        EventTypes Type;
+        unsigned Slot;
+
+        /// Orders the priority queue by time, then by order of scheduling
+        bool operator>(const Event& other) const
+        {
+            if (TimeUsec != other.TimeUsec) {
+                return TimeUsec > other.TimeUsec;
+            }
+            return Sequence > other.Sequence;
+        }
+    };
+
+    const SimulatorParams& Params;
+    const unsigned FlowIndex;
+    FlowResult& Result;
+    SimulatorResult& Totals;
+
+    SiameseEncoder Encoder = nullptr;
+    SiameseDecoder Decoder = nullptr;
+
+    SimulatedLink ForwardLink, ReverseLink;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> Events;
+    uint64_t NextSequence = 0;
+
+    // Packets in flight, reused through a free list
+    std::vector<std::vector<uint8_t>> Slots;
+    std::vector<unsigned> FreeSlots;
+
+    // Original data is a window into this random pool
+    std::vector<uint8_t> DataPool;
+
+    // Client state
+    unsigned NextNewPacket = 0;
+    uint64_t StartUsec = 0;
+    uint64_t LastNewSendUsec = 0;
+    std::vector<uint64_t> FirstSendUsec;
+    std::vector<bool> FirstCopyLost;
+
+    // Server state
+    unsigned NextExpectedPacket = 0;
+    bool ReceivedSinceAck = false;
+    bool Finished = false;
+    uint64_t FinishUsec = 0;
+
+    void Schedule(uint64_t timeUsec, EventTypes type, unsigned slot = 0);
+    void SetError(const char* error);
+
+    unsigned GetPacketBytes(unsigned packetNum) const;
+    const uint8_t* GetPacketData(unsigned packetNum) const;
+
+    /// Put a packet on a link.  Returns true if it will arrive
+    bool SendPacket(bool forward, const uint8_t* data, unsigned bytes);
+
+    void OnClientSend();
+    void OnClientReceive(unsigned slot);
+    void OnServerReceive(unsigned slot);
+    void OnServerAck();
+
+    bool ClientRetransmit();
+    bool ClientSendNewOriginal();
+    void ClientSendRecovery();
+
+    void ServerOnOriginal(const SiameseOriginalPacket& original);
+    void ServerDeliver(const SiameseOriginalPacket& original);
+    void ServerResumeDelivery();
+    void ServerCheckRecovery();
+};
+
+SimulatedFlow::SimulatedFlow(const SimulatorParams& params, unsigned flowIndex, FlowResult& result)
+    : Params(params)
+    , FlowIndex(flowIndex)
+    , Result(result)
+    , Totals(result.Totals)
+{
+}
+
+SimulatedFlow::~SimulatedFlow()
+{
+    siamese_encoder_free(Encoder);
+    siamese_decoder_free(Decoder);
+}
+
+void SimulatedFlow::Schedule(uint64_t timeUsec, EventTypes type, unsigned slot)
+{
+    Event event;
+    event.TimeUsec = timeUsec;
+    event.Sequence = NextSequence++;
+    event.Type = type;
+    event.Slot = slot;
+    Events.push(event);
+}
+
+void SimulatedFlow::SetError(const char* error)
+{
+    if (Totals.Error.empty()) {
+        Totals.Error = error;
+    }
+}
+
+unsigned SimulatedFlow::GetPacketBytes(unsigned packetNum) const
+{
+    const unsigned range = Params.MaxPacketBytes - Params.MinPacketBytes + 1;
+    return Params.MinPacketBytes + (packetNum * 2654435761u >> 8) % range;
+}
+
+const uint8_t* SimulatedFlow::GetPacketData(unsigned packetNum) const
+{
+    return &DataPool[packetNum % Params.MaxPacketBytes];
+}
+
+bool SimulatedFlow::SendPacket(bool forward, const uint8_t* data, unsigned bytes)
+{
+    SimulatedLink& link = forward ? ForwardLink : ReverseLink;
+
+    uint64_t arrivalUsec = 0;
+    bool queueDrop = false;
+    if (!link.Send(FlowClockUsec, bytes, arrivalUsec, queueDrop))
+    {
+        if (!forward) {
+            Totals.ReverseLost++;
+        }
+        else if (queueDrop) {
+            Totals.ForwardQueueDrops++;
+        }
+        else {
+            Totals.ForwardLost++;
+        }
+        return false;
+    }
+
+    unsigned slot;
+    if (!FreeSlots.empty())
+    {
+        slot = FreeSlots.back();
+        FreeSlots.pop_back();
+    }
+    else
+    {
+        slot = (unsigned)Slots.size();
+        Slots.emplace_back();
+    }
+    Slots[slot].assign(data, data + bytes);
+
+    Schedule(arrivalUsec, forward ? Event_ServerReceive : Event_ClientReceive, slot);
+    return true;
+}
+
+bool SimulatedFlow::Run()
+{
+    siamese::PCGRandom prng;
+    prng.Seed(Params.Seed, FlowIndex);
+
+    DataPool.resize(Params.MaxPacketBytes * 2);
+    for (auto& value : DataPool) {
+        value = (uint8_t)prng.Next();
+    }
+
+    FirstSendUsec.resize(Params.PacketCount);
+    FirstCopyLost.resize(Params.PacketCount);
+
+    const unsigned oneWayUsec = Params.RttUsec / 2;
+    ForwardLink.Initialize(Params.Forward, oneWayUsec, Params.Seed, FlowIndex * 2 + 1);
+    ReverseLink.Initialize(Params.Reverse, oneWayUsec, Params.Seed, FlowIndex * 2 + 2);
+
+    // Start the clock at one second since the encoder treats a zero send
+    // timestamp as unset
+    FlowClockUsec = 1000000;
+    StartUsec = FlowClockUsec;
+
+    {
+        ScopedCallTimer timer(Totals.EncoderNsec);
+        Encoder = siamese_encoder_create();
+    }
+    {
+        ScopedCallTimer timer(Totals.DecoderNsec);
+        Decoder = siamese_decoder_create();
+    }
+    if (!Encoder || !Decoder)
+    {
+        SetError("Unable to create codec");
+        return false;
+    }
+    if (Params.SolverThreads > 1 &&
+        siamese_decoder_set_solver_threads(Decoder, Params.SolverThreads) != Siamese_Success)
+    {
+        SetError("Unable to start solver threads");
+        return false;
+    }
+
+    Schedule(StartUsec, Event_ClientSend);
+    Schedule(StartUsec + Params.AckIntervalUsec, Event_ServerAck);
+
+    while (!Finished && Totals.Error.empty() && !Events.empty())
+    {
+        const Event event = Events.top();
+        Events.pop();
+
+        FlowClockUsec = event.TimeUsec;
+
+        switch (event.Type)
+        {
+        case Event_ClientSend:
+            OnClientSend();
+            break;
+        case Event_ClientReceive:
+            OnClientReceive(event.Slot);
+            break;
+        case Event_ServerReceive:
+            OnServerReceive(event.Slot);
+            break;
+        case Event_ServerAck:
+            OnServerAck();
+            break;
+        }
+    }
+
+    if (Finished)
+    {
+        Totals.CompletedFlows = 1;
+        Totals.SimulatedUsec = FinishUsec - StartUsec;
+        if (Totals.SimulatedUsec > 0) {
+            Totals.GoodputBps = Totals.DeliveredBytes * 8. * 1000000. / Totals.SimulatedUsec;
+        }
+    }
+
+    uint64_t stats[SiameseDecoderStats_Count];
+    if (siamese_decoder_stats(Decoder, stats, SiameseDecoderStats_Count) == Siamese_Success) {
+        Totals.FECOverheadCount = stats[SiameseDecoderStats_SolveFailCount] + stats[SiameseDecoderStats_DupedRecoveryCount];
+    }
+
+    return Totals.Error.empty();
+}
+
+void SimulatedFlow::OnClientSend()
+{
+    if (NextNewPacket >= Params.PacketCount &&
+        FlowClockUsec - LastNewSendUsec > Params.DrainLimitUsec)
+    {
+        SetError("Flow did not finish within the drain limit");
+        return;
+    }
+
+    // Retransmissions take the place of new data
+    if (!ClientRetransmit()) {
+        ClientSendNewOriginal();
+    }
+
+    // Send FEC at the requested rate
+    if (Totals.RecoveryCount * 100. < Params.RedundancyPercent * Totals.OriginalCount) {
+        ClientSendRecovery();
+    }
+
+    Schedule(FlowClockUsec + Params.SendIntervalUsec, Event_ClientSend);
+}
+
+bool SimulatedFlow::ClientRetransmit()
+{
+    SiameseOriginalPacket original;
+    SiameseResult result;
+    {
+        ScopedCallTimer timer(Totals.EncoderNsec);
+        result = siamese_encoder_retransmit(Encoder, &original);
+    }
+
+    if (result == Siamese_NeedMoreData) {
+        return false;
+    }
+    if (result != Siamese_Success)
+    {
+        SetError("siamese_encoder_retransmit failed");
+        return false;
+    }
+
+    if (Params.RetransmitWithFEC)
+    {
+        ClientSendRecovery();
+        return true;
+    }
+
+    uint8_t packet[1 + 4 + 65536];
+    if (original.DataBytes > sizeof(packet) - 1 - 4)
+    {
+        SetError("Retransmitted packet is too large");
+        return false;
+    }
+    packet[0] = OpCode_Data;
+    siamese::WriteU32_LE(packet + 1, original.PacketNum);
+    memcpy(packet + 1 + 4, original.Data, original.DataBytes);
+
+    Totals.RetransmitCount++;
+    Totals.RetransmitBytesSent += 1 + 4 + original.DataBytes;
+
+    SendPacket(true, packet, 1 + 4 + original.DataBytes);
+    return true;
+}
+
+bool SimulatedFlow::ClientSendNewOriginal()
+{
+    if (NextNewPacket >= Params.PacketCount) {
+        return false;
+    }
+
+    const unsigned packetNum = NextNewPacket;
+
+    SiameseOriginalPacket original;
+    original.Data = GetPacketData(packetNum);
+    original.DataBytes = GetPacketBytes(packetNum);
+
+    SiameseResult result;
+    {
+        ScopedCallTimer timer(Totals.EncoderNsec);
+        result = siamese_encoder_add(Encoder, &original);
+    }
+
+    // If the encoder window is full, wait for acknowledgements
+    if (result == Siamese_MaxPacketsReached) {
+        return false;
+    }
+    if (result != Siamese_Success && result != Siamese_Backpressure)
+    {
+        SetError("siamese_encoder_add failed");
+        return false;
+    }
+    if (original.PacketNum != packetNum)
+    {
+        SetError("Unexpected packet number from siamese_encoder_add");
+        return false;
+    }
+
+    ++NextNewPacket;
+    LastNewSendUsec = FlowClockUsec;
+    FirstSendUsec[packetNum] = FlowClockUsec;
+
+    uint8_t packet[1 + 4 + 65536];
+    packet[0] = OpCode_Data;
+    siamese::WriteU32_LE(packet + 1, packetNum);
+    memcpy(packet + 1 + 4, original.Data, original.DataBytes);
+
+    Totals.OriginalCount++;
+    Totals.OriginalBytesSent += 1 + 4 + original.DataBytes;
+
+    if (!SendPacket(true, packet, 1 + 4 + original.DataBytes)) {
+        FirstCopyLost[packetNum] = true;
+    }
+    return true;
+}
+
+void SimulatedFlow::ClientSendRecovery()
+{
+    SiameseRecoveryPacket recovery;
+    SiameseResult result;
+    {
+        ScopedCallTimer timer(Totals.EncoderNsec);
+        result = siamese_encode(Encoder, &recovery);
+    }
+
+    if (result == Siamese_NeedMoreData) {
+        return;
+    }
+    if (result != Siamese_Success)
+    {
+        SetError("siamese_encode failed");
+        return;
+    }
+
+    uint8_t packet[1 + 65536 + SIAMESE_MAX_ENCODE_OVERHEAD];
+    if (recovery.DataBytes > sizeof(packet) - 1)
+    {
+        SetError("Recovery packet is too large");
+        return;
+    }
+    packet[0] = OpCode_Recovery;
+    memcpy(packet + 1, recovery.Data, recovery.DataBytes);
+
+    Totals.RecoveryCount++;
+    Totals.RecoveryBytesSent += 1 + recovery.DataBytes;
+
+    SendPacket(true, packet, 1 + recovery.DataBytes);
+}
+
+void SimulatedFlow::OnClientReceive(unsigned slot)
+{
+    const std::vector<uint8_t>& packet = Slots[slot];
+
+    if (packet.size() < 1 || packet[0] != OpCode_Ack) {
+        SetError("Invalid s2c protocol opcode");
+    }
+    else
+    {
+        unsigned nextExpected = 0;
+        SiameseResult result;
+        {
+            ScopedCallTimer timer(Totals.EncoderNsec);
+            result = siamese_encoder_ack(Encoder, packet.data() + 1, (unsigned)packet.size() - 1, &nextExpected);
+        }
+        if (result != Siamese_Success) {
+            SetError("siamese_encoder_ack failed");
+        }
+    }
+
+    FreeSlots.push_back(slot);
+}
+
+void SimulatedFlow::OnServerReceive(unsigned slot)
+{
+    const std::vector<uint8_t>& packet = Slots[slot];
+    const unsigned bytes = (unsigned)packet.size();
+
+    ReceivedSinceAck = true;
+
+    if (bytes > 1 + 4 && packet[0] == OpCode_Data)
+    {
+        SiameseOriginalPacket original;
+        original.PacketNum = siamese::ReadU32_LE(packet.data() + 1);
+        original.Data = packet.data() + 1 + 4;
+        original.DataBytes = bytes - 1 - 4;
+        ServerOnOriginal(original);
+    }
+    else if (bytes > 1 && packet[0] == OpCode_Recovery)
+    {
+        SiameseRecoveryPacket recovery;
+        recovery.Data = packet.data() + 1;
+        recovery.DataBytes = bytes - 1;
+
+        SiameseResult result;
+        {
+            ScopedCallTimer timer(Totals.DecoderNsec);
+            result = siamese_decoder_add_recovery(Decoder, &recovery);
+        }
+        if (result != Siamese_Success) {
+            SetError("siamese_decoder_add_recovery failed");
+        }
+        else {
+            ServerCheckRecovery();
+        }
+    }
+    else {
+        SetError("Invalid c2s protocol opcode");
+    }
+
+    FreeSlots.push_back(slot);
+}
+
+void SimulatedFlow::OnServerAck()
+{
+    if (ReceivedSinceAck)
+    {
+        ReceivedSinceAck = false;
+
+        uint8_t packet[1 + 1400];
+        packet[0] = OpCode_Ack;
+        unsigned usedBytes = 0;
+
+        SiameseResult result;
+        {
+            ScopedCallTimer timer(Totals.DecoderNsec);
+            result = siamese_decoder_ack(Decoder, packet + 1, (unsigned)sizeof(packet) - 1, &usedBytes);
+        }
+        if (result == Siamese_Success)
+        {
+            Totals.AckBytesSent += 1 + usedBytes;
+            SendPacket(false, packet, 1 + usedBytes);
+        }
+        else if (result != Siamese_NeedMoreData)
+        {
+            SetError("siamese_decoder_ack failed");
+            return;
+        }
+    }
+
+    Schedule(FlowClockUsec + Params.AckIntervalUsec, Event_ServerAck);
+}
+
+void SimulatedFlow::ServerOnOriginal(const SiameseOriginalPacket& original)
+{
+    // Deliver in-sequence data right away.
+    // Note: The data must be delivered before the decoder has it, or else
+    // the decoder would hand it out again from siamese_decoder_get()
+    if (original.PacketNum == NextExpectedPacket) {
+        ServerDeliver(original);
+    }
+
+    SiameseResult result;
+    {
+        ScopedCallTimer timer(Totals.DecoderNsec);
+        result = siamese_decoder_add_original(Decoder, &original);
+    }
+
+    if (result == Siamese_DuplicateData) {
+        return;
+    }
+    if (result != Siamese_Success)
+    {
+        SetError("siamese_decoder_add_original failed");
+        return;
+    }
+
+    ServerResumeDelivery();
+    ServerCheckRecovery();
+}
+
+void SimulatedFlow::ServerDeliver(const SiameseOriginalPacket& original)
+{
+    const unsigned packetNum = original.PacketNum;
+    SIAMESE_DEBUG_ASSERT(packetNum == NextExpectedPacket);
+
+    if (packetNum >= Params.PacketCount ||
+        original.DataBytes != GetPacketBytes(packetNum) ||
+        0 != memcmp(original.Data, GetPacketData(packetNum), original.DataBytes))
+    {
+        SetError("Delivered data was corrupted");
+        return;
+    }
+
+    const uint64_t delayUsec = FlowClockUsec - FirstSendUsec[packetNum];
+    Result.DeliveryDelays.push_back(delayUsec);
+    if (FirstCopyLost[packetNum]) {
+        Result.RecoveryDelays.push_back(delayUsec);
+    }
+
+    Totals.DeliveredCount++;
+    Totals.DeliveredBytes += original.DataBytes;
+
+    NextExpectedPacket = SIAMESE_PACKET_NUM_INC(NextExpectedPacket);
+    if (NextExpectedPacket >= Params.PacketCount)
+    {
+        Finished = true;
+        FinishUsec = FlowClockUsec;
+    }
+}
+
+void SimulatedFlow::ServerResumeDelivery()
+{
+    while (!Finished && Totals.Error.empty())
+    {
+        SiameseOriginalPacket original;
+        original.PacketNum = NextExpectedPacket;
+
+        SiameseResult result;
+        {
+            ScopedCallTimer timer(Totals.DecoderNsec);
+            result = siamese_decoder_get(Decoder, &original);
+        }
+        if (result != Siamese_Success) {
+            break;
+        }
+
+        ServerDeliver(original);
+    }
+}
+
+void SimulatedFlow::ServerCheckRecovery()
+{
+    while (!Finished && Totals.Error.empty())
+    {
+        SiameseResult result;
+        {
+            ScopedCallTimer timer(Totals.DecoderNsec);
+            result = siamese_decoder_is_ready(Decoder);
+        }
+        if (result != Siamese_Success) {
+            break;
+        }
+
+        SiameseOriginalPacket* recovered = nullptr;
+        unsigned recoveredCount = 0;
+        {
+            ScopedCallTimer timer(Totals.DecoderNsec);
+            result = siamese_decode(Decoder, &recovered, &recoveredCount);
+        }
+
+        // If recovery failed, wait for more data
+        if (result == Siamese_NeedMoreData) {
+            break;
+        }
+        if (result != Siamese_Success)
+        {
+            SetError("siamese_decode failed");
+            break;
+        }
+
+        Totals.RecoveredCount += recoveredCount;
+        ServerResumeDelivery();
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// LoopbackSimulator
+
+static bool ValidateParams(const SimulatorParams& params, SimulatorResult& result)
+{
+    const SimulatorLinkParams* links[2] = { &params.Forward, &params.Reverse };
+    for (const SimulatorLinkParams* link : links)
+    {
+        if (link->Loss.LossRate < 0. || link->Loss.LossRate >= 1. ||
+            link->Loss.BurstLength < 1. ||
+            link->ReorderRate < 0. || link->ReorderRate > 1.)
+        {
+            result.Error = "Invalid link parameters";
+            return false;
+        }
+    }
+
+    if (params.FlowCount < 1 || params.ThreadCount < 1 ||
+        params.PacketCount < 1 || params.PacketCount >= SIAMESE_PACKET_NUM_COUNT ||
+        params.MinPacketBytes < 1 || params.MinPacketBytes > params.MaxPacketBytes ||
+        params.MaxPacketBytes > 65536 ||
+        params.SendIntervalUsec < 1 || params.AckIntervalUsec < 1 ||
+        params.RedundancyPercent < 0.)
+    {
+        result.Error = "Invalid simulator parameters";
+        return false;
+    }
+
+    return true;
+}
+
+static void MergeFlowResult(const SimulatorResult& flow, SimulatorResult& result)
+{
+    result.CompletedFlows += flow.CompletedFlows;
+    result.SimulatedUsec += flow.SimulatedUsec;
+    result.GoodputBps += flow.GoodputBps;
+    result.DeliveredCount += flow.DeliveredCount;
+    result.DeliveredBytes += flow.DeliveredBytes;
+    result.OriginalBytesSent += flow.OriginalBytesSent;
+    result.RetransmitBytesSent += flow.RetransmitBytesSent;
+    result.RecoveryBytesSent += flow.RecoveryBytesSent;
+    result.AckBytesSent += flow.AckBytesSent;
+    result.OriginalCount += flow.OriginalCount;
+    result.RetransmitCount += flow.RetransmitCount;
+    result.RecoveryCount += flow.RecoveryCount;
+    result.ForwardLost += flow.ForwardLost;
+    result.ForwardQueueDrops += flow.ForwardQueueDrops;
+    result.ReverseLost += flow.ReverseLost;
+    result.RecoveredCount += flow.RecoveredCount;
+    result.FECOverheadCount += flow.FECOverheadCount;
+    result.EncoderNsec += flow.EncoderNsec;
+    result.DecoderNsec += flow.DecoderNsec;
+    if (result.Error.empty()) {
+        result.Error = flow.Error;
+    }
+}
+
+bool RunLoopbackSimulation(const SimulatorParams& params, SimulatorResult& result)
+{
+    result = SimulatorResult();
+
+    if (!ValidateParams(params, result)) {
+        return false;
+    }
+
+    std::vector<FlowResult> flows(params.FlowCount);
+
+    // Each thread runs every ThreadCount'th flow to completion in turn
+    auto runThread = [&params, &flows](unsigned threadIndex)
+    {
+        for (unsigned i = threadIndex; i < params.FlowCount; i += params.ThreadCount)
+        {
+            SimulatedFlow flow(params, i, flows[i]);
+            flow.Run();
+        }
+    };
+
+    siamese_set_clock(OnFlowClock, nullptr);
+
+    const unsigned threadCount = std::min(params.ThreadCount, params.FlowCount);
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; ++i) {
+        threads.emplace_back(runThread, i);
+    }
+    runThread(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    siamese_set_clock(nullptr, nullptr);
+
+    // Combine in flow order so the results do not depend on thread timing
+    std::vector<uint64_t> deliveryDelays, recoveryDelays;
+    for (FlowResult& flow : flows)
+    {
+        MergeFlowResult(flow.Totals, result);
+        deliveryDelays.insert(deliveryDelays.end(), flow.DeliveryDelays.begin(), flow.DeliveryDelays.end());
+        recoveryDelays.insert(recoveryDelays.end(), flow.RecoveryDelays.begin(), flow.RecoveryDelays.end());
+    }
+
+    ComputePercentiles(deliveryDelays, result.DeliveryDelay);
+    ComputePercentiles(recoveryDelays, result.RecoveryDelay);
+
+    if (result.DeliveredBytes > 0)
+    {
+        result.FECOverheadRatio = result.RecoveryBytesSent / (double)result.DeliveredBytes;
+        result.RetransmitOverheadRatio = result.RetransmitBytesSent / (double)result.DeliveredBytes;
+        result.CpuNsecPerByte = (result.EncoderNsec + result.DecoderNsec) / (double)result.DeliveredBytes;
+    }
+
+    if (result.Error.empty() && result.CompletedFlows != params.FlowCount) {
+        result.Error = "Not every flow finished";
+    }
+
+    return result.Error.empty();
+}
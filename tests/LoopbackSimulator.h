@@ -0,0 +1,209 @@
+/*
+    Copyright (c) 2016 Christopher A. Taylor.  All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Siamese nor the names of its contributors may be
+      used to endorse or promote products derived from this software without
+      specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+
+/*
+    Loopback Simulator
+
+    Drives real Siamese encoder/decoder pairs over a modeled link so that FEC
+    rates and codec settings can be compared for a link before deployment.
+
+    Each flow has a client that sends originals, retransmissions and recovery
+    packets, and a server that decodes, delivers data in order and sends acks.
+    The link in each direction has a bottleneck rate with a drop-tail queue,
+    a fixed one-way delay, optional jitter and reordering, and Bernoulli or
+    Gilbert-Elliott burst loss.
+
+    Time is simulated, and siamese_set_clock() gives each flow its own clock,
+    so a run is repeatable for a given seed and takes only as long as the CPU
+    work.  Flows are spread across threads, and each flow has its own link.
+*/
+
+#include <stdint.h>
+#include <string>
+
+#include "../siamese.h"
+
+
+//------------------------------------------------------------------------------
+// SimulatorParams
+
+/// Loss model for one direction of the link
+struct SimulatorLossParams
+{
+    /// Average loss rate in [0, 1)
+    double LossRate = 0.03;
+
+    /// Average burst length in packets.
+    /// 1 gives independent losses, and above 1 uses a Gilbert-Elliott channel
+    double BurstLength = 1.;
+};
+
+/// One direction of the modeled link
+struct SimulatorLinkParams
+{
+    /// Bottleneck rate in bits per second, or 0 for no limit
+    uint64_t BandwidthBps = 100 * 1000 * 1000;
+
+    /// Packets are dropped if they would queue longer than this
+    unsigned QueueLimitUsec = 50 * 1000;
+
+    /// Each packet is delayed by up to this much more than the base delay
+    unsigned JitterUsec = 0;
+
+    /// Fraction of packets held back by ReorderDelayUsec so later ones pass
+    double ReorderRate = 0.;
+    unsigned ReorderDelayUsec = 5 * 1000;
+
+    SimulatorLossParams Loss;
+};
+
+struct SimulatorParams
+{
+    /// Number of independent flows, and threads to run them on
+    unsigned FlowCount = 1;
+    unsigned ThreadCount = 1;
+
+    /// Round trip time without queuing, split evenly between the directions
+    unsigned RttUsec = 40 * 1000;
+
+    /// Client to server (data) and server to client (ack) links
+    SimulatorLinkParams Forward, Reverse;
+
+    /// Originals each flow delivers
+    unsigned PacketCount = 20000;
+
+    /// Original sizes are picked uniformly from this range
+    unsigned MinPacketBytes = 1000;
+    unsigned MaxPacketBytes = 1200;
+
+    /// The client sends one packet per interval, and a retransmission takes
+    /// the place of a new original.  There is no congestion control, so this
+    /// should leave room for recovery packets within the forward bandwidth
+    unsigned SendIntervalUsec = 1000;
+
+    /// Recovery packets sent per 100 originals
+    double RedundancyPercent = 6.;
+
+    /// Send a recovery packet instead of each retransmission
+    bool RetransmitWithFEC = false;
+
+    /// Microseconds between acknowledgements from the server
+    unsigned AckIntervalUsec = 2000;
+
+    /// A flow is abandoned if it has not finished in this much simulated time
+    /// after its last original was first sent
+    unsigned DrainLimitUsec = 10 * 1000 * 1000;
+
+    /// Decoder solver threads per flow
+    unsigned SolverThreads = 0;
+
+    uint64_t Seed = 1;
+};
+
+
+//------------------------------------------------------------------------------
+// SimulatorResult
+
+/// Percentiles of a set of samples
+struct SimulatorPercentiles
+{
+    uint64_t Count = 0;
+    double Mean = 0.;
+    uint64_t P50 = 0, P99 = 0, P999 = 0, Max = 0;
+};
+
+struct SimulatorResult
+{
+    /// Flows that delivered every original
+    unsigned CompletedFlows = 0;
+
+    /// Simulated time from the first send until the last in-order delivery,
+    /// summed over all flows
+    uint64_t SimulatedUsec = 0;
+
+    /// Sum over the flows of delivered bytes divided by simulated time, as if
+    /// the flows shared one wide pipe
+    double GoodputBps = 0.;
+
+    uint64_t DeliveredCount = 0;
+    uint64_t DeliveredBytes = 0;
+
+    /// Bytes put on the forward link, split by packet type
+    uint64_t OriginalBytesSent = 0;
+    uint64_t RetransmitBytesSent = 0;
+    uint64_t RecoveryBytesSent = 0;
+    uint64_t AckBytesSent = 0;
+
+    uint64_t OriginalCount = 0;
+    uint64_t RetransmitCount = 0;
+    uint64_t RecoveryCount = 0;
+
+    /// Packets lost to the loss model or dropped by a full queue
+    uint64_t ForwardLost = 0;
+    uint64_t ForwardQueueDrops = 0;
+    uint64_t ReverseLost = 0;
+
+    /// Originals rebuilt from recovery packets
+    uint64_t RecoveredCount = 0;
+
+    /// Wasted FEC: SolveFailCount + DupedRecoveryCount from the decoders
+    uint64_t FECOverheadCount = 0;
+
+    /// Recovery and retransmission bytes per delivered original byte
+    double FECOverheadRatio = 0.;
+    double RetransmitOverheadRatio = 0.;
+
+    /// Delay from the first send until in-order delivery, in microseconds.
+    /// RecoveryDelay only counts originals whose first copy did not arrive
+    SimulatorPercentiles DeliveryDelay;
+    SimulatorPercentiles RecoveryDelay;
+
+    /// Wall time spent inside codec calls, in nanoseconds
+    uint64_t EncoderNsec = 0;
+    uint64_t DecoderNsec = 0;
+
+    /// Codec CPU nanoseconds per delivered byte
+    double CpuNsecPerByte = 0.;
+
+    /// Empty on success
+    std::string Error;
+};
+
+
+//------------------------------------------------------------------------------
+// LoopbackSimulator
+
+/**
+    Run all of the flows described by the params.
+
+    Returns true if every flow delivered all of its originals intact.
+    Returns false and sets result.Error otherwise.
+*/
+bool RunLoopbackSimulation(const SimulatorParams& params, SimulatorResult& result);
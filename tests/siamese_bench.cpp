@@ -0,0 +1,805 @@
+/*
+    Copyright (c) 2016 Christopher A. Taylor.  All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Siamese nor the names of its contributors may be
+      used to endorse or promote products derived from this software without
+      specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Siamese benchmark suite
+
+    Runs seeded encoder/decoder scenarios and gf256 kernel microbenchmarks,
+    and writes the results to stdout as one JSON object so that runs can be
+    compared across commits and machines.
+
+    Codec scenario: Each flow sends originals over a simulated channel with
+    a fixed packet interval.  The decoder acknowledges every --ack-interval
+    packets and each ack reaches the encoder --window packets later, so the
+    window is the number of packets in flight.  The encoder clock is
+    simulated too, so retransmissions are identical from run to run.
+
+    Kernel scenario: Each gf256 bulk memory kernel is timed for every
+    instruction set path that the CPU supports.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include "../siamese.h"
+#include "../SiameseTools.h"
+#include "../gf256.h"
+
+
+//------------------------------------------------------------------------------
+// Parameters
+
+struct BenchParams
+{
+    std::string Suite = "all";
+
+    // Codec scenario
+    unsigned PacketBytes = 1000;
+    unsigned PacketCount = 100000;
+    unsigned Window = 128;
+    double LossRate = 0.03;
+    bool BurstLoss = false;
+    double BurstLength = 4.;
+    unsigned AckInterval = 16;
+    unsigned RecoveryInterval = 8;
+    unsigned IntervalUsec = 100;
+    unsigned Threads = 1;
+    unsigned SolverThreads = 0;
+    unsigned DecoderBatch = 1;
+    uint64_t Seed = 1;
+
+    // Kernel scenario
+    unsigned KernelBytes = 1400;
+    unsigned KernelIterations = 100000;
+};
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "Usage: siamese_bench [options]\n"
+        "  --suite all|codec|kernels   Which benchmarks to run (all)\n"
+        "  --packet-bytes N            Original packet size (1000)\n"
+        "  --packets N                 Originals sent per flow (100000)\n"
+        "  --window N                  Packets in flight before an ack arrives (128)\n"
+        "  --loss R                    Average loss rate in [0, 1) (0.03)\n"
+        "  --pattern bernoulli|burst   Independent or Gilbert-Elliott losses (bernoulli)\n"
+        "  --burst-length N            Average burst length for burst losses (4)\n"
+        "  --ack-interval N            Originals between acks (16)\n"
+        "  --recovery-interval N       Originals between recovery packets (8)\n"
+        "  --interval-usec N           Simulated time between originals (100)\n"
+        "  --threads N                 Independent flows run in parallel (1)\n"
+        "  --solver-threads N          Decoder solver threads per flow (0)\n"
+        "  --decoder-batch N           Originals per decoder add call, above 1 uses the batch API (1)\n"
+        "  --seed N                    Random seed (1)\n"
+        "  --kernel-bytes N            Buffer size for kernel benchmarks (1400)\n"
+        "  --kernel-iterations N       Calls per kernel and instruction set (100000)\n");
+}
+
+static bool ParseParams(int argc, char** argv, BenchParams& params)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* name = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "Missing value for %s\n", name);
+            return false;
+        }
+        const char* value = argv[++i];
+        const unsigned number = (unsigned)strtoul(value, nullptr, 10);
+
+        if (0 == strcmp(name, "--suite"))
+            params.Suite = value;
+        else if (0 == strcmp(name, "--packet-bytes"))
+            params.PacketBytes = number;
+        else if (0 == strcmp(name, "--packets"))
+            params.PacketCount = number;
+        else if (0 == strcmp(name, "--window"))
+            params.Window = number;
+        else if (0 == strcmp(name, "--loss"))
+            params.LossRate = strtod(value, nullptr);
+        else if (0 == strcmp(name, "--pattern"))
+        {
+            if (0 == strcmp(value, "burst"))
+                params.BurstLoss = true;
+            else if (0 == strcmp(value, "bernoulli"))
+                params.BurstLoss = false;
+            else
+            {
+                fprintf(stderr, "Unknown loss pattern %s\n", value);
+                return false;
+            }
+        }
+        else if (0 == strcmp(name, "--burst-length"))
+            params.BurstLength = strtod(value, nullptr);
+        else if (0 == strcmp(name, "--ack-interval"))
+            params.AckInterval = number;
+        else if (0 == strcmp(name, "--recovery-interval"))
+            params.RecoveryInterval = number;
+        else if (0 == strcmp(name, "--interval-usec"))
+            params.IntervalUsec = number;
+        else if (0 == strcmp(name, "--threads"))
+            params.Threads = number;
+        else if (0 == strcmp(name, "--solver-threads"))
+            params.SolverThreads = number;
+        else if (0 == strcmp(name, "--decoder-batch"))
+            params.DecoderBatch = number;
+        else if (0 == strcmp(name, "--seed"))
+            params.Seed = strtoull(value, nullptr, 10);
+        else if (0 == strcmp(name, "--kernel-bytes"))
+            params.KernelBytes = number;
+        else if (0 == strcmp(name, "--kernel-iterations"))
+            params.KernelIterations = number;
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", name);
+            return false;
+        }
+    }
+
+    if (params.Suite != "all" && params.Suite != "codec" && params.Suite != "kernels")
+    {
+        fprintf(stderr, "Unknown suite %s\n", params.Suite.c_str());
+        return false;
+    }
+    if (params.PacketBytes < 1 || params.PacketCount < 1 ||
+        params.AckInterval < 1 || params.RecoveryInterval < 1 ||
+        params.Threads < 1 || params.KernelBytes < 1 ||
+        params.DecoderBatch < 1 || params.DecoderBatch > SIAMESE_MAX_ORIGINAL_BATCH ||
+        params.KernelIterations < 1 ||
+        params.LossRate < 0. || params.LossRate >= 1. ||
+        params.BurstLength < 1.)
+    {
+        fprintf(stderr, "Invalid parameter value\n");
+        return false;
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Timing
+
+static uint64_t GetNsec()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Collects latency samples in nanoseconds
+struct LatencyStats
+{
+    std::vector<uint64_t> Samples;
+    uint64_t TotalNsec = 0;
+
+    void Add(uint64_t nsec)
+    {
+        Samples.push_back(nsec);
+        TotalNsec += nsec;
+    }
+
+    void Merge(const LatencyStats& other)
+    {
+        Samples.insert(Samples.end(), other.Samples.begin(), other.Samples.end());
+        TotalNsec += other.TotalNsec;
+    }
+
+    /// Writes a JSON object with the count, mean and percentiles.
+    /// Sorts the samples in place
+    void Print(const char* name)
+    {
+        std::sort(Samples.begin(), Samples.end());
+        const size_t count = Samples.size();
+        printf("\"%s\": {\"count\": %zu, \"mean_ns\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+            name,
+            count,
+            count > 0 ? (double)TotalNsec / count : 0.,
+            (unsigned long long)Percentile(0.5),
+            (unsigned long long)Percentile(0.99),
+            (unsigned long long)Percentile(0.999),
+            (unsigned long long)(count > 0 ? Samples[count - 1] : 0));
+    }
+
+    /// Requires that the samples are sorted
+    uint64_t Percentile(double q) const
+    {
+        if (Samples.empty())
+            return 0;
+        size_t index = (size_t)(q * Samples.size());
+        if (index >= Samples.size())
+            index = Samples.size() - 1;
+        return Samples[index];
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Loss Model
+
+/**
+    Bernoulli losses drop each packet independently.
+
+    Burst losses use a Gilbert-Elliott channel with a lossless good state and
+    a bad state that loses everything.  Leaving the bad state with probability
+    1/L gives an average burst length of L, and the rate of entering it is
+    picked so that the long-run loss rate matches.
+*/
+class LossModel
+{
+public:
+    void Initialize(const BenchParams& params, siamese::PCGRandom* prng)
+    {
+        Prng = prng;
+        LossRate = params.LossRate;
+        BurstLoss = params.BurstLoss;
+        ExitBad = 1. / params.BurstLength;
+        EnterBad = LossRate * ExitBad / (1. - LossRate);
+        InBadState = false;
+    }
+
+    bool IsLost()
+    {
+        if (!BurstLoss)
+            return NextUniform() < LossRate;
+
+        if (InBadState)
+        {
+            if (NextUniform() < ExitBad)
+                InBadState = false;
+        }
+        else if (NextUniform() < EnterBad)
+            InBadState = true;
+        return InBadState;
+    }
+
+private:
+    siamese::PCGRandom* Prng = nullptr;
+    double LossRate = 0.;
+    bool BurstLoss = false;
+    double EnterBad = 0., ExitBad = 1.;
+    bool InBadState = false;
+
+    double NextUniform()
+    {
+        return Prng->Next() / 4294967296.;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Codec Scenario
+
+// Simulated encoder clock for the flow running on this thread
+static thread_local uint64_t FlowClockUsec = 0;
+
+static uint64_t OnFlowClock(void* /*context*/)
+{
+    return FlowClockUsec;
+}
+
+struct FlowResult
+{
+    LatencyStats EncoderAdd, Encode, DecoderAdd, Decode, Ack;
+
+    uint64_t OriginalCount = 0;
+    uint64_t OriginalBytes = 0;
+    uint64_t OriginalLost = 0;
+    uint64_t RecoveryCount = 0;
+    uint64_t RecoveryBytes = 0;
+    uint64_t RecoveryLost = 0;
+    uint64_t RetransmitCount = 0;
+    uint64_t RecoveredCount = 0;
+
+    std::string Error;
+
+    void Merge(const FlowResult& other)
+    {
+        EncoderAdd.Merge(other.EncoderAdd);
+        Encode.Merge(other.Encode);
+        DecoderAdd.Merge(other.DecoderAdd);
+        Decode.Merge(other.Decode);
+        Ack.Merge(other.Ack);
+        OriginalCount += other.OriginalCount;
+        OriginalBytes += other.OriginalBytes;
+        OriginalLost += other.OriginalLost;
+        RecoveryCount += other.RecoveryCount;
+        RecoveryBytes += other.RecoveryBytes;
+        RecoveryLost += other.RecoveryLost;
+        RetransmitCount += other.RetransmitCount;
+        RecoveredCount += other.RecoveredCount;
+        if (Error.empty())
+            Error = other.Error;
+    }
+};
+
+struct PendingAck
+{
+    unsigned DeliverAt;
+    std::vector<uint8_t> Data;
+};
+
+static void DeliverOriginal(SiameseDecoder decoder, const SiameseOriginalPacket& original, FlowResult& result)
+{
+    const uint64_t t0 = GetNsec();
+    const SiameseResult r = siamese_decoder_add_original(decoder, &original);
+    result.DecoderAdd.Add(GetNsec() - t0);
+
+    if (r != Siamese_Success && r != Siamese_DuplicateData && result.Error.empty())
+        result.Error = "siamese_decoder_add_original failed";
+}
+
+/// Deliver the originals queued for siamese_decoder_add_original_batch().
+/// Each packet gets an equal share of the call time as its latency sample
+static void DeliverBatch(SiameseDecoder decoder, std::vector<SiameseOriginalPacket>& batch, FlowResult& result)
+{
+    if (batch.empty())
+        return;
+
+    const uint64_t t0 = GetNsec();
+    const SiameseResult r = siamese_decoder_add_original_batch(decoder, batch.data(), (unsigned)batch.size());
+    const uint64_t perPacketNsec = (GetNsec() - t0) / batch.size();
+    for (size_t i = 0; i < batch.size(); ++i)
+        result.DecoderAdd.Add(perPacketNsec);
+    batch.clear();
+
+    if (r != Siamese_Success && r != Siamese_DuplicateData && result.Error.empty())
+        result.Error = "siamese_decoder_add_original_batch failed";
+}
+
+static void RunFlow(const BenchParams& params, unsigned flowIndex, FlowResult& result)
+{
+    siamese::PCGRandom prng;
+    prng.Seed(params.Seed, flowIndex);
+
+    LossModel loss;
+    loss.Initialize(params, &prng);
+
+    // Packet contents are windows into a random pool so that the kernels
+    // never see runs of zeros
+    std::vector<uint8_t> pool(params.PacketBytes * 2);
+    for (auto& value : pool)
+        value = (uint8_t)prng.Next();
+
+    // Start the clock at one second since the encoder treats a zero send
+    // timestamp as unset
+    FlowClockUsec = 1000000;
+
+    SiameseEncoder encoder = siamese_encoder_create();
+    SiameseDecoder decoder = siamese_decoder_create();
+    if (!encoder || !decoder)
+    {
+        result.Error = "Failed to create codec";
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+        return;
+    }
+    if (params.SolverThreads > 1)
+        siamese_decoder_set_solver_threads(decoder, params.SolverThreads);
+
+    std::deque<PendingAck> acks;
+    std::vector<SiameseOriginalPacket> batch;
+
+    for (unsigned n = 0; n < params.PacketCount && result.Error.empty(); ++n)
+    {
+        FlowClockUsec += params.IntervalUsec;
+
+        SiameseOriginalPacket original;
+        original.Data = &pool[n % params.PacketBytes];
+        original.DataBytes = params.PacketBytes;
+
+        uint64_t t0 = GetNsec();
+        SiameseResult r = siamese_encoder_add(encoder, &original);
+        result.EncoderAdd.Add(GetNsec() - t0);
+        if (r != Siamese_Success && r != Siamese_Backpressure)
+        {
+            result.Error = "siamese_encoder_add failed";
+            break;
+        }
+        ++result.OriginalCount;
+        result.OriginalBytes += original.DataBytes;
+
+        if (loss.IsLost())
+            ++result.OriginalLost;
+        else if (params.DecoderBatch > 1)
+        {
+            batch.push_back(original);
+            if (batch.size() >= params.DecoderBatch)
+                DeliverBatch(decoder, batch, result);
+        }
+        else
+            DeliverOriginal(decoder, original, result);
+
+        if (n % params.RecoveryInterval == params.RecoveryInterval - 1)
+        {
+            SiameseRecoveryPacket recovery;
+
+            t0 = GetNsec();
+            r = siamese_encode(encoder, &recovery);
+            result.Encode.Add(GetNsec() - t0);
+
+            if (r == Siamese_Success)
+            {
+                ++result.RecoveryCount;
+                result.RecoveryBytes += recovery.DataBytes;
+
+                if (loss.IsLost())
+                    ++result.RecoveryLost;
+                else
+                {
+                    DeliverBatch(decoder, batch, result);
+
+                    SiameseOriginalPacket* recovered = nullptr;
+                    unsigned recoveredCount = 0;
+
+                    t0 = GetNsec();
+                    r = siamese_decoder_add_recovery(decoder, &recovery);
+                    if (r == Siamese_Success && siamese_decoder_is_ready(decoder) == Siamese_Success)
+                    {
+                        r = siamese_decode(decoder, &recovered, &recoveredCount);
+                        if (r == Siamese_NeedMoreData)
+                            r = Siamese_Success;
+                    }
+                    result.Decode.Add(GetNsec() - t0);
+
+                    if (r != Siamese_Success && r != Siamese_DuplicateData)
+                        result.Error = "Decoder failed";
+
+                    // Check the recovered data outside of the timed region
+                    result.RecoveredCount += recoveredCount;
+                    for (unsigned i = 0; i < recoveredCount; ++i)
+                    {
+                        const SiameseOriginalPacket& packet = recovered[i];
+                        if (packet.DataBytes != params.PacketBytes ||
+                            0 != memcmp(packet.Data, &pool[packet.PacketNum % params.PacketBytes], params.PacketBytes))
+                        {
+                            result.Error = "Recovered data is corrupted";
+                        }
+                    }
+                }
+            }
+            else if (r != Siamese_NeedMoreData)
+                result.Error = "siamese_encode failed";
+        }
+
+        if (n % params.AckInterval == params.AckInterval - 1)
+        {
+            DeliverBatch(decoder, batch, result);
+
+            PendingAck pending;
+            pending.DeliverAt = n + params.Window;
+            pending.Data.resize(1400);
+            unsigned usedBytes = 0;
+            if (siamese_decoder_ack(decoder, pending.Data.data(), (unsigned)pending.Data.size(), &usedBytes) == Siamese_Success)
+            {
+                pending.Data.resize(usedBytes);
+                acks.push_back(std::move(pending));
+            }
+        }
+
+        while (!acks.empty() && acks.front().DeliverAt <= n)
+        {
+            const PendingAck& pending = acks.front();
+
+            unsigned nextExpected = 0;
+            t0 = GetNsec();
+            r = siamese_encoder_ack(encoder, pending.Data.data(), (unsigned)pending.Data.size(), &nextExpected);
+            result.Ack.Add(GetNsec() - t0);
+            acks.pop_front();
+
+            if (r != Siamese_Success)
+            {
+                result.Error = "siamese_encoder_ack failed";
+                break;
+            }
+
+            SiameseOriginalPacket retransmit;
+            while (siamese_encoder_retransmit(encoder, &retransmit) == Siamese_Success)
+            {
+                ++result.RetransmitCount;
+                if (!loss.IsLost())
+                    DeliverOriginal(decoder, retransmit, result);
+            }
+        }
+    }
+
+    siamese_encoder_free(encoder);
+    siamese_decoder_free(decoder);
+}
+
+static bool RunCodec(const BenchParams& params)
+{
+    siamese_set_clock(OnFlowClock, nullptr);
+
+    std::vector<FlowResult> results(params.Threads);
+    std::vector<std::thread> threads;
+
+    const uint64_t t0 = GetNsec();
+    for (unsigned i = 1; i < params.Threads; ++i)
+        threads.emplace_back(RunFlow, std::cref(params), i, std::ref(results[i]));
+    RunFlow(params, 0, results[0]);
+    for (auto& thread : threads)
+        thread.join();
+    const uint64_t wallNsec = GetNsec() - t0;
+
+    siamese_set_clock(nullptr, nullptr);
+
+    FlowResult total;
+    for (const auto& result : results)
+        total.Merge(result);
+
+    const double wallSec = wallNsec / 1e9;
+    printf("\"codec\": {\"wall_ns\": %llu, \"original_count\": %llu, \"original_bytes\": %llu, \"original_lost\": %llu, ",
+        (unsigned long long)wallNsec,
+        (unsigned long long)total.OriginalCount,
+        (unsigned long long)total.OriginalBytes,
+        (unsigned long long)total.OriginalLost);
+    printf("\"recovery_count\": %llu, \"recovery_bytes\": %llu, \"recovery_lost\": %llu, \"retransmit_count\": %llu, \"recovered_count\": %llu, ",
+        (unsigned long long)total.RecoveryCount,
+        (unsigned long long)total.RecoveryBytes,
+        (unsigned long long)total.RecoveryLost,
+        (unsigned long long)total.RetransmitCount,
+        (unsigned long long)total.RecoveredCount);
+    printf("\"packets_per_sec\": %.1f, \"goodput_mbps\": %.3f, \"encode_mbps\": %.3f, ",
+        wallSec > 0. ? total.OriginalCount / wallSec : 0.,
+        wallSec > 0. ? total.OriginalBytes * 8. / 1e6 / wallSec : 0.,
+        total.Encode.TotalNsec > 0 ? total.RecoveryBytes * 8. * 1e3 / total.Encode.TotalNsec : 0.);
+    printf("\"error\": \"%s\",\n    \"latency\": {", total.Error.c_str());
+    total.EncoderAdd.Print("encoder_add");
+    printf(", ");
+    total.Encode.Print("encode");
+    printf(", ");
+    total.Ack.Print("encoder_ack");
+    printf(", ");
+    total.DecoderAdd.Print("decoder_add_original");
+    printf(", ");
+    total.Decode.Print("decode");
+    printf("}}");
+
+    if (!total.Error.empty())
+    {
+        fprintf(stderr, "Codec scenario failed: %s\n", total.Error.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Kernel Scenario
+
+enum KernelType
+{
+    Kernel_AddMem,
+    Kernel_Add2Mem,
+    Kernel_AddSetMem,
+    Kernel_MulMem,
+    Kernel_MulAddMem,
+    Kernel_MulAddMultiMem,
+    Kernel_MemSwap,
+
+    Kernel_Count
+};
+
+static const char* kKernelNames[Kernel_Count] = {
+    "gf256_add_mem",
+    "gf256_add2_mem",
+    "gf256_addset_mem",
+    "gf256_mul_mem",
+    "gf256_muladd_mem",
+    "gf256_muladd_multi_mem",
+    "gf256_memswap"
+};
+
+// Number of sources for gf256_muladd_multi_mem()
+static const unsigned kMultiSources = 4;
+
+// Calls timed together for each latency sample, to hide the timer overhead
+static const unsigned kKernelBatch = 16;
+
+struct KernelBuffers
+{
+    std::vector<uint8_t> X, Y, Z;
+    std::vector<uint8_t> Sources[kMultiSources];
+    const void* SourcePtrs[kMultiSources];
+    int SourceBytes[kMultiSources];
+    uint8_t Coefficients[kMultiSources];
+};
+
+static void RunKernelOnce(KernelType kernel, KernelBuffers& buffers, int bytes)
+{
+    switch (kernel)
+    {
+    case Kernel_AddMem:
+        gf256_add_mem(buffers.Z.data(), buffers.X.data(), bytes);
+        break;
+    case Kernel_Add2Mem:
+        gf256_add2_mem(buffers.Z.data(), buffers.X.data(), buffers.Y.data(), bytes);
+        break;
+    case Kernel_AddSetMem:
+        gf256_addset_mem(buffers.Z.data(), buffers.X.data(), buffers.Y.data(), bytes);
+        break;
+    case Kernel_MulMem:
+        gf256_mul_mem(buffers.Z.data(), buffers.X.data(), 0x5b, bytes);
+        break;
+    case Kernel_MulAddMem:
+        gf256_muladd_mem(buffers.Z.data(), 0x5b, buffers.X.data(), bytes);
+        break;
+    case Kernel_MulAddMultiMem:
+        gf256_muladd_multi_mem(buffers.Z.data(), kMultiSources, buffers.Coefficients,
+            buffers.SourcePtrs, buffers.SourceBytes);
+        break;
+    case Kernel_MemSwap:
+        gf256_memswap(buffers.Z.data(), buffers.X.data(), bytes);
+        break;
+    default:
+        break;
+    }
+}
+
+static void RunKernels(const BenchParams& params)
+{
+    siamese::PCGRandom prng;
+    prng.Seed(params.Seed);
+
+    const int bytes = (int)params.KernelBytes;
+
+    KernelBuffers buffers;
+    buffers.X.resize(bytes);
+    buffers.Y.resize(bytes);
+    buffers.Z.resize(bytes);
+    for (int i = 0; i < bytes; ++i)
+    {
+        buffers.X[i] = (uint8_t)prng.Next();
+        buffers.Y[i] = (uint8_t)prng.Next();
+        buffers.Z[i] = (uint8_t)prng.Next();
+    }
+    for (unsigned i = 0; i < kMultiSources; ++i)
+    {
+        buffers.Sources[i].resize(bytes);
+        for (auto& value : buffers.Sources[i])
+            value = (uint8_t)prng.Next();
+        buffers.SourcePtrs[i] = buffers.Sources[i].data();
+        buffers.SourceBytes[i] = bytes;
+        buffers.Coefficients[i] = (uint8_t)(2 + i * 0x35);
+    }
+
+    const unsigned batches = (params.KernelIterations + kKernelBatch - 1) / kKernelBatch;
+    const int detectedIsa = gf256_detected_isa();
+    bool first = true;
+
+    printf("\"kernels\": [");
+
+    for (int isa = GF256_ISA_PORTABLE; isa <= detectedIsa; ++isa)
+    {
+        gf256_set_max_isa(isa);
+
+        for (int kernel = 0; kernel < Kernel_Count; ++kernel)
+        {
+            const KernelType type = static_cast<KernelType>(kernel);
+
+            // Warm up caches and branch predictors
+            for (unsigned i = 0; i < kKernelBatch; ++i)
+                RunKernelOnce(type, buffers, bytes);
+
+            LatencyStats latency;
+            for (unsigned batch = 0; batch < batches; ++batch)
+            {
+                const uint64_t t0 = GetNsec();
+                for (unsigned i = 0; i < kKernelBatch; ++i)
+                    RunKernelOnce(type, buffers, bytes);
+                latency.Add((GetNsec() - t0) / kKernelBatch);
+            }
+
+            // Bytes processed counts the destination once per source
+            const uint64_t calls = (uint64_t)batches * kKernelBatch;
+            const double bytesPerCall = (double)bytes * (type == Kernel_MulAddMultiMem ? kMultiSources : 1);
+            const double totalNsec = (double)latency.TotalNsec * kKernelBatch;
+
+            printf("%s\n    {\"isa\": \"%s\", \"kernel\": \"%s\", \"bytes\": %d, \"calls\": %llu, \"gbps\": %.3f, ",
+                first ? "" : ",",
+                gf256_isa_name(isa),
+                kKernelNames[kernel],
+                bytes,
+                (unsigned long long)calls,
+                totalNsec > 0. ? bytesPerCall * calls * 8. / totalNsec : 0.);
+            latency.Print("latency");
+            printf("}");
+            first = false;
+        }
+    }
+
+    printf("]");
+
+    gf256_set_max_isa(GF256_ISA_COUNT);
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv)
+{
+    BenchParams params;
+    if (!ParseParams(argc, argv, params))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (0 != siamese_init())
+    {
+        fprintf(stderr, "siamese_init failed\n");
+        return 1;
+    }
+
+    printf("{\"version\": 1, \"detected_isa\": \"%s\",\n", gf256_isa_name(gf256_detected_isa()));
+    printf("  \"params\": {\"suite\": \"%s\", \"packet_bytes\": %u, \"packets\": %u, \"window\": %u, \"loss\": %g, \"pattern\": \"%s\", \"burst_length\": %g, ",
+        params.Suite.c_str(),
+        params.PacketBytes,
+        params.PacketCount,
+        params.Window,
+        params.LossRate,
+        params.BurstLoss ? "burst" : "bernoulli",
+        params.BurstLength);
+    printf("\"ack_interval\": %u, \"recovery_interval\": %u, \"interval_usec\": %u, \"threads\": %u, \"solver_threads\": %u, \"decoder_batch\": %u, \"seed\": %llu, \"kernel_bytes\": %u, \"kernel_iterations\": %u}",
+        params.AckInterval,
+        params.RecoveryInterval,
+        params.IntervalUsec,
+        params.Threads,
+        params.SolverThreads,
+        params.DecoderBatch,
+        (unsigned long long)params.Seed,
+        params.KernelBytes,
+        params.KernelIterations);
+
+    bool success = true;
+
+    if (params.Suite == "all" || params.Suite == "codec")
+    {
+        printf(",\n  ");
+        success = RunCodec(params);
+    }
+
+    if (params.Suite == "all" || params.Suite == "kernels")
+    {
+        printf(",\n  ");
+        RunKernels(params);
+    }
+
+    printf("\n}\n");
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+/*
+    Copyright (c) 2016 Christopher A. Taylor.  All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of Siamese nor the names of its contributors may be
+      used to endorse or promote products derived from this software without
+      specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Siamese loopback simulator
+
+    Runs encoder/decoder flows over a modeled link and writes the goodput,
+    overhead, delay and CPU cost to stdout as one JSON object, so that FEC
+    settings can be chosen for a link before it is deployed.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "LoopbackSimulator.h"
+
+
+//------------------------------------------------------------------------------
+// Parameters
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "Usage: siamese_sim [options]\n"
+        "  --flows N                   Independent flows (1)\n"
+        "  --threads N                 Threads to run the flows on (1)\n"
+        "  --rtt-usec N                Round trip time without queuing (40000)\n"
+        "  --bandwidth-mbps R          Bottleneck rate in each direction, 0 for none (100)\n"
+        "  --queue-usec N              Longest queuing delay before drops (50000)\n"
+        "  --jitter-usec N             Extra random delay per packet (0)\n"
+        "  --reorder R                 Fraction of packets held back (0)\n"
+        "  --reorder-delay-usec N      How long reordered packets are held (5000)\n"
+        "  --loss R                    Forward loss rate in [0, 1) (0.03)\n"
+        "  --burst-length N            Average forward burst length, 1 for independent (1)\n"
+        "  --reverse-loss R            Reverse (ack) loss rate in [0, 1) (0.03)\n"
+        "  --reverse-burst-length N    Average reverse burst length (1)\n"
+        "  --packets N                 Originals delivered per flow (20000)\n"
+        "  --min-bytes N               Smallest original (1000)\n"
+        "  --max-bytes N               Largest original (1200)\n"
+        "  --interval-usec N           Time between packets sent (1000)\n"
+        "  --redundancy R              Recovery packets per 100 originals (6)\n"
+        "  --retransmit-with-fec 0|1   Send recovery in place of retransmissions (0)\n"
+        "  --ack-interval-usec N       Time between acks (2000)\n"
+        "  --solver-threads N          Decoder solver threads per flow (0)\n"
+        "  --seed N                    Random seed (1)\n");
+}
+
+static bool ParseParams(int argc, char** argv, SimulatorParams& params)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* name = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "Missing value for %s\n", name);
+            return false;
+        }
+        const char* value = argv[++i];
+        const unsigned number = (unsigned)strtoul(value, nullptr, 10);
+        const double real = strtod(value, nullptr);
+
+        if (0 == strcmp(name, "--flows"))
+            params.FlowCount = number;
+        else if (0 == strcmp(name, "--threads"))
+            params.ThreadCount = number;
+        else if (0 == strcmp(name, "--rtt-usec"))
+            params.RttUsec = number;
+        else if (0 == strcmp(name, "--bandwidth-mbps"))
+            params.Forward.BandwidthBps = params.Reverse.BandwidthBps = (uint64_t)(real * 1000000.);
+        else if (0 == strcmp(name, "--queue-usec"))
+            params.Forward.QueueLimitUsec = params.Reverse.QueueLimitUsec = number;
+        else if (0 == strcmp(name, "--jitter-usec"))
+            params.Forward.JitterUsec = params.Reverse.JitterUsec = number;
+        else if (0 == strcmp(name, "--reorder"))
+            params.Forward.ReorderRate = params.Reverse.ReorderRate = real;
+        else if (0 == strcmp(name, "--reorder-delay-usec"))
+            params.Forward.ReorderDelayUsec = params.Reverse.ReorderDelayUsec = number;
+        else if (0 == strcmp(name, "--loss"))
+            params.Forward.Loss.LossRate = real;
+        else if (0 == strcmp(name, "--burst-length"))
+            params.Forward.Loss.BurstLength = real;
+        else if (0 == strcmp(name, "--reverse-loss"))
+            params.Reverse.Loss.LossRate = real;
+        else if (0 == strcmp(name, "--reverse-burst-length"))
+            params.Reverse.Loss.BurstLength = real;
+        else if (0 == strcmp(name, "--packets"))
+            params.PacketCount = number;
+        else if (0 == strcmp(name, "--min-bytes"))
+            params.MinPacketBytes = number;
+        else if (0 == strcmp(name, "--max-bytes"))
+            params.MaxPacketBytes = number;
+        else if (0 == strcmp(name, "--interval-usec"))
+            params.SendIntervalUsec = number;
+        else if (0 == strcmp(name, "--redundancy"))
+            params.RedundancyPercent = real;
+        else if (0 == strcmp(name, "--retransmit-with-fec"))
+            params.RetransmitWithFEC = (number != 0);
+        else if (0 == strcmp(name, "--ack-interval-usec"))
+            params.AckIntervalUsec = number;
+        else if (0 == strcmp(name, "--solver-threads"))
+            params.SolverThreads = number;
+        else if (0 == strcmp(name, "--seed"))
+            params.Seed = strtoull(value, nullptr, 10);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Output
+
+static void PrintLink(const char* name, const SimulatorLinkParams& link)
+{
+    printf("\"%s\": {\"bandwidth_bps\": %llu, \"queue_usec\": %u, \"jitter_usec\": %u, \"reorder\": %g, \"reorder_delay_usec\": %u, \"loss\": %g, \"burst_length\": %g}",
+        name,
+        (unsigned long long)link.BandwidthBps,
+        link.QueueLimitUsec,
+        link.JitterUsec,
+        link.ReorderRate,
+        link.ReorderDelayUsec,
+        link.Loss.LossRate,
+        link.Loss.BurstLength);
+}
+
+static void PrintPercentiles(const char* name, const SimulatorPercentiles& percentiles)
+{
+    printf("\"%s\": {\"count\": %llu, \"mean_usec\": %.1f, \"p50_usec\": %llu, \"p99_usec\": %llu, \"p999_usec\": %llu, \"max_usec\": %llu}",
+        name,
+        (unsigned long long)percentiles.Count,
+        percentiles.Mean,
+        (unsigned long long)percentiles.P50,
+        (unsigned long long)percentiles.P99,
+        (unsigned long long)percentiles.P999,
+        (unsigned long long)percentiles.Max);
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv)
+{
+    SimulatorParams params;
+    if (!ParseParams(argc, argv, params))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (0 != siamese_init())
+    {
+        fprintf(stderr, "siamese_init failed\n");
+        return 1;
+    }
+
+    SimulatorResult result;
+    const bool success = RunLoopbackSimulation(params, result);
+
+    printf("{\"version\": 1,\n");
+    printf("  \"params\": {\"flows\": %u, \"threads\": %u, \"rtt_usec\": %u, \"packets\": %u, \"min_bytes\": %u, \"max_bytes\": %u, ",
+        params.FlowCount,
+        params.ThreadCount,
+        params.RttUsec,
+        params.PacketCount,
+        params.MinPacketBytes,
+        params.MaxPacketBytes);
+    printf("\"interval_usec\": %u, \"redundancy\": %g, \"retransmit_with_fec\": %s, \"ack_interval_usec\": %u, \"solver_threads\": %u, \"seed\": %llu,\n    ",
+        params.SendIntervalUsec,
+        params.RedundancyPercent,
+        params.RetransmitWithFEC ? "true" : "false",
+        params.AckIntervalUsec,
+        params.SolverThreads,
+        (unsigned long long)params.Seed);
+    PrintLink("forward", params.Forward);
+    printf(",\n    ");
+    PrintLink("reverse", params.Reverse);
+    printf("},\n");
+
+    printf("  \"result\": {\"completed_flows\": %u, \"simulated_usec\": %llu, \"goodput_mbps\": %.3f, \"delivered_count\": %llu, \"delivered_bytes\": %llu,\n",
+        result.CompletedFlows,
+        (unsigned long long)result.SimulatedUsec,
+        result.GoodputBps / 1000000.,
+        (unsigned long long)result.DeliveredCount,
+        (unsigned long long)result.DeliveredBytes);
+    printf("    \"original_count\": %llu, \"original_bytes\": %llu, \"retransmit_count\": %llu, \"retransmit_bytes\": %llu, \"recovery_count\": %llu, \"recovery_bytes\": %llu, \"ack_bytes\": %llu,\n",
+        (unsigned long long)result.OriginalCount,
+        (unsigned long long)result.OriginalBytesSent,
+        (unsigned long long)result.RetransmitCount,
+        (unsigned long long)result.RetransmitBytesSent,
+        (unsigned long long)result.RecoveryCount,
+        (unsigned long long)result.RecoveryBytesSent,
+        (unsigned long long)result.AckBytesSent);
+    printf("    \"forward_lost\": %llu, \"forward_queue_drops\": %llu, \"reverse_lost\": %llu, \"recovered_count\": %llu,\n",
+        (unsigned long long)result.ForwardLost,
+        (unsigned long long)result.ForwardQueueDrops,
+        (unsigned long long)result.ReverseLost,
+        (unsigned long long)result.RecoveredCount);
+    printf("    \"fec_overhead_count\": %llu, \"fec_overhead_ratio\": %.5f, \"retransmit_overhead_ratio\": %.5f,\n",
+        (unsigned long long)result.FECOverheadCount,
+        result.FECOverheadRatio,
+        result.RetransmitOverheadRatio);
+    printf("    \"encoder_ns\": %llu, \"decoder_ns\": %llu, \"cpu_ns_per_byte\": %.3f, \"error\": \"%s\",\n    ",
+        (unsigned long long)result.EncoderNsec,
+        (unsigned long long)result.DecoderNsec,
+        result.CpuNsecPerByte,
+        result.Error.c_str());
+    PrintPercentiles("delivery_delay", result.DeliveryDelay);
+    printf(",\n    ");
+    PrintPercentiles("recovery_delay", result.RecoveryDelay);
+    printf("}\n}\n");
+
+    return success ? 0 : 1;
+}
@@ -30,13 +30,18 @@
 #include <string>
 #include <queue>
 #include <thread>
+#include <atomic>
 #include <chrono>
 using namespace std;
 
 #include "../Logger.h"
+#include "../PacketAllocator.h"
 #include "../siamese.h"
+#include "../SiameseCommon.h"
+#include "../SiameseDecoder.h"
 #include "../SiameseTools.h"
 #include "../SiameseSerializers.h"
+#include "LoopbackSimulator.h"
 
 #define TEST_VARIABLE_SIZED_DATA
 
@@ -46,6 +51,84 @@ using namespace std;
 // Test: This is a simulated channel with delay and uniform packetloss + ARQ + FEC for transport
 //#define TEST_HARQ_STREAM
 
+// Test: Verify the vectorized bitmap scans match a bit-by-bit scan
+#define TEST_BITMAP_SCANS
+
+// Test: Verify the subwindow ring keeps order as it grows, rotates and shrinks
+#define TEST_SUBWINDOW_RING
+
+// Test: Verify siamese_encode_batch() matches repeated siamese_encode() calls
+#define TEST_ENCODE_BATCH
+
+// Test: Verify recovery packets shrink once long packets are acknowledged
+#define TEST_ENCODER_LENGTH_DECAY
+
+// Test: Verify siamese_encoder_add_external() matches siamese_encoder_add()
+#define TEST_ENCODER_ADD_EXTERNAL
+
+// Test: Verify siamese_encoder_add_gather() matches siamese_encoder_add()
+#define TEST_ENCODER_ADD_GATHER
+
+// Test: Verify siamese_encoder_set_add_queue() with adds from another thread
+#define TEST_ENCODER_ADD_QUEUE
+
+// Test: Verify siamese_decoder_set_output() recovers into application buffers
+#define TEST_DECODER_SET_OUTPUT
+
+// Test: Verify siamese_decoder_set_solver_threads() matches the serial solver
+#define TEST_DECODER_SOLVER_THREADS
+
+// Test: Verify originals that arrive between failed solves are eliminated
+#define TEST_DECODER_LATE_ORIGINALS
+
+// Test: Verify every packet recovered from long burst losses on a stream
+#define TEST_DECODER_BURST_LOSS
+
+// Test: Verify sum rows are used after a long run without losses
+#define TEST_DECODER_SUM_RESTART
+
+// Test: Verify an Allocator frees the fallback allocations still live in it
+#define TEST_ALLOCATOR_FALLBACK
+
+// Test: Verify siamese_decoder_add_original_batch() matches adding one at a time
+#define TEST_DECODER_ADD_ORIGINAL_BATCH
+
+// Test: Verify recovery packets delivered far out of order still recover all losses
+#define TEST_DECODER_RECOVERY_REORDER
+
+// Test: Verify repeated recovery packets recover without a failed solve per copy
+#define TEST_DECODER_RECOVERY_DUPLICATES
+
+// Test: Verify recovery packets deleted from runs of equal keys keep the list sorted
+#define TEST_RECOVERY_LIST_DELETE
+
+// Test: Verify one and two losses solved without the recovery matrix
+#define TEST_DECODER_SMALL_SOLVE
+
+// Test: Verify recovery as running sums hand over to Cauchy rows at each crossover
+#define TEST_ENCODER_CAUCHY_CROSSOVER
+
+// Test: Verify codecs restored from snapshots mid-stream carry on unchanged
+#define TEST_CODEC_SNAPSHOT
+
+// Test: Verify lazy sums skip loss-free data and recover the same as eager sums
+#define TEST_DECODER_LAZY_SUMS
+
+// Test: Verify many codecs on several threads sharing one memory pool
+#define TEST_MEMORY_POOL
+
+// Test: Verify encoder backpressure and decoder shedding under a memory budget
+#define TEST_MEMORY_BUDGET
+
+// Test: Verify siamese_set_clock() drives packet timestamps and retransmission
+#define TEST_SET_CLOCK
+
+// Test: Verify compiled-out log levels and logging from several threads at once
+#define TEST_LOGGER
+
+// Test: Verify sampled profiling histograms count encodes and solution attempts
+#define TEST_PROFILING
+
 // Test: Encoding data with packetloss
 #define TEST_STREAMING
 
@@ -657,1123 +740,4487 @@ DoneDecoding:
 }
 
 
-class HARQSimulation
-{
-    enum DataHeaderTypes
-    {
-        OpCode_Data,
-        OpCode_Recovery,
-        OpCode_Ack
-    };
-
-    // Number of packets
-    static const unsigned kLastPacket = 20000; // Something longer than Siamese max 16K packets to make sure that is tested
-
-    // Channel character
-    static const unsigned kLossPercent = 3;
-
-    // FEC parameters
-    static const unsigned kRedundancyPercent = 6;
-
-    // Bandwidth
-    static const unsigned kPacketsPerInterval = 4;
-
-    // Latency
-    static const unsigned kPacketIntervalMsec = 4;
-    static const unsigned kQueueDepth = 10;
-
-    siamese::PCGRandom prngLoss;
-    siamese::PCGRandom prngPacketData;
-    siamese::PCGRandom prngLength;
-
-    FunctionTimer t_siamese_encoder_create;
-    FunctionTimer t_siamese_decoder_create;
-    FunctionTimer t_siamese_encoder_add;
-    FunctionTimer t_siamese_decoder_add_original;
-    FunctionTimer t_siamese_encode;
-    FunctionTimer t_siamese_decoder_add_recovery;
-    FunctionTimer t_siamese_decoder_is_ready;
-    FunctionTimer t_siamese_decode;
-    FunctionTimer t_siamese_encoder_remove;
-    FunctionTimer t_siamese_encoder_ack;
-    FunctionTimer t_siamese_decoder_ack;
-    FunctionTimer t_siamese_encoder_retransmit;
-
-    struct Counts
-    {
-        unsigned Sent = 0, Received = 0, Lost = 0;
-
-        uint64_t BytesSent = 0, BytesReceived = 0;
-    };
-
-    Counts Originals, Acks, Recoveries;
-
-    unsigned RetransmitCount = 0;
-    uint64_t RetransmitBytes = 0;
-
-    unsigned RecoveryFailCount = 0;
-    unsigned DuplicateOriginalsReceived = 0;
-    unsigned RecoverySuccessCount = 0;
-    unsigned RecoveredPacketCount = 0;
-
-    SiameseEncoder encoder;
-    SiameseDecoder decoder;
-
-    unsigned NextExpectedPacket = 0;
-    unsigned NextSendPacketId = 0;
-
-    std::vector<uint64_t> Timestamps;
-    std::vector<unsigned> UsecDeltas;
-
-    // Simulate a delay over a network
-    struct QueuedPacket
-    {
-        uint8_t Data[2000];
-        unsigned Bytes;
-    };
-    struct QueueRound
-    {
-        std::vector<QueuedPacket> Packets;
-    };
-    std::queue<QueueRound> c2sRounds, s2cRounds;
-
-    /*
-        Client is sending video data to server (simulation)
-        c2s = video data + recovery data (from encoder)
-        s2c = acks (from decoder)
-    */
-    QueueRound c2sRound, s2cRound;
-
-    unsigned loopCount = 0;
-
-    bool UnrecoverableError = false;
-
-public:
-    HARQSimulation();
-    void Run(unsigned seed);
-
-    void ClientSendNewVideoData();
-    void ClientReceiveData();
-    bool ClientRetransmitData();
-    void ClientSendRecoveryData();
-
-    void ServerReceiveData();
-    void ServerSendAck();
-    void ServerOnOriginal(SiameseOriginalPacket& original);
-    void ServerOnRecovery(SiameseRecoveryPacket& recovery);
-    void ServerCheckRecovery();
-
-    void ServerResumeProcessing();
-    void ServerSimulateProcessingOriginal(SiameseOriginalPacket& original);
-};
+//------------------------------------------------------------------------------
+// HARQStreamTest
 
-HARQSimulation::HARQSimulation()
-    : t_siamese_encoder_create("siamese_encoder_create")
-    , t_siamese_decoder_create("siamese_decoder_create")
-    , t_siamese_encoder_add("siamese_encoder_add")
-    , t_siamese_decoder_add_original("siamese_decoder_add_original")
-    , t_siamese_encode("siamese_encode")
-    , t_siamese_decoder_add_recovery("siamese_decoder_add_recovery")
-    , t_siamese_decoder_is_ready("siamese_decoder_is_ready")
-    , t_siamese_decode("siamese_decode")
-    , t_siamese_encoder_remove("siamese_encoder_remove")
-    , t_siamese_encoder_ack("siamese_encoder_ack")
-    , t_siamese_decoder_ack("siamese_decoder_ack")
-    , t_siamese_encoder_retransmit("siamese_encoder_retransmit")
+/*
+    Simulated channel with delay and uniform packetloss + ARQ + FEC, run on
+    the loopback simulator from LoopbackSimulator.h with the channel and FEC
+    settings this test has always used.
+*/
+bool HARQStreamTest()
 {
-}
+    Logger.Info("Test: HARQStreamTest");
 
-void HARQSimulation::ClientSendNewVideoData()
-{
-    QueuedPacket newData;
+    SimulatorParams params;
 
-    newData.Bytes = GetPacketBytes(NextSendPacketId);
+    // Something longer than Siamese max 16K packets to make sure that is tested
+    params.PacketCount = 20000;
+    params.MinPacketBytes = 2;
+    params.MaxPacketBytes = 1200;
 
-    Originals.Sent++;
-    Originals.BytesSent += newData.Bytes;
+    // Channel character: 3% loss and 40 msec latency in each direction
+    params.Forward.Loss.LossRate = 0.03;
+    params.Reverse.Loss.LossRate = 0.03;
+    params.RttUsec = 80 * 1000;
 
-    SetPacket(NextSendPacketId, newData.Data + 1 + 4, newData.Bytes);
+    // FEC parameters
+    params.RedundancyPercent = 6;
+#ifdef HARQ_RETRANSMIT_WITH_FEC
+    params.RetransmitWithFEC = true;
+#endif
 
-    SiameseOriginalPacket original;
-    original.Data = newData.Data + 1 + 4;
-    original.DataBytes = newData.Bytes;
-    newData.Bytes += 1 + 4;
+    // Several flows with different random channels
+    params.FlowCount = 8;
+    params.ThreadCount = 4;
+    params.Seed = kSeed;
 
-    t_siamese_encoder_add.BeginCall();
-    int result = siamese_encoder_add(encoder, &original);
-    t_siamese_encoder_add.EndCall();
-    if (result)
+    SimulatorResult result;
+    if (!RunLoopbackSimulation(params, result))
     {
-        UnrecoverableError = true;
-        Logger.Error("Unable to add original data to encoder");
+        Logger.Error("Simulation failed: ", result.Error);
         SIAMESE_DEBUG_BREAK();
-        return;
+        return false;
     }
-    SIAMESE_DEBUG_ASSERT(NextSendPacketId == original.PacketNum);
-    SIAMESE_DEBUG_ASSERT(Timestamps.size() == NextSendPacketId);
-    ++NextSendPacketId;
-    Timestamps.push_back(siamese::GetTimeUsec());
 
-    newData.Data[0] = OpCode_Data;
-    siamese::WriteU32_LE(newData.Data + 1, original.PacketNum);
+    Logger.Info("Streaming completed: ", result.CompletedFlows, " flows. Goodput = ",
+        result.GoodputBps / 1000000., " Mbps over ", result.SimulatedUsec / 1000, " simulated msec");
+    Logger.Info("Originals sent: ", result.OriginalCount, " lost: ", result.ForwardLost,
+        " retransmits: ", result.RetransmitCount, " recoveries: ", result.RecoveryCount,
+        " recovered: ", result.RecoveredCount);
+    Logger.Info("FEC overhead = ", result.FECOverheadRatio * 100., "% of delivered bytes, wasted recoveries = ",
+        result.FECOverheadCount, ". Retransmit overhead = ", result.RetransmitOverheadRatio * 100., "%");
+    Logger.Info("Simulated one-way delivery latency: median = ", result.DeliveryDelay.P50 / 1000.f,
+        " msec, 99% = ", result.DeliveryDelay.P99 / 1000.f, " msec, max = ", result.DeliveryDelay.Max / 1000.f, " msec");
+    Logger.Info("Latency of lost originals: median = ", result.RecoveryDelay.P50 / 1000.f,
+        " msec, 99% = ", result.RecoveryDelay.P99 / 1000.f, " msec");
+    Logger.Info("Codec CPU = ", result.CpuNsecPerByte, " nsec per delivered byte");
 
-    c2sRound.Packets.push_back(newData);
+    return true;
 }
 
-void HARQSimulation::ClientReceiveData()
+
+/*
+    Given a PRNG, generate a deck of cards in a random order.
+    The deck will contain elements with values between 0 and count - 1.
+*/
+
+static void ShuffleDeck16(siamese::PCGRandom& prng, uint16_t* GF256_RESTRICT deck, uint32_t count)
 {
-    QueueRound nextS2C = s2cRounds.front();
-    s2cRounds.pop();
+    deck[0] = 0;
 
-    for (auto& s2cPacket : nextS2C.Packets)
+    // If we can unroll 4 times,
+    if (count <= 256)
     {
-        switch (s2cPacket.Data[0])
+        for (uint32_t ii = 1;;)
         {
-        case OpCode_Ack:
-            if ((prngLoss.Next() % 100) >= kLossPercent)
-            {
-                Logger.Trace("** Got ACK");
-
-                Acks.Received++;
-                Acks.BytesReceived += s2cPacket.Bytes - 1;
+            uint32_t jj, rv = prng.Next();
 
-                t_siamese_encoder_ack.BeginCall();
-                unsigned nextExpectedAck;
-                int result = siamese_encoder_ack(encoder, s2cPacket.Data + 1, s2cPacket.Bytes - 1, &nextExpectedAck);
-                t_siamese_encoder_ack.EndCall();
-                if (result)
-                {
-                    UnrecoverableError = true;
-                    Logger.Error("Encoder decided ack data was malformed");
-                    SIAMESE_DEBUG_BREAK();
-                    return;
-                }
-            }
-            else
+            // 8-bit unroll
+            switch (count - ii)
             {
-                Logger.Trace("** Lost ACK");
-                Acks.Lost++;
+            default:
+                jj = (uint8_t)rv % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+                jj = (uint8_t)(rv >> 8) % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+                jj = (uint8_t)(rv >> 16) % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+                jj = (uint8_t)(rv >> 24) % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+                break;
+
+            case 3:
+                jj = (uint8_t)rv % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+            case 2:
+                jj = (uint8_t)(rv >> 8) % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+            case 1:
+                jj = (uint8_t)(rv >> 16) % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+            case 0:
+                return;
             }
-            break;
-        case OpCode_Data:
-        case OpCode_Recovery:
-        default:
-            UnrecoverableError = true;
-            Logger.Error("Invalid s2c protocol opcode");
-            SIAMESE_DEBUG_BREAK();
-            return;
         }
     }
-}
-
-void HARQSimulation::ServerReceiveData()
-{
-    QueueRound nextC2S = c2sRounds.front();
-    c2sRounds.pop();
-
-    Logger.Trace("*** Processing ", nextC2S.Packets.size(), " c2s packets this round");
-
-    for (auto& c2sPacket : nextC2S.Packets)
+    else
     {
-        switch (c2sPacket.Data[0])
+        // For each deck entry,
+        for (uint32_t ii = 1;;)
         {
-        case OpCode_Data:
-            if ((prngLoss.Next() % 100) >= kLossPercent)
-            {
-                // Note: Also counts retransmits
-                Originals.Received++;
-                Originals.BytesReceived += c2sPacket.Bytes - 1 - 4;
+            uint32_t jj, rv = prng.Next();
 
-                SiameseOriginalPacket original;
-                original.PacketNum = siamese::ReadU32_LE(c2sPacket.Data + 1);
-                Logger.Trace("** Got Original: ", original.PacketNum);
-                original.Data = c2sPacket.Data + 1 + 4;
-                original.DataBytes = c2sPacket.Bytes - 1 - 4;
-                ServerOnOriginal(original);
-            }
-            else
-            {
-                uint32_t packetNum = siamese::ReadU32_LE(c2sPacket.Data + 1);
-                Logger.Trace("** Lost Data ", packetNum);
-                Originals.Lost++;
-            }
-            break;
-        case OpCode_Recovery:
-            if ((prngLoss.Next() % 100) >= kLossPercent)
+            // 16-bit unroll
+            switch (count - ii)
             {
-                Logger.Trace("** Got Recovery");
-                Recoveries.Received++;
-                Recoveries.BytesReceived += c2sPacket.Bytes - 1;
+            default:
+                jj = (uint16_t)rv % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+                jj = (uint16_t)(rv >> 16) % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+                ++ii;
+                break;
 
-                SiameseRecoveryPacket recovery;
-                recovery.Data = c2sPacket.Data + 1;
-                recovery.DataBytes = c2sPacket.Bytes - 1;
-                ServerOnRecovery(recovery);
-            }
-            else
-            {
-                Logger.Trace("** Lost Recovery");
-                Recoveries.Lost++;
+            case 1:
+                jj = (uint16_t)rv % ii;
+                deck[ii] = deck[jj];
+                deck[jj] = ii;
+            case 0:
+                return;
             }
-            break;
-        case OpCode_Ack:
-        default:
-            UnrecoverableError = true;
-            Logger.Error("Invalid c2s protocol opcode");
-            SIAMESE_DEBUG_BREAK();
-            return;
         }
     }
 }
 
-bool HARQSimulation::ClientRetransmitData()
-{
-    SiameseOriginalPacket original;
-
-    t_siamese_encoder_retransmit.BeginCall();
-    int result = siamese_encoder_retransmit(encoder, &original);
-    t_siamese_encoder_retransmit.EndCall();
-
-    if (result == Siamese_Success)
-    {
-#ifdef HARQ_RETRANSMIT_WITH_FEC
-        SiameseRecoveryPacket recovery;
-
-        t_siamese_encode.BeginCall();
-        int result = siamese_encode(encoder, &recovery);
-        t_siamese_encode.EndCall();
-        if (result)
-        {
-            // If there was no data to encode:
-            if (result != Siamese_NeedMoreData)
-            {
-                UnrecoverableError = true;
-                Logger.Error("Unable to generate encoded data: ", result);
-                SIAMESE_DEBUG_BREAK();
-                return false;
-            }
-        }
-
-        ++Recoveries.Sent;
-        Recoveries.BytesSent += recovery.DataBytes;
-
-        QueuedPacket newData;
-        newData.Data[0] = OpCode_Recovery;
-        memcpy(newData.Data + 1, recovery.Data, recovery.DataBytes);
-        newData.Bytes = recovery.DataBytes + 1;
-
-        c2sRound.Packets.push_back(newData);
-#else
-        Logger.Trace("Retransmitted : ", original.PacketNum);
-
-        QueuedPacket newData;
-        newData.Data[0] = OpCode_Data;
-        siamese::WriteU32_LE(newData.Data + 1, original.PacketNum);
-        memcpy(newData.Data + 1 + 4, original.Data, original.DataBytes);
-        newData.Bytes = 1 + 4 + original.DataBytes;
 
-        c2sRound.Packets.push_back(newData);
+// This test verifies that the kMaximumLossRecoveryCount logic works properly:
+// It should only use up to kMaximumLossRecoveryCount recovery packets to attempt recovery.
+// This test will pick 255 * 2 random losses in a set of 1000 packets, and then provide 255 * 2 recovery packets.
+// Then lost original packets are provided out of order and recovery is attempted each time.
+// The expectation is that it will recover after 255 packets most of the time, and sometimes 256.
+// And that's what happens!
+bool TestLargeBurstLoss()
+{
+    Logger.Info("Test: TestLargeBurstLoss");
 
-        ++RetransmitCount;
-        RetransmitBytes += original.DataBytes;
+    FunctionTimer t_siamese_encoder_create("siamese_encoder_create");
+    FunctionTimer t_siamese_decoder_create("siamese_decoder_create");
+    FunctionTimer t_siamese_encoder_add("siamese_encoder_add");
+    FunctionTimer t_siamese_decoder_add_original("siamese_decoder_add_original");
+    FunctionTimer t_siamese_encode("siamese_encode");
+    FunctionTimer t_siamese_decoder_add_recovery("siamese_decoder_add_recovery");
+    FunctionTimer t_siamese_decoder_is_ready("siamese_decoder_is_ready");
+    FunctionTimer t_siamese_decode("siamese_decode");
 
-        // Note: Also counts as original data sent
-        Originals.Sent++;
-        Originals.BytesSent += newData.Bytes;
-#endif
+    static const int N = 1000;
+    static const int K = 255;
 
-        return true;
-    }
+    static const unsigned kTrials = 999;
 
-    // If there was no data to retransmit:
-    if (result != Siamese_NeedMoreData)
+    for (unsigned trial = 0; trial < kTrials; ++trial)
     {
-        UnrecoverableError = true;
-        Logger.Error("Unexpected error result from encoder retransmit: ", result);
-        SIAMESE_DEBUG_BREAK();
-        return false;
-    }
-
-    return false;
-}
-
-void HARQSimulation::ClientSendRecoveryData()
-{
-    if (Recoveries.Sent * 100.f / (float)Originals.Sent >= kRedundancyPercent)
-        return;
+        uint16_t losses[N];
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+        ShuffleDeck16(prng, losses, N);
 
-    SiameseRecoveryPacket recovery;
+        t_siamese_encoder_create.BeginCall();
+        SiameseEncoder encoder = siamese_encoder_create();
+        t_siamese_encoder_create.EndCall();
 
-    t_siamese_encode.BeginCall();
-    int result = siamese_encode(encoder, &recovery);
-    t_siamese_encode.EndCall();
-    if (result)
-    {
-        // If there was no data to encode:
-        if (result != Siamese_NeedMoreData)
+        if (!encoder)
         {
-            UnrecoverableError = true;
-            Logger.Error("Unable to generate encoded data: ", result);
+            Logger.Error("Unable to create encoder");
             SIAMESE_DEBUG_BREAK();
-            return;
+            return false;
         }
-    }
-
-    ++Recoveries.Sent;
-    Recoveries.BytesSent += recovery.DataBytes;
-
-    QueuedPacket newData;
-    newData.Data[0] = OpCode_Recovery;
-    memcpy(newData.Data + 1, recovery.Data, recovery.DataBytes);
-    newData.Bytes = recovery.DataBytes + 1;
-
-    c2sRound.Packets.push_back(newData);
-}
-
-void HARQSimulation::ServerSendAck()
-{
-    // TCP sends ACK every other packet
-    bool TimeToSendAckPacket = (loopCount % 2 == 0);
-    if (!TimeToSendAckPacket)
-        return;
-
-    QueuedPacket newData;
-    newData.Data[0] = OpCode_Ack;
 
-    unsigned usedBytes = 0;
+        t_siamese_decoder_create.BeginCall();
+        SiameseDecoder decoder = siamese_decoder_create();
+        t_siamese_decoder_create.EndCall();
 
-    t_siamese_decoder_ack.BeginCall();
-    int result = siamese_decoder_ack(decoder, newData.Data + 1, (unsigned)sizeof(newData.Data), &usedBytes);
-    t_siamese_decoder_ack.EndCall();
-    if (result)
-    {
-        // If there was no data to encode:
-        if (result != Siamese_NeedMoreData)
+        if (!decoder)
         {
-            UnrecoverableError = true;
-            Logger.Error("Unable to generate decoder acknowledgement message: ", result);
+            Logger.Error("Unable to create decoder");
             SIAMESE_DEBUG_BREAK();
-            return;
+            return false;
         }
-    }
-
-    newData.Bytes = 1 + usedBytes;
-
-    s2cRound.Packets.push_back(newData);
 
-    ++Acks.Sent;
-    Acks.BytesSent += usedBytes;
-}
+        unsigned decoderReceiveCount = 0;
 
-void HARQSimulation::ServerResumeProcessing()
-{
-    for (;;)
+        for (int i = 0; i < N; ++i)
+        {
+            uint8_t buffer[2000];
+            unsigned bytes = GetPacketBytes(i);
+            SIAMESE_DEBUG_ASSERT(bytes <= sizeof(buffer));
+            SetPacket(i, buffer, bytes);
+
+            SiameseOriginalPacket original;
+            original.Data = buffer;
+            original.DataBytes = bytes;
+            {
+                t_siamese_encoder_add.BeginCall();
+                int result = siamese_encoder_add(encoder, &original);
+                t_siamese_encoder_add.EndCall();
+                if (result)
+                {
+                    Logger.Error("Unable to add original data to encoder");
+                    SIAMESE_DEBUG_BREAK();
+                    return false;
+                }
+            }
+
+            // Lose 255 * 2 packets
+            bool lost = false;
+            for (unsigned j = 0; j < 255 * 2; ++j)
+            {
+                if (losses[j] == i)
+                {
+                    lost = true;
+                    break;
+                }
+            }
+
+            if (!lost)
+            {
+                t_siamese_decoder_add_original.BeginCall();
+                int result = siamese_decoder_add_original(decoder, &original);
+                t_siamese_decoder_add_original.EndCall();
+                if (result)
+                {
+                    Logger.Error("Unable to add original data to decoder");
+                    SIAMESE_DEBUG_BREAK();
+                    return false;
+                }
+                ++decoderReceiveCount;
+            }
+        }
+
+        // Add 255 recovery packets
+        for (int j = 0; j < 255; ++j)
+        {
+            SiameseRecoveryPacket recovery;
+
+            {
+                t_siamese_encode.BeginCall();
+                int result = siamese_encode(encoder, &recovery);
+                t_siamese_encode.EndCall();
+                if (result)
+                {
+                    SIAMESE_DEBUG_BREAK();
+                    Logger.Error("Unable to generate encoded data");
+                    return false;
+                }
+            }
+
+            {
+                t_siamese_decoder_add_recovery.BeginCall();
+                int result = siamese_decoder_add_recovery(decoder, &recovery);
+                t_siamese_decoder_add_recovery.EndCall();
+                if (result)
+                {
+                    Logger.Error("Unable to add recovery data to decoder");
+                    SIAMESE_DEBUG_BREAK();
+                    return false;
+                }
+            }
+        }
+
+        for (int j = 0; j < N; ++j)
+        {
+            unsigned packetId = losses[j];
+
+            uint8_t buffer[2000];
+            unsigned bytes = GetPacketBytes(packetId);
+            SIAMESE_DEBUG_ASSERT(bytes <= sizeof(buffer));
+            SetPacket(packetId, buffer, bytes);
+
+            SiameseOriginalPacket original;
+            original.Data = buffer;
+            original.DataBytes = bytes;
+            original.PacketNum = packetId;
+
+            t_siamese_decoder_add_original.BeginCall();
+            int result = siamese_decoder_add_original(decoder, &original);
+            t_siamese_decoder_add_original.EndCall();
+            if (result)
+            {
+                Logger.Error("Unable to add original data to decoder");
+                SIAMESE_DEBUG_BREAK();
+                return false;
+            }
+            ++decoderReceiveCount;
+
+            for (;;)
+            {
+                t_siamese_decoder_is_ready.BeginCall();
+                int readyResult = siamese_decoder_is_ready(decoder);
+                t_siamese_decoder_is_ready.EndCall();
+
+                if (readyResult)
+                {
+                    SIAMESE_DEBUG_ASSERT(readyResult == Siamese_NeedMoreData);
+                    break;
+                }
+
+                SiameseOriginalPacket* packets = nullptr;
+                unsigned packetCount = 0;
+
+                t_siamese_decode.BeginCall();
+                int decodeResult = siamese_decode(decoder, &packets, &packetCount);
+                t_siamese_decode.EndCall();
+
+                if (decodeResult == Siamese_Success)
+                {
+                    //cout << "Successful decode: ";
+                    for (unsigned i = 0; i < packetCount; ++i)
+                    {
+                        //cout << packets[i].PacketNum << " ";
+
+                        if (!CheckPacket(packets[i].PacketNum, packets[i].Data, packets[i].DataBytes))
+                        {
+                            Logger.Error("Packet check failed for ", i, ".DataBytes = ", packets[i].DataBytes);
+                            SIAMESE_DEBUG_BREAK();
+                            return false;
+                        }
+
+                        ++decoderReceiveCount;
+                    }
+                    //cout);
+
+                    if (decoderReceiveCount >= N)
+                    {
+                        Logger.Info("Decode successful after ", j + 1, " originals - Should be around 255");
+                        goto DoneDecoding;
+                    }
+                }
+                else if (decodeResult == Siamese_NeedMoreData)
+                {
+                    //cout << "Needed more data to decode");
+                }
+                else
+                {
+                    Logger.Error("Decode returned ", decodeResult);
+                    SIAMESE_DEBUG_BREAK();
+                    return false;
+                }
+            }
+        }
+
+DoneDecoding:
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    // Flush the log so we do not miss the last part
+    logger::Flush();
+
+    Logger.Info("Test successful. Timing summary:");
+
+    t_siamese_encoder_create.Print(kTrials);
+    t_siamese_encoder_add.Print(kTrials);
+    t_siamese_encode.Print(kTrials);
+    t_siamese_decoder_create.Print(kTrials);
+    t_siamese_decoder_add_original.Print(kTrials);
+    t_siamese_decoder_add_recovery.Print(kTrials);
+    t_siamese_decoder_is_ready.Print(kTrials);
+    t_siamese_decode.Print(kTrials);
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// TestBitmapScans
+
+bool TestBitmapScans()
+{
+    Logger.Info("Test: TestBitmapScans");
+
+    static const unsigned kWords = 40;
+    static const unsigned kBits = kWords * 64;
+    static const unsigned kTrials = 200;
+    static const unsigned kQueries = 200;
+
+    siamese::PCGRandom prng;
+    prng.Seed(kSeed);
+
+    uint64_t words[kWords];
+
+    for (unsigned trial = 0; trial < kTrials; ++trial)
+    {
+        // Alternate runs of set and clear bits, some longer than a vector
+        const unsigned maxRun = (trial % 4 == 0) ? 8 : 400;
+        bool value = (prng.Next() % 2) != 0;
+        memset(words, 0, sizeof(words));
+        for (unsigned bit = 0; bit < kBits; value = !value)
+        {
+            const unsigned run = 1 + prng.Next() % maxRun;
+            for (unsigned j = 0; j < run && bit < kBits; ++j, ++bit) {
+                if (value) {
+                    words[bit / 64] |= (uint64_t)1 << (bit % 64);
+                }
+            }
+        }
+
+        for (unsigned query = 0; query < kQueries; ++query)
+        {
+            unsigned bitStart = prng.Next() % (kBits + 1);
+            unsigned bitEnd = prng.Next() % (kBits + 1);
+            if (bitStart > bitEnd) {
+                std::swap(bitStart, bitEnd);
+            }
+
+            unsigned expectedCount = 0;
+            unsigned expectedClear = bitEnd, expectedSet = bitEnd;
+            for (unsigned bit = bitEnd; bit-- > bitStart;)
+            {
+                if (words[bit / 64] & ((uint64_t)1 << (bit % 64)))
+                {
+                    ++expectedCount;
+                    expectedSet = bit;
+                }
+                else {
+                    expectedClear = bit;
+                }
+            }
+
+            if (pktalloc::BitmapRangePopcount(words, bitStart, bitEnd) != expectedCount ||
+                pktalloc::BitmapFindFirstClear(words, bitStart, bitEnd) != expectedClear ||
+                pktalloc::BitmapFindFirstSet(words, bitStart, bitEnd) != expectedSet)
+            {
+                Logger.Error("Bitmap scan mismatch for range ", bitStart, " to ", bitEnd);
+                SIAMESE_DEBUG_BREAK();
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// TestSubwindowRing
+
+bool TestSubwindowRing()
+{
+    Logger.Info("Test: TestSubwindowRing");
+
+    static const unsigned kSteps = 20000;
+    static const unsigned kMaxCount = 300;
+
+    siamese::PCGRandom prng;
+    prng.Seed(kSeed);
+
+    // Each subwindow is stood in for by a unique address
+    std::vector<uint8_t> ids(kSteps + 1);
+    unsigned nextId = 0;
+
+    siamese::SubwindowRing<uint8_t> ring;
+    std::vector<uint8_t*> expected;
+
+    for (unsigned step = 0; step < kSteps; ++step)
+    {
+        const unsigned op = prng.Next() % 8;
+        if (op < 4 && expected.size() < kMaxCount)
+        {
+            // Grow by a few, like GrowWindow()
+            const unsigned count = (unsigned)expected.size() + 1 + prng.Next() % 4;
+            if (!ring.Reserve(count)) {
+                return false;
+            }
+            while (expected.size() < count)
+            {
+                uint8_t* id = &ids[nextId++];
+                if (!ring.Append(id)) {
+                    return false;
+                }
+                expected.push_back(id);
+            }
+        }
+        else if (op < 7)
+        {
+            // Remove from the front, which moves them to the back for reuse
+            const unsigned count = prng.Next() % (expected.size() + 1);
+            ring.RotateFront(count);
+            std::rotate(expected.begin(), expected.begin() + count, expected.end());
+        }
+        else
+        {
+            // Free the subwindows kept for reuse past some point
+            const unsigned count = prng.Next() % (expected.size() + 1);
+            ring.Truncate(count);
+            expected.resize(count);
+        }
+
+        if (ring.GetSize() != expected.size()) {
+            Logger.Error("Ring size mismatch at step ", step);
+            SIAMESE_DEBUG_BREAK();
+            return false;
+        }
+        for (unsigned i = 0; i < ring.GetSize(); ++i)
+        {
+            if (ring.Get(i) != expected[i])
+            {
+                Logger.Error("Ring order mismatch at step ", step, " index ", i);
+                SIAMESE_DEBUG_BREAK();
+                return false;
+            }
+        }
+
+        // Slots past the allocated subwindows must be empty
+        unsigned usedSlots = 0;
+        for (unsigned i = 0; i < ring.GetCapacity(); ++i) {
+            if (ring.Slots.GetRef(i)) {
+                ++usedSlots;
+            }
+        }
+        if (usedSlots != ring.GetSize())
+        {
+            Logger.Error("Ring slot count mismatch at step ", step);
+            SIAMESE_DEBUG_BREAK();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// TestEncodeBatch
+
+bool TestEncodeBatch()
+{
+    Logger.Info("Test: TestEncodeBatch");
+
+    // Window sizes covering single, Cauchy and Siamese sum recovery packets
+    static const unsigned kWindowSizes[] = { 1, 2, 20, 100, 500 };
+
+    for (unsigned windowSize : kWindowSizes)
+    {
+        SiameseEncoder encoderA = siamese_encoder_create();
+        SiameseEncoder encoderB = siamese_encoder_create();
+        if (!encoderA || !encoderB)
+        {
+            Logger.Error("Unable to create encoder");
+            return false;
+        }
+
+        bool success = true;
+
+        for (unsigned i = 0; i < windowSize; ++i)
+        {
+            uint8_t buffer[2000];
+            unsigned bytes = GetPacketBytes(i);
+            SIAMESE_DEBUG_ASSERT(bytes <= sizeof(buffer));
+            SetPacket(i, buffer, bytes);
+
+            SiameseOriginalPacket original;
+            original.Data = buffer;
+            original.DataBytes = bytes;
+            if (siamese_encoder_add(encoderA, &original) ||
+                siamese_encoder_add(encoderB, &original))
+            {
+                Logger.Error("Unable to add original data to encoder");
+                success = false;
+                break;
+            }
+        }
+
+        // Alternate batch sizes so that rows wrap around between calls
+        for (unsigned round = 0; success && round < 8; ++round)
+        {
+            const unsigned count = 1 + (round * 11) % SIAMESE_MAX_ENCODE_BATCH;
+
+            SiameseRecoveryPacket batch[SIAMESE_MAX_ENCODE_BATCH];
+            if (siamese_encode_batch(encoderA, count, batch))
+            {
+                Logger.Error("siamese_encode_batch failed");
+                success = false;
+                break;
+            }
+
+            for (unsigned i = 0; i < count; ++i)
+            {
+                SiameseRecoveryPacket recovery;
+                if (siamese_encode(encoderB, &recovery))
+                {
+                    Logger.Error("siamese_encode failed");
+                    success = false;
+                    break;
+                }
+
+                if (recovery.DataBytes != batch[i].DataBytes ||
+                    0 != memcmp(recovery.Data, batch[i].Data, recovery.DataBytes))
+                {
+                    Logger.Error("Batch packet ", i, " does not match for window size ", windowSize);
+                    success = false;
+                    break;
+                }
+            }
+        }
+
+        siamese_encoder_free(encoderA);
+        siamese_encoder_free(encoderB);
+
+        if (!success)
+        {
+            SIAMESE_DEBUG_BREAK();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// TestEncoderLengthDecay
+
+bool TestEncoderLengthDecay()
+{
+    Logger.Info("Test: TestEncoderLengthDecay");
+
+    // Each round starts with one long packet followed by short ones
+    static const unsigned kRounds = 5;
+    static const unsigned kRoundPackets = 100;
+    static const unsigned kLongBytes = 1400;
+    static const unsigned kShortBytes = 100;
+    static const unsigned kFirstLoss = 20;
+    static const unsigned kLossStride = 10;
+
+    SiameseEncoder encoder = siamese_encoder_create();
+    SiameseDecoder decoder = siamese_decoder_create();
+    if (!encoder || !decoder)
+    {
+        Logger.Error("Unable to create codec");
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+        return false;
+    }
+
+    bool success = true;
+    uint8_t buffer[2000];
+
+    for (unsigned round = 0; success && round < kRounds; ++round)
+    {
+        const unsigned roundStart = round * kRoundPackets;
+        std::vector<bool> missing(kRoundPackets, false);
+        unsigned missingCount = 0;
+
+        for (unsigned j = 0; j < kRoundPackets; ++j)
+        {
+            const unsigned i = roundStart + j;
+            const unsigned bytes = (j == 0) ? kLongBytes : kShortBytes;
+            SetPacket(i, buffer, bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = buffer;
+            original.DataBytes = bytes;
+            missing[j] = (j >= kFirstLoss && j % kLossStride == 0);
+
+            if (siamese_encoder_add(encoder, &original) ||
+                original.PacketNum != i ||
+                (!missing[j] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+                break;
+            }
+            if (missing[j]) {
+                ++missingCount;
+            }
+        }
+
+        // The long packet is not acknowledged yet, so it sizes the recovery packet
+        SiameseRecoveryPacket recovery;
+        if (!success ||
+            siamese_encode(encoder, &recovery) ||
+            recovery.DataBytes <= kLongBytes ||
+            siamese_decoder_add_recovery(decoder, &recovery))
+        {
+            Logger.Error("Recovery packet before acknowledgement is wrong");
+            success = false;
+            break;
+        }
+
+        // Acknowledge everything up to the first loss of this round
+        uint8_t ack[SIAMESE_ACK_MIN_BYTES + 256];
+        unsigned ackBytes = 0, nextExpected = 0;
+        if (siamese_decoder_ack(decoder, ack, sizeof(ack), &ackBytes) ||
+            siamese_encoder_ack(encoder, ack, ackBytes, &nextExpected))
+        {
+            Logger.Error("Acknowledgement failed");
+            success = false;
+            break;
+        }
+        if (nextExpected != roundStart + kFirstLoss)
+        {
+            Logger.Error("Unexpected next packet ", nextExpected);
+            success = false;
+            break;
+        }
+
+        // Only the short packets remain, so recovery packets are short again
+        for (unsigned attempt = 0; missingCount > 0; ++attempt)
+        {
+            if (attempt >= missingCount * 4 + 8)
+            {
+                Logger.Error("Recovery did not finish");
+                success = false;
+                break;
+            }
+
+            if (siamese_encode(encoder, &recovery) ||
+                recovery.DataBytes >= kShortBytes * 2 ||
+                siamese_decoder_add_recovery(decoder, &recovery))
+            {
+                Logger.Error("Recovery packet after acknowledgement is wrong: ", recovery.DataBytes, " bytes");
+                success = false;
+                break;
+            }
+
+            if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                continue;
+            }
+
+            SiameseOriginalPacket* packets;
+            unsigned count = 0;
+            if (siamese_decode(decoder, &packets, &count)) {
+                continue;
+            }
+
+            for (unsigned k = 0; k < count; ++k)
+            {
+                const unsigned j = packets[k].PacketNum - roundStart;
+                if (j >= kRoundPackets || !missing[j] ||
+                    packets[k].DataBytes != kShortBytes ||
+                    !CheckPacket(packets[k].PacketNum, packets[k].Data, packets[k].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", packets[k].PacketNum, " is wrong");
+                    success = false;
+                    break;
+                }
+                missing[j] = false;
+                --missingCount;
+            }
+            if (!success) {
+                break;
+            }
+        }
+    }
+
+    siamese_encoder_free(encoder);
+    siamese_decoder_free(decoder);
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// TestEncoderAddExternal
+
+struct ExternalPacketState
+{
+    std::vector<uint8_t> Data;
+    bool Released = false;
+};
+
+static void OnExternalRelease(void* context, const SiameseOriginalPacket* packet)
+{
+    std::vector<ExternalPacketState>& packets = *(std::vector<ExternalPacketState>*)context;
+    SIAMESE_DEBUG_ASSERT(packet->PacketNum < packets.size());
+    ExternalPacketState& state = packets[packet->PacketNum];
+    SIAMESE_DEBUG_ASSERT(!state.Released && packet->Data == state.Data.data());
+    state.Released = true;
+
+    // Scribble over the data to catch any later use
+    memset(&state.Data[0], 0xcd, state.Data.size());
+}
+
+bool TestEncoderAddExternal()
+{
+    Logger.Info("Test: TestEncoderAddExternal");
+
+    static const unsigned N = 2000;
+
+    std::vector<ExternalPacketState> packets(N);
+
+    SiameseEncoder encoderA = siamese_encoder_create();
+    SiameseEncoder encoderB = siamese_encoder_create();
+    if (!encoderA || !encoderB)
+    {
+        Logger.Error("Unable to create encoder");
+        return false;
+    }
+
+    bool success = true;
+
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        packets[i].Data.resize(bytes);
+        SetPacket(i, &packets[i].Data[0], bytes);
+
+        SiameseOriginalPacket original;
+        original.Data = &packets[i].Data[0];
+        original.DataBytes = bytes;
+
+        // Mix copied and external packets in encoder A
+        SiameseResult result;
+        if (i % 3 != 0) {
+            result = siamese_encoder_add_external(encoderA, &original, OnExternalRelease, &packets);
+        }
+        else {
+            result = siamese_encoder_add(encoderA, &original);
+            packets[i].Released = true;
+        }
+
+        if (result || siamese_encoder_add(encoderB, &original))
+        {
+            Logger.Error("Unable to add original data to encoder");
+            success = false;
+            break;
+        }
+
+        // Acknowledge everything but the last 100 packets
+        if (i % 50 == 49 && i >= 100)
+        {
+            siamese_encoder_remove_before(encoderA, i - 100);
+            siamese_encoder_remove_before(encoderB, i - 100);
+        }
+
+        if (i % 4 != 3) {
+            continue;
+        }
+
+        SiameseRecoveryPacket recoveryA, recoveryB;
+        if (siamese_encode(encoderA, &recoveryA) ||
+            siamese_encode(encoderB, &recoveryB))
+        {
+            Logger.Error("siamese_encode failed");
+            success = false;
+            break;
+        }
+
+        if (recoveryA.DataBytes != recoveryB.DataBytes ||
+            0 != memcmp(recoveryA.Data, recoveryB.Data, recoveryA.DataBytes))
+        {
+            Logger.Error("External recovery packet does not match at ", i);
+            success = false;
+            break;
+        }
+
+        SiameseOriginalPacket retrieved;
+        retrieved.PacketNum = i;
+        if (siamese_encoder_get(encoderA, &retrieved) ||
+            !CheckPacket(i, retrieved.Data, retrieved.DataBytes))
+        {
+            Logger.Error("siamese_encoder_get failed for external packet ", i);
+            success = false;
+            break;
+        }
+    }
+
+    siamese_encoder_free(encoderA);
+    siamese_encoder_free(encoderB);
+
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        if (!packets[i].Released)
+        {
+            Logger.Error("External packet ", i, " was never released");
+            success = false;
+        }
+    }
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool TestEncoderAddGather()
+{
+    Logger.Info("Test: TestEncoderAddGather");
+
+    static const unsigned N = 2000;
+    static const unsigned kMaxFragments = 4;
+
+    // Encoder A gathers, B adds linear copies, and C gathers through an add queue
+    SiameseEncoder encoderA = siamese_encoder_create();
+    SiameseEncoder encoderB = siamese_encoder_create();
+    SiameseEncoder encoderC = siamese_encoder_create();
+    if (!encoderA || !encoderB || !encoderC ||
+        siamese_encoder_set_add_queue(encoderC, 64))
+    {
+        Logger.Error("Unable to create encoder");
+        siamese_encoder_free(encoderA);
+        siamese_encoder_free(encoderB);
+        siamese_encoder_free(encoderC);
+        return false;
+    }
+
+    bool success = true;
+
+    // Packets must have data, and fragments with data need a pointer
+    uint8_t scratch[1] = { 0 };
+    SiameseFragment badFragments[2];
+    badFragments[0].Data = scratch;
+    badFragments[0].DataBytes = 0;
+    badFragments[1].Data = nullptr;
+    badFragments[1].DataBytes = 1;
+    unsigned badPacketNum = 0;
+    if (siamese_encoder_add_gather(encoderA, badFragments, 0, &badPacketNum) != Siamese_InvalidInput ||
+        siamese_encoder_add_gather(encoderA, badFragments, 1, &badPacketNum) != Siamese_InvalidInput ||
+        siamese_encoder_add_gather(encoderA, badFragments, 2, &badPacketNum) != Siamese_InvalidInput ||
+        siamese_encoder_add_gather(encoderA, badFragments, 1, nullptr) != Siamese_InvalidInput)
+    {
+        Logger.Error("siamese_encoder_add_gather accepted invalid input");
+        success = false;
+    }
+
+    siamese::PCGRandom prng;
+    prng.Seed(kSeed, N);
+
+    std::vector<uint8_t> data(2000);
+
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
+
+        // Split the packet at random points, which may leave empty fragments
+        SiameseFragment fragments[kMaxFragments];
+        const unsigned fragmentCount = 1 + prng.Next() % kMaxFragments;
+        unsigned offset = 0;
+        for (unsigned j = 0; j < fragmentCount; ++j)
+        {
+            unsigned fragmentBytes = bytes - offset;
+            if (j + 1 < fragmentCount) {
+                fragmentBytes = prng.Next() % (fragmentBytes + 1);
+            }
+            fragments[j].Data = &data[offset];
+            fragments[j].DataBytes = fragmentBytes;
+            offset += fragmentBytes;
+        }
+
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
+
+        unsigned packetNumA = 0, packetNumC = 0;
+        if (siamese_encoder_add_gather(encoderA, fragments, fragmentCount, &packetNumA) ||
+            siamese_encoder_add(encoderB, &original) ||
+            siamese_encoder_add_gather(encoderC, fragments, fragmentCount, &packetNumC) ||
+            packetNumA != i || packetNumC != i)
+        {
+            Logger.Error("Unable to add original data to encoder");
+            success = false;
+            break;
+        }
+
+        // Scribble over the data to make sure it was copied
+        memset(&data[0], 0xfe, bytes);
+
+        // Acknowledge everything but the last 100 packets
+        if (i % 50 == 49 && i >= 100)
+        {
+            siamese_encoder_remove_before(encoderA, i - 100);
+            siamese_encoder_remove_before(encoderB, i - 100);
+            siamese_encoder_remove_before(encoderC, i - 100);
+        }
+
+        if (i % 4 != 3) {
+            continue;
+        }
+
+        SiameseRecoveryPacket recoveryA, recoveryB, recoveryC;
+        if (siamese_encode(encoderA, &recoveryA) ||
+            siamese_encode(encoderB, &recoveryB) ||
+            siamese_encode(encoderC, &recoveryC))
+        {
+            Logger.Error("siamese_encode failed");
+            success = false;
+            break;
+        }
+
+        if (recoveryA.DataBytes != recoveryB.DataBytes ||
+            recoveryC.DataBytes != recoveryB.DataBytes ||
+            0 != memcmp(recoveryA.Data, recoveryB.Data, recoveryA.DataBytes) ||
+            0 != memcmp(recoveryC.Data, recoveryB.Data, recoveryC.DataBytes))
+        {
+            Logger.Error("Gathered recovery packet does not match at ", i);
+            success = false;
+            break;
+        }
+
+        SiameseOriginalPacket retrieved;
+        retrieved.PacketNum = i;
+        if (siamese_encoder_get(encoderA, &retrieved) ||
+            !CheckPacket(i, retrieved.Data, retrieved.DataBytes))
+        {
+            Logger.Error("siamese_encoder_get failed for gathered packet ", i);
+            success = false;
+            break;
+        }
+    }
+
+    siamese_encoder_free(encoderA);
+    siamese_encoder_free(encoderB);
+    siamese_encoder_free(encoderC);
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// TestDecoderSetOutput
+
+struct OutputBufferState
+{
+    std::vector<ExternalPacketState> Packets;
+
+    /// Released packets that are scribbled over once the results are checked
+    std::vector<unsigned> PendingScribble;
+
+    unsigned ProvidedCount = 0;
+};
+
+bool TestEncoderAddQueue()
+{
+    Logger.Info("Test: TestEncoderAddQueue");
+
+    static const unsigned N = 2000;
+    static const unsigned kLosses = 100;
+    static const unsigned kQueueSize = 16;
+
+    std::vector<ExternalPacketState> packets(N);
+    for (unsigned i = 0; i < N; ++i)
+    {
+        const unsigned bytes = GetPacketBytes(i);
+        packets[i].Data.resize(bytes);
+        SetPacket(i, &packets[i].Data[0], bytes);
+    }
+
+    SiameseEncoder encoder = siamese_encoder_create();
+    if (!encoder)
+    {
+        Logger.Error("Unable to create encoder");
+        return false;
+    }
+    if (siamese_encoder_set_add_queue(encoder, kQueueSize) != Siamese_Success ||
+        siamese_encoder_set_add_queue(encoder, kQueueSize) != Siamese_InvalidInput)
+    {
+        Logger.Error("siamese_encoder_set_add_queue failed");
+        siamese_encoder_free(encoder);
+        return false;
+    }
+
+    std::atomic<bool> producerFailed(false);
+    std::atomic<bool> producerDone(false);
+
+    // Add packets from another thread, mixing copied and external packets
+    std::thread producer([&]()
+    {
+        std::vector<uint8_t> data;
+        for (unsigned i = 0; i < N; ++i)
+        {
+            SiameseOriginalPacket original;
+            original.DataBytes = (unsigned)packets[i].Data.size();
+
+            SiameseResult result;
+            do
+            {
+                if (i % 2 == 0)
+                {
+                    // Reuse the same buffer to check that it was copied
+                    data = packets[i].Data;
+                    original.Data = &data[0];
+                    result = siamese_encoder_add(encoder, &original);
+                }
+                else
+                {
+                    original.Data = &packets[i].Data[0];
+                    result = siamese_encoder_add_external(encoder, &original, OnExternalRelease, &packets);
+                }
+                if (result == Siamese_MaxPacketsReached) {
+                    std::this_thread::yield();
+                }
+            } while (result == Siamese_MaxPacketsReached);
+
+            if (result != Siamese_Success || original.PacketNum != i)
+            {
+                producerFailed = true;
+                break;
+            }
+        }
+        producerDone = true;
+    });
+
+    // Meanwhile generate recovery data on this thread
+    std::vector< std::vector<uint8_t> > recoveryData;
+    bool success = true;
+    for (unsigned extra = 0; success && extra < kLosses * 2;)
+    {
+        const bool done = producerDone;
+
+        SiameseRecoveryPacket recovery;
+        const SiameseResult result = siamese_encode(encoder, &recovery);
+        if (result == Siamese_Success) {
+            recoveryData.push_back(std::vector<uint8_t>(recovery.Data, recovery.Data + recovery.DataBytes));
+        }
+        else if (result != Siamese_NeedMoreData)
+        {
+            Logger.Error("siamese_encode failed");
+            success = false;
+        }
+
+        if (done) {
+            ++extra;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+
+    producer.join();
+    if (producerFailed)
+    {
+        Logger.Error("Producer thread failed to add data");
+        success = false;
+    }
+
+    // All packets should be in the window with their copied data
+    for (unsigned i = 0; success && i < N; i += 2)
+    {
+        SiameseOriginalPacket original;
+        original.PacketNum = i;
+        if (siamese_encoder_get(encoder, &original) != Siamese_Success ||
+            !CheckPacket(i, original.Data, original.DataBytes))
+        {
+            Logger.Error("siamese_encoder_get returned the wrong packet ", i);
+            success = false;
+        }
+    }
+
+    siamese_encoder_free(encoder);
+
+    for (unsigned i = 1; success && i < N; i += 2)
+    {
+        if (!packets[i].Released)
+        {
+            Logger.Error("External packet ", i, " was not released");
+            success = false;
+        }
+    }
+
+    // Decode with losses to check the recovery data
+    SiameseDecoder decoder = siamese_decoder_create();
+    if (!decoder) {
+        success = false;
+    }
+
+    uint16_t losses[N];
+    siamese::PCGRandom prng;
+    prng.Seed(kSeed, N);
+    ShuffleDeck16(prng, losses, N);
+    std::vector<bool> lost(N, false);
+    for (unsigned j = 0; j < kLosses; ++j) {
+        lost[losses[j]] = true;
+    }
+
+    std::vector<uint8_t> data(2000);
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        if (lost[i]) {
+            continue;
+        }
+
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
+
+        SiameseOriginalPacket original;
+        original.PacketNum = i;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
+        if (siamese_decoder_add_original(decoder, &original))
+        {
+            Logger.Error("Unable to add original data");
+            success = false;
+        }
+    }
+
+    unsigned recoveredCount = 0;
+    for (size_t j = 0; success && j < recoveryData.size(); ++j)
+    {
+        SiameseRecoveryPacket recovery;
+        recovery.Data = &recoveryData[j][0];
+        recovery.DataBytes = (unsigned)recoveryData[j].size();
+        if (siamese_decoder_add_recovery(decoder, &recovery))
+        {
+            Logger.Error("Unable to add recovery data");
+            success = false;
+            break;
+        }
+
+        if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+            continue;
+        }
+
+        SiameseOriginalPacket* recovered;
+        unsigned count = 0;
+        if (siamese_decode(decoder, &recovered, &count)) {
+            continue;
+        }
+
+        for (unsigned k = 0; k < count; ++k)
+        {
+            if (!CheckPacket(recovered[k].PacketNum, recovered[k].Data, recovered[k].DataBytes))
+            {
+                Logger.Error("Recovered packet ", recovered[k].PacketNum, " is wrong");
+                success = false;
+                break;
+            }
+        }
+        recoveredCount += count;
+    }
+
+    if (success && recoveredCount != kLosses)
+    {
+        Logger.Error("Only recovered ", recoveredCount, " of ", kLosses, " packets");
+        success = false;
+    }
+
+    siamese_decoder_free(decoder);
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+static unsigned char* OnOutputProvide(void* context, unsigned packetNum, unsigned dataBytes)
+{
+    OutputBufferState& state = *(OutputBufferState*)context;
+    SIAMESE_DEBUG_ASSERT(packetNum < state.Packets.size());
+
+    // Let the decoder keep some of the packets to exercise the fallback
+    if (packetNum % 5 == 0) {
+        return nullptr;
+    }
+
+    ExternalPacketState& packet = state.Packets[packetNum];
+    SIAMESE_DEBUG_ASSERT(packet.Data.empty());
+    packet.Data.resize(dataBytes);
+    ++state.ProvidedCount;
+    return &packet.Data[0];
+}
+
+static void OnOutputRelease(void* context, const SiameseOriginalPacket* packet)
+{
+    OutputBufferState& state = *(OutputBufferState*)context;
+    SIAMESE_DEBUG_ASSERT(packet->PacketNum < state.Packets.size());
+    ExternalPacketState& external = state.Packets[packet->PacketNum];
+    SIAMESE_DEBUG_ASSERT(!external.Released && packet->Data == external.Data.data());
+    external.Released = true;
+    state.PendingScribble.push_back(packet->PacketNum);
+}
+
+static void ScribbleReleased(OutputBufferState& state)
+{
+    // Scribble over the data to catch any later use
+    for (unsigned packetNum : state.PendingScribble) {
+        memset(&state.Packets[packetNum].Data[0], 0xcd, state.Packets[packetNum].Data.size());
+    }
+    state.PendingScribble.clear();
+}
+
+bool TestDecoderSetOutput()
+{
+    Logger.Info("Test: TestDecoderSetOutput");
+
+    static const unsigned N = 4000;
+
+    OutputBufferState state;
+    state.Packets.resize(N);
+
+    SiameseEncoder encoder = siamese_encoder_create();
+    SiameseDecoder decoderA = siamese_decoder_create();
+    SiameseDecoder decoderB = siamese_decoder_create();
+    if (!encoder || !decoderA || !decoderB)
+    {
+        Logger.Error("Unable to create codec");
+        return false;
+    }
+
+    bool success = true;
+
+    if (siamese_decoder_set_output(decoderA, OnOutputProvide, nullptr, &state) != Siamese_InvalidInput ||
+        siamese_decoder_set_output(decoderA, OnOutputProvide, OnOutputRelease, &state) != Siamese_Success)
+    {
+        Logger.Error("siamese_decoder_set_output failed");
+        success = false;
+    }
+
+    std::vector<uint8_t> data(1200);
+    std::vector<bool> delivered(N, false);
+    unsigned recoveredCount = 0;
+
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
+
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
+
+        if (siamese_encoder_add(encoder, &original))
+        {
+            Logger.Error("Unable to add original data to encoder");
+            success = false;
+            break;
+        }
+
+        // Lose about 10% of the originals, with some short bursts
+        if ((i * 7) % 11 != 3 && i % 97 >= 3)
+        {
+            delivered[i] = true;
+            if (siamese_decoder_add_original(decoderA, &original) ||
+                siamese_decoder_add_original(decoderB, &original))
+            {
+                Logger.Error("siamese_decoder_add_original failed");
+                success = false;
+                break;
+            }
+        }
+
+        if (i % 4 == 3)
+        {
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(decoderA, &recovery) ||
+                siamese_decoder_add_recovery(decoderB, &recovery))
+            {
+                Logger.Error("siamese_encode failed");
+                success = false;
+                break;
+            }
+
+            // Both decoders must recover the same packets
+            SiameseOriginalPacket* packetsA;
+            SiameseOriginalPacket* packetsB;
+            unsigned countA = 0, countB = 0;
+            const bool readyA = (siamese_decoder_is_ready(decoderA) == Siamese_Success);
+            const bool readyB = (siamese_decoder_is_ready(decoderB) == Siamese_Success);
+            if (readyA != readyB ||
+                (readyA && (siamese_decode(decoderA, &packetsA, &countA) ||
+                            siamese_decode(decoderB, &packetsB, &countB))) ||
+                countA != countB)
+            {
+                Logger.Error("Decoders disagree at ", i);
+                success = false;
+                break;
+            }
+
+            for (unsigned j = 0; j < countA; ++j)
+            {
+                const unsigned packetNum = packetsA[j].PacketNum;
+                const ExternalPacketState& external = state.Packets[packetNum];
+                const bool provided = !external.Data.empty();
+
+                if (packetNum != packetsB[j].PacketNum ||
+                    provided != (packetsA[j].Data == external.Data.data()) ||
+                    !CheckPacket(packetNum, packetsA[j].Data, packetsA[j].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", packetNum, " is wrong");
+                    success = false;
+                    break;
+                }
+
+                delivered[packetNum] = true;
+                ++recoveredCount;
+            }
+
+            ScribbleReleased(state);
+        }
+
+        // Acknowledge what has been received so far
+        if (i % 50 == 49)
+        {
+            uint8_t ack[SIAMESE_ACK_MIN_BYTES + 256];
+            unsigned ackBytes = 0, nextExpected = 0;
+            if (siamese_decoder_ack(decoderB, ack, sizeof(ack), &ackBytes) == Siamese_Success) {
+                siamese_encoder_ack(encoder, ack, ackBytes, &nextExpected);
+            }
+        }
+
+        // Recovered packets must stay readable until they are released
+        for (unsigned j = (i >= 200) ? i - 200 : 0; j <= i; ++j)
+        {
+            if (!delivered[j] || state.Packets[j].Released) {
+                continue;
+            }
+
+            SiameseOriginalPacket retrieved;
+            retrieved.PacketNum = j;
+            if (siamese_decoder_get(decoderA, &retrieved) == Siamese_Success &&
+                !CheckPacket(j, retrieved.Data, retrieved.DataBytes))
+            {
+                Logger.Error("siamese_decoder_get failed for packet ", j);
+                success = false;
+                break;
+            }
+        }
+    }
+
+    siamese_encoder_free(encoder);
+    siamese_decoder_free(decoderA);
+    siamese_decoder_free(decoderB);
+
+    if (success && (recoveredCount == 0 || state.ProvidedCount == 0 || state.ProvidedCount == recoveredCount))
+    {
+        Logger.Error("No packets were recovered into application buffers");
+        success = false;
+    }
+
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        if (!state.Packets[i].Data.empty() && !state.Packets[i].Released)
+        {
+            Logger.Error("Output buffer ", i, " was never released");
+            success = false;
+        }
+    }
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// TestDecoderSolverThreads
+
+bool TestDecoderSolverThreads()
+{
+    Logger.Info("Test: TestDecoderSolverThreads");
+
+    static const unsigned N = 1500;
+    static const unsigned kLosses = 150;
+    static const unsigned kTrials = 4;
+
+    bool success = true;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        uint16_t losses[N];
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+        ShuffleDeck16(prng, losses, N);
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoderA = siamese_decoder_create();
+        SiameseDecoder decoderB = siamese_decoder_create();
+        if (!encoder || !decoderA || !decoderB)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+        else if (siamese_decoder_set_solver_threads(decoderA, 2 + trial) != Siamese_Success)
+        {
+            Logger.Error("siamese_decoder_set_solver_threads failed");
+            success = false;
+        }
+        else
+        {
+            // Split every solve, since the measured thresholds keep the
+            // solver threads off on machines with few cores
+            reinterpret_cast<siamese::Decoder*>(decoderA)->SetSolverThresholds(0, 0);
+        }
+
+        std::vector<bool> lost(N, false);
+        for (unsigned j = 0; j < kLosses; ++j) {
+            lost[losses[j]] = true;
+        }
+
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!lost[i] && (siamese_decoder_add_original(decoderA, &original) ||
+                              siamese_decoder_add_original(decoderB, &original))))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+            }
+        }
+
+        // Keep adding recovery data until both decoders are able to solve
+        for (unsigned j = 0; success && j < kLosses + 16; ++j)
+        {
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(decoderA, &recovery) ||
+                siamese_decoder_add_recovery(decoderB, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+
+            const bool readyA = (siamese_decoder_is_ready(decoderA) == Siamese_Success);
+            const bool readyB = (siamese_decoder_is_ready(decoderB) == Siamese_Success);
+            if (readyA != readyB)
+            {
+                Logger.Error("Decoders disagree on readiness at ", j);
+                success = false;
+                break;
+            }
+            if (!readyA) {
+                continue;
+            }
+
+            SiameseOriginalPacket* packetsA;
+            SiameseOriginalPacket* packetsB;
+            unsigned countA = 0, countB = 0;
+            if (siamese_decode(decoderA, &packetsA, &countA) ||
+                siamese_decode(decoderB, &packetsB, &countB) ||
+                countA != countB)
+            {
+                Logger.Error("Decoders disagree on recovery at ", j);
+                success = false;
+                break;
+            }
+
+            for (unsigned k = 0; k < countA; ++k)
+            {
+                if (packetsA[k].PacketNum != packetsB[k].PacketNum ||
+                    !CheckPacket(packetsA[k].PacketNum, packetsA[k].Data, packetsA[k].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", packetsA[k].PacketNum, " is wrong");
+                    success = false;
+                    break;
+                }
+            }
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoderA);
+        siamese_decoder_free(decoderB);
+    }
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestDecoderLateOriginals()
+{
+    Logger.Info("Test: TestDecoderLateOriginals");
+
+    static const unsigned N = 400;
+    static const unsigned kLosses = 40;
+    static const unsigned kTrials = 1000;
+
+    bool success = true;
+    uint64_t solveFailCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        uint16_t losses[N];
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+        ShuffleDeck16(prng, losses, N);
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        // Some of the lost originals are delivered late, between recovery packets
+        std::vector<bool> missing(N, false);
+        for (unsigned j = 0; j < kLosses; ++j) {
+            missing[losses[j]] = true;
+        }
+        unsigned missingCount = kLosses;
+        unsigned lateIndex = 0;
+
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+            }
+        }
+
+        for (unsigned j = 0; success && missingCount > 0; ++j)
+        {
+            if (j >= kLosses * 2)
+            {
+                Logger.Error("Recovery did not finish");
+                success = false;
+                break;
+            }
+
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(decoder, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+
+            // Deliver one of the lost originals late about a third of the time
+            while (lateIndex < kLosses && !missing[losses[lateIndex]]) {
+                ++lateIndex;
+            }
+            if (lateIndex < kLosses && prng.Next() % 3 == 0)
+            {
+                const unsigned i = losses[lateIndex];
+                unsigned bytes = GetPacketBytes(i);
+                SetPacket(i, &data[0], bytes);
+
+                SiameseOriginalPacket original;
+                original.PacketNum = i;
+                original.Data = &data[0];
+                original.DataBytes = bytes;
+
+                if (siamese_decoder_add_original(decoder, &original))
+                {
+                    Logger.Error("Unable to add late original data");
+                    success = false;
+                    break;
+                }
+                missing[i] = false;
+                --missingCount;
+            }
+
+            if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                continue;
+            }
+
+            SiameseOriginalPacket* packets;
+            unsigned count = 0;
+            if (siamese_decode(decoder, &packets, &count))
+            {
+                continue;
+            }
+
+            for (unsigned k = 0; k < count; ++k)
+            {
+                const unsigned i = packets[k].PacketNum;
+                if (i >= N || !missing[i] ||
+                    !CheckPacket(i, packets[k].Data, packets[k].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", i, " is wrong");
+                    success = false;
+                    break;
+                }
+                missing[i] = false;
+                --missingCount;
+            }
+        }
+
+        uint64_t stats[SiameseDecoderStats_Count];
+        if (decoder && siamese_decoder_stats(decoder, stats, SiameseDecoderStats_Count) == Siamese_Success) {
+            solveFailCount += stats[SiameseDecoderStats_SolveFailCount];
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestDecoderLateOriginals: ", solveFailCount, " failed solves");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+// Two-state loss channel: 20% loss in bursts of 20 packets on average
+class BurstLossChannel
+{
+public:
+    explicit BurstLossChannel(siamese::PCGRandom& prng)
+        : Prng(prng)
+    {
+    }
+
+    bool IsLost()
+    {
+        const unsigned staySameOdds = Lost ? 950 : 988;
+        if (Prng.Next() % 1000 >= staySameOdds) {
+            Lost = !Lost;
+        }
+        return Lost;
+    }
+
+private:
+    siamese::PCGRandom& Prng;
+    bool Lost = false;
+};
+
+bool TestDecoderBurstLoss()
+{
+    Logger.Info("Test: TestDecoderBurstLoss");
+
+    static const unsigned N = 20000;
+    static const unsigned kRecoveryInterval = 8;
+    static const unsigned kAckInterval = 16;
+    static const unsigned kAckDelay = 128;
+    static const unsigned kRetransmitDelay = 128;
+    static const unsigned kTrials = 20;
+
+    bool success = true;
+    unsigned lostCount = 0, recoveredCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+        BurstLossChannel channel(prng);
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        // Lost originals are sent again after a delay until they get through,
+        // unless the decoder recovers them first
+        std::vector<bool> missing(N, false);
+        std::queue<std::pair<unsigned, unsigned> > retransmits, acks;
+        unsigned firstMissing = 0;
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && (i < N || firstMissing < N); ++i)
+        {
+            if (i < N)
+            {
+                unsigned bytes = GetPacketBytes(i);
+                SetPacket(i, &data[0], bytes);
+
+                SiameseOriginalPacket original;
+                original.PacketNum = i;
+                original.Data = &data[0];
+                original.DataBytes = bytes;
+
+                if (siamese_encoder_add(encoder, &original))
+                {
+                    Logger.Error("Unable to add original data");
+                    success = false;
+                    break;
+                }
+
+                if (channel.IsLost())
+                {
+                    missing[i] = true;
+                    retransmits.push(std::make_pair(i + kRetransmitDelay, i));
+                    ++lostCount;
+                }
+                else if (siamese_decoder_add_original(decoder, &original))
+                {
+                    Logger.Error("Unable to add original data");
+                    success = false;
+                    break;
+                }
+            }
+
+            while (success && !retransmits.empty() && retransmits.front().first <= i)
+            {
+                const unsigned n = retransmits.front().second;
+                retransmits.pop();
+                if (!missing[n]) {
+                    continue;
+                }
+                if (channel.IsLost())
+                {
+                    retransmits.push(std::make_pair(i + kRetransmitDelay, n));
+                    continue;
+                }
+
+                unsigned bytes = GetPacketBytes(n);
+                SetPacket(n, &data[0], bytes);
+
+                SiameseOriginalPacket original;
+                original.PacketNum = n;
+                original.Data = &data[0];
+                original.DataBytes = bytes;
+
+                if (siamese_decoder_add_original(decoder, &original))
+                {
+                    Logger.Error("Unable to add late original data");
+                    success = false;
+                    break;
+                }
+                missing[n] = false;
+            }
+
+            if (success && i % kRecoveryInterval == kRecoveryInterval - 1 && !channel.IsLost())
+            {
+                SiameseRecoveryPacket recovery;
+                SiameseResult result = siamese_encode(encoder, &recovery);
+                if (result == Siamese_Success) {
+                    result = siamese_decoder_add_recovery(decoder, &recovery);
+                }
+                else if (result == Siamese_NeedMoreData) {
+                    result = Siamese_Success;
+                }
+                if (result != Siamese_Success)
+                {
+                    Logger.Error("Unable to add recovery data");
+                    success = false;
+                    break;
+                }
+
+                SiameseOriginalPacket* packets;
+                unsigned count = 0;
+                if (siamese_decoder_is_ready(decoder) == Siamese_Success &&
+                    siamese_decode(decoder, &packets, &count) == Siamese_Success)
+                {
+                    for (unsigned k = 0; k < count; ++k)
+                    {
+                        const unsigned n = packets[k].PacketNum;
+                        if (n >= N || !missing[n] ||
+                            !CheckPacket(n, packets[k].Data, packets[k].DataBytes))
+                        {
+                            Logger.Error("Recovered packet ", n, " is wrong");
+                            success = false;
+                            break;
+                        }
+                        missing[n] = false;
+                        ++recoveredCount;
+                    }
+                }
+            }
+
+            while (firstMissing < N && firstMissing <= i && !missing[firstMissing]) {
+                ++firstMissing;
+            }
+            if (i % kAckInterval == kAckInterval - 1) {
+                acks.push(std::make_pair(i + kAckDelay, firstMissing));
+            }
+            while (success && !acks.empty() && acks.front().first <= i)
+            {
+                if (siamese_encoder_remove_before(encoder, acks.front().second))
+                {
+                    Logger.Error("siamese_encoder_remove_before failed");
+                    success = false;
+                }
+                acks.pop();
+            }
+        }
+
+        if (success && siamese_decoder_is_ready(decoder) == Siamese_Disabled)
+        {
+            Logger.Error("Decoder disabled itself in trial ", trial);
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestDecoderBurstLoss: ", recoveredCount, " of ", lostCount, " lost packets recovered");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestDecoderSumRestart()
+{
+    Logger.Info("Test: TestDecoderSumRestart");
+
+    static const unsigned N = 6000;
+    static const unsigned kCleanCount = 3000;
+    static const unsigned kMaxInFlight = 400;
+    static const unsigned kRecoveryInterval = 4;
+    static const unsigned kLossPercent = 2;
+    static const unsigned kTrials = 4;
+
+    bool success = true;
+    uint64_t recoveryCount = 0, dupedRecoveryCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        // The decoder sees no losses for a long time, so it removes data
+        // from its window before it has started any running sums
+        std::vector<bool> missing(N, false);
+        unsigned missingCount = 0;
+        unsigned firstMissing = 0;
+        unsigned firstKept = 0;
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            if (i >= kCleanCount && prng.Next() % 100 < kLossPercent)
+            {
+                missing[i] = true;
+                ++missingCount;
+            }
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+                break;
+            }
+
+            // Keep the encoder window short unless there are losses in it
+            while (firstMissing <= i && !missing[firstMissing]) {
+                ++firstMissing;
+            }
+            unsigned keep = (i + 1 > kMaxInFlight) ? i + 1 - kMaxInFlight : 0;
+            if (keep > firstMissing) {
+                keep = firstMissing;
+            }
+            if (keep > firstKept)
+            {
+                if (siamese_encoder_remove_before(encoder, keep))
+                {
+                    Logger.Error("siamese_encoder_remove_before failed");
+                    success = false;
+                    break;
+                }
+                firstKept = keep;
+            }
+
+            if (i % kRecoveryInterval != kRecoveryInterval - 1) {
+                continue;
+            }
+
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(decoder, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+
+            SiameseOriginalPacket* packets;
+            unsigned count = 0;
+            if (siamese_decoder_is_ready(decoder) != Siamese_Success ||
+                siamese_decode(decoder, &packets, &count))
+            {
+                continue;
+            }
+
+            for (unsigned k = 0; k < count; ++k)
+            {
+                const unsigned n = packets[k].PacketNum;
+                if (n >= N || !missing[n] ||
+                    !CheckPacket(n, packets[k].Data, packets[k].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", n, " is wrong");
+                    success = false;
+                    break;
+                }
+                missing[n] = false;
+                --missingCount;
+            }
+        }
+
+        uint64_t stats[SiameseDecoderStats_Count];
+        if (success && siamese_decoder_stats(decoder, stats, SiameseDecoderStats_Count))
+        {
+            Logger.Error("siamese_decoder_stats failed");
+            success = false;
+        }
+        if (success)
+        {
+            recoveryCount += stats[SiameseDecoderStats_RecoveryCount];
+            dupedRecoveryCount += stats[SiameseDecoderStats_DupedRecoveryCount];
+        }
+
+        // Sum rows must not be dropped as clipped once losses start
+        if (success && missingCount > 0)
+        {
+            Logger.Error("Trial ", trial, " did not recover ", missingCount, " packets");
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestDecoderSumRestart: ", dupedRecoveryCount, " of ", recoveryCount, " recovery packets unused");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestAllocatorFallback()
+{
+    Logger.Info("Test: TestAllocatorFallback");
+
+    // Larger than a window, so each one is a fallback allocation
+    static const unsigned kLargeBytes = pktalloc::kWindowMaxUnits * pktalloc::kUnitSize;
+    static const unsigned kAllocationCount = 32;
+    static const unsigned kTrials = 100;
+
+    bool success = true;
+
+    // Trials take turns between no pool, a mapped pool that carves fallback
+    // allocations out of its chunks, and a heap pool where the allocator
+    // asks for its own mapped placement
+    pktalloc::WindowPool mappedPool(0, true, -1);
+    pktalloc::WindowPool heapPool;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        pktalloc::WindowPool* pool = nullptr;
+        bool hugePages = false;
+        int numaNode = -1;
+        if (trial % 3 == 1) {
+            pool = &mappedPool;
+        }
+        else if (trial % 3 == 2)
+        {
+            pool = &heapPool;
+            hugePages = true;
+            numaNode = 0;
+        }
+
+        pktalloc::Allocator allocator(pool, hugePages, numaNode);
+        uint8_t* allocations[kAllocationCount];
+        unsigned sizes[kAllocationCount];
+
+        for (unsigned i = 0; i < kAllocationCount; ++i)
+        {
+            sizes[i] = kLargeBytes + prng.Next() % kLargeBytes;
+            allocations[i] = allocator.Allocate(sizes[i]);
+            if (!allocations[i])
+            {
+                Logger.Error("Allocate failed");
+                success = false;
+                break;
+            }
+            memset(allocations[i], (uint8_t)i, sizes[i]);
+        }
+
+        // Free or grow some of them from anywhere in the list
+        for (unsigned i = 0; success && i < kAllocationCount; ++i)
+        {
+            const unsigned action = prng.Next() % 3;
+            if (action == 0)
+            {
+                allocator.Free(allocations[i]);
+                allocations[i] = nullptr;
+            }
+            else if (action == 1)
+            {
+                allocations[i] = allocator.Reallocate(allocations[i], sizes[i] * 2, pktalloc::Realloc::CopyExisting);
+                if (!allocations[i])
+                {
+                    Logger.Error("Reallocate failed");
+                    success = false;
+                    break;
+                }
+                memset(allocations[i] + sizes[i], (uint8_t)i, sizes[i]);
+                sizes[i] *= 2;
+            }
+        }
+
+        for (unsigned i = 0; success && i < kAllocationCount; ++i)
+        {
+            if (!allocations[i]) {
+                continue;
+            }
+            for (unsigned j = 0; j < sizes[i]; ++j)
+            {
+                if (allocations[i][j] != (uint8_t)i)
+                {
+                    Logger.Error("Fallback allocation ", i, " was corrupted");
+                    success = false;
+                    break;
+                }
+            }
+        }
+
+        if (success && !allocator.IntegrityCheck())
+        {
+            Logger.Error("Allocator integrity check failed");
+            success = false;
+        }
+
+#if defined(__linux__) || defined(_WIN32)
+        // Every allocation fits in a chunk, so the pools only map whole chunks
+        if (success && pool && pool->GetMemoryAllocatedBytes() % pktalloc::kWindowPoolChunkBytes != 0)
+        {
+            Logger.Error("Fallback allocations were not carved out of chunks");
+            success = false;
+        }
+#endif // Mapped memory
+
+        // The rest are still allocated when the allocator goes away, which
+        // frees them.  Leak checkers will catch it if it does not
+    }
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestDecoderAddOriginalBatch()
+{
+    Logger.Info("Test: TestDecoderAddOriginalBatch");
+
+    static const unsigned N = 2000;
+    static const unsigned kMaxBatch = 64;
+    static const unsigned kRecoveryInterval = 8;
+    static const unsigned kTrials = 20;
+
+    bool success = true;
+    uint64_t recoveredCount = 0;
+
+    {
+        SiameseDecoder decoder = siamese_decoder_create();
+        uint8_t data[1] = { 0 };
+        SiameseOriginalPacket original;
+        original.PacketNum = 0;
+        original.Data = data;
+        original.DataBytes = 1;
+
+        if (!decoder ||
+            siamese_decoder_add_original_batch(decoder, &original, 0) != Siamese_InvalidInput ||
+            siamese_decoder_add_original_batch(decoder, &original, SIAMESE_MAX_ORIGINAL_BATCH + 1) != Siamese_InvalidInput ||
+            siamese_decoder_add_original_batch(decoder, &original, 1) != Siamese_Success ||
+            siamese_decoder_add_original_batch(decoder, &original, 1) != Siamese_DuplicateData)
+        {
+            Logger.Error("Unexpected result for a simple batch");
+            success = false;
+        }
+        siamese_decoder_free(decoder);
+    }
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        // Decoder A gets the originals one at a time and decoder B in batches
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoderA = siamese_decoder_create();
+        SiameseDecoder decoderB = siamese_decoder_create();
+        if (!encoder || !decoderA || !decoderB)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        const unsigned lossPercent = 2 + trial % 8;
+        std::vector<std::vector<uint8_t>> packetData(N);
+        std::vector<SiameseOriginalPacket> originals(N);
+        std::vector<unsigned> sendOrder;
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            const unsigned bytes = GetPacketBytes(i);
+            packetData[i].resize(bytes);
+            SetPacket(i, &packetData[i][0], bytes);
+
+            originals[i].PacketNum = i;
+            originals[i].Data = &packetData[i][0];
+            originals[i].DataBytes = bytes;
+
+            if (prng.Next() % 100 >= lossPercent) {
+                sendOrder.push_back(i);
+            }
+        }
+
+        unsigned sent = 0, encoded = 0, sinceRecovery = 0;
+        while (success && sent < sendOrder.size())
+        {
+            // Build a batch that is a little out of order and has some repeats
+            SiameseOriginalPacket batch[kMaxBatch];
+            unsigned batchCount = 1 + prng.Next() % kMaxBatch;
+            if (batchCount > sendOrder.size() - sent) {
+                batchCount = (unsigned)(sendOrder.size() - sent);
+            }
+            for (unsigned k = 0; k < batchCount; ++k) {
+                batch[k] = originals[sendOrder[sent + k]];
+            }
+            sent += batchCount;
+            for (unsigned k = 1; k < batchCount; ++k)
+            {
+                if (prng.Next() % 4 == 0) {
+                    std::swap(batch[k - 1], batch[k]);
+                }
+                if (prng.Next() % 16 == 0) {
+                    batch[k] = batch[prng.Next() % k];
+                }
+            }
+
+            for (unsigned k = 0; k < batchCount; ++k)
+            {
+                const SiameseResult result = siamese_decoder_add_original(decoderA, &batch[k]);
+                if (result != Siamese_Success && result != Siamese_DuplicateData)
+                {
+                    Logger.Error("Unable to add original data to decoder");
+                    success = false;
+                }
+            }
+            const SiameseResult batchResult = siamese_decoder_add_original_batch(decoderB, batch, batchCount);
+            if (batchResult != Siamese_Success && batchResult != Siamese_DuplicateData)
+            {
+                Logger.Error("siamese_decoder_add_original_batch failed");
+                success = false;
+                break;
+            }
+
+            // The encoder has seen everything up to the last packet sent
+            const unsigned encodeEnd = (sent < sendOrder.size()) ? sendOrder[sent] : N;
+            for (; success && encoded < encodeEnd; ++encoded)
+            {
+                SiameseOriginalPacket copy = originals[encoded];
+                if (siamese_encoder_add(encoder, &copy))
+                {
+                    Logger.Error("Unable to add original data to encoder");
+                    success = false;
+                }
+            }
+
+            for (sinceRecovery += batchCount; success && sinceRecovery >= kRecoveryInterval; sinceRecovery -= kRecoveryInterval)
+            {
+                SiameseRecoveryPacket recovery;
+                if (siamese_encode(encoder, &recovery) ||
+                    siamese_decoder_add_recovery(decoderA, &recovery) ||
+                    siamese_decoder_add_recovery(decoderB, &recovery))
+                {
+                    Logger.Error("Unable to add recovery data");
+                    success = false;
+                    break;
+                }
+
+                const SiameseResult readyA = siamese_decoder_is_ready(decoderA);
+                const SiameseResult readyB = siamese_decoder_is_ready(decoderB);
+                if (readyA != readyB)
+                {
+                    Logger.Error("Decoders disagree on siamese_decoder_is_ready()");
+                    success = false;
+                    break;
+                }
+                if (readyA != Siamese_Success) {
+                    continue;
+                }
+
+                SiameseOriginalPacket* packetsA;
+                SiameseOriginalPacket* packetsB;
+                unsigned countA = 0, countB = 0;
+                const SiameseResult decodeA = siamese_decode(decoderA, &packetsA, &countA);
+                const SiameseResult decodeB = siamese_decode(decoderB, &packetsB, &countB);
+                if (decodeA != decodeB || countA != countB)
+                {
+                    Logger.Error("Decoders disagree on siamese_decode()");
+                    success = false;
+                    break;
+                }
+
+                for (unsigned k = 0; k < countB; ++k)
+                {
+                    const unsigned i = packetsB[k].PacketNum;
+                    if (i >= N || packetsA[k].PacketNum != i ||
+                        !CheckPacket(i, packetsB[k].Data, packetsB[k].DataBytes))
+                    {
+                        Logger.Error("Recovered packet ", i, " is wrong");
+                        success = false;
+                        break;
+                    }
+                }
+                recoveredCount += countB;
+            }
+        }
+
+        // Both decoders should now acknowledge the same packets
+        uint8_t ackA[1000], ackB[1000];
+        unsigned ackBytesA = 0, ackBytesB = 0;
+        if (success &&
+            (siamese_decoder_ack(decoderA, ackA, sizeof(ackA), &ackBytesA) !=
+             siamese_decoder_ack(decoderB, ackB, sizeof(ackB), &ackBytesB) ||
+             ackBytesA != ackBytesB ||
+             0 != memcmp(ackA, ackB, ackBytesA)))
+        {
+            Logger.Error("Decoders disagree on siamese_decoder_ack()");
+            success = false;
+        }
+
+        uint64_t statsA[SiameseDecoderStats_Count], statsB[SiameseDecoderStats_Count];
+        if (success &&
+            (siamese_decoder_stats(decoderA, statsA, SiameseDecoderStats_Count) ||
+             siamese_decoder_stats(decoderB, statsB, SiameseDecoderStats_Count) ||
+             statsA[SiameseDecoderStats_OriginalCount] != statsB[SiameseDecoderStats_OriginalCount] ||
+             statsA[SiameseDecoderStats_OriginalBytes] != statsB[SiameseDecoderStats_OriginalBytes] ||
+             statsA[SiameseDecoderStats_DupedOriginalCount] != statsB[SiameseDecoderStats_DupedOriginalCount] ||
+             statsA[SiameseDecoderStats_SolveSuccessCount] != statsB[SiameseDecoderStats_SolveSuccessCount]))
+        {
+            Logger.Error("Decoder statistics do not match");
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoderA);
+        siamese_decoder_free(decoderB);
+    }
+
+    Logger.Info("TestDecoderAddOriginalBatch: ", recoveredCount, " packets recovered");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestDecoderRecoveryReorder()
+{
+    Logger.Info("Test: TestDecoderRecoveryReorder");
+
+    static const unsigned N = 2000;
+    static const unsigned kLosses = 200;
+    static const unsigned kRecoveryInterval = 8;
+    static const unsigned kTrials = 10;
+
+    bool success = true;
+    unsigned recoveredCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        uint16_t losses[N];
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+        ShuffleDeck16(prng, losses, N);
+
+        std::vector<bool> missing(N, false);
+        for (unsigned j = 0; j < kLosses; ++j) {
+            missing[losses[j]] = true;
+        }
+        unsigned missingCount = kLosses;
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        // Make all of the recovery packets before any of them are delivered
+        std::vector<std::vector<uint8_t>> recoveryPackets;
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+                break;
+            }
+
+            // Extra recovery at the end covers losses in the last few packets
+            if (i % kRecoveryInterval == kRecoveryInterval - 1 || i >= N - 4)
+            {
+                SiameseRecoveryPacket recovery;
+                if (siamese_encode(encoder, &recovery))
+                {
+                    Logger.Error("Unable to generate recovery data");
+                    success = false;
+                    break;
+                }
+                recoveryPackets.emplace_back(recovery.Data, recovery.Data + recovery.DataBytes);
+            }
+        }
+
+        // Deliver them in a random order, so most land in the middle of the list
+        const unsigned recoveryCount = (unsigned)recoveryPackets.size();
+        for (unsigned j = recoveryCount; j > 1; --j) {
+            std::swap(recoveryPackets[j - 1], recoveryPackets[prng.Next() % j]);
+        }
+
+        for (unsigned j = 0; success && j < recoveryCount; ++j)
+        {
+            SiameseRecoveryPacket recovery;
+            recovery.Data = &recoveryPackets[j][0];
+            recovery.DataBytes = (unsigned)recoveryPackets[j].size();
+            if (siamese_decoder_add_recovery(decoder, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+
+            if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                continue;
+            }
+
+            SiameseOriginalPacket* packets;
+            unsigned count = 0;
+            if (siamese_decode(decoder, &packets, &count)) {
+                continue;
+            }
+
+            for (unsigned k = 0; k < count; ++k)
+            {
+                const unsigned i = packets[k].PacketNum;
+                if (i >= N || !missing[i] ||
+                    !CheckPacket(i, packets[k].Data, packets[k].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", i, " is wrong");
+                    success = false;
+                    break;
+                }
+                missing[i] = false;
+                --missingCount;
+                ++recoveredCount;
+            }
+        }
+
+        if (success && missingCount > 0)
+        {
+            Logger.Error("Trial ", trial, " did not recover ", missingCount, " packets");
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestDecoderRecoveryReorder: ", recoveredCount, " packets recovered");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestDecoderRecoveryDuplicates()
+{
+    Logger.Info("Test: TestDecoderRecoveryDuplicates");
+
+    static const unsigned N = 1000;
+    static const unsigned kLossRate = 10; // percent
+    static const unsigned kRecoveryCount = 200;
+    static const unsigned kCopies = 3;
+    static const unsigned kTrials = 20;
+
+    bool success = true;
+    unsigned recoveredCount = 0;
+    uint64_t solveFailCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        std::vector<bool> missing(N, false);
+        unsigned missingCount = 0;
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            if (i > 0 && prng.Next() % 100 < kLossRate)
+            {
+                missing[i] = true;
+                ++missingCount;
+            }
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+            }
+        }
+
+        // Every recovery packet is delivered several times in a row, so most
+        // rows in the decoder are linearly dependent on earlier ones
+        for (unsigned j = 0; success && j < kRecoveryCount; ++j)
+        {
+            SiameseRecoveryPacket encoded;
+            if (siamese_encode(encoder, &encoded))
+            {
+                Logger.Error("Unable to generate recovery data");
+                success = false;
+                break;
+            }
+            std::vector<uint8_t> copy(encoded.Data, encoded.Data + encoded.DataBytes);
+
+            for (unsigned k = 0; success && k < kCopies; ++k)
+            {
+                SiameseRecoveryPacket recovery;
+                recovery.Data = &copy[0];
+                recovery.DataBytes = (unsigned)copy.size();
+                if (siamese_decoder_add_recovery(decoder, &recovery))
+                {
+                    Logger.Error("Unable to add recovery data");
+                    success = false;
+                    break;
+                }
+
+                if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                    continue;
+                }
+
+                SiameseOriginalPacket* packets;
+                unsigned count = 0;
+                if (siamese_decode(decoder, &packets, &count)) {
+                    continue;
+                }
+
+                for (unsigned r = 0; r < count; ++r)
+                {
+                    const unsigned i = packets[r].PacketNum;
+                    if (i >= N || !missing[i] ||
+                        !CheckPacket(i, packets[r].Data, packets[r].DataBytes))
+                    {
+                        Logger.Error("Recovered packet ", i, " is wrong");
+                        success = false;
+                        break;
+                    }
+                    missing[i] = false;
+                    --missingCount;
+                    ++recoveredCount;
+                }
+            }
+        }
+
+        if (success && missingCount > 0)
+        {
+            Logger.Error("Trial ", trial, " did not recover ", missingCount, " packets");
+            success = false;
+        }
+
+        uint64_t stats[SiameseDecoderStats_Count];
+        if (success &&
+            siamese_decoder_stats(decoder, stats, SiameseDecoderStats_Count) == Siamese_Success)
+        {
+            solveFailCount += stats[SiameseDecoderStats_SolveFailCount];
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestDecoderRecoveryDuplicates: ", recoveredCount, " packets recovered with ",
+        solveFailCount, " failed solves");
+
+    // Repeated rows are known to be dependent once a solve fails, so they
+    // should not each trigger another failed solve
+    if (success && solveFailCount >= kTrials * kRecoveryCount / 4)
+    {
+        Logger.Error("Too many failed solves: ", solveFailCount);
+        success = false;
+    }
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestRecoveryListDelete()
+{
+    Logger.Info("Test: TestRecoveryListDelete");
+
+    static const unsigned kPacketCount = 64;
+    static const unsigned kTrials = 100;
+
+    bool success = true;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        pktalloc::Allocator allocator;
+        siamese::RecoveryMatrixState matrix;
+        matrix.TheAllocator = &allocator;
+        siamese::CheckedRegionState checkedRegion;
+        checkedRegion.RecoveryMatrix = &matrix;
+        siamese::RecoveryPacketList list;
+        list.TheAllocator = &allocator;
+        list.CheckedRegion = &checkedRegion;
+
+        // Few enough keys that most of them are shared by several packets,
+        // as they are when recovery rows are repeated
+        std::vector<siamese::RecoveryPacket*> live;
+        for (unsigned i = 0; i < kPacketCount; ++i)
+        {
+            siamese::RecoveryPacket* recovery = allocator.Construct<siamese::RecoveryPacket>();
+            if (!recovery)
+            {
+                Logger.Error("Construct failed");
+                success = false;
+                break;
+            }
+            recovery->ElementEnd = 8 + prng.Next() % 8;
+            recovery->Metadata.ColumnStart = prng.Next() % 3;
+            recovery->ElementStart = 0;
+            if (!list.Insert(recovery, true))
+            {
+                Logger.Error("Insert failed");
+                allocator.Destruct(recovery);
+                success = false;
+                break;
+            }
+            live.push_back(recovery);
+        }
+
+        // Delete from anywhere in the list, including the middle of a run
+        while (success && !live.empty())
+        {
+            const unsigned victim = prng.Next() % (unsigned)live.size();
+            list.Delete(live[victim]);
+            live.erase(live.begin() + victim);
+
+            if (list.RecoveryPacketCount != live.size() ||
+                list.Index.GetSize() != live.size())
+            {
+                Logger.Error("List count mismatch after delete");
+                success = false;
+                break;
+            }
+
+            // The linked list and the index must agree and stay sorted
+            siamese::RecoveryPacket* prev = nullptr;
+            siamese::RecoveryPacket* recovery = list.Head;
+            for (unsigned i = 0; i < live.size(); ++i, prev = recovery, recovery = recovery->Next)
+            {
+                if (!recovery ||
+                    recovery != list.Index.GetRef(i) ||
+                    recovery->Prev != prev ||
+                    std::find(live.begin(), live.end(), recovery) == live.end())
+                {
+                    Logger.Error("List order mismatch at index ", i);
+                    success = false;
+                    break;
+                }
+                if (!prev) {
+                    continue;
+                }
+                const unsigned startDelta = siamese::SubtractColumns(
+                    recovery->Metadata.ColumnStart, prev->Metadata.ColumnStart);
+                if (prev->ElementEnd > recovery->ElementEnd ||
+                    (prev->ElementEnd == recovery->ElementEnd &&
+                     startDelta != 0 && !siamese::IsColumnDeltaNegative(startDelta)))
+                {
+                    Logger.Error("List not sorted at index ", i);
+                    success = false;
+                    break;
+                }
+            }
+            if (success && (recovery || list.Tail != prev))
+            {
+                Logger.Error("List tail mismatch");
+                success = false;
+            }
+        }
+
+        // Anything left after a failure goes with the allocator
+    }
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestDecoderSmallSolve()
+{
+    Logger.Info("Test: TestDecoderSmallSolve");
+
+    static const unsigned kMaxN = 300;
+    static const unsigned kTrials = 2000;
+    static const unsigned kExtraRecovery = 8;
+
+    bool success = true;
+    unsigned recoveredCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        // Window sizes cover both Cauchy and Siamese rows
+        const unsigned N = 2 + prng.Next() % (kMaxN - 1);
+        const unsigned lossCount = 1 + trial % 2;
+
+        uint16_t losses[kMaxN];
+        ShuffleDeck16(prng, losses, N);
+
+        std::vector<bool> missing(N, false);
+        for (unsigned j = 0; j < lossCount; ++j) {
+            missing[losses[j]] = true;
+        }
+        unsigned missingCount = lossCount;
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        // Recover into application buffers for some of the trials
+        OutputBufferState state;
+        state.Packets.resize(N);
+        if (success && trial % 3 == 0 &&
+            siamese_decoder_set_output(decoder, OnOutputProvide, OnOutputRelease, &state))
+        {
+            Logger.Error("siamese_decoder_set_output failed");
+            success = false;
+        }
+
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+            }
+        }
+
+        for (unsigned j = 0; success && missingCount > 0 && j < lossCount + kExtraRecovery; ++j)
+        {
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(decoder, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+
+            if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                continue;
+            }
+
+            SiameseOriginalPacket* packets;
+            unsigned count = 0;
+            if (siamese_decode(decoder, &packets, &count)) {
+                continue;
+            }
+
+            for (unsigned k = 0; k < count; ++k)
+            {
+                const unsigned i = packets[k].PacketNum;
+                if (i >= N || !missing[i] ||
+                    !CheckPacket(i, packets[k].Data, packets[k].DataBytes))
+                {
+                    Logger.Error("Recovered packet ", i, " is wrong");
+                    success = false;
+                    break;
+                }
+                missing[i] = false;
+                --missingCount;
+                ++recoveredCount;
+            }
+        }
+
+        SiameseOriginalPacket original;
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            if (missing[i]) {
+                continue;
+            }
+
+            // All of the recovered packets should be readable by number
+            original.PacketNum = i;
+            if (siamese_decoder_get(decoder, &original) ||
+                !CheckPacket(i, original.Data, original.DataBytes))
+            {
+                Logger.Error("Trial ", trial, " could not read packet ", i);
+                success = false;
+            }
+        }
+
+        if (success && missingCount > 0)
+        {
+            Logger.Error("Trial ", trial, " did not recover ", missingCount, " of ", lossCount, " packets from N=", N);
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestDecoderSmallSolve: ", recoveredCount, " packets recovered");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+bool TestEncoderCauchyCrossover()
+{
+    Logger.Info("Test: TestEncoderCauchyCrossover");
+
+    static const unsigned kCount = 1200;
+    static const unsigned kMaxWindow = 120;
+    static const unsigned kMinWindow = 4;
+    static const unsigned kExtraRecovery = 20;
+    static const unsigned kCrossovers[] = {
+        SIAMESE_CAUCHY_CROSSOVER_AUTO, 1, 32, SIAMESE_CAUCHY_CROSSOVER_MAX
+    };
+
+    bool success = true;
+    unsigned recoveredCount = 0;
+
+    for (unsigned crossover : kCrossovers)
+    {
+        if (!success) {
+            break;
+        }
+
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, crossover);
+
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        if (success &&
+            (siamese_encoder_set_cauchy_crossover(encoder, SIAMESE_CAUCHY_CROSSOVER_MAX + 1) != Siamese_InvalidInput ||
+             siamese_encoder_set_cauchy_crossover(encoder, crossover) != Siamese_Success))
+        {
+            Logger.Error("siamese_encoder_set_cauchy_crossover failed for ", crossover);
+            success = false;
+        }
+
+        std::vector<bool> missing(kCount, false);
+        unsigned missingCount = 0;
+        unsigned firstMissing = 0;
+        unsigned firstKept = 0;
+        std::vector<uint8_t> data(2000);
+
+        for (unsigned i = 0; success && i < kCount; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
+
+            SiameseOriginalPacket original;
+            original.PacketNum = i;
+            original.Data = &data[0];
+            original.DataBytes = bytes;
+
+            missing[i] = (prng.Next() % 100 < 3);
+            if (missing[i]) {
+                ++missingCount;
+            }
+
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+            {
+                Logger.Error("Unable to add original data");
+                success = false;
+                break;
+            }
+
+            // Let the window grow past the Cauchy threshold so sums start,
+            // then sweep it down to a few packets so that the running sums
+            // meet the crossover on the way down
+            const unsigned sweep = kMaxWindow - kMinWindow;
+            const unsigned phase = i % (sweep * 2);
+            while (firstMissing <= i && !missing[firstMissing]) {
+                ++firstMissing;
+            }
+            unsigned keep = firstKept;
+            if (phase >= sweep)
+            {
+                const unsigned window = kMaxWindow - (phase - sweep);
+                if (i + 1 > window) {
+                    keep = i + 1 - window;
+                }
+            }
+            if (keep > firstMissing) {
+                keep = firstMissing;
+            }
+            if (keep > firstKept)
+            {
+                if (siamese_encoder_remove_before(encoder, keep))
+                {
+                    Logger.Error("siamese_encoder_remove_before failed");
+                    success = false;
+                    break;
+                }
+                firstKept = keep;
+            }
+
+            const bool lastPacket = (i == kCount - 1);
+            if (i % 4 != 3 && !lastPacket) {
+                continue;
+            }
+
+            for (unsigned j = 0; success && j < (lastPacket ? kExtraRecovery : 1); ++j)
+            {
+                SiameseRecoveryPacket recovery;
+                if (siamese_encode(encoder, &recovery) ||
+                    siamese_decoder_add_recovery(decoder, &recovery))
+                {
+                    Logger.Error("Unable to add recovery data");
+                    success = false;
+                    break;
+                }
+
+                if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                    continue;
+                }
+
+                SiameseOriginalPacket* packets;
+                unsigned count = 0;
+                if (siamese_decode(decoder, &packets, &count)) {
+                    continue;
+                }
+
+                for (unsigned k = 0; k < count; ++k)
+                {
+                    const unsigned n = packets[k].PacketNum;
+                    if (n > i || !missing[n] ||
+                        !CheckPacket(n, packets[k].Data, packets[k].DataBytes))
+                    {
+                        Logger.Error("Recovered packet ", n, " is wrong");
+                        success = false;
+                        break;
+                    }
+                    missing[n] = false;
+                    --missingCount;
+                    ++recoveredCount;
+                }
+            }
+        }
+
+        if (success && missingCount > 0)
+        {
+            Logger.Error("Crossover ", crossover, " did not recover ", missingCount, " packets");
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestEncoderCauchyCrossover: ", recoveredCount, " packets recovered");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+/// Replace the encoder with a new one restored from its snapshot
+static bool MoveEncoder(SiameseEncoder& encoder)
+{
+    unsigned bytes = 0, usedBytes = 0;
+    if (siamese_encoder_snapshot(encoder, nullptr, 0, &bytes) != Siamese_NeedMoreData || bytes == 0) {
+        return false;
+    }
+    std::vector<uint8_t> snapshot(bytes);
+    if (siamese_encoder_snapshot(encoder, &snapshot[0], bytes, &usedBytes) || usedBytes != bytes) {
+        return false;
+    }
+
+    SiameseEncoder restored = siamese_encoder_create();
+    if (!restored || siamese_encoder_restore(restored, &snapshot[0], bytes))
+    {
+        siamese_encoder_free(restored);
+        return false;
+    }
+
+    // The snapshot must not reference the old encoder or its own buffer
+    siamese_encoder_free(encoder);
+    std::fill(snapshot.begin(), snapshot.end(), (uint8_t)0xfe);
+    encoder = restored;
+    return true;
+}
+
+/// Replace the decoder with a new one restored from its snapshot
+static bool MoveDecoder(SiameseDecoder& decoder)
+{
+    unsigned bytes = 0, usedBytes = 0;
+    if (siamese_decoder_snapshot(decoder, nullptr, 0, &bytes) != Siamese_NeedMoreData || bytes == 0) {
+        return false;
+    }
+    std::vector<uint8_t> snapshot(bytes);
+    if (siamese_decoder_snapshot(decoder, &snapshot[0], bytes, &usedBytes) || usedBytes != bytes) {
+        return false;
+    }
+
+    SiameseDecoder restored = siamese_decoder_create();
+    if (!restored || siamese_decoder_restore(restored, &snapshot[0], bytes))
+    {
+        siamese_decoder_free(restored);
+        return false;
+    }
+
+    siamese_decoder_free(decoder);
+    std::fill(snapshot.begin(), snapshot.end(), (uint8_t)0xfe);
+    decoder = restored;
+    return true;
+}
+
+/// Check that bad snapshots and restores are rejected without breaking the codecs
+static bool TestSnapshotErrors(SiameseEncoder encoder, SiameseDecoder decoder)
+{
+    unsigned encoderBytes = 0, decoderBytes = 0, usedBytes = 0;
+    if (siamese_encoder_snapshot(encoder, nullptr, 0, &encoderBytes) != Siamese_NeedMoreData ||
+        siamese_decoder_snapshot(decoder, nullptr, 0, &decoderBytes) != Siamese_NeedMoreData ||
+        encoderBytes <= 12 || decoderBytes <= 12)
+    {
+        Logger.Error("Snapshot size query failed");
+        return false;
+    }
+
+    std::vector<uint8_t> encoderSnapshot(encoderBytes), decoderSnapshot(decoderBytes);
+    if (siamese_encoder_snapshot(encoder, &encoderSnapshot[0], encoderBytes - 1, &usedBytes) != Siamese_NeedMoreData ||
+        usedBytes != encoderBytes ||
+        siamese_encoder_snapshot(encoder, &encoderSnapshot[0], encoderBytes, &usedBytes) ||
+        siamese_decoder_snapshot(decoder, &decoderSnapshot[0], decoderBytes, &usedBytes) ||
+        siamese_encoder_snapshot(nullptr, &encoderSnapshot[0], encoderBytes, &usedBytes) != Siamese_InvalidInput ||
+        siamese_encoder_snapshot(encoder, &encoderSnapshot[0], encoderBytes, nullptr) != Siamese_InvalidInput)
+    {
+        Logger.Error("Snapshot failed");
+        return false;
+    }
+
+    // Codecs that are already in use cannot be restored
+    if (siamese_encoder_restore(encoder, &encoderSnapshot[0], encoderBytes) != Siamese_InvalidInput ||
+        siamese_decoder_restore(decoder, &decoderSnapshot[0], decoderBytes) != Siamese_InvalidInput)
+    {
+        Logger.Error("Restore into a codec in use was accepted");
+        return false;
+    }
+
+    SiameseEncoder restoredEncoder = siamese_encoder_create();
+    SiameseDecoder restoredDecoder = siamese_decoder_create();
+    bool success = true;
+
+    // A bad header is rejected before anything is restored, so the codecs
+    // can still be restored afterwards.  Truncating the data changes the size
+    // in the header, and each snapshot has a different magic number
+    if (siamese_encoder_restore(restoredEncoder, &encoderSnapshot[0], encoderBytes - 1) != Siamese_InvalidInput ||
+        siamese_decoder_restore(restoredDecoder, &decoderSnapshot[0], decoderBytes - 1) != Siamese_InvalidInput ||
+        siamese_encoder_restore(restoredEncoder, &decoderSnapshot[0], decoderBytes) != Siamese_InvalidInput ||
+        siamese_decoder_restore(restoredDecoder, &encoderSnapshot[0], encoderBytes) != Siamese_InvalidInput ||
+        siamese_encoder_restore(restoredEncoder, &encoderSnapshot[0], encoderBytes) ||
+        siamese_decoder_restore(restoredDecoder, &decoderSnapshot[0], decoderBytes))
+    {
+        Logger.Error("Restore after a bad header failed");
+        success = false;
+    }
+    siamese_encoder_free(restoredEncoder);
+    siamese_decoder_free(restoredDecoder);
+
+    // Truncated data with a matching header disables the restored codec
+    const unsigned truncatedEncoderBytes = encoderBytes - 5;
+    const unsigned truncatedDecoderBytes = decoderBytes - 5;
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        encoderSnapshot[8 + i] = (uint8_t)(truncatedEncoderBytes >> (i * 8));
+        decoderSnapshot[8 + i] = (uint8_t)(truncatedDecoderBytes >> (i * 8));
+    }
+
+    restoredEncoder = siamese_encoder_create();
+    restoredDecoder = siamese_decoder_create();
+    SiameseRecoveryPacket recovery;
+    if (success &&
+        (siamese_encoder_restore(restoredEncoder, &encoderSnapshot[0], truncatedEncoderBytes) != Siamese_InvalidInput ||
+         siamese_decoder_restore(restoredDecoder, &decoderSnapshot[0], truncatedDecoderBytes) != Siamese_InvalidInput ||
+         siamese_encode(restoredEncoder, &recovery) != Siamese_Disabled ||
+         siamese_decoder_is_ready(restoredDecoder) != Siamese_Disabled))
+    {
+        Logger.Error("Truncated snapshot was not rejected");
+        success = false;
+    }
+    siamese_encoder_free(restoredEncoder);
+    siamese_decoder_free(restoredDecoder);
+
+    return success;
+}
+
+bool TestCodecSnapshot()
+{
+    Logger.Info("Test: TestCodecSnapshot");
+
+    static const unsigned N = 2000;
+    static const unsigned kTrials = 20;
+    static const unsigned kLossPercent = 5;
+    static const unsigned kRecoveryInterval = 8;
+    static const unsigned kAckInterval = 32;
+    static const unsigned kMoveInterval = 500;
+    static const unsigned kMaxFlushRecovery = 200;
+
+    bool success = true;
+    unsigned moveCount = 0;
+
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
+    {
+        siamese::PCGRandom prng;
+        prng.Seed(kSeed, trial);
+
+        // The reference encoder sees the same data and acknowledgements but is
+        // never moved, so the moved encoder must produce the same recovery data
+        SiameseEncoder encoder   = siamese_encoder_create();
+        SiameseEncoder reference = siamese_encoder_create();
+        SiameseDecoder decoder   = siamese_decoder_create();
+        if (!encoder || !reference || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+        }
+
+        std::vector<bool> missing(N, false);
+        unsigned missingCount = 0;
+        std::vector<uint8_t> data(2000);
+        const unsigned moveOffset = (trial * 37) % kMoveInterval;
+
+        for (unsigned i = 0; success && i < N + kMaxFlushRecovery * kRecoveryInterval; ++i)
+        {
+            if (i >= N && missingCount == 0) {
+                break;
+            }
+
+            if (i < N && i % kMoveInterval == moveOffset)
+            {
+                if (trial == 0 && moveCount == 1 && !TestSnapshotErrors(encoder, decoder))
+                {
+                    success = false;
+                    break;
+                }
+
+                // The restored decoder must acknowledge the same packets
+                uint8_t ackBefore[SIAMESE_ACK_MIN_BYTES + 256], ackAfter[SIAMESE_ACK_MIN_BYTES + 256];
+                unsigned ackBytesBefore = 0, ackBytesAfter = 0;
+                const SiameseResult ackResultBefore = siamese_decoder_ack(decoder, ackBefore, sizeof(ackBefore), &ackBytesBefore);
+
+                if (!MoveEncoder(encoder) || !MoveDecoder(decoder))
+                {
+                    Logger.Error("Unable to move the codecs at packet ", i);
+                    success = false;
+                    break;
+                }
+                ++moveCount;
+
+                if (siamese_decoder_ack(decoder, ackAfter, sizeof(ackAfter), &ackBytesAfter) != ackResultBefore ||
+                    ackBytesAfter != ackBytesBefore ||
+                    0 != memcmp(ackBefore, ackAfter, ackBytesBefore))
+                {
+                    Logger.Error("Restored decoder acknowledges different data");
+                    success = false;
+                    break;
+                }
+            }
+
+            if (i < N)
+            {
+                unsigned bytes = GetPacketBytes(i);
+                SetPacket(i, &data[0], bytes);
+
+                SiameseOriginalPacket original;
+                original.PacketNum = i;
+                original.Data = &data[0];
+                original.DataBytes = bytes;
+
+                const bool lost = (prng.Next() % 100 < kLossPercent);
+                SiameseOriginalPacket referenceOriginal = original;
+                if (siamese_encoder_add(encoder, &original) ||
+                    siamese_encoder_add(reference, &referenceOriginal) ||
+                    original.PacketNum != referenceOriginal.PacketNum ||
+                    (!lost && siamese_decoder_add_original(decoder, &original)))
+                {
+                    Logger.Error("Unable to add original data");
+                    success = false;
+                    break;
+                }
+                if (lost)
+                {
+                    missing[i] = true;
+                    ++missingCount;
+                }
+            }
+
+            if (i % kRecoveryInterval == kRecoveryInterval - 1)
+            {
+                SiameseRecoveryPacket recovery, referenceRecovery;
+                if (siamese_encode(encoder, &recovery) ||
+                    siamese_encode(reference, &referenceRecovery) ||
+                    recovery.DataBytes != referenceRecovery.DataBytes ||
+                    0 != memcmp(recovery.Data, referenceRecovery.Data, recovery.DataBytes))
+                {
+                    Logger.Error("Moved encoder produced different recovery data at packet ", i);
+                    success = false;
+                    break;
+                }
+
+                if (siamese_decoder_add_recovery(decoder, &recovery))
+                {
+                    Logger.Error("Unable to add recovery data");
+                    success = false;
+                    break;
+                }
+
+                while (success && siamese_decoder_is_ready(decoder) == Siamese_Success)
+                {
+                    SiameseOriginalPacket* packets;
+                    unsigned count = 0;
+                    if (siamese_decode(decoder, &packets, &count)) {
+                        break;
+                    }
+
+                    for (unsigned k = 0; k < count; ++k)
+                    {
+                        const unsigned id = packets[k].PacketNum;
+                        if (id >= N || !missing[id] ||
+                            !CheckPacket(id, packets[k].Data, packets[k].DataBytes))
+                        {
+                            Logger.Error("Recovered packet ", id, " is wrong");
+                            success = false;
+                            break;
+                        }
+                        missing[id] = false;
+                        --missingCount;
+                    }
+                }
+            }
+
+            if (success && i < N && i % kAckInterval == kAckInterval - 1)
+            {
+                uint8_t ack[SIAMESE_ACK_MIN_BYTES + 256];
+                unsigned ackBytes = 0, nextExpected = 0, referenceNextExpected = 0;
+                if (siamese_decoder_ack(decoder, ack, sizeof(ack), &ackBytes) == Siamese_Success &&
+                    (siamese_encoder_ack(encoder, ack, ackBytes, &nextExpected) ||
+                     siamese_encoder_ack(reference, ack, ackBytes, &referenceNextExpected) ||
+                     nextExpected != referenceNextExpected))
+                {
+                    Logger.Error("Acknowledgement failed");
+                    success = false;
+                }
+            }
+        }
+
+        if (success && missingCount != 0)
+        {
+            Logger.Error("Recovery did not finish: ", missingCount, " packets missing");
+            success = false;
+        }
+
+        siamese_encoder_free(encoder);
+        siamese_encoder_free(reference);
+        siamese_decoder_free(decoder);
+    }
+
+    Logger.Info("TestCodecSnapshot: Moved the codecs ", moveCount, " times");
+
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+    return true;
+}
+
+/// Decode what is available and check the recovered packets
+static bool DecodeAndCheck(SiameseDecoder decoder, std::vector<bool>& missing, unsigned& missingCount)
+{
+    if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+        return true;
+    }
+
+    SiameseOriginalPacket* packets;
+    unsigned count = 0;
+    if (siamese_decode(decoder, &packets, &count)) {
+        return true;
+    }
+
+    for (unsigned k = 0; k < count; ++k)
+    {
+        const unsigned n = packets[k].PacketNum;
+        if (n >= missing.size() || !missing[n] ||
+            !CheckPacket(n, packets[k].Data, packets[k].DataBytes))
+        {
+            Logger.Error("Recovered packet ", n, " is wrong");
+            return false;
+        }
+        missing[n] = false;
+        --missingCount;
+    }
+    return true;
+}
+
+bool TestDecoderLazySums()
+{
+    Logger.Info("Test: TestDecoderLazySums");
+
+    static const unsigned kCount = 6000;
+    static const unsigned kCleanCount = 3000;
+    static const unsigned kWindow = 400;
+    static const unsigned kLossRate = 2; // percent
+
+    bool success = true;
+
+    siamese::PCGRandom prng;
+    prng.Seed(kSeed, 30);
+
+    SiameseEncoder encoder = siamese_encoder_create();
+    SiameseDecoder eager = siamese_decoder_create();
+    SiameseDecoder lazy = siamese_decoder_create();
+    if (!encoder || !eager || !lazy)
+    {
+        Logger.Error("Unable to create codec");
+        success = false;
+    }
+
+    if (success &&
+        (siamese_decoder_set_lazy_sums(lazy, SIAMESE_MAX_PACKETS + 1) != Siamese_InvalidInput ||
+         siamese_decoder_set_lazy_sums(lazy, SIAMESE_MAX_PACKETS) != Siamese_Success))
+    {
+        Logger.Error("siamese_decoder_set_lazy_sums failed");
+        success = false;
+    }
+
+    std::vector<bool> lost(kCount, false);
+    std::vector<bool> eagerMissing(kCount, false), lazyMissing(kCount, false);
+    unsigned eagerMissingCount = 0, lazyMissingCount = 0;
+    unsigned firstMissing = 0;
+    unsigned firstKept = 0;
+    std::vector<uint8_t> data(2000);
+    uint64_t eagerStats[SiameseDecoderStats_Count];
+    uint64_t lazyStats[SiameseDecoderStats_Count];
+
+    for (unsigned i = 0; success && i < kCount; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
+
+        SiameseOriginalPacket original;
+        original.PacketNum = i;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
+
+        if (i >= kCleanCount && prng.Next() % 100 < kLossRate)
+        {
+            lost[i] = eagerMissing[i] = lazyMissing[i] = true;
+            ++eagerMissingCount;
+            ++lazyMissingCount;
+        }
+
+        if (siamese_encoder_add(encoder, &original) ||
+            (!lost[i] && siamese_decoder_add_original(eager, &original)) ||
+            (!lost[i] && siamese_decoder_add_original(lazy, &original)))
+        {
+            Logger.Error("Unable to add original data");
+            success = false;
+            break;
+        }
+
+        // Keep enough packets in flight for the encoder to run long sums
+        while (firstMissing <= i && !eagerMissing[firstMissing] && !lazyMissing[firstMissing]) {
+            ++firstMissing;
+        }
+        unsigned keep = (i + 1 > kWindow) ? i + 1 - kWindow : 0;
+        if (keep > firstMissing) {
+            keep = firstMissing;
+        }
+        if (keep > firstKept)
+        {
+            if (siamese_encoder_remove_before(encoder, keep))
+            {
+                Logger.Error("siamese_encoder_remove_before failed");
+                success = false;
+                break;
+            }
+            firstKept = keep;
+        }
+
+        if (i % 4 == 3)
+        {
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(eager, &recovery) ||
+                siamese_decoder_add_recovery(lazy, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+
+            if (!DecodeAndCheck(eager, eagerMissing, eagerMissingCount) ||
+                !DecodeAndCheck(lazy, lazyMissing, lazyMissingCount))
+            {
+                success = false;
+                break;
+            }
+        }
+
+        // While nothing was lost the lazy decoder should not sum anything
+        if (i == kCleanCount - 1)
+        {
+            if (siamese_decoder_stats(eager, eagerStats, SiameseDecoderStats_Count) ||
+                siamese_decoder_stats(lazy, lazyStats, SiameseDecoderStats_Count))
+            {
+                Logger.Error("siamese_decoder_stats failed");
+                success = false;
+                break;
+            }
+
+            Logger.Info("TestDecoderLazySums: Loss-free sums added: eager ",
+                eagerStats[SiameseDecoderStats_SumAddCount], " lazy ",
+                lazyStats[SiameseDecoderStats_SumAddCount]);
+
+            if (eagerStats[SiameseDecoderStats_SumAddCount] == 0 ||
+                lazyStats[SiameseDecoderStats_SumAddCount] != 0)
+            {
+                Logger.Error("Lazy sums were not skipped on the loss-free stream");
+                success = false;
+                break;
+            }
+
+            // Going over the memory budget should sum the unsummed data
+            // rather than disabling the decoder, and the stream carries on
+            if (siamese_decoder_set_memory_budget(lazy, 1000 * 1000) ||
+                siamese_decoder_stats(lazy, lazyStats, SiameseDecoderStats_Count) ||
+                lazyStats[SiameseDecoderStats_SumAddCount] == 0 ||
+                siamese_decoder_set_memory_budget(lazy, 0))
+            {
+                Logger.Error("Lazy sums were not summed to meet the memory budget");
+                success = false;
+            }
+        }
+    }
+
+    if (success && (eagerMissingCount > 0 || lazyMissingCount > 0))
     {
-        SiameseOriginalPacket original;
-        original.PacketNum = NextExpectedPacket;
+        Logger.Error("Did not recover ", eagerMissingCount, " eager and ", lazyMissingCount, " lazy packets");
+        success = false;
+    }
+
+    if (success &&
+        (siamese_decoder_stats(eager, eagerStats, SiameseDecoderStats_Count) ||
+         siamese_decoder_stats(lazy, lazyStats, SiameseDecoderStats_Count)))
+    {
+        Logger.Error("siamese_decoder_stats failed");
+        success = false;
+    }
 
-        t_siamese_decode.BeginCall();
-        int getResult = siamese_decoder_get(decoder, &original);
-        t_siamese_decode.EndCall();
+    if (success)
+    {
+        Logger.Info("TestDecoderLazySums: Sums added: eager ",
+            eagerStats[SiameseDecoderStats_SumAddCount], " lazy ",
+            lazyStats[SiameseDecoderStats_SumAddCount], ". Memory used: eager ",
+            eagerStats[SiameseDecoderStats_MemoryUsed], " lazy ",
+            lazyStats[SiameseDecoderStats_MemoryUsed]);
 
-        if (getResult != Siamese_Success)
-            break;
+        if (lazyStats[SiameseDecoderStats_SumAddCount] > eagerStats[SiameseDecoderStats_SumAddCount])
+        {
+            Logger.Error("Lazy sums added more data than eager sums");
+            success = false;
+        }
+    }
+
+    siamese_encoder_free(encoder);
+    siamese_decoder_free(eager);
+    siamese_decoder_free(lazy);
 
-        ServerSimulateProcessingOriginal(original);
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
     }
+
+    return true;
 }
 
-void HARQSimulation::ServerCheckRecovery()
+static bool RunPooledSession(SiameseMemoryPool pool, unsigned session)
 {
-    for (;;)
+    static const unsigned N = 300;
+    static const unsigned kLosses = 10;
+
+    SiameseEncoder encoder = siamese_encoder_create_pooled(pool);
+    SiameseDecoder decoder = siamese_decoder_create_pooled(pool);
+    if (!encoder || !decoder)
+    {
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+        return false;
+    }
+
+    bool success = true;
+
+    // Idle codecs should not hold any memory
+    uint64_t stats[SiameseEncoderStats_Count];
+    if (siamese_encoder_stats(encoder, stats, SiameseEncoderStats_Count) ||
+        stats[SiameseEncoderStats_MemoryUsed] != 0)
     {
-        t_siamese_decoder_is_ready.BeginCall();
-        int readyResult = siamese_decoder_is_ready(decoder);
-        t_siamese_decoder_is_ready.EndCall();
+        success = false;
+    }
 
-        if (readyResult)
-        {
-            SIAMESE_DEBUG_ASSERT(readyResult == Siamese_NeedMoreData);
-            break;
-        }
+    uint16_t losses[N];
+    siamese::PCGRandom prng;
+    prng.Seed(kSeed, session);
+    ShuffleDeck16(prng, losses, N);
+    std::vector<bool> missing(N, false);
+    for (unsigned j = 0; j < kLosses; ++j) {
+        missing[losses[j]] = true;
+    }
+    unsigned missingCount = kLosses;
 
-        SiameseOriginalPacket* recoveredOriginals;
-        unsigned recoveredOriginalCount;
+    std::vector<uint8_t> data(2000);
 
-        // Attempt to decode
-        // Note we do not request the list of decoded packets because we only process
-        // data in order.  Protocols that process data out of order may find that useful
-        t_siamese_decode.BeginCall();
-        int decodeResult = siamese_decode(decoder, &recoveredOriginals, &recoveredOriginalCount);
-        t_siamese_decode.EndCall();
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
 
-        if (decodeResult == Siamese_Success)
-        {
-            // Resume processing data
-            ServerResumeProcessing();
+        SiameseOriginalPacket original;
+        original.PacketNum = i;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
 
-            ++RecoverySuccessCount;
-            RecoveredPacketCount += recoveredOriginalCount;
+        if (siamese_encoder_add(encoder, &original) ||
+            (!missing[i] && siamese_decoder_add_original(decoder, &original)))
+        {
+            success = false;
         }
-        else if (decodeResult == Siamese_NeedMoreData)
+    }
+
+    for (unsigned j = 0; success && missingCount > 0; ++j)
+    {
+        SiameseRecoveryPacket recovery;
+        if (j >= kLosses * 2 ||
+            siamese_encode(encoder, &recovery) ||
+            siamese_decoder_add_recovery(decoder, &recovery))
         {
-            Logger.Trace("** Recovery failed and needs more data (rare)");
-            ++RecoveryFailCount;
+            success = false;
+            break;
         }
-        else
+
+        if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+            continue;
+        }
+
+        SiameseOriginalPacket* packets;
+        unsigned count = 0;
+        if (siamese_decode(decoder, &packets, &count)) {
+            continue;
+        }
+
+        for (unsigned k = 0; k < count; ++k)
         {
-            UnrecoverableError = true;
-            Logger.Error("Unexpected siamese decode error result: ", decodeResult);
-            SIAMESE_DEBUG_BREAK();
-            return;
+            const unsigned i = packets[k].PacketNum;
+            if (i >= N || !missing[i] ||
+                !CheckPacket(i, packets[k].Data, packets[k].DataBytes))
+            {
+                success = false;
+                break;
+            }
+            missing[i] = false;
+            --missingCount;
         }
     }
+
+    if (siamese_encoder_stats(encoder, stats, SiameseEncoderStats_Count) ||
+        stats[SiameseEncoderStats_PoolMemoryUsed] < stats[SiameseEncoderStats_MemoryUsed])
+    {
+        success = false;
+    }
+
+    siamese_encoder_free(encoder);
+    siamese_decoder_free(decoder);
+    return success;
 }
 
-void HARQSimulation::ServerOnRecovery(SiameseRecoveryPacket& recovery)
+static bool RunPooledSessions(SiameseMemoryPool pool, unsigned threadCount, unsigned sessionsPerThread)
 {
-    t_siamese_decoder_add_recovery.BeginCall();
-    int result = siamese_decoder_add_recovery(decoder, &recovery);
-    t_siamese_decoder_add_recovery.EndCall();
-
-    if (result)
+    // Sessions on different threads take memory from the same pool
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < threadCount; ++t)
     {
-        UnrecoverableError = true;
-        Logger.Error("Unable add recovery data to encoder: ", result);
-        SIAMESE_DEBUG_BREAK();
-        return;
+        threads.push_back(std::thread([&failed, pool, t, sessionsPerThread]()
+        {
+            for (unsigned i = 0; i < sessionsPerThread && !failed; ++i)
+            {
+                if (!RunPooledSession(pool, t * sessionsPerThread + i)) {
+                    failed = true;
+                }
+            }
+        }));
     }
-
-    ServerCheckRecovery();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return !failed;
 }
 
-void HARQSimulation::ServerSimulateProcessingOriginal(SiameseOriginalPacket& original)
+bool TestMemoryPool()
 {
-    if (!CheckPacket(original.PacketNum, original.Data, original.DataBytes))
+    Logger.Info("Test: TestMemoryPool");
+
+    SiameseMemoryPool pool = siamese_memory_pool_create(0);
+    if (!pool)
     {
-        UnrecoverableError = true;
-        Logger.Error("Data was corrupted");
-        SIAMESE_DEBUG_BREAK();
-        return;
+        Logger.Error("Unable to create pool");
+        return false;
     }
 
-    // If this is the next packet in sequence:
-    if (original.PacketNum != NextExpectedPacket)
+    bool success = RunPooledSessions(pool, 4, 50);
+
+    siamese_memory_pool_free(pool);
+
+    if (!success)
     {
-        UnrecoverableError = true;
-        Logger.Error("Received data out of order");
+        Logger.Error("Pooled session failed");
         SIAMESE_DEBUG_BREAK();
-        return;
+        return false;
     }
 
-    SIAMESE_DEBUG_ASSERT(Timestamps.size() > original.PacketNum);
-    const uint64_t tsUsec = Timestamps[original.PacketNum];
-    const uint64_t nowUsec = siamese::GetTimeUsec();
-    SIAMESE_DEBUG_ASSERT(nowUsec > tsUsec);
-    const unsigned deltaUsec = (unsigned)(nowUsec - tsUsec);
+    // Huge pages on NUMA node 0, which falls back if either is unavailable
+    pool = siamese_memory_pool_create_ex(0, SIAMESE_MEMORY_POOL_HUGE_PAGES, 0);
+    if (!pool)
+    {
+        Logger.Error("Unable to create mapped pool");
+        return false;
+    }
 
-    UsecDeltas.push_back(deltaUsec);
+    success = RunPooledSessions(pool, 2, 20);
 
-    NextExpectedPacket = SIAMESE_PACKET_NUM_INC(NextExpectedPacket);
-    Logger.Trace("Received in sequence: ", original.PacketNum, " OWD = ", deltaUsec);
+    // Packets too large for a window are carved out of the chunks, here for
+    // an encoder with its own placement in the same pool
+    SiameseEncoder encoder = siamese_encoder_create_pooled_ex(pool, 0, 0);
+    if (!encoder)
+    {
+        Logger.Error("Unable to create encoder with its own placement");
+        success = false;
+    }
+    std::vector<uint8_t> data(40000);
+    for (unsigned i = 0; success && i < 10; ++i)
+    {
+        SetPacket(i, &data[0], (unsigned)data.size());
 
-    // Note: Do not call any decoder functions here
-    // because the original packet hasn't been added yet
-}
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = (unsigned)data.size();
 
-void HARQSimulation::ServerOnOriginal(SiameseOriginalPacket& original)
-{
-    // If this is the next packet in sequence:
-    if (original.PacketNum == NextExpectedPacket)
+        SiameseRecoveryPacket recovery;
+        if (siamese_encoder_add(encoder, &original) ||
+            (i > 0 && siamese_encode(encoder, &recovery)))
+        {
+            success = false;
+        }
+    }
+    siamese_encoder_free(encoder);
+
+    siamese_memory_pool_free(pool);
+
+    if (!success)
+    {
+        Logger.Error("Mapped pool session failed");
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+
+#ifndef SIAMESE_DEBUG // Out of memory paths debug break
+    // A codec that runs into the pool memory limit must disable itself
+    static const uint64_t kLimitBytes = 256 * 1000;
+
+    pool = siamese_memory_pool_create(kLimitBytes);
+    encoder = siamese_encoder_create_pooled(pool);
+    if (!pool || !encoder)
     {
-        ServerSimulateProcessingOriginal(original);
+        Logger.Error("Unable to create limited pool");
+        siamese_encoder_free(encoder);
+        siamese_memory_pool_free(pool);
+        return false;
     }
 
-    t_siamese_decoder_add_original.BeginCall();
-    int result = siamese_decoder_add_original(decoder, &original);
-    t_siamese_decoder_add_original.EndCall();
-    if (result == Siamese_Success)
+    success = false;
+    data.resize(1000);
+    for (unsigned i = 0; i < 1000; ++i)
     {
-        // Process any data we can without recovery
-        ServerResumeProcessing();
+        SetPacket(i, &data[0], (unsigned)data.size());
+
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = (unsigned)data.size();
 
-        // Check if we can recover now
-        ServerCheckRecovery();
+        if (siamese_encoder_add(encoder, &original) != Siamese_Success)
+        {
+            success = true;
+            break;
+        }
     }
-    else if (result == Siamese_DuplicateData)
+
+    uint64_t stats[SiameseEncoderStats_Count];
+    if (siamese_encoder_stats(encoder, stats, SiameseEncoderStats_Count) ||
+        stats[SiameseEncoderStats_PoolMemoryUsed] > kLimitBytes)
     {
-        Logger.Trace("Received duplicated data: ", original.PacketNum);
-        ++DuplicateOriginalsReceived;
+        success = false;
     }
-    else
+
+    siamese_encoder_free(encoder);
+    siamese_memory_pool_free(pool);
+
+    if (!success)
     {
-        UnrecoverableError = true;
-        Logger.Error("Unable to add original data to decoder");
-        SIAMESE_DEBUG_BREAK();
-        return;
+        Logger.Error("Memory limit was not enforced");
+        return false;
     }
+#endif // SIAMESE_DEBUG
+
+    return true;
 }
 
-void HARQSimulation::Run(unsigned seed)
+static bool FillBudgetedEncoder(SiameseEncoder encoder, unsigned& nextPacketNum, unsigned& addedCount)
 {
-    prngLoss.Seed(seed);
-    prngPacketData.Seed(seed + 2);
-    prngLength.Seed(seed + 1);
+    std::vector<uint8_t> data(1000);
+    bool sawBackpressure = false;
+    addedCount = 0;
 
-    t_siamese_encoder_create.BeginCall();
-    encoder = siamese_encoder_create();
-    t_siamese_encoder_create.EndCall();
-
-    if (!encoder)
+    for (;;)
     {
-        UnrecoverableError = true;
-        Logger.Error("Unable to create encoder");
-        SIAMESE_DEBUG_BREAK();
-        return;
+        SetPacket(nextPacketNum, &data[0], (unsigned)data.size());
+
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = (unsigned)data.size();
+
+        const SiameseResult result = siamese_encoder_add(encoder, &original);
+        if (result == Siamese_MaxPacketsReached) {
+            break;
+        }
+        if (result != Siamese_Success && result != Siamese_Backpressure)
+        {
+            Logger.Error("Unexpected add result ", result);
+            return false;
+        }
+        if (original.PacketNum != nextPacketNum)
+        {
+            Logger.Error("Wrong packet number");
+            return false;
+        }
+        ++nextPacketNum;
+        ++addedCount;
+
+        if (result == Siamese_Backpressure)
+        {
+            sawBackpressure = true;
+            if (siamese_encoder_is_ready(encoder) != Siamese_Backpressure)
+            {
+                Logger.Error("is_ready did not report backpressure");
+                return false;
+            }
+        }
+        else if (sawBackpressure)
+        {
+            Logger.Error("Backpressure went away without removing data");
+            return false;
+        }
+
+        if (addedCount > 1000)
+        {
+            Logger.Error("Budget was not enforced");
+            return false;
+        }
     }
 
-    t_siamese_decoder_create.BeginCall();
-    decoder = siamese_decoder_create();
-    t_siamese_decoder_create.EndCall();
+    return sawBackpressure;
+}
 
-    if (!decoder)
+static bool TestEncoderMemoryBudget(bool useAddQueue)
+{
+    static const uint64_t kBudgetBytes = 200 * 1000;
+
+    SiameseEncoder encoder = siamese_encoder_create();
+    if (!encoder ||
+        (useAddQueue && siamese_encoder_set_add_queue(encoder, 1024)) ||
+        siamese_encoder_set_memory_budget(encoder, kBudgetBytes))
     {
-        UnrecoverableError = true;
-        Logger.Error("Unable to create decoder");
-        SIAMESE_DEBUG_BREAK();
-        return;
+        siamese_encoder_free(encoder);
+        return false;
     }
 
-    NextExpectedPacket = 0;
+    unsigned nextPacketNum = 0, addedCount = 0;
+    bool success = FillBudgetedEncoder(encoder, nextPacketNum, addedCount);
 
-    while (!c2sRounds.empty())
-        c2sRounds.pop();
-    while (!s2cRounds.empty())
-        s2cRounds.pop();
+    // The budget covers the data plus sums, so it holds fewer packets
+    if (success && addedCount * 1000 > kBudgetBytes) {
+        success = false;
+    }
 
-    c2sRound.Packets.clear();
-    s2cRound.Packets.clear();
+    // Acknowledging some of the data makes room without encoding
+    if (success && !useAddQueue)
+    {
+        siamese_encoder_remove_before(encoder, 100);
 
-    uint64_t simStartMsec = siamese::GetTimeMsec();
+        std::vector<uint8_t> data(1000);
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = (unsigned)data.size();
+        if (siamese_encoder_add(encoder, &original) == Siamese_MaxPacketsReached) {
+            success = false;
+        }
+        else {
+            ++nextPacketNum;
+        }
+    }
 
-    for (loopCount = 0;; ++loopCount, c2sRounds.push(c2sRound), s2cRounds.push(s2cRound))
+    // Acknowledging all of the data lets it accept more
+    if (success)
     {
-        if (UnrecoverableError)
-        {
-            Logger.Error("Aborting simulation on unrecoverable error");
-            break;
-        }
+        siamese_encoder_remove_before(encoder, nextPacketNum);
+
+        SiameseRecoveryPacket recovery;
+        siamese_encode(encoder, &recovery);
 
-        if (NextExpectedPacket >= kLastPacket)
+        if (siamese_encoder_is_ready(encoder) != Siamese_Success ||
+            !FillBudgetedEncoder(encoder, nextPacketNum, addedCount))
         {
-            Logger.Info("Ending simulation after ", NextExpectedPacket, " packets were received");
-            break;
+            success = false;
         }
+    }
+
+    siamese_encoder_free(encoder);
+    return success;
+}
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(kPacketIntervalMsec)); // ms between rounds
+static bool TestDecoderMemoryBudget()
+{
+    static const unsigned N = 400;
+    static const unsigned kRecoveryCount = 150;
 
-        // TODO: Reordering
+    SiameseEncoder encoder = siamese_encoder_create();
+    SiameseDecoder decoder = siamese_decoder_create();
+    if (!encoder || !decoder ||
+        siamese_decoder_set_memory_budget(decoder, 400 * 1000))
+    {
+        siamese_encoder_free(encoder);
+        siamese_decoder_free(decoder);
+        return false;
+    }
 
-        c2sRound.Packets.clear(), s2cRound.Packets.clear();
+    bool success = true;
+    std::vector<uint8_t> data(2000);
 
-        for (unsigned i = 0; i < kPacketsPerInterval; ++i)
-        {
-            const bool retransmitted = ClientRetransmitData();
+    // Lose the first two packets, so the whole window must be kept
+    for (unsigned i = 0; success && i < N; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
 
-            // Check if we should retransmit data every round (c2s)
-            if (!retransmitted)
-            {
-                // Generate new e.g. video original data periodically
-                ClientSendNewVideoData();
-            }
+        SiameseOriginalPacket original;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
 
-            // FEC redundant data packets (c2s)
-            ClientSendRecoveryData();
+        if (siamese_encoder_add(encoder, &original) ||
+            (i >= 2 && siamese_decoder_add_original(decoder, &original)))
+        {
+            success = false;
         }
+    }
 
-        // Start by queuing up a bunch of original data packets
-        if (loopCount < (size_t)kQueueDepth)
+    // Many more recovery packets than needed push out the oldest ones
+    for (unsigned j = 0; success && j < kRecoveryCount; ++j)
+    {
+        SiameseRecoveryPacket recovery;
+        if (siamese_encode(encoder, &recovery) ||
+            siamese_decoder_add_recovery(decoder, &recovery))
         {
-            Logger.Trace("Building up initial pipe queue...");
-            continue;
+            success = false;
         }
+    }
 
-        // This is the s2c back-channel: Acks are received here from "server"
-        ClientReceiveData();
+    uint64_t stats[SiameseDecoderStats_Count];
+    if (!success ||
+        siamese_decoder_stats(decoder, stats, SiameseDecoderStats_Count) ||
+        stats[SiameseDecoderStats_DroppedRecoveryCount] == 0)
+    {
+        Logger.Error("Decoder did not drop recovery packets");
+        success = false;
+    }
+
+    // The newest recovery packets are still enough to recover
+    unsigned recoveredCount = 0;
+    while (success && siamese_decoder_is_ready(decoder) == Siamese_Success)
+    {
+        SiameseOriginalPacket* packets;
+        unsigned count = 0;
+        if (siamese_decode(decoder, &packets, &count)) {
+            break;
+        }
+        for (unsigned k = 0; k < count; ++k)
+        {
+            if (packets[k].PacketNum >= 2 ||
+                !CheckPacket(packets[k].PacketNum, packets[k].Data, packets[k].DataBytes))
+            {
+                success = false;
+            }
+        }
+        recoveredCount += count;
+    }
+    if (recoveredCount != 2)
+    {
+        Logger.Error("Decoder did not recover with dropped recovery packets");
+        success = false;
+    }
 
-        // This is the c2s forward channel: Data/recovery packets are received here from "client"
-        ServerReceiveData();
+    siamese_encoder_free(encoder);
+    siamese_decoder_free(decoder);
 
-        // Server sends acknowledgement of data (s2c)
-        ServerSendAck();
+    // A decoder that cannot get under the budget disables itself
+    decoder = siamese_decoder_create();
+    if (!success || !decoder ||
+        siamese_decoder_set_memory_budget(decoder, 100 * 1000))
+    {
+        siamese_decoder_free(decoder);
+        return false;
     }
 
-    uint64_t simEndMsec = siamese::GetTimeMsec();
+    SiameseResult result = Siamese_Success;
+    for (unsigned i = 1; i < N && result == Siamese_Success; ++i)
+    {
+        unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, &data[0], bytes);
 
-    // Flush the log so we do not miss the last part
-    logger::Flush();
+        SiameseOriginalPacket original;
+        original.PacketNum = i;
+        original.Data = &data[0];
+        original.DataBytes = bytes;
 
-    Logger.Info("Streaming completed:");
+        result = siamese_decoder_add_original(decoder, &original);
+    }
+    if (result != Siamese_Disabled ||
+        siamese_decoder_is_ready(decoder) != Siamese_Disabled)
+    {
+        Logger.Error("Decoder was not disabled over budget");
+        success = false;
+    }
+
+    siamese_decoder_free(decoder);
+    return success;
+}
+
+bool TestMemoryBudget()
+{
+    Logger.Info("Test: TestMemoryBudget");
 
-    const uint64_t TotalBytesSent = Originals.BytesSent + Acks.BytesSent + Recoveries.BytesSent;
-    const uint64_t TotalBytesReceived = Originals.BytesReceived + Acks.BytesReceived + Recoveries.BytesReceived;
+    if (!TestEncoderMemoryBudget(false))
+    {
+        Logger.Error("Encoder memory budget failed");
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
 
-    Logger.Info("Total bytes sent: ", TotalBytesSent);
+    if (!TestEncoderMemoryBudget(true))
+    {
+        Logger.Error("Encoder memory budget with add queue failed");
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
 
-    const uint64_t SimTimeMsec = simEndMsec - simStartMsec;
+    if (!TestDecoderMemoryBudget())
+    {
+        Logger.Error("Decoder memory budget failed");
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
 
-    static const unsigned OriginalDataSizeBytes = kLastPacket * 1200; // bytes
+    return true;
+}
 
-    Logger.Info("Total time taken: ", SimTimeMsec, " msec. Speed = ", OriginalDataSizeBytes / (double)SimTimeMsec, " KBPS");
 
-    Logger.Info("Originals sent: ", Originals.Sent, " recv: ", Originals.Received, " lost: ", Originals.Lost, " = ", Originals.Lost * 100.f / (float)Originals.Sent, "% loss");
-    Logger.Info("Originals sent bytes: ", Originals.BytesSent, " recv bytes: ", Originals.BytesReceived, " = ", Originals.BytesSent * 100.f / (float)TotalBytesSent, "% of total sent bytes");
+//------------------------------------------------------------------------------
+// TestSetClock
 
-    Logger.Info("Acks sent: ", Acks.Sent, " recv: ", Acks.Received, " lost: ", Acks.Lost, " = ", Acks.Lost * 100.f / (float)Acks.Sent, "% loss");
-    Logger.Info("Acks sent bytes: ", Acks.BytesSent, " recv bytes: ", Acks.BytesReceived, " = ", Acks.BytesSent * 100.f / (float)TotalBytesSent, "% of total sent bytes");
+static uint64_t OnTestClock(void* context)
+{
+    return *static_cast<const uint64_t*>(context);
+}
 
-    Logger.Info("Recoveries sent: ", Recoveries.Sent, " recv: ", Recoveries.Received, " lost: ", Recoveries.Lost, " = ", Recoveries.Lost * 100.f / (float)Recoveries.Sent, "% loss");
-    Logger.Info("Recoveries sent bytes: ", Recoveries.BytesSent, " recv bytes: ", Recoveries.BytesReceived, " = ", Recoveries.BytesSent * 100.f / (float)TotalBytesSent, "% of total sent bytes");
+bool TestSetClock()
+{
+    Logger.Info("Test: TestSetClock");
 
-    Logger.Info("RetransmitCount = ", RetransmitCount, " retransmit bytes = ", RetransmitBytes, " = ", RetransmitBytes * 100.f / (float)TotalBytesSent, "% of total sent bytes");
+    static const unsigned N = 20;
+    static const unsigned kLostPacket = 5;
+    static const uint64_t kAckDelayUsec = 100 * 1000;
 
-    Logger.Info("DuplicateOriginalsReceived = ", DuplicateOriginalsReceived);
+    uint64_t nowUsec = 10 * 1000 * 1000;
+    siamese_set_clock(OnTestClock, &nowUsec);
 
-    Logger.Info("RecoverySuccessCount = ", RecoverySuccessCount);
-    Logger.Info("RecoveredPacketCount = ", RecoveredPacketCount);
-    Logger.Info("RecoveryFailCount = ", RecoveryFailCount, " = ", RecoveryFailCount * 100.f / (RecoveryFailCount + RecoverySuccessCount), "% failure rate");
+    SiameseEncoder encoder = siamese_encoder_create();
+    SiameseDecoder decoder = siamese_decoder_create();
+    bool success = (encoder != nullptr && decoder != nullptr);
 
-    unsigned percentile1 = 0;
-    if (UsecDeltas.size() > 200)
+    uint8_t buffer[2000];
+    for (unsigned i = 0; success && i < N; ++i)
     {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.99 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile1 = UsecDeltas[goalOffset];
-    }
+        const unsigned bytes = GetPacketBytes(i);
+        SetPacket(i, buffer, bytes);
 
-    unsigned percentile5 = 0;
-    if (UsecDeltas.size() > 100)
-    {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.95 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile5 = UsecDeltas[goalOffset];
-    }
+        SiameseOriginalPacket original;
+        original.PacketNum = i;
+        original.Data = buffer;
+        original.DataBytes = bytes;
 
-    unsigned percentile25 = 0;
-    if (UsecDeltas.size() > 4)
-    {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.75 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile25 = UsecDeltas[goalOffset];
+        if (siamese_encoder_add(encoder, &original) ||
+            (i != kLostPacket && siamese_decoder_add_original(decoder, &original)))
+        {
+            Logger.Error("Unable to add original data");
+            success = false;
+        }
     }
 
-    unsigned percentile50 = 0;
-    if (UsecDeltas.size() > 4)
-    {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.5 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile50 = UsecDeltas[goalOffset];
-    }
+    // The acknowledgement arrives after the application clock moves on,
+    // which sets the RTO to 1.5x this delay
+    nowUsec += kAckDelayUsec;
 
-    unsigned percentile75 = 0;
-    if (UsecDeltas.size() > 8)
+    uint8_t ack[SIAMESE_ACK_MIN_BYTES + 256];
+    unsigned ackBytes = 0, nextExpected = 0;
+    if (success &&
+        (siamese_decoder_ack(decoder, ack, sizeof(ack), &ackBytes) ||
+         siamese_encoder_ack(encoder, ack, ackBytes, &nextExpected) ||
+         nextExpected != kLostPacket))
     {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.25 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile75 = UsecDeltas[goalOffset];
+        Logger.Error("Acknowledgement failed");
+        success = false;
     }
 
-    unsigned percentile95 = 0;
-    if (UsecDeltas.size() > 40)
+    // Nothing is due for retransmission until the RTO elapses on the application clock
+    SiameseOriginalPacket retransmit;
+    if (success && siamese_encoder_retransmit(encoder, &retransmit) != Siamese_NeedMoreData)
     {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.05 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile95 = UsecDeltas[goalOffset];
+        Logger.Error("Retransmitted before the RTO elapsed");
+        success = false;
     }
 
-    unsigned percentile99 = 0;
-    if (UsecDeltas.size() > 200)
+    nowUsec += kAckDelayUsec;
+
+    if (success &&
+        (siamese_encoder_retransmit(encoder, &retransmit) ||
+         retransmit.PacketNum != kLostPacket ||
+         !CheckPacket(kLostPacket, retransmit.Data, retransmit.DataBytes)))
     {
-        std::vector<unsigned>::size_type goalOffset = (unsigned)(0.01 * UsecDeltas.size());
-        std::nth_element(UsecDeltas.begin(), UsecDeltas.begin() + goalOffset, UsecDeltas.end(),
-            [](unsigned a, unsigned b)->bool {
-            return a < b;
-        });
-        percentile99 = UsecDeltas[goalOffset];
+        Logger.Error("Lost packet was not retransmitted after the RTO elapsed");
+        success = false;
     }
 
-    Logger.Info("Simulated one-way  1% percentile latency = ", percentile1 / 1000.f, " msec");
-    Logger.Info("Simulated one-way  5% percentile latency = ", percentile5 / 1000.f, " msec");
-    Logger.Info("Simulated one-way 25% percentile latency = ", percentile25 / 1000.f, " msec");
-    Logger.Info("Simulated one-way 50% percentile latency = ", percentile50 / 1000.f, " msec (median)");
-    Logger.Info("Simulated one-way 75% percentile latency = ", percentile75 / 1000.f, " msec");
-    Logger.Info("Simulated one-way 95% percentile latency = ", percentile95 / 1000.f, " msec");
-    Logger.Info("Simulated one-way 99% percentile latency = ", percentile99 / 1000.f, " msec");
-
     siamese_encoder_free(encoder);
     siamese_decoder_free(decoder);
 
-    static const unsigned kTrials = 1;
+    // Restore the default clock and check it advances
+    siamese_set_clock(nullptr, nullptr);
+    const uint64_t t0 = siamese::GetTimeUsec();
+    const uint64_t t1 = siamese::GetTimeUsec();
+    if (t1 < t0 || t0 == nowUsec)
+    {
+        Logger.Error("Default clock was not restored");
+        success = false;
+    }
 
-    t_siamese_encoder_create.Print(kTrials);
-    t_siamese_encoder_add.Print(kTrials);
-    t_siamese_encoder_remove.Print(kTrials);
-    t_siamese_encode.Print(kTrials);
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
 
-    t_siamese_decoder_create.Print(kTrials);
-    t_siamese_decoder_add_original.Print(kTrials);
-    t_siamese_decoder_add_recovery.Print(kTrials);
-    t_siamese_decoder_is_ready.Print(kTrials);
-    t_siamese_decode.Print(kTrials);
+    return true;
 }
 
 
-/*
-    Given a PRNG, generate a deck of cards in a random order.
-    The deck will contain elements with values between 0 and count - 1.
-*/
+//------------------------------------------------------------------------------
+// TestLogger
 
-static void ShuffleDeck16(siamese::PCGRandom& prng, uint16_t* GF256_RESTRICT deck, uint32_t count)
+bool TestLogger()
 {
-    deck[0] = 0;
+    Logger.Info("Test: TestLogger");
 
-    // If we can unroll 4 times,
-    if (count <= 256)
+    // Levels below the compiled level are off whatever the runtime level is
+    logger::CompiledChannel<logger::Level::Warning> compiled("LoggerTest", logger::Level::Trace);
+    if (compiled.ShouldLog(logger::Level::Info) ||
+        !compiled.ShouldLog(logger::Level::Warning) ||
+        !Logger.ShouldLog(logger::Level::Info))
     {
-        for (uint32_t ii = 1;;)
-        {
-            uint32_t jj, rv = prng.Next();
+        Logger.Error("Compiled log level is wrong");
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
+    compiled.Info("This message is compiled out");
 
-            // 8-bit unroll
-            switch (count - ii)
-            {
-            default:
-                jj = (uint8_t)rv % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-                jj = (uint8_t)(rv >> 8) % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-                jj = (uint8_t)(rv >> 16) % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-                jj = (uint8_t)(rv >> 24) % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-                break;
+    // Overlong messages are truncated rather than overflowing the slot
+    const std::string longText(logger::kMaxMessageBytes * 2, 'x');
+    compiled.Warning("Truncated: ", longText);
 
-            case 3:
-                jj = (uint8_t)rv % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-            case 2:
-                jj = (uint8_t)(rv >> 8) % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-            case 1:
-                jj = (uint8_t)(rv >> 16) % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-            case 0:
-                return;
-            }
-        }
-    }
-    else
+    // Several threads write into the ring at once, racing with flushes
+    static const unsigned kThreadCount = 4;
+    static const unsigned kMessagesPerThread = 100;
+
+    logger::Channel channel("LoggerTest", logger::Level::Trace);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < kThreadCount; ++t)
     {
-        // For each deck entry,
-        for (uint32_t ii = 1;;)
+        threads.emplace_back([&channel, t]()
         {
-            uint32_t jj, rv = prng.Next();
-
-            // 16-bit unroll
-            switch (count - ii)
+            for (unsigned i = 0; i < kMessagesPerThread; ++i)
             {
-            default:
-                jj = (uint16_t)rv % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-                jj = (uint16_t)(rv >> 16) % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-                ++ii;
-                break;
-
-            case 1:
-                jj = (uint16_t)rv % ii;
-                deck[ii] = deck[jj];
-                deck[jj] = ii;
-            case 0:
-                return;
+                channel.Debug("Thread ", t, " message ", i);
+                if (i % 25 == 0) {
+                    logger::Flush();
+                }
             }
-        }
+        });
     }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    logger::Flush();
+
+    return true;
 }
 
 
-// This test verifies that the kMaximumLossRecoveryCount logic works properly:
-// It should only use up to kMaximumLossRecoveryCount recovery packets to attempt recovery.
-// This test will pick 255 * 2 random losses in a set of 1000 packets, and then provide 255 * 2 recovery packets.
-// Then lost original packets are provided out of order and recovery is attempted each time.
-// The expectation is that it will recover after 255 packets most of the time, and sometimes 256.
-// And that's what happens!
-bool TestLargeBurstLoss()
+//------------------------------------------------------------------------------
+// TestProfiling
+
+static uint64_t SumHistogramBuckets(const uint64_t* buckets)
 {
-    Logger.Info("Test: TestLargeBurstLoss");
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < SIAMESE_HISTOGRAM_BUCKETS; ++i) {
+        sum += buckets[i];
+    }
+    return sum;
+}
 
-    FunctionTimer t_siamese_encoder_create("siamese_encoder_create");
-    FunctionTimer t_siamese_decoder_create("siamese_decoder_create");
-    FunctionTimer t_siamese_encoder_add("siamese_encoder_add");
-    FunctionTimer t_siamese_decoder_add_original("siamese_decoder_add_original");
-    FunctionTimer t_siamese_encode("siamese_encode");
-    FunctionTimer t_siamese_decoder_add_recovery("siamese_decoder_add_recovery");
-    FunctionTimer t_siamese_decoder_is_ready("siamese_decoder_is_ready");
-    FunctionTimer t_siamese_decode("siamese_decode");
+bool TestProfiling()
+{
+    Logger.Info("Test: TestProfiling");
 
-    static const int N = 1000;
-    static const int K = 255;
+    static const unsigned N = 300;
+    static const unsigned kLosses = 30;
+    static const unsigned kTrials = 20;
 
-    static const unsigned kTrials = 999;
+    bool success = true;
 
-    for (unsigned trial = 0; trial < kTrials; ++trial)
+    for (unsigned trial = 0; success && trial < kTrials; ++trial)
     {
         uint16_t losses[N];
         siamese::PCGRandom prng;
         prng.Seed(kSeed, trial);
         ShuffleDeck16(prng, losses, N);
 
-        t_siamese_encoder_create.BeginCall();
-        SiameseEncoder encoder = siamese_encoder_create();
-        t_siamese_encoder_create.EndCall();
-
-        if (!encoder)
-        {
-            Logger.Error("Unable to create encoder");
-            SIAMESE_DEBUG_BREAK();
-            return false;
-        }
-
-        t_siamese_decoder_create.BeginCall();
-        SiameseDecoder decoder = siamese_decoder_create();
-        t_siamese_decoder_create.EndCall();
-
-        if (!decoder)
-        {
-            Logger.Error("Unable to create decoder");
-            SIAMESE_DEBUG_BREAK();
-            return false;
-        }
-
-        unsigned decoderReceiveCount = 0;
-
-        for (int i = 0; i < N; ++i)
-        {
-            uint8_t buffer[2000];
-            unsigned bytes = GetPacketBytes(i);
-            SIAMESE_DEBUG_ASSERT(bytes <= sizeof(buffer));
-            SetPacket(i, buffer, bytes);
-
-            SiameseOriginalPacket original;
-            original.Data = buffer;
-            original.DataBytes = bytes;
-            {
-                t_siamese_encoder_add.BeginCall();
-                int result = siamese_encoder_add(encoder, &original);
-                t_siamese_encoder_add.EndCall();
-                if (result)
-                {
-                    Logger.Error("Unable to add original data to encoder");
-                    SIAMESE_DEBUG_BREAK();
-                    return false;
-                }
-            }
-
-            // Lose 255 * 2 packets
-            bool lost = false;
-            for (unsigned j = 0; j < 255 * 2; ++j)
-            {
-                if (losses[j] == i)
-                {
-                    lost = true;
-                    break;
-                }
-            }
-
-            if (!lost)
-            {
-                t_siamese_decoder_add_original.BeginCall();
-                int result = siamese_decoder_add_original(decoder, &original);
-                t_siamese_decoder_add_original.EndCall();
-                if (result)
-                {
-                    Logger.Error("Unable to add original data to decoder");
-                    SIAMESE_DEBUG_BREAK();
-                    return false;
-                }
-                ++decoderReceiveCount;
-            }
-        }
-
-        // Add 255 recovery packets
-        for (int j = 0; j < 255; ++j)
-        {
-            SiameseRecoveryPacket recovery;
-
-            {
-                t_siamese_encode.BeginCall();
-                int result = siamese_encode(encoder, &recovery);
-                t_siamese_encode.EndCall();
-                if (result)
-                {
-                    SIAMESE_DEBUG_BREAK();
-                    Logger.Error("Unable to generate encoded data");
-                    return false;
-                }
-            }
-
-            {
-                t_siamese_decoder_add_recovery.BeginCall();
-                int result = siamese_decoder_add_recovery(decoder, &recovery);
-                t_siamese_decoder_add_recovery.EndCall();
-                if (result)
-                {
-                    Logger.Error("Unable to add recovery data to decoder");
-                    SIAMESE_DEBUG_BREAK();
-                    return false;
-                }
-            }
+        SiameseEncoder encoder = siamese_encoder_create();
+        SiameseDecoder decoder = siamese_decoder_create();
+        if (!encoder || !decoder)
+        {
+            Logger.Error("Unable to create codec");
+            success = false;
+            break;
         }
 
-        for (int j = 0; j < N; ++j)
+        // Odd trials sample every other call
+        const unsigned samplePeriod = 1 + trial % 2;
+        if (siamese_encoder_set_profiling(encoder, samplePeriod) ||
+            siamese_decoder_set_profiling(decoder, samplePeriod))
         {
-            unsigned packetId = losses[j];
+            Logger.Error("Unable to enable profiling");
+            success = false;
+        }
 
-            uint8_t buffer[2000];
-            unsigned bytes = GetPacketBytes(packetId);
-            SIAMESE_DEBUG_ASSERT(bytes <= sizeof(buffer));
-            SetPacket(packetId, buffer, bytes);
+        std::vector<bool> missing(N, false);
+        for (unsigned j = 0; j < kLosses; ++j) {
+            missing[losses[j]] = true;
+        }
+        unsigned missingCount = kLosses;
+
+        std::vector<uint8_t> data(2000);
+        for (unsigned i = 0; success && i < N; ++i)
+        {
+            unsigned bytes = GetPacketBytes(i);
+            SetPacket(i, &data[0], bytes);
 
             SiameseOriginalPacket original;
-            original.Data = buffer;
+            original.PacketNum = i;
+            original.Data = &data[0];
             original.DataBytes = bytes;
-            original.PacketNum = packetId;
 
-            t_siamese_decoder_add_original.BeginCall();
-            int result = siamese_decoder_add_original(decoder, &original);
-            t_siamese_decoder_add_original.EndCall();
-            if (result)
+            if (siamese_encoder_add(encoder, &original) ||
+                (!missing[i] && siamese_decoder_add_original(decoder, &original)))
             {
-                Logger.Error("Unable to add original data to decoder");
-                SIAMESE_DEBUG_BREAK();
-                return false;
+                Logger.Error("Unable to add original data");
+                success = false;
             }
-            ++decoderReceiveCount;
+        }
 
-            for (;;)
+        unsigned encodeCount = 0, solveAttempts = 0, solveSuccesses = 0;
+        while (success && missingCount > 0)
+        {
+            if (encodeCount >= kLosses * 2)
             {
-                t_siamese_decoder_is_ready.BeginCall();
-                int readyResult = siamese_decoder_is_ready(decoder);
-                t_siamese_decoder_is_ready.EndCall();
+                Logger.Error("Recovery did not finish");
+                success = false;
+                break;
+            }
 
-                if (readyResult)
-                {
-                    SIAMESE_DEBUG_ASSERT(readyResult == Siamese_NeedMoreData);
-                    break;
-                }
+            SiameseRecoveryPacket recovery;
+            if (siamese_encode(encoder, &recovery) ||
+                siamese_decoder_add_recovery(decoder, &recovery))
+            {
+                Logger.Error("Unable to add recovery data");
+                success = false;
+                break;
+            }
+            ++encodeCount;
 
-                SiameseOriginalPacket* packets = nullptr;
-                unsigned packetCount = 0;
+            if (siamese_decoder_is_ready(decoder) != Siamese_Success) {
+                continue;
+            }
 
-                t_siamese_decode.BeginCall();
-                int decodeResult = siamese_decode(decoder, &packets, &packetCount);
-                t_siamese_decode.EndCall();
+            ++solveAttempts;
+            SiameseOriginalPacket* packets;
+            unsigned count = 0;
+            if (siamese_decode(decoder, &packets, &count)) {
+                continue;
+            }
+            ++solveSuccesses;
 
-                if (decodeResult == Siamese_Success)
+            for (unsigned k = 0; k < count; ++k)
+            {
+                const unsigned i = packets[k].PacketNum;
+                if (i >= N || !missing[i])
                 {
-                    //cout << "Successful decode: ";
-                    for (unsigned i = 0; i < packetCount; ++i)
-                    {
-                        //cout << packets[i].PacketNum << " ";
+                    Logger.Error("Recovered packet ", i, " is wrong");
+                    success = false;
+                    break;
+                }
+                missing[i] = false;
+                --missingCount;
+            }
+        }
 
-                        if (!CheckPacket(packets[i].PacketNum, packets[i].Data, packets[i].DataBytes))
-                        {
-                            Logger.Error("Packet check failed for ", i, ".DataBytes = ", packets[i].DataBytes);
-                            SIAMESE_DEBUG_BREAK();
-                            return false;
-                        }
+        uint64_t buckets[SIAMESE_HISTOGRAM_BUCKETS];
+        if (success && siamese_encoder_histogram(encoder, SiameseEncoderHistogram_EncodeUsec, buckets, SIAMESE_HISTOGRAM_BUCKETS))
+            success = false;
+        if (success && SumHistogramBuckets(buckets) != encodeCount / samplePeriod)
+        {
+            Logger.Error("Encode histogram count is wrong");
+            success = false;
+        }
 
-                        ++decoderReceiveCount;
-                    }
-                    //cout);
+        // Every sampled attempt records the solve time, and only successes
+        // record the extra recovery packets used
+        uint64_t solveSamples = 0;
+        for (unsigned histogram = 0; success && histogram < SiameseDecoderHistogram_Count; ++histogram)
+        {
+            if (siamese_decoder_histogram(decoder, (SiameseDecoderHistogram)histogram, buckets, SIAMESE_HISTOGRAM_BUCKETS))
+            {
+                success = false;
+                break;
+            }
+            const uint64_t sampleCount = SumHistogramBuckets(buckets);
 
-                    if (decoderReceiveCount >= N)
-                    {
-                        Logger.Info("Decode successful after ", j + 1, " originals - Should be around 255");
-                        goto DoneDecoding;
-                    }
-                }
-                else if (decodeResult == Siamese_NeedMoreData)
+            if (histogram == SiameseDecoderHistogram_SolveUsec) {
+                solveSamples = sampleCount;
+            }
+            else if (histogram == SiameseDecoderHistogram_ExtraRecoveryCount)
+            {
+                if (sampleCount > solveSamples || (samplePeriod == 1 && sampleCount != solveSuccesses))
                 {
-                    //cout << "Needed more data to decode");
+                    Logger.Error("Extra recovery histogram count is wrong");
+                    success = false;
                 }
-                else
+            }
+            else if (histogram == SiameseDecoderHistogram_MatrixRows ||
+                histogram == SiameseDecoderHistogram_MatrixColumns ||
+                histogram == SiameseDecoderHistogram_GenerateMatrixUsec ||
+                histogram == SiameseDecoderHistogram_GaussianEliminationUsec)
+            {
+                if (sampleCount != solveSamples)
                 {
-                    Logger.Error("Decode returned ", decodeResult);
-                    SIAMESE_DEBUG_BREAK();
-                    return false;
+                    Logger.Error("Decoder histogram ", histogram, " count is wrong");
+                    success = false;
                 }
             }
         }
+        if (success && (solveSamples != solveAttempts / samplePeriod || solveAttempts == 0))
+        {
+            Logger.Error("Solve histogram count is wrong");
+            success = false;
+        }
 
-DoneDecoding:
+        if (success && siamese_decoder_histogram(decoder, SiameseDecoderHistogram_Count, buckets, 1) != Siamese_InvalidInput)
+        {
+            Logger.Error("Invalid histogram was accepted");
+            success = false;
+        }
 
         siamese_encoder_free(encoder);
         siamese_decoder_free(decoder);
     }
 
-    // Flush the log so we do not miss the last part
-    logger::Flush();
-
-    Logger.Info("Test successful. Timing summary:");
-
-    t_siamese_encoder_create.Print(kTrials);
-    t_siamese_encoder_add.Print(kTrials);
-    t_siamese_encode.Print(kTrials);
-    t_siamese_decoder_create.Print(kTrials);
-    t_siamese_decoder_add_original.Print(kTrials);
-    t_siamese_decoder_add_recovery.Print(kTrials);
-    t_siamese_decoder_is_ready.Print(kTrials);
-    t_siamese_decode.Print(kTrials);
+    if (!success)
+    {
+        SIAMESE_DEBUG_BREAK();
+        return false;
+    }
 
     return true;
 }
 
-
 int main()
 {
     FunctionTimer t_siamese_init("siamese_init");
@@ -1788,6 +5235,214 @@ int main()
 
     t_siamese_init.Print(1);
 
+#ifdef TEST_BITMAP_SCANS
+    if (!TestBitmapScans())
+    {
+        Logger.Error("Test failed: TestBitmapScans");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_SUBWINDOW_RING
+    if (!TestSubwindowRing())
+    {
+        Logger.Error("Test failed: TestSubwindowRing");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ENCODE_BATCH
+    if (!TestEncodeBatch())
+    {
+        Logger.Error("Test failed: TestEncodeBatch");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ENCODER_LENGTH_DECAY
+    if (!TestEncoderLengthDecay())
+    {
+        Logger.Error("Test failed: TestEncoderLengthDecay");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ENCODER_ADD_EXTERNAL
+    if (!TestEncoderAddExternal())
+    {
+        Logger.Error("Test failed: TestEncoderAddExternal");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ENCODER_ADD_GATHER
+    if (!TestEncoderAddGather())
+    {
+        Logger.Error("Test failed: TestEncoderAddGather");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ENCODER_ADD_QUEUE
+    if (!TestEncoderAddQueue())
+    {
+        Logger.Error("Test failed: TestEncoderAddQueue");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_SET_OUTPUT
+    if (!TestDecoderSetOutput())
+    {
+        Logger.Error("Test failed: TestDecoderSetOutput");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_SOLVER_THREADS
+    if (!TestDecoderSolverThreads())
+    {
+        Logger.Error("Test failed: TestDecoderSolverThreads");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_LATE_ORIGINALS
+    if (!TestDecoderLateOriginals())
+    {
+        Logger.Error("Test failed: TestDecoderLateOriginals");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_BURST_LOSS
+    if (!TestDecoderBurstLoss())
+    {
+        Logger.Error("Test failed: TestDecoderBurstLoss");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_SUM_RESTART
+    if (!TestDecoderSumRestart())
+    {
+        Logger.Error("Test failed: TestDecoderSumRestart");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ALLOCATOR_FALLBACK
+    if (!TestAllocatorFallback())
+    {
+        Logger.Error("Test failed: TestAllocatorFallback");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_ADD_ORIGINAL_BATCH
+    if (!TestDecoderAddOriginalBatch())
+    {
+        Logger.Error("Test failed: TestDecoderAddOriginalBatch");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_RECOVERY_REORDER
+    if (!TestDecoderRecoveryReorder())
+    {
+        Logger.Error("Test failed: TestDecoderRecoveryReorder");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_RECOVERY_DUPLICATES
+    if (!TestDecoderRecoveryDuplicates())
+    {
+        Logger.Error("Test failed: TestDecoderRecoveryDuplicates");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_RECOVERY_LIST_DELETE
+    if (!TestRecoveryListDelete())
+    {
+        Logger.Error("Test failed: TestRecoveryListDelete");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_SMALL_SOLVE
+    if (!TestDecoderSmallSolve())
+    {
+        Logger.Error("Test failed: TestDecoderSmallSolve");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_ENCODER_CAUCHY_CROSSOVER
+    if (!TestEncoderCauchyCrossover())
+    {
+        Logger.Error("Test failed: TestEncoderCauchyCrossover");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_CODEC_SNAPSHOT
+    if (!TestCodecSnapshot())
+    {
+        Logger.Error("Test failed: TestCodecSnapshot");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_DECODER_LAZY_SUMS
+    if (!TestDecoderLazySums())
+    {
+        Logger.Error("Test failed: TestDecoderLazySums");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_MEMORY_POOL
+    if (!TestMemoryPool())
+    {
+        Logger.Error("Test failed: TestMemoryPool");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_MEMORY_BUDGET
+    if (!TestMemoryBudget())
+    {
+        Logger.Error("Test failed: TestMemoryBudget");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_SET_CLOCK
+    if (!TestSetClock())
+    {
+        Logger.Error("Test failed: TestSetClock");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_LOGGER
+    if (!TestLogger())
+    {
+        Logger.Error("Test failed: TestLogger");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
+#ifdef TEST_PROFILING
+    if (!TestProfiling())
+    {
+        Logger.Error("Test failed: TestProfiling");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
+    }
+#endif
 #ifdef TEST_LARGE_BURST_LOSS
     if (!TestLargeBurstLoss())
     {
@@ -1797,10 +5452,11 @@ int main()
     }
 #endif
 #ifdef TEST_HARQ_STREAM
-    for (unsigned seed = 0;; ++seed)
+    if (!HARQStreamTest())
     {
-        HARQSimulation simulation;
-        simulation.Run(seed);
+        Logger.Error("Test failed: HARQStreamTest");
+        SIAMESE_DEBUG_BREAK();
+        return -1;
     }
 #endif
 #ifdef TEST_STREAMING